@@ -0,0 +1,178 @@
+#include "MQTTBroker.h"
+
+// wakes up the broker for the keepalive checks
+#define MQTT_BROKER_POLL_INTERVAL 1000
+
+namespace MQTT
+{
+
+MQTTBroker::MQTTBroker(NetworkInterface * aNetwork) : network(aNetwork), stopRequested(false)
+{
+    memset(sockets, 0, sizeof(sockets));
+    memset(&stats, 0, sizeof(stats));
+}
+
+MQTTBroker::~MQTTBroker()
+{
+    for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++)
+        if (sockets[i])
+            closeConnection(i);
+}
+
+bool MQTTBroker::init(int port)
+{
+    nsapi_error_t ret = server.open(network);
+    if (ret != 0)
+    {
+        printf("ERROR: MQTT broker failed to open socket %d\r\n", ret);
+        return false;
+    }
+
+    ret = server.bind(port);
+    if (ret != 0)
+    {
+        printf("ERROR: MQTT broker failed to bind %d\r\n", ret);
+        return false;
+    }
+
+    ret = server.listen(MQTT_BROKER_MAX_CONNECTIONS);
+    if (ret != 0)
+    {
+        printf("ERROR: MQTT broker failed to listen %d\r\n", ret);
+        return false;
+    }
+    return true;
+}
+
+// sigio, called from the network stack
+void MQTTBroker::onSocketEvent()
+{
+    flags.set(FLAG_SOCKET);
+}
+
+void MQTTBroker::run()
+{
+    server.set_blocking(false);
+    server.sigio(mbed::callback(this, &MQTTBroker::onSocketEvent));
+
+    while (!stopRequested)
+    {
+        flags.wait_any(FLAG_SOCKET | FLAG_STOP, MQTT_BROKER_POLL_INTERVAL);
+        uint32_t now = (uint32_t) Kernel::get_ms_count();
+
+        acceptConnections(now);
+
+        // read all connections first, a PUBLISH queues messages for the others
+        for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++)
+        {
+            if (sockets[i] && readConnection(i, now) < 0)
+            {
+                // the CONNACK with an error code goes out before the close
+                sendConnection(i);
+                closeConnection(i);
+            }
+        }
+
+        for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++)
+        {
+            if (sockets[i] && (sendConnection(i) < 0 || core.isExpired(i, now)))
+                closeConnection(i);
+        }
+
+        CriticalSectionLock lock;
+        core.getStats(&stats);
+    }
+
+    for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++)
+        if (sockets[i])
+            closeConnection(i);
+    server.sigio(NULL);
+    server.close();
+}
+
+void MQTTBroker::stop()
+{
+    stopRequested = true;
+    flags.set(FLAG_STOP);
+}
+
+void MQTTBroker::getStats(BrokerStats * stats)
+{
+    CriticalSectionLock lock;
+    *stats = this->stats;
+}
+
+void MQTTBroker::acceptConnections(uint32_t now)
+{
+    while (true)
+    {
+        nsapi_error_t ret = 0;
+        TCPSocket * socket = server.accept(&ret);
+        if (socket == NULL)
+            return;
+
+        int conn = core.open(now);
+        if (conn < 0)
+        {
+            printf("ERROR: MQTT broker has no free connection\r\n");
+            socket->close();
+            continue;
+        }
+
+        socket->set_blocking(false);
+        socket->sigio(mbed::callback(this, &MQTTBroker::onSocketEvent));
+        sockets[conn] = socket;
+    }
+}
+
+// one recv per connection and round, so the subscribers are served
+// before a fast publisher overflows their queues
+int MQTTBroker::readConnection(int conn, uint32_t now)
+{
+    // packets that waited for room in the transmit buffer
+    if (core.received(conn, 0, now) < 0)
+        return -1;
+
+    int space;
+    unsigned char * buffer = core.receiveBuffer(conn, &space);
+    if (space == 0)
+        return 0;
+
+    nsapi_size_or_error_t len = sockets[conn]->recv(buffer, space);
+    if (len == NSAPI_ERROR_WOULD_BLOCK)
+        return 0;
+    if (len <= 0)
+        return -1;          // closed by the client
+
+    // more may be waiting, come back after the others
+    if (len == space)
+        flags.set(FLAG_SOCKET);
+    return core.received(conn, len, now);
+}
+
+int MQTTBroker::sendConnection(int conn)
+{
+    const unsigned char * data;
+    int len;
+
+    while ((len = core.pending(conn, &data)) > 0)
+    {
+        nsapi_size_or_error_t sent = sockets[conn]->send(data, len);
+        if (sent == NSAPI_ERROR_WOULD_BLOCK)
+            return 0;       // sigio tells when there is room again
+        if (sent < 0)
+            return -1;
+        core.sent(conn, sent);
+    }
+    return 0;
+}
+
+void MQTTBroker::closeConnection(int conn)
+{
+    core.close(conn);
+    sockets[conn]->sigio(NULL);
+    sockets[conn]->close();
+    sockets[conn] = NULL;
+}
+
+}
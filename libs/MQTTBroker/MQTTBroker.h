@@ -0,0 +1,56 @@
+#ifndef _MQTT_BROKER_H_
+#define _MQTT_BROKER_H_
+
+#include "mbed.h"
+#include "rtos.h"
+#include "NetworkInterface.h"
+#include "MQTTBrokerCore.h"
+
+namespace MQTT
+{
+
+/**
+ * \brief MQTTBroker serves the MQTTBrokerCore on a TCP port.
+ *
+ * One thread handles all connections with non-blocking sockets, sigio
+ * wakes it up. The core and its buffers are members, so the object
+ * should be static, not on the stack of a thread.
+ */
+class MQTTBroker
+{
+public:
+    MQTTBroker(NetworkInterface * aNetwork);
+    ~MQTTBroker();
+
+    bool init(int port = 1883);
+
+    // thread function, returns after stop()
+    void run();
+    void stop();
+
+    void getStats(BrokerStats * stats);
+
+private:
+    enum
+    {
+        FLAG_SOCKET = 1,
+        FLAG_STOP = 2
+    };
+
+    void onSocketEvent();
+    void acceptConnections(uint32_t now);
+    int readConnection(int conn, uint32_t now);
+    int sendConnection(int conn);
+    void closeConnection(int conn);
+
+    NetworkInterface * network;
+    TCPSocket server;
+    TCPSocket * sockets[MQTT_BROKER_MAX_CONNECTIONS];
+    MQTTBrokerCore core;
+    EventFlags flags;
+    bool stopRequested;
+    BrokerStats stats;
+};
+
+}
+#endif
@@ -0,0 +1,796 @@
+#include "MQTTBrokerCore.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+//#define MQTT_BROKER_DEBUG 1
+
+#ifdef MQTT_BROKER_DEBUG
+#define DBG(fmt, args...)    printf(fmt, ## args)
+#else
+#define DBG(fmt, args...)    /* Don't do anything in release builds */
+#endif
+
+// the biggest answer to a packet: SUBACK with one code per filter
+#define ACK_SPACE (4 + MQTT_BROKER_MAX_SUBSCRIPTIONS)
+
+namespace MQTT
+{
+
+BrokerMessage * BrokerMessage::alloc(const char * topic, int topicLength, const unsigned char * payload, int payloadLength)
+{
+    BrokerMessage * message = (BrokerMessage *) malloc(sizeof(BrokerMessage) + topicLength + payloadLength);
+    if (message == NULL)
+        return NULL;
+
+    message->refs = 1;
+    message->topicLength = topicLength;
+    message->payloadLength = payloadLength;
+    message->qos = 0;
+    memcpy(message->topic(), topic, topicLength);
+    memcpy(message->payload(), payload, payloadLength);
+    return message;
+}
+
+/**
+ * The state of a client id: subscriptions and the messages to deliver.
+ * With cleansession = 0 it outlives the network connection.
+ */
+class BrokerSession
+{
+public:
+    struct Subscription
+    {
+        BrokerSession * session;
+        std::string filter;         // empty = free
+        unsigned char qos;
+
+        void deliver(MQTTBrokerCore::Dispatch * dispatch)
+        {
+            unsigned char q = (qos < dispatch->message->qos) ? qos : dispatch->message->qos;
+            if (!session->enqueue(dispatch, q))
+                dispatch->dropped++;
+        };
+    };
+
+    typedef struct
+    {
+        BrokerMessage * message;    // NULL = free inflight slot
+        unsigned char qos;
+        bool retained;
+        bool sent;
+        unsigned short packetId;
+    }Delivery;
+
+    BrokerSession() : connected(false), cleanSession(true), clientIDLength(0), lastSequence(0),
+        queueHead(0), queueCount(0), nextPacketId(0)
+    {
+        clientID[0] = 0;
+        for (int i = 0; i < MQTT_BROKER_MAX_SUBSCRIPTIONS; i++)
+        {
+            subscriptions[i].session = this;
+            subscriptions[i].qos = 0;
+        }
+        memset(inflight, 0, sizeof(inflight));
+    };
+
+    ~BrokerSession()
+    {
+        while (queueCount > 0)
+            pop()->message->release();
+        for (int i = 0; i < MQTT_BROKER_MAX_INFLIGHT; i++)
+            if (inflight[i].message)
+                inflight[i].message->release();
+    };
+
+    // a message matching several filters is queued once, with the highest QoS
+    bool enqueue(MQTTBrokerCore::Dispatch * dispatch, unsigned char qos)
+    {
+        if (lastSequence == dispatch->sequence && queueCount > 0)
+        {
+            Delivery& last = queue[(queueHead + queueCount - 1) % MQTT_BROKER_QUEUE_SIZE];
+            if (last.message == dispatch->message)
+            {
+                if (qos > last.qos)
+                    last.qos = qos;
+                return true;
+            }
+        }
+
+        // QoS0 messages are not kept for offline clients
+        if (!connected && qos == 0)
+            return true;
+        if (queueCount == MQTT_BROKER_QUEUE_SIZE)
+            return false;
+
+        Delivery& delivery = queue[(queueHead + queueCount) % MQTT_BROKER_QUEUE_SIZE];
+        delivery.message = dispatch->message;
+        delivery.qos = qos;
+        delivery.retained = dispatch->retained;
+        delivery.sent = false;
+        delivery.packetId = 0;
+        dispatch->message->retain();
+        queueCount++;
+        lastSequence = dispatch->sequence;
+        return true;
+    };
+
+    Delivery * pop()
+    {
+        Delivery * delivery = &queue[queueHead];
+        queueHead = (queueHead + 1) % MQTT_BROKER_QUEUE_SIZE;
+        queueCount--;
+        return delivery;
+    };
+
+    int freeInflight()
+    {
+        for (int i = 0; i < MQTT_BROKER_MAX_INFLIGHT; i++)
+            if (inflight[i].message == NULL)
+                return i;
+        return -1;
+    };
+
+    unsigned short newPacketId()
+    {
+        while (true)
+        {
+            if (++nextPacketId == 0)
+                nextPacketId = 1;
+            bool used = false;
+            for (int i = 0; i < MQTT_BROKER_MAX_INFLIGHT; i++)
+                used |= (inflight[i].message && inflight[i].packetId == nextPacketId);
+            if (!used)
+                return nextPacketId;
+        }
+    };
+
+    void acknowledge(unsigned short packetId)
+    {
+        for (int i = 0; i < MQTT_BROKER_MAX_INFLIGHT; i++)
+        {
+            if (inflight[i].message && inflight[i].sent && inflight[i].packetId == packetId)
+            {
+                inflight[i].message->release();
+                inflight[i].message = NULL;
+                return;
+            }
+        }
+    };
+
+    // existing subscription of the filter or a free one
+    Subscription * findSubscription(const char * filter, int length, bool allocate)
+    {
+        Subscription * unused = NULL;
+        for (int i = 0; i < MQTT_BROKER_MAX_SUBSCRIPTIONS; i++)
+        {
+            Subscription& subscription = subscriptions[i];
+            if (subscription.filter.empty())
+            {
+                if (!unused)
+                    unused = &subscription;
+            }
+            else if (subscription.filter.size() == (size_t) length && memcmp(subscription.filter.data(), filter, length) == 0)
+                return &subscription;
+        }
+        return allocate ? unused : NULL;
+    };
+
+    bool connected;
+    bool cleanSession;
+    char clientID[MQTT_BROKER_CLIENTID_LENGTH + 1];
+    int clientIDLength;
+    uint32_t lastSequence;
+    Subscription subscriptions[MQTT_BROKER_MAX_SUBSCRIPTIONS];
+    Delivery queue[MQTT_BROKER_QUEUE_SIZE];
+    int queueHead;
+    int queueCount;
+    // QoS1 sent and not yet acknowledged, sent again with DUP after a reconnect
+    Delivery inflight[MQTT_BROKER_MAX_INFLIGHT];
+    unsigned short nextPacketId;
+};
+
+static bool hasWildcards(const char * topic, int length)
+{
+    return memchr(topic, '+', length) || memchr(topic, '#', length);
+}
+
+MQTTBrokerCore::MQTTBrokerCore() : trieDirty(false), sequence(0), nextClientID(0)
+{
+    for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++)
+    {
+        connections[i].used = false;
+        connections[i].session = NULL;
+        connections[i].will = NULL;
+    }
+    memset(sessions, 0, sizeof(sessions));
+    memset(retained, 0, sizeof(retained));
+    memset(&stats, 0, sizeof(stats));
+}
+
+MQTTBrokerCore::~MQTTBrokerCore()
+{
+    for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++)
+        if (connections[i].used && connections[i].will)
+            connections[i].will->release();
+    for (int i = 0; i < MQTT_BROKER_MAX_SESSIONS; i++)
+        delete sessions[i];
+    for (int i = 0; i < MQTT_BROKER_MAX_RETAINED; i++)
+        if (retained[i])
+            retained[i]->release();
+}
+
+int MQTTBrokerCore::open(uint32_t now)
+{
+    for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++)
+    {
+        Connection& c = connections[i];
+        if (c.used)
+            continue;
+
+        c.used = true;
+        c.expired = false;
+        c.disconnected = false;
+        c.session = NULL;
+        c.will = NULL;
+        c.willRetain = false;
+        c.keepAlive = 0;
+        c.lastReceived = now;
+        c.rxLength = 0;
+        c.txLength = 0;
+        stats.connections++;
+        return i;
+    }
+    return -1;
+}
+
+void MQTTBrokerCore::close(int conn)
+{
+    Connection& c = connections[conn];
+    if (!c.used)
+        return;
+
+    if (c.will)
+    {
+        if (!c.disconnected)
+            publish(c.will, c.willRetain);
+        c.will->release();
+        c.will = NULL;
+    }
+
+    BrokerSession * session = c.session;
+    if (session)
+    {
+        DBG("MQTT broker: %s disconnected\r\n", session->clientID);
+        session->connected = false;
+        if (session->cleanSession)
+            endSession(session);
+        else
+        {
+            for (int i = 0; i < MQTT_BROKER_MAX_INFLIGHT; i++)
+                session->inflight[i].sent = false;
+        }
+    }
+
+    c.session = NULL;
+    c.used = false;
+    stats.connections--;
+}
+
+unsigned char * MQTTBrokerCore::receiveBuffer(int conn, int * space)
+{
+    Connection& c = connections[conn];
+    *space = sizeof(c.rx) - c.rxLength;
+    return c.rx + c.rxLength;
+}
+
+int MQTTBrokerCore::received(int conn, int length, uint32_t now)
+{
+    Connection& c = connections[conn];
+    int pos = 0;
+    int rc = 0;
+
+    c.rxLength += length;
+    if (length > 0)
+        c.lastReceived = now;
+
+    while (c.rxLength - pos >= 2)
+    {
+        // remaining length, 1 to 4 bytes
+        int remaining = 0;
+        int multiplier = 1;
+        int i = 1;
+        bool complete = false;
+        while (i < 5 && pos + i < c.rxLength)
+        {
+            unsigned char byte = c.rx[pos + i];
+            remaining += (byte & 127) * multiplier;
+            multiplier *= 128;
+            i++;
+            if ((byte & 128) == 0)
+            {
+                complete = true;
+                break;
+            }
+        }
+        if (!complete)
+        {
+            if (i == 5)
+                rc = -1;
+            break;
+        }
+
+        int total = i + remaining;
+        if (total > (int) sizeof(c.rx))
+        {
+            DBG("MQTT broker: packet of %d bytes too large\r\n", total);
+            rc = -1;
+            break;
+        }
+        if (c.rxLength - pos < total)
+            break;
+        // the client does not read, stop reading until the answers fit
+        if ((int) sizeof(c.tx) - c.txLength < ACK_SPACE)
+            break;
+
+        rc = handlePacket(c, c.rx + pos, total);
+        if (rc < 0)
+            break;
+        pos += total;
+    }
+
+    if (pos > 0)
+    {
+        memmove(c.rx, c.rx + pos, c.rxLength - pos);
+        c.rxLength -= pos;
+    }
+    return rc;
+}
+
+int MQTTBrokerCore::pending(int conn, const unsigned char ** data)
+{
+    Connection& c = connections[conn];
+    BrokerSession * session = c.session;
+    *data = c.tx;
+    if (session == NULL)
+        return c.txLength;
+
+    // the messages in flight of a resumed session first, then the queue
+    for (int i = 0; i < MQTT_BROKER_MAX_INFLIGHT; i++)
+    {
+        BrokerSession::Delivery& delivery = session->inflight[i];
+        if (delivery.message == NULL || delivery.sent)
+            continue;
+
+        MQTTString topic = MQTTString_initializer;
+        topic.lenstring.data = delivery.message->topic();
+        topic.lenstring.len = delivery.message->topicLength;
+        int len = MQTTSerialize_publish(c.tx + c.txLength, sizeof(c.tx) - c.txLength, 1, delivery.qos, delivery.retained,
+                                        delivery.packetId, topic, delivery.message->payload(), delivery.message->payloadLength);
+        if (len <= 0)
+            return c.txLength;
+        c.txLength += len;
+        delivery.sent = true;
+    }
+
+    while (session->queueCount > 0)
+    {
+        BrokerSession::Delivery& delivery = session->queue[session->queueHead];
+        int slot = -1;
+        unsigned short packetId = 0;
+        if (delivery.qos > 0)
+        {
+            slot = session->freeInflight();
+            if (slot < 0)
+                break;      // wait for a PUBACK
+            packetId = session->newPacketId();
+        }
+
+        MQTTString topic = MQTTString_initializer;
+        topic.lenstring.data = delivery.message->topic();
+        topic.lenstring.len = delivery.message->topicLength;
+        int len = MQTTSerialize_publish(c.tx + c.txLength, sizeof(c.tx) - c.txLength, 0, delivery.qos, delivery.retained,
+                                        packetId, topic, delivery.message->payload(), delivery.message->payloadLength);
+        if (len <= 0)
+            break;          // no room, wait for sent()
+        c.txLength += len;
+
+        if (slot >= 0)
+        {
+            // the reference moves from the queue to the inflight slot
+            session->inflight[slot] = delivery;
+            session->inflight[slot].packetId = packetId;
+            session->inflight[slot].sent = true;
+        }
+        else
+            delivery.message->release();
+        session->pop();
+        stats.messagesDelivered++;
+    }
+
+    return c.txLength;
+}
+
+void MQTTBrokerCore::sent(int conn, int length)
+{
+    Connection& c = connections[conn];
+    memmove(c.tx, c.tx + length, c.txLength - length);
+    c.txLength -= length;
+}
+
+bool MQTTBrokerCore::isExpired(int conn, uint32_t now)
+{
+    Connection& c = connections[conn];
+    if (c.expired)
+        return true;
+    if (c.session == NULL)
+        return (now - c.lastReceived) > MQTT_BROKER_CONNECT_TIMEOUT;
+    // the client has one and a half keepalive periods
+    return c.keepAlive > 0 && (now - c.lastReceived) > c.keepAlive * 1500u;
+}
+
+void MQTTBrokerCore::getStats(BrokerStats * stats)
+{
+    *stats = this->stats;
+}
+
+int MQTTBrokerCore::handlePacket(Connection& c, unsigned char * packet, int length)
+{
+    MQTTHeader header = {0};
+    header.byte = packet[0];
+
+    // the first packet must be CONNECT, and only the first
+    if ((c.session == NULL) != (header.bits.type == CONNECT))
+        return -1;
+
+    switch (header.bits.type)
+    {
+        case CONNECT:
+            return handleConnect(c, packet, length);
+        case PUBLISH:
+            return handlePublish(c, packet, length);
+        case PUBACK:
+            return handleAck(c, packet, length);
+        case PUBREL:
+            {
+                // QoS2 is forwarded on PUBLISH, only the flow is completed here
+                unsigned char type, dup;
+                unsigned short packetId;
+                if (MQTTDeserialize_ack(&type, &dup, &packetId, packet, length) != 1)
+                    return -1;
+                c.txLength += MQTTSerialize_ack(c.tx + c.txLength, sizeof(c.tx) - c.txLength, PUBCOMP, 0, packetId);
+                return 0;
+            }
+        case SUBSCRIBE:
+            return handleSubscribe(c, packet, length);
+        case UNSUBSCRIBE:
+            return handleUnsubscribe(c, packet, length);
+        case PINGREQ:
+            c.tx[c.txLength++] = PINGRESP << 4;
+            c.tx[c.txLength++] = 0;
+            return 0;
+        case DISCONNECT:
+            c.disconnected = true;
+            return -1;
+        default:
+            // PUBREC/PUBCOMP: the broker does not send QoS2
+            return -1;
+    }
+}
+
+int MQTTBrokerCore::handleConnect(Connection& c, unsigned char * packet, int length)
+{
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    unsigned char rc = 0;
+    bool sessionPresent = false;
+    char id[MQTT_BROKER_CLIENTID_LENGTH + 1];
+    int idLength = data.clientID.lenstring.len;
+
+    if (MQTTDeserialize_connect(&data, packet, length) != 1)
+        rc = 1;             // unacceptable protocol version, or broken
+    else
+    {
+        idLength = data.clientID.lenstring.len;
+        if (idLength > MQTT_BROKER_CLIENTID_LENGTH || (idLength == 0 && !data.cleansession))
+            rc = 2;         // identifier rejected
+        else if (idLength == 0)
+            idLength = snprintf(id, sizeof(id), "auto-%lu", (unsigned long) ++nextClientID);
+        else
+        {
+            memcpy(id, data.clientID.lenstring.data, idLength);
+            id[idLength] = 0;
+        }
+    }
+
+    BrokerSession * session = NULL;
+    if (rc == 0)
+    {
+        session = findSession(id, idLength);
+        if (session && session->connected)
+        {
+            // the client has connected again, the old connection is closed
+            for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++)
+            {
+                if (connections[i].used && connections[i].session == session)
+                {
+                    connections[i].session = NULL;
+                    connections[i].expired = true;
+                }
+            }
+            session->connected = false;
+        }
+        if (session && data.cleansession)
+        {
+            endSession(session);
+            session = NULL;
+        }
+        sessionPresent = (session != NULL);
+        if (!session)
+        {
+            session = newSession();
+            if (!session)
+                rc = 3;     // server unavailable
+        }
+    }
+
+    c.txLength += MQTTSerialize_connack(c.tx + c.txLength, sizeof(c.tx) - c.txLength, rc, sessionPresent);
+    if (rc != 0)
+        return -1;
+
+    memcpy(session->clientID, id, idLength + 1);
+    session->clientIDLength = idLength;
+    session->cleanSession = data.cleansession;
+    session->connected = true;
+    c.session = session;
+    c.keepAlive = data.keepAliveInterval;
+
+    if (data.willFlag)
+    {
+        MQTTLenString& topic = data.will.topicName.lenstring;
+        MQTTLenString& message = data.will.message.lenstring;
+        if (topic.len == 0 || hasWildcards(topic.data, topic.len))
+            return -1;
+        c.will = BrokerMessage::alloc(topic.data, topic.len, (unsigned char *) message.data, message.len);
+        if (c.will)
+            c.will->qos = (data.will.qos > 0) ? 1 : 0;
+        c.willRetain = data.will.retained;
+    }
+
+    stats.connects++;
+    DBG("MQTT broker: %s connected%s\r\n", id, sessionPresent ? ", session present" : "");
+    return 0;
+}
+
+int MQTTBrokerCore::handlePublish(Connection& c, unsigned char * packet, int length)
+{
+    unsigned char dup, retain;
+    int qos;
+    unsigned short packetId;
+    MQTTString topic;
+    unsigned char * payload;
+    int payloadLength;
+
+    if (MQTTDeserialize_publish(&dup, &qos, &retain, &packetId, &topic, &payload, &payloadLength, packet, length) != 1)
+        return -1;
+    if (qos > 2 || topic.lenstring.len == 0 || hasWildcards(topic.lenstring.data, topic.lenstring.len))
+        return -1;
+
+    stats.messagesReceived++;
+    BrokerMessage * message = BrokerMessage::alloc(topic.lenstring.data, topic.lenstring.len, payload, payloadLength);
+    if (message)
+    {
+        message->qos = (qos > 0) ? 1 : 0;
+        publish(message, retain);
+        message->release();
+    }
+    else
+        stats.messagesDropped++;
+
+    if (qos > 0)
+        c.txLength += MQTTSerialize_ack(c.tx + c.txLength, sizeof(c.tx) - c.txLength, (qos == 1) ? PUBACK : PUBREC, 0, packetId);
+    return 0;
+}
+
+int MQTTBrokerCore::handleSubscribe(Connection& c, unsigned char * packet, int length)
+{
+    MQTTString filters[MQTT_BROKER_MAX_SUBSCRIPTIONS];
+    int qos[MQTT_BROKER_MAX_SUBSCRIPTIONS];
+    unsigned char dup;
+    unsigned short packetId;
+    int count;
+
+    if (MQTTDeserialize_subscribe(&dup, &packetId, MQTT_BROKER_MAX_SUBSCRIPTIONS, &count, filters, qos, packet, length) != 1 || count == 0)
+        return -1;
+
+    // the new filters, to find the retained messages for them
+    TopicTrie<Dispatch *> added;
+    for (int i = 0; i < count; i++)
+    {
+        MQTTLenString& filter = filters[i].lenstring;
+        int requested = qos[i];
+        qos[i] = 0x80;
+
+        if (filter.len == 0 || requested < 0 || requested > 2)
+            continue;
+        BrokerSession::Subscription * subscription = c.session->findSubscription(filter.data, filter.len, true);
+        if (!subscription)
+            continue;
+
+        std::string name(filter.data, filter.len);
+        TopicTrie<Dispatch *>::Handler handler;
+        handler.attach(subscription, &BrokerSession::Subscription::deliver);
+        if (!added.add(name.c_str(), handler))
+            continue;       // wildcard not on a whole level
+
+        subscription->filter = name;
+        subscription->qos = (requested > 0) ? 1 : 0;
+        qos[i] = subscription->qos;
+    }
+
+    c.txLength += MQTTSerialize_suback(c.tx + c.txLength, sizeof(c.tx) - c.txLength, packetId, count, qos);
+    trieDirty = true;
+
+    for (int i = 0; i < MQTT_BROKER_MAX_RETAINED; i++)
+    {
+        if (retained[i])
+        {
+            Dispatch dispatch = { retained[i], ++sequence, true, 0 };
+            added.dispatch(retained[i]->topic(), retained[i]->topicLength, &dispatch);
+            stats.messagesDropped += dispatch.dropped;
+        }
+    }
+    return 0;
+}
+
+int MQTTBrokerCore::handleUnsubscribe(Connection& c, unsigned char * packet, int length)
+{
+    MQTTString filters[MQTT_BROKER_MAX_SUBSCRIPTIONS];
+    unsigned char dup;
+    unsigned short packetId;
+    int count;
+
+    if (MQTTDeserialize_unsubscribe(&dup, &packetId, MQTT_BROKER_MAX_SUBSCRIPTIONS, &count, filters, packet, length) != 1)
+        return -1;
+
+    for (int i = 0; i < count; i++)
+    {
+        BrokerSession::Subscription * subscription = c.session->findSubscription(filters[i].lenstring.data, filters[i].lenstring.len, false);
+        if (subscription)
+            subscription->filter.clear();
+    }
+
+    c.txLength += MQTTSerialize_unsuback(c.tx + c.txLength, sizeof(c.tx) - c.txLength, packetId);
+    trieDirty = true;
+    return 0;
+}
+
+int MQTTBrokerCore::handleAck(Connection& c, unsigned char * packet, int length)
+{
+    unsigned char type, dup;
+    unsigned short packetId;
+
+    if (MQTTDeserialize_ack(&type, &dup, &packetId, packet, length) != 1)
+        return -1;
+    c.session->acknowledge(packetId);
+    return 0;
+}
+
+BrokerSession * MQTTBrokerCore::findSession(const char * clientID, int length)
+{
+    for (int i = 0; i < MQTT_BROKER_MAX_SESSIONS; i++)
+    {
+        BrokerSession * session = sessions[i];
+        if (session && session->clientIDLength == length && memcmp(session->clientID, clientID, length) == 0)
+            return session;
+    }
+    return NULL;
+}
+
+BrokerSession * MQTTBrokerCore::newSession()
+{
+    int slot = -1;
+    for (int i = 0; i < MQTT_BROKER_MAX_SESSIONS && slot < 0; i++)
+        if (sessions[i] == NULL)
+            slot = i;
+
+    // all taken, the state of an offline client is given up
+    for (int i = 0; i < MQTT_BROKER_MAX_SESSIONS && slot < 0; i++)
+    {
+        if (!sessions[i]->connected)
+        {
+            DBG("MQTT broker: session of %s dropped\r\n", sessions[i]->clientID);
+            endSession(sessions[i]);
+            slot = i;
+        }
+    }
+
+    if (slot < 0)
+        return NULL;
+    sessions[slot] = new BrokerSession();
+    return sessions[slot];
+}
+
+void MQTTBrokerCore::endSession(BrokerSession * session)
+{
+    for (int i = 0; i < MQTT_BROKER_MAX_SESSIONS; i++)
+    {
+        if (sessions[i] == session)
+        {
+            sessions[i] = NULL;
+            delete session;
+            trieDirty = true;
+            return;
+        }
+    }
+}
+
+void MQTTBrokerCore::publish(BrokerMessage * message, bool retain)
+{
+    if (retain)
+        storeRetained(message);
+
+    updateTrie();
+    // to current subscribers the message is not sent as retained
+    Dispatch dispatch = { message, ++sequence, false, 0 };
+    trie.dispatch(message->topic(), message->topicLength, &dispatch);
+    stats.messagesDropped += dispatch.dropped;
+}
+
+// an empty payload deletes the retained message of the topic
+void MQTTBrokerCore::storeRetained(BrokerMessage * message)
+{
+    int slot = -1;
+    for (int i = 0; i < MQTT_BROKER_MAX_RETAINED; i++)
+    {
+        BrokerMessage * entry = retained[i];
+        if (entry == NULL)
+        {
+            if (slot < 0)
+                slot = i;
+        }
+        else if (entry->topicLength == message->topicLength && memcmp(entry->topic(), message->topic(), message->topicLength) == 0)
+        {
+            entry->release();
+            retained[i] = NULL;
+            stats.retained--;
+            slot = i;
+            break;
+        }
+    }
+
+    if (message->payloadLength == 0)
+        return;
+    if (slot < 0)
+    {
+        stats.retainedDropped++;
+        return;
+    }
+    message->retain();
+    retained[slot] = message;
+    stats.retained++;
+}
+
+void MQTTBrokerCore::updateTrie()
+{
+    if (!trieDirty)
+        return;
+
+    trie.clear();
+    for (int i = 0; i < MQTT_BROKER_MAX_SESSIONS; i++)
+    {
+        if (sessions[i] == NULL)
+            continue;
+        for (int j = 0; j < MQTT_BROKER_MAX_SUBSCRIPTIONS; j++)
+        {
+            BrokerSession::Subscription& subscription = sessions[i]->subscriptions[j];
+            if (subscription.filter.empty())
+                continue;
+            TopicTrie<Dispatch *>::Handler handler;
+            handler.attach(&subscription, &BrokerSession::Subscription::deliver);
+            trie.add(subscription.filter.c_str(), handler);
+        }
+    }
+    trieDirty = false;
+}
+
+}
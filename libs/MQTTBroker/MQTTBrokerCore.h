@@ -0,0 +1,206 @@
+#ifndef _MQTT_BROKER_CORE_H_
+#define _MQTT_BROKER_CORE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "MQTTPacket.h"
+#include "TopicTrie.h"
+
+// network connections served at the same time
+#ifndef MQTT_BROKER_MAX_CONNECTIONS
+#define MQTT_BROKER_MAX_CONNECTIONS 4
+#endif
+// sessions, more than connections to keep the state of clients with cleansession = 0
+#ifndef MQTT_BROKER_MAX_SESSIONS
+#define MQTT_BROKER_MAX_SESSIONS (2 * MQTT_BROKER_MAX_CONNECTIONS)
+#endif
+// topic filters per session
+#ifndef MQTT_BROKER_MAX_SUBSCRIPTIONS
+#define MQTT_BROKER_MAX_SUBSCRIPTIONS 8
+#endif
+// retained messages, further topics are not retained
+#ifndef MQTT_BROKER_MAX_RETAINED
+#define MQTT_BROKER_MAX_RETAINED 16
+#endif
+// messages waiting per session, more are dropped
+#ifndef MQTT_BROKER_QUEUE_SIZE
+#define MQTT_BROKER_QUEUE_SIZE 16
+#endif
+// QoS1 messages sent per session and not yet acknowledged
+#ifndef MQTT_BROKER_MAX_INFLIGHT
+#define MQTT_BROKER_MAX_INFLIGHT 4
+#endif
+// largest packet accepted from a client
+#ifndef MQTT_BROKER_PACKET_SIZE
+#define MQTT_BROKER_PACKET_SIZE 512
+#endif
+// packets waiting for the socket, per connection, must hold the largest packet
+#ifndef MQTT_BROKER_TX_BUFFER_SIZE
+#define MQTT_BROKER_TX_BUFFER_SIZE 1024
+#endif
+// ms for the CONNECT packet after the connection is opened
+#ifndef MQTT_BROKER_CONNECT_TIMEOUT
+#define MQTT_BROKER_CONNECT_TIMEOUT 10000
+#endif
+// 23 bytes must be accepted by a 3.1.1 server
+#ifndef MQTT_BROKER_CLIENTID_LENGTH
+#define MQTT_BROKER_CLIENTID_LENGTH 32
+#endif
+
+namespace MQTT
+{
+
+/**
+ * \brief BrokerMessage holds topic and payload of a published message.
+ *
+ * The message is allocated once and shared by the queues of all matching
+ * sessions and the retained table, the last release() frees it.
+ */
+class BrokerMessage
+{
+public:
+    static BrokerMessage * alloc(const char * topic, int topicLength, const unsigned char * payload, int payloadLength);
+
+    void retain() { refs++; };
+    void release() { if (--refs == 0) free(this); };
+
+    char * topic() { return (char *) (this + 1); };
+    unsigned char * payload() { return (unsigned char *) (this + 1) + topicLength; };
+
+    int refs;
+    int topicLength;
+    int payloadLength;
+    unsigned char qos;
+};
+
+typedef struct
+{
+    uint32_t connects;
+    uint32_t connections;           // connected now
+    uint32_t messagesReceived;
+    uint32_t messagesDelivered;
+    uint32_t messagesDropped;       // queue of a session full
+    uint32_t retained;
+    uint32_t retainedDropped;       // retained table full
+}BrokerStats;
+
+class BrokerSession;
+
+/**
+ * \brief MQTTBrokerCore is a small MQTT 3.1.1 broker without network code.
+ *
+ * The network side feeds the received bytes of a connection with
+ * receiveBuffer()/received() and sends what pending() returns, the core
+ * parses the packets and queues the messages for the matching sessions.
+ * So the same code runs on the target behind the sockets of MQTTBroker
+ * and on the host for tests and benchmarks.
+ *
+ * Messages are delivered with QoS0 and QoS1, a QoS2 PUBLISH is accepted
+ * and forwarded with QoS1. Subscriptions are matched by a TopicTrie, a
+ * message is stored once and its reference is queued for every session.
+ *
+ * Not thread safe, all calls come from the network thread.
+ */
+class MQTTBrokerCore
+{
+public:
+    MQTTBrokerCore();
+    ~MQTTBrokerCore();
+
+    /**
+     *  Takes a new network connection
+     *
+     *  @return connection number, -1 if all connections are in use
+     */
+    int open(uint32_t now);
+
+    /**
+     *  Ends a connection, the will message is published unless the
+     *  client has sent DISCONNECT
+     */
+    void close(int conn);
+
+    /**
+     *  Returns the free space of the receive buffer, the network
+     *  writes the received bytes there and calls received()
+     */
+    unsigned char * receiveBuffer(int conn, int * space);
+
+    /**
+     *  Handles the complete packets in the receive buffer
+     *
+     *  @param length - bytes written to receiveBuffer(), 0 continues
+     *                  with the packets that waited for room to answer
+     *  @return -1 if the connection must be closed
+     */
+    int received(int conn, int length, uint32_t now);
+
+    /**
+     *  Returns the bytes to send, fills the transmit buffer from the
+     *  queue of the session before
+     */
+    int pending(int conn, const unsigned char ** data);
+
+    // removes length bytes sent from the transmit buffer
+    void sent(int conn, int length);
+
+    // true if the keepalive timed out or the client has connected again
+    bool isExpired(int conn, uint32_t now);
+
+    void getStats(BrokerStats * stats);
+
+    // for the subscriptions in the topic trie
+    struct Dispatch
+    {
+        BrokerMessage * message;
+        uint32_t sequence;          // a session matching several filters gets one copy
+        bool retained;
+        int dropped;
+    };
+
+private:
+    struct Connection
+    {
+        bool used;
+        bool expired;
+        bool disconnected;          // DISCONNECT received, no will
+        BrokerSession * session;
+        BrokerMessage * will;
+        bool willRetain;
+        uint16_t keepAlive;
+        uint32_t lastReceived;
+        int rxLength;
+        int txLength;
+        unsigned char rx[MQTT_BROKER_PACKET_SIZE];
+        unsigned char tx[MQTT_BROKER_TX_BUFFER_SIZE];
+    };
+
+    int handlePacket(Connection& c, unsigned char * packet, int length);
+    int handleConnect(Connection& c, unsigned char * packet, int length);
+    int handlePublish(Connection& c, unsigned char * packet, int length);
+    int handleSubscribe(Connection& c, unsigned char * packet, int length);
+    int handleUnsubscribe(Connection& c, unsigned char * packet, int length);
+    int handleAck(Connection& c, unsigned char * packet, int length);
+
+    BrokerSession * findSession(const char * clientID, int length);
+    BrokerSession * newSession();
+    void endSession(BrokerSession * session);
+
+    void publish(BrokerMessage * message, bool retain);
+    void storeRetained(BrokerMessage * message);
+    void updateTrie();
+
+    Connection connections[MQTT_BROKER_MAX_CONNECTIONS];
+    BrokerSession * sessions[MQTT_BROKER_MAX_SESSIONS];
+    BrokerMessage * retained[MQTT_BROKER_MAX_RETAINED];
+
+    // rebuilt after SUBSCRIBE/UNSUBSCRIBE, the trie cannot remove filters
+    TopicTrie<Dispatch *> trie;
+    bool trieDirty;
+    uint32_t sequence;
+    uint32_t nextClientID;
+    BrokerStats stats;
+};
+
+}
+#endif
@@ -7,8 +7,15 @@
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/error.h"
 
-static MemoryPool<MQTT::PubMessage, 8> mpool;
-static Queue<MQTT::PubMessage, 8> mqueue;
+// the outbox, messages hold a reference until they are acknowledged
+static uint64_t outboxMemory[MQTT_OUTBOX_RING_SIZE / 8];
+static MQTT::PublishRing outbox(outboxMemory, sizeof(outboxMemory), MQTT_OUTBOX_SIZE);
+
+#define FLAG_SOCKET     (1UL << 0)
+#define FLAG_OUTBOX     (1UL << 1)
+#define FLAG_STOP       (1UL << 2)
+// outboxFlags
+#define FLAG_SPACE      (1UL << 0)
 
 // SSL/TLS variables
 mbedtls_entropy_context _entropy;
@@ -27,7 +34,7 @@ static int ssl_recv(void *ctx, unsigned char *buf, size_t len)
 {
     int recv = -1;
     TCPSocket *socket = static_cast<TCPSocket *>(ctx);
-    socket->set_timeout(DEFAULT_SOCKET_TIMEOUT);
+    // the timeout is set by readBytesToBuffer
     recv = socket->recv(buf, len);
 
     if (NSAPI_ERROR_WOULD_BLOCK == recv) {
@@ -46,7 +53,7 @@ static int ssl_send(void *ctx, const unsigned char *buf, size_t len)
 {
     int sent = -1;
     TCPSocket *socket = static_cast<TCPSocket *>(ctx);
-    socket->set_timeout(DEFAULT_SOCKET_TIMEOUT);    
+    // the timeout is set by sendBytesFromBuffer
     sent = socket->send(buf, len);
 
     if(NSAPI_ERROR_WOULD_BLOCK == sent) {
@@ -125,6 +132,7 @@ void MQTTThreadedClient::freeTLS()
 {
         if (useTLS)
         {
+            mbedtls_ssl_session_free(&saved_session);
             mbedtls_entropy_free(&_entropy);
             mbedtls_ctr_drbg_free(&_ctr_drbg);
             mbedtls_x509_crt_free(&_cacert);
@@ -175,6 +183,12 @@ int MQTTThreadedClient::initTLS()
         DBG("mbedtls_ssl_conf_authmode ...\r\n");         
         mbedtls_ssl_conf_authmode(&_ssl_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
 
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+        // a ticket needs no session cache on the server, the reconnect
+        // resumes with the session id if the server does not send one
+        mbedtls_ssl_conf_session_tickets(&_ssl_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+
 #if DEBUG_LEVEL > 0
         mbedtls_ssl_conf_verify(&_ssl_conf, my_verify, NULL);
         mbedtls_ssl_conf_dbg(&_ssl_conf, my_debug, NULL);
@@ -195,14 +209,28 @@ int MQTTThreadedClient::doTLSHandshake()
 {
         int ret;
         
-        /* Start the handshake, the rest will be done in onReceive() */
-        printf("Starting the TLS handshake...\r\n");
-        ret = mbedtls_ssl_handshake(&_ssl);
+        /* Start the handshake, with the saved session the server
+           may skip the certificate and the key exchange */
+        DBG("Starting the TLS handshake...\r\n");
+        tcpSocket->set_timeout(DEFAULT_SOCKET_TIMEOUT);
+        bool resumed = false;
+        do
+        {
+            ret = mbedtls_ssl_handshake_step(&_ssl);
+            // set after the ServerHello, the handshake data is freed at the end
+            if (_ssl.handshake != NULL && _ssl.handshake->resume)
+                resumed = true;
+        } while (ret == 0 && _ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER);
+
         if (ret < 0) 
         {
             if (ret != MBEDTLS_ERR_SSL_WANT_READ &&
                 ret != MBEDTLS_ERR_SSL_WANT_WRITE) 
-                    mbedtls_printf("mbedtls_ssl_handshake returned [%x]\r\n", ret);
+            {
+                mbedtls_printf("mbedtls_ssl_handshake returned [%x]\r\n", ret);
+                // the next attempt is a full handshake
+                hasSavedSession = false;
+            }
             else 
             {
                 // do not close the socket if timed out
@@ -212,16 +240,25 @@ int MQTTThreadedClient::doTLSHandshake()
         }
 
         /* Handshake done, time to print info */
-        printf("TLS connection to %s:%d established\r\n", 
-            host.c_str(), port);
+        printf("TLS connection to %s:%d established%s\r\n", 
+            host.c_str(), port, resumed ? ", session resumed" : "");
+        {
+            CriticalSectionLock lock;
+            if (resumed)
+                statTLSResumed++;
+            else
+                statTLSFull++;
+        }
 
         const uint32_t buf_size = 1024;
         char *buf = new char[buf_size];
-        mbedtls_x509_crt_info(buf, buf_size, "\r    ",
-                        mbedtls_ssl_get_peer_cert(&_ssl));
-                        
-        printf("Server certificate:\r\n%s\r", buf);
-        // Verify server cert ...
+        if (!resumed)
+        {
+            mbedtls_x509_crt_info(buf, buf_size, "\r    ",
+                            mbedtls_ssl_get_peer_cert(&_ssl));
+            printf("Server certificate:\r\n%s\r", buf);
+        }
+        // Verify server cert, a resumed session keeps the result ...
         uint32_t flags = mbedtls_ssl_get_verify_result(&_ssl);
         if( flags != 0 )
         {
@@ -229,26 +266,28 @@ int MQTTThreadedClient::doTLSHandshake()
             printf("Certificate verification failed:\r\n%s\r\r\n", buf);
             // free server cert ... before error return
             delete [] buf;
+            hasSavedSession = false;
             return -1;
         }
         
-        printf("Certificate verification passed\r\n\r\n");
+        DBG("Certificate verification passed\r\n\r\n");
         // delete server cert after verification
         delete [] buf;
         
 #if defined(MBEDTLS_SSL_CLI_C)        
-				printf("Saving SSL/TLS session ...\r\n");
-        // TODO: Save the session here for reconnect.
+        // also after a resumption, the server may have sent a new ticket.
+        // The copy of the last session is freed first.
+        mbedtls_ssl_session_free( &saved_session );
         if( ( ret = mbedtls_ssl_get_session( &_ssl, &saved_session ) ) != 0 )
         {
             mbedtls_printf( "mbedtls_ssl_get_session returned -0x%x\n\n", -ret );
             hasSavedSession = false;
-            return -1;
+            // the connection is fine, only the next one is a full handshake
+            return 0;
         }  
-        printf("Session saved for reconnect ...\r\n");				
-#endif        
-     
+        DBG("Session saved for reconnect ...\r\n");				
         hasSavedSession = true;
+#endif        
         
         return 0;
 }
@@ -263,6 +302,7 @@ int MQTTThreadedClient::readBytesToBuffer(char * buffer, size_t size, int timeou
     if (useTLS) 
     {
         // Do SSL/TLS read
+        tcpSocket->set_timeout(timeout);
         rc = mbedtls_ssl_read(&_ssl, (unsigned char *) buffer, size);
         if (MBEDTLS_ERR_SSL_WANT_READ == rc)
             return TIMEOUT;
@@ -290,6 +330,7 @@ int MQTTThreadedClient::sendBytesFromBuffer(char * buffer, size_t size, int time
     
     if (useTLS) {
         // Do SSL/TLS write
+        tcpSocket->set_timeout(timeout);
         rc =  mbedtls_ssl_write(&_ssl, (const unsigned char *) buffer, size);
         if (MBEDTLS_ERR_SSL_WANT_WRITE == rc)
             return TIMEOUT;
@@ -345,14 +386,52 @@ exit:
     return len;
 }
 
+/**
+ * Sends the packet in sendbuf, after the packets collected in txbuf.
+ **/
 int MQTTThreadedClient::sendPacket(size_t length)
+{
+    if (flushTx() != SUCCESS)
+        return FAILURE;
+
+    return sendSegment(sendbuf, length);
+}
+
+/**
+ * Collects data for one send call. Data that does not fit into the
+ * empty txbuf is sent directly.
+ **/
+int MQTTThreadedClient::appendTx(const unsigned char * data, size_t length)
+{
+    if (txlen + length > MQTT_TX_BUFFER_SIZE && flushTx() != SUCCESS)
+        return FAILURE;
+
+    if (length > MQTT_TX_BUFFER_SIZE)
+        return sendSegment(data, length);
+
+    memcpy(&txbuf[txlen], data, length);
+    txlen += length;
+    return SUCCESS;
+}
+
+int MQTTThreadedClient::flushTx()
+{
+    if (txlen == 0)
+        return SUCCESS;
+
+    size_t length = txlen;
+    txlen = 0;
+    return sendSegment(txbuf, length);
+}
+
+int MQTTThreadedClient::sendSegment(const unsigned char * data, size_t length)
 {
     int rc = FAILURE;
-    int sent = 0;
+    size_t sent = 0;
 
     while (sent < length)
     {
-        rc = sendBytesFromBuffer((char *) &sendbuf[sent], length - sent, DEFAULT_SOCKET_TIMEOUT);
+        rc = sendBytesFromBuffer((char *) &data[sent], length - sent, DEFAULT_SOCKET_TIMEOUT);
         if (rc < 0)  // there was an error writing the data
             break;
         sent += rc;
@@ -369,8 +448,12 @@ int MQTTThreadedClient::sendPacket(size_t length)
  * Reads the entire packet to readbuf and returns
  * the type of packet when successful, otherwise
  * a negative error code is returned.
+ *
+ * timeout is the wait for the first byte, 0 returns TIMEOUT
+ * at once if no data is available. The rest of a packet
+ * is waited for with DEFAULT_SOCKET_TIMEOUT.
  **/
-int MQTTThreadedClient::readPacket()
+int MQTTThreadedClient::readPacket(int timeout)
 {
     int rc = FAILURE;
     MQTTHeader header = {0};
@@ -378,10 +461,16 @@ int MQTTThreadedClient::readPacket()
     int rem_len = 0;
 
     /* 1. read the header byte.  This has the packet type in it */
-    if ( (rc = readBytesToBuffer((char *) &readbuf[0], 1, DEFAULT_SOCKET_TIMEOUT)) != 1)
+    if ( (rc = readBytesToBuffer((char *) &readbuf[0], 1, timeout)) != 1)
+    {
+        // 0 bytes: closed by the server
+        if (rc != TIMEOUT)
+            rc = FAILURE;
         goto exit;
+    }
 
     len = 1;
+    rc = FAILURE;
     /* 2. read the remaining length.  This is variable in itself */
     if ( readPacketLength(&rem_len) < 0 )
         goto exit;
@@ -394,9 +483,15 @@ int MQTTThreadedClient::readPacket()
         goto exit;
     }
 
-    /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (readBytesToBuffer((char *) (readbuf + len), rem_len, DEFAULT_SOCKET_TIMEOUT) != rem_len))
-        goto exit;
+    /* 3. read the rest of the buffer, recv returns what has arrived, maybe less */
+    while (rem_len > 0)
+    {
+        int n = readBytesToBuffer((char *) (readbuf + len), rem_len, DEFAULT_SOCKET_TIMEOUT);
+        if (n <= 0)
+            goto exit;
+        len += n;
+        rem_len -= n;
+    }
 
     // Convert the header to type
     // and update rc
@@ -410,7 +505,8 @@ exit:
 
 /**
  * Read until a specified packet type is received, or untill the specified
- * timeout dropping packets along the way.
+ * timeout. Publish messages and acknowledges read along the way are
+ * handled, other packets are dropped.
  **/
 int MQTTThreadedClient::readUntil(int packetType, int timeout)
 {
@@ -422,6 +518,12 @@ int MQTTThreadedClient::readUntil(int packetType, int timeout)
         pType = readPacket();
         if (pType < 0)
             break;
+
+        if (pType != packetType && handlePacket(pType) < 0)
+        {
+            pType = FAILURE;
+            break;
+        }
             
         if (timer.read_ms() > timeout)
         {
@@ -454,24 +556,82 @@ int MQTTThreadedClient::login()
     DBG("\tUsername: [%s]\r\n", connect_options.username.cstring);
     DBG("\tPassword: [%s]\r\n", connect_options.password.cstring);
     
-    if ((len = MQTTSerialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, &connect_options)) <= 0)
+    if (connect_options.MQTTVersion == 5)
+    {
+        MQTTProperty propertyArray[3];
+        MQTTProperties properties = MQTTProperties_initializer;
+        MQTTProperty property;
+        properties.array = propertyArray;
+        properties.max_count = 3;
+
+        if (sessionExpiry > 0)
+        {
+            property.identifier = MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL;
+            property.value.integer4 = sessionExpiry;
+            MQTTProperties_add(&properties, &property);
+        }
+        // the QoS2 ids we can remember and the size of readbuf
+        property.identifier = MQTTPROPERTY_CODE_RECEIVE_MAXIMUM;
+        property.value.integer2 = MQTT_MAX_QOS2_RECEIVED;
+        MQTTProperties_add(&properties, &property);
+        property.identifier = MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE;
+        property.value.integer4 = MAX_MQTT_PACKET_SIZE;
+        MQTTProperties_add(&properties, &property);
+
+        len = MQTTV5Serialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, &connect_options, &properties, NULL);
+    }
+    else
+        len = MQTTSerialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, &connect_options);
+
+    if (len <= 0)
     {
         DBG("Error serializing connect packet ...\r\n");
         return rc;
     }
-    if ((rc = sendPacket((size_t) len)) != SUCCESS)  // send the connect packet
+    // The SUBSCRIBE packets follow without waiting for the CONNACK, 
+    // connect and subscribe take one round trip
+    if ((rc = appendTx(sendbuf, (size_t) len)) != SUCCESS
+        || sendSubscriptions() < 0 
+        || (rc = flushTx()) != SUCCESS)
     {
         DBG("Error sending the connect request packet ...\r\n");
-        return rc; 
+        return FAILURE; 
     }
     
+    // the limits of the server, v3 has none
+    uint16_t receiveMaximum = MQTT_MAX_INFLIGHT;
+    uint16_t topicAliasMaximum = 0;
+
     // Wait for the CONNACK 
     if (readUntil(CONNACK, COMMAND_TIMEOUT) == CONNACK)
     {
         unsigned char connack_rc = 255;
         bool sessionPresent = false;
         DBG("Connection acknowledgement received ... deserializing respones ...\r\n");
-        if (MQTTDeserialize_connack((unsigned char*)&sessionPresent, &connack_rc, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        if (connect_options.MQTTVersion == 5)
+        {
+            MQTTProperty propertyArray[12];
+            MQTTProperties properties = MQTTProperties_initializer;
+            properties.array = propertyArray;
+            properties.max_count = 12;
+
+            if (MQTTV5Deserialize_connack(&properties, (unsigned char*)&sessionPresent, &connack_rc, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+            {
+                rc = connack_rc;
+                MQTTProperty *property = MQTTProperties_get(&properties, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM);
+                if (property && property->value.integer2 > 0)
+                    receiveMaximum = property->value.integer2;
+                property = MQTTProperties_get(&properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM);
+                if (property)
+                    topicAliasMaximum = property->value.integer2;
+                property = MQTTProperties_get(&properties, MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE);
+                if (property)
+                    keepAliveInterval = property->value.integer2 * 1000;
+            }
+            else
+                rc = FAILURE;
+        }
+        else if (MQTTDeserialize_connack((unsigned char*)&sessionPresent, &connack_rc, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
             rc = connack_rc;
         else
             rc = FAILURE;
@@ -483,6 +643,32 @@ int MQTTThreadedClient::login()
     {
         DBG("Connected!!! ... starting connection timers ...\r\n");
         resetConnectionTimer();
+        {
+            CriticalSectionLock lock;
+            uint64_t now = Kernel::get_ms_count();
+            statConnects++;
+            statConnectTime_ms = (uint32_t) (now - sessionStart);
+            if (connectionLost != 0)
+            {
+                statReconnectTime_ms = (uint32_t) (now - connectionLost);
+                if (statReconnectTime_ms > statReconnectTimeMax_ms)
+                    statReconnectTimeMax_ms = statReconnectTime_ms;
+            }
+        }
+        connectionLost = 0;
+        reconnectAttempt = 0;
+
+        // aliases are only valid for this connection
+        inflightLimit = (receiveMaximum < MQTT_MAX_INFLIGHT) ? receiveMaximum : MQTT_MAX_INFLIGHT;
+        topicAliases.reset(topicAliasMaximum);
+
+        // A clean session does not know our QoS2 receive state. The
+        // outbox is kept, its messages are resent after the subscriptions.
+        if (connect_options.cleansession)
+        {
+            memset(qos2Received, 0, sizeof(qos2Received));
+            qos2ReceivedNext = 0;
+        }
     }
     
     DBG("Returning with rc = %d\r\n", rc);
@@ -503,6 +689,8 @@ void MQTTThreadedClient::disconnect()
         }        
         
         isConnected = false;
+        txlen = 0;
+        tcpSocket->sigio(NULL);
         tcpSocket->close();      
     }
 }
@@ -527,7 +715,8 @@ int MQTTThreadedClient::connect()
 #if defined(MBEDTLS_SSL_CLI_C)
         if ( hasSavedSession && (( ret = mbedtls_ssl_set_session( &_ssl, &saved_session ) ) != 0 )) {
             mbedtls_printf( " failed\n  ! mbedtls_ssl_conf_session returned %d\n\n", ret );
-            return ret;
+            // continue with a full handshake
+            hasSavedSession = false;
         }
 #endif        
     }
@@ -548,6 +737,9 @@ int MQTTThreadedClient::connect()
          return ret;
     }else
          isConnected = true;
+
+    // TCP connected, the setup time of the session starts here
+    sessionStart = Kernel::get_ms_count();
     
     if (useTLS) 
     {
@@ -571,49 +763,178 @@ void MQTTThreadedClient::setConnectionParameters(const char * chost, uint16_t cp
     connect_options = options;    
 }
 
-int MQTTThreadedClient::publish(PubMessage& msg)
+/**
+ * Waits until the listener thread frees space in the outbox. The caller
+ * has counted itself in outboxWaiters and cleared FLAG_SPACE before its
+ * last try, so no wake up is lost.
+ *
+ * @param end - ms, Kernel::get_ms_count()
+ * @return false if the time is over
+ **/
+bool MQTTThreadedClient::waitOutbox(uint64_t end)
+{
+    uint64_t now = Kernel::get_ms_count();
+    if (now >= end)
+        return false;
+
+    outboxFlags.wait_any(FLAG_SPACE, (uint32_t) (end - now), false);
+    return true;
+}
+
+PublishBuffer* MQTTThreadedClient::allocPublish(const char * topic, size_t maxLength, uint32_t timeout)
+{
+    // see publish()
+    if (strlen(topic) + 13 > MAX_MQTT_PACKET_SIZE)
+        return NULL;
+
+    PublishBuffer *message = outbox.alloc(topic, maxLength);
+    if (message == NULL)
+    {
+        // the listener frees the space, also a padding at the end of the ring
+        listenerFlags.set(FLAG_OUTBOX);
+    }
+    if (message == NULL && timeout > 0)
+    {
+        uint64_t end = Kernel::get_ms_count() + timeout;
+        core_util_atomic_incr_u32(&outboxWaiters, 1);
+        do
+        {
+            outboxFlags.clear(FLAG_SPACE);
+            message = outbox.alloc(topic, maxLength);
+        } while (message == NULL && waitOutbox(end));
+        core_util_atomic_decr_u32(&outboxWaiters, 1);
+    }
+
+    return message;
+}
+
+int MQTTThreadedClient::publish(PublishBuffer* message, uint32_t timeout)
 {
-#if 0
-    int id = queue.call(mbed::callback(this, &MQTTThreadedClient::sendPublish), topic, message);
-    // TODO: handle id values when the function is called later
-    if (id == 0)
+    // fixed header (5), topic length (2), packet id (2) and the v5 
+    // properties (4) go with the topic into sendbuf
+    if (message->getTopicLength() + 13 > MAX_MQTT_PACKET_SIZE)
+    {
+        DBG("Topic too long ...\r\n");
+        message->release();
         return FAILURE;
-    else
-        return SUCCESS;
-#endif
-    PubMessage *message = mpool.alloc();
-    // Simple copy
-    *message = msg;
-    
+    }
+
     // Push the data to the thread
     DBG("Pushing data to consumer thread ...\r\n");
-    mqueue.put(message);
+    message->timestamp = us_ticker_read();
+    bool pushed = outbox.push(message);
+    if (!pushed && timeout > 0)
+    {
+        uint64_t end = Kernel::get_ms_count() + timeout;
+        core_util_atomic_incr_u32(&outboxWaiters, 1);
+        do
+        {
+            outboxFlags.clear(FLAG_SPACE);
+            pushed = outbox.push(message);
+        } while (!pushed && waitOutbox(end));
+        core_util_atomic_decr_u32(&outboxWaiters, 1);
+    }
+    if (!pushed)
+    {
+        DBG("Outbox full ...\r\n");
+        message->release();
+        return OUTBOX_FULL;
+    }
+    listenerFlags.set(FLAG_OUTBOX);
     
     return SUCCESS;
 }
 
-int MQTTThreadedClient::sendPublish(PubMessage& message)
+int MQTTThreadedClient::publish(PubMessage& msg, uint32_t timeout)
 {
-     MQTTString topicString = MQTTString_initializer;
+    PublishBuffer *message = allocPublish(msg.topic, msg.payloadlen, timeout);
+    if (message == NULL)
+        return OUTBOX_FULL;
+
+    // Simple copy
+    memcpy(message->payload(), msg.payload, msg.payloadlen);
+    message->setPayloadLength(msg.payloadlen);
+    message->qos = msg.qos;
+    
+    return publish(message);
+}
+
+/**
+ * Appends the PUBLISH packet to txbuf, header and topic are 
+ * serialized in sendbuf. A payload larger than txbuf is sent
+ * straight from the message buffer.
+ **/
+int MQTTThreadedClient::sendPublish(PublishBuffer& message, bool dup)
+{
+     MQTTHeader header = {0};
+     unsigned char *ptr = sendbuf;
+     size_t topicLength = message.getTopicLength();
+     size_t payloadLength = message.getPayloadLength();
+     bool v5 = (connect_options.MQTTVersion == 5);
      
      if (!isConnected) 
      {
         DBG("Not connected!!! ...\r\n");
         return FAILURE;
      }
-        
-     topicString.cstring = (char*) &message.topic[0];
-     int len = MQTTSerialize_publish(sendbuf, MAX_MQTT_PACKET_SIZE, 0, message.qos, false, message.id,
-              topicString, (unsigned char*) &message.payload[0], (int) message.payloadlen);
-     if (len <= 0)
+
+     // v5: a topic the server knows is replaced by its alias
+     bool aliasKnown = false;
+     uint16_t alias = v5 ? topicAliases.get(message.getTopic(), topicLength, &aliasKnown) : 0;
+     if (aliasKnown)
+         topicLength = 0;
+
+     int remLength = 2 + topicLength + payloadLength;
+     if (message.qos > QOS0)
+         remLength += 2;
+     if (v5)
+         remLength += alias ? 4 : 1;
+
+     header.bits.type = PUBLISH;
+     header.bits.dup = dup;
+     header.bits.qos = message.qos;
+     header.bits.retain = message.retained;
+     *ptr++ = header.byte;
+     ptr += MQTTPacket_encode(ptr, remLength);
+     *ptr++ = (unsigned char) (topicLength >> 8);
+     *ptr++ = (unsigned char) topicLength;
+     memcpy(ptr, message.getTopic(), topicLength);
+     ptr += topicLength;
+     if (message.qos > QOS0)
      {
-         DBG("Failed serializing message ...\r\n");
-         return FAILURE;
+         *ptr++ = (unsigned char) (message.id >> 8);
+         *ptr++ = (unsigned char) message.id;
      }
+     if (v5)
+     {
+         // property length and the only property
+         *ptr++ = alias ? 3 : 0;
+         if (alias)
+         {
+             *ptr++ = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+             *ptr++ = (unsigned char) (alias >> 8);
+             *ptr++ = (unsigned char) alias;
+         }
+     }
+     size_t headerLength = ptr - sendbuf;
+     
+     int rc = appendTx(sendbuf, headerLength);
+     if (rc == SUCCESS)
+         rc = appendTx(message.payload(), payloadLength);
      
-     if (sendPacket(len) == SUCCESS)
+     if (rc == SUCCESS)
      {
          DBG("Successfully sent publish packet to server ...\r\n");
+         if (!dup)
+         {
+             uint32_t latency = us_ticker_read() - message.timestamp;
+             CriticalSectionLock lock;
+             statMessagesSent++;
+             statBytesSent += headerLength + payloadLength;
+             statLatencySum_us += latency;
+             if (latency > statLatencyMax_us)
+                 statLatencyMax_us = latency;
+         }
          return SUCCESS;
      }
     
@@ -621,18 +942,430 @@ int MQTTThreadedClient::sendPublish(PubMessage& message)
     return FAILURE;
 }
 
-void MQTTThreadedClient::addTopicHandler(const char * topicstr, void (*function)(MessageData &))
+int MQTTThreadedClient::sendAck(int packetType, unsigned short packetId)
+{
+    int len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, (unsigned char) packetType, 0, packetId);
+    if (len <= 0)
+        return FAILURE;
+
+    return appendTx(sendbuf, len);
+}
+
+/**
+ * Sends the PUBLISH (with DUP) or the PUBREL of an in-flight message again.
+ **/
+int MQTTThreadedClient::retransmit(InFlightMessage& entry)
+{
+    int rc;
+
+    DBG("Retransmitting packet id [%d] ...\r\n", entry.message->id);
+    statRetransmissions++;
+    if (entry.state == WAIT_PUBCOMP)
+        rc = sendAck(PUBREL, entry.message->id);
+    else
+        rc = sendPublish(*entry.message, true);
+
+    entry.sentTime = Kernel::get_ms_count();
+    return rc;
+}
+
+/**
+ * After a reconnect, everything unacknowledged is sent again in
+ * the order of the first transmission.
+ **/
+int MQTTThreadedClient::resendInFlight()
+{
+    bool done[MQTT_MAX_INFLIGHT] = { false };
+
+    for (int n = 0; n < inflightCount; n++)
+    {
+        int oldest = -1;
+        for (int i = 0; i < MQTT_MAX_INFLIGHT; i++)
+        {
+            if (inflight[i].message && !done[i]
+                && (oldest < 0 || inflight[i].sentTime < inflight[oldest].sentTime))
+                oldest = i;
+        }
+        if (oldest < 0)
+            break;
+
+        done[oldest] = true;
+        if (retransmit(inflight[oldest]) != SUCCESS)
+            return FAILURE;
+    }
+
+    return flushTx();
+}
+
+/**
+ * Frees the space of the sent and acknowledged messages in the outbox
+ * and wakes up the publishers waiting for it.
+ **/
+void MQTTThreadedClient::collectOutbox()
+{
+    if (outbox.collect() && outboxWaiters > 0)
+        outboxFlags.set(FLAG_SPACE);
+}
+
+/**
+ * Retransmits timed out messages (v3.1.1), then drains the outbox into the
+ * free slots of the in-flight window and sends them. QoS0 messages do not 
+ * use a slot and are freed after sending.
+ * 
+ * @return SUCCESS, or FAILURE if the connection failed
+ **/
+int MQTTThreadedClient::processOutbox()
+{
+    uint64_t now = Kernel::get_ms_count();
+    bool timedRetry = (connect_options.MQTTVersion != 5);
+
+    for (int i = 0; timedRetry && i < MQTT_MAX_INFLIGHT; i++)
+    {
+        if (inflight[i].message && (now - inflight[i].sentTime >= MQTT_RETRY_TIMEOUT))
+        {
+            if (retransmit(inflight[i]) != SUCCESS)
+                return FAILURE;
+        }
+    }
+
+    while (inflightCount < inflightLimit)
+    {
+        PublishBuffer * message = outbox.pop();
+        if (message == NULL)
+            break;
+
+        DBG("Got message to publish! ... \r\n");
+        if (sendMessage(message) != SUCCESS)
+            return FAILURE;
+    }
+
+    // everything collected in this pass goes out with one send call,
+    // including the acks of the packets read before
+    int rc = flushTx();
+    collectOutbox();
+    return rc;
+}
+
+/**
+ * Sends a message from the outbox or the offline log, QoS1/QoS2
+ * messages take a free slot of the in-flight window.
+ **/
+int MQTTThreadedClient::sendMessage(PublishBuffer* message)
+{
+    if (message->qos == QOS0)
+    {
+        // at most once, the message is gone even if sending failed
+        int rc = sendPublish(*message);
+        message->release();
+        if (rc != SUCCESS)
+            return FAILURE;
+        resetConnectionTimer();
+        return SUCCESS;
+    }
+
+    int slot = 0;
+    while (inflight[slot].message != NULL)
+        slot++;
+
+    message->id = packetid.getNext();
+    inflight[slot].message = message;
+    inflight[slot].state = (message->qos == QOS1) ? WAIT_PUBACK : WAIT_PUBREC;
+    inflight[slot].sentTime = Kernel::get_ms_count();
+    inflightCount++;
+
+    // If this fails, the message is resent with DUP after the reconnect
+    if (sendPublish(*message) != SUCCESS)
+        return FAILURE;
+    resetConnectionTimer();
+    return SUCCESS;
+}
+
+void MQTTThreadedClient::setOfflineLog(OfflineLog* log, uint32_t replayRate)
+{
+    offlineLog = log;
+    replayInterval = (replayRate > 0) ? 1000 / replayRate : 0;
+}
+
+/**
+ * Sends messages from the offline log at the replay rate, as long
+ * as the in-flight window has room.
+ **/
+int MQTTThreadedClient::processBacklog()
+{
+    if (offlineLog == NULL || offlineLog->empty())
+        return SUCCESS;
+
+    uint64_t now = Kernel::get_ms_count();
+    // no burst to catch up after a pause
+    if (nextReplay + 1000 < now)
+        nextReplay = now;
+
+    while (now >= nextReplay && inflightCount < inflightLimit)
+    {
+        PublishBuffer * message = offlineLog->pop();
+        if (message == NULL)
+            break;
+
+        nextReplay += replayInterval;
+        if (sendMessage(message) != SUCCESS)
+            return FAILURE;
+    }
+
+    return flushTx();
+}
+
+/**
+ * While disconnected, the outbox goes to the offline log.
+ **/
+void MQTTThreadedClient::storeOutbox()
+{
+    if (offlineLog == NULL)
+        return;
+
+    bool stored = false;
+    PublishBuffer * message;
+    while ((message = outbox.pop()) != NULL)
+    {
+        if (offlineLog->append(message) != 0)
+            DBG("Message lost, offline log failed ...\r\n");
+        message->release();
+        stored = true;
+    }
+
+    // write the tail block once for all messages of this pass
+    if (stored)
+        offlineLog->sync();
+    collectOutbox();
+}
+
+/**
+ * Returns the ms to wait before the next connect attempt. The interval
+ * doubles with every failed attempt up to MQTT_RECONNECT_MAX_INTERVAL, 
+ * a random part spreads devices that lost the broker at the same time.
+ **/
+uint32_t MQTTThreadedClient::nextBackoff()
+{
+    uint32_t interval = MQTT_RECONNECT_MIN_INTERVAL;
+    for (int i = 0; i < reconnectAttempt && interval < MQTT_RECONNECT_MAX_INTERVAL; i++)
+        interval *= 2;
+    if (interval > MQTT_RECONNECT_MAX_INTERVAL)
+        interval = MQTT_RECONNECT_MAX_INTERVAL;
+    reconnectAttempt++;
+
+    // xorshift32, the seed differs by client id and time of the failure
+    if (backoffSeed == 0)
+    {
+        const char * id = connect_options.clientID.cstring;
+        backoffSeed = 2166136261u;
+        for (; id && *id; id++)
+            backoffSeed = (backoffSeed ^ (uint8_t) *id) * 16777619u;
+    }
+    backoffSeed ^= us_ticker_read();
+    if (backoffSeed == 0)
+        backoffSeed = 1;
+    backoffSeed ^= backoffSeed << 13;
+    backoffSeed ^= backoffSeed >> 17;
+    backoffSeed ^= backoffSeed << 5;
+
+    // half fixed, half random
+    return interval / 2 + backoffSeed % (interval / 2 + 1);
+}
+
+/**
+ * Waits before the next connect attempt, published messages are
+ * stored in the offline log meanwhile.
+ **/
+void MQTTThreadedClient::waitReconnect()
+{
+    uint32_t backoff = nextBackoff();
+    uint64_t retry = Kernel::get_ms_count() + backoff;
+    DBG("Reconnect in %lu ms ...\r\n", backoff);
+
+    storeOutbox();
+    while (!stopRequested)
+    {
+        uint64_t now = Kernel::get_ms_count();
+        if (now >= retry)
+            break;
+
+        listenerFlags.wait_any((offlineLog ? FLAG_OUTBOX : 0) | FLAG_STOP, (uint32_t) (retry - now));
+        storeOutbox();
+    }
+}
+
+/**
+ * Handles PUBACK, PUBREC, PUBREL and PUBCOMP in readbuf.
+ **/
+int MQTTThreadedClient::handleAckMsg(int packetType)
+{
+    unsigned char type = 0;
+    unsigned char dup = 0;
+    unsigned short id = 0;
+    unsigned char reasonCode = MQTTREASONCODE_SUCCESS;
+    int ok;
+
+    if (connect_options.MQTTVersion == 5)
+        ok = MQTTV5Deserialize_ack(&type, &dup, &id, &reasonCode, NULL, readbuf, MAX_MQTT_PACKET_SIZE);
+    else
+        ok = MQTTDeserialize_ack(&type, &dup, &id, readbuf, MAX_MQTT_PACKET_SIZE);
+    if (ok != 1)
+    {
+        DBG("Error deserializing ack ...\r\n");
+        return FAILURE;
+    }
+
+    // receiving QoS2: the server releases the message, forget the id
+    if (packetType == PUBREL)
+    {
+        for (int i = 0; i < MQTT_MAX_QOS2_RECEIVED; i++)
+        {
+            if (qos2Received[i] == id)
+                qos2Received[i] = 0;
+        }
+        return sendAck(PUBCOMP, id);
+    }
+
+    for (int i = 0; i < MQTT_MAX_INFLIGHT; i++)
+    {
+        InFlightMessage& entry = inflight[i];
+        if (entry.message == NULL || entry.message->id != id)
+            continue;
+
+        // v5: a PUBREC with an error ends the QoS2 flow
+        if ((packetType == PUBACK && entry.state == WAIT_PUBACK)
+            || (packetType == PUBCOMP && entry.state == WAIT_PUBCOMP)
+            || (packetType == PUBREC && reasonCode >= MQTTREASONCODE_UNSPECIFIED_ERROR))
+        {
+            if (reasonCode >= MQTTREASONCODE_UNSPECIFIED_ERROR)
+                DBG("Packet id [%d] rejected, reason [0x%02x] ...\r\n", id, reasonCode);
+            DBG("Packet id [%d] delivered ...\r\n", id);
+            entry.message->release();
+            entry.message = NULL;
+            inflightCount--;
+            return SUCCESS;
+        }
+        if (packetType == PUBREC && entry.state != WAIT_PUBACK)
+        {
+            // also answers a repeated PUBREC
+            entry.state = WAIT_PUBCOMP;
+            entry.sentTime = Kernel::get_ms_count();
+            return sendAck(PUBREL, id);
+        }
+    }
+
+    DBG("Ack type [%d] for unknown packet id [%d] ...\r\n", packetType, id);
+    // the server waits for the PUBREL of a message we already completed
+    if (packetType == PUBREC && reasonCode < MQTTREASONCODE_UNSPECIFIED_ERROR)
+        return sendAck(PUBREL, id);
+
+    return SUCCESS;
+}
+
+bool MQTTThreadedClient::addTopicHandler(const char * topicstr, void (*function)(MessageData &), QoS qos)
 {
-    // Push the subscription into the map ...
     FP<void,MessageData &> fp;
     fp.attach(function);
     
-    topicCBMap.insert(std::pair<std::string, FP<void,MessageData &> >(std::string(topicstr),fp));    
+    return addTopicHandler(topicstr, fp, qos);
+} 
+
+bool MQTTThreadedClient::addTopicHandler(const char * topicstr, FP<void, MessageData &> fp, QoS qos)
+{
+    // Push the subscription into the trie ...
+    if (!topicTrie.add(topicstr, fp))
+    {
+        DBG("Invalid topic filter [%s]\r\n", topicstr);
+        return false;
+    }
+
+    std::map<std::string, QoS>::iterator it = topicQoSMap.find(topicstr);
+    if (it == topicQoSMap.end())
+        topicQoSMap.insert(std::pair<std::string, QoS>(std::string(topicstr), qos));
+    else if (it->second < qos)
+        it->second = qos;
+
+    return true;
 } 
 
+/**
+ * Appends the subscribed filters to txbuf, packed into as few 
+ * SUBSCRIBE packets as fit sendbuf. The SUBACKs are collected
+ * by processSubscriptions.
+ **/
+int MQTTThreadedClient::sendSubscriptions()
+{
+    MQTTString topics[MQTT_MAX_SUBSCRIBE_FILTERS];
+    int qos[MQTT_MAX_SUBSCRIBE_FILTERS];
+    unsigned char options[MQTT_MAX_SUBSCRIBE_FILTERS];
+    bool v5 = (connect_options.MQTTVersion == 5);
+    int packets = 0;
+
+    pendingSubscribes.clear();
+
+    std::map<std::string, QoS>::iterator it = topicQoSMap.begin();
+    while (it != topicQoSMap.end())
+    {
+        PendingSubscribe pending;
+        int count = 0;
+        // packet id and the v5 property length
+        int remLength = v5 ? 3 : 2;
+
+        pending.first = it;
+        for (; it != topicQoSMap.end() && count < MQTT_MAX_SUBSCRIBE_FILTERS; it++)
+        {
+            int filterLength = 2 + it->first.length() + 1;
+            if (MQTTPacket_len(remLength + filterLength) > MAX_MQTT_PACKET_SIZE)
+                break;
+
+            topics[count].cstring = (char*) it->first.c_str();
+            topics[count].lenstring.len = 0;
+            topics[count].lenstring.data = NULL;
+            qos[count] = it->second;
+            options[count] = (unsigned char) it->second;
+            remLength += filterLength;
+            count++;
+        }
+
+        if (count == 0)
+        {
+            DBG("Topic filter too long [%s]\r\n", it->first.c_str());
+            it++;
+            continue;
+        }
+
+        pending.id = packetid.getNext();
+        pending.count = count;
+
+        int len;
+        if (v5)
+            len = MQTTV5Serialize_subscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, pending.id, NULL, count, topics, options);
+        else
+            len = MQTTSerialize_subscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, pending.id, count, topics, qos);
+        if (len <= 0)
+        {
+            DBG("Error serializing subscribe packet ...\r\n");
+            continue;
+        }
+
+        DBG("Subscribing %d topics with packet id [%d]\r\n", count, pending.id);
+        if (appendTx(sendbuf, len) != SUCCESS)
+            return FAILURE;
+        pendingSubscribes.push_back(pending);
+        packets++;
+    }
+
+    return packets;
+}
+
+/**
+ * Waits for the SUBACKs of the SUBSCRIBE packets sent with the
+ * CONNECT, returns the number of subscribed filters.
+ **/
 int MQTTThreadedClient::processSubscriptions()
 {
     int numsubscribed = 0;
+    int reasonCodes[MQTT_MAX_SUBSCRIBE_FILTERS];
+    uint64_t start = Kernel::get_ms_count();
     
     if (!isConnected) 
     {
@@ -640,80 +1373,81 @@ int MQTTThreadedClient::processSubscriptions()
             return 0;
     }
     
-    DBG("Processing subscribed topics ....\r\n");
+    DBG("Waiting for %d subscription acks ...\r\n", pendingSubscribes.size());
     
-    std::map<std::string, FP<void, MessageData &> >::iterator it;
-    for(it = topicCBMap.begin(); it != topicCBMap.end(); it++) 
+    while (!pendingSubscribes.empty())
     {
-        int rc = FAILURE;
-        int len = 0;
-        //TODO: We only subscribe to QoS = 0 for now
-        QoS qos = QOS0;
-
-        MQTTString topic = {(char*)it->first.c_str(), {0, 0}};
-        DBG("Subscribing to topic [%s]\r\n", topic.cstring);
+        uint64_t elapsed = Kernel::get_ms_count() - start;
+        if (elapsed >= COMMAND_TIMEOUT)
+            break;
 
+        int pType = readPacket(COMMAND_TIMEOUT - (int) elapsed);
+        if (pType < 0)
+            break;
+        if (pType != SUBACK)
+        {
+            // publishes of a stored session may come first
+            if (handlePacket(pType) < 0)
+                break;
+            continue;
+        }
 
-        len = MQTTSerialize_subscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), 1, &topic, (int*)&qos);
-        if (len <= 0) {
-            DBG("Error serializing subscribe packet ...\r\n");
+        int count = 0;
+        unsigned short mypacketid = 0;
+        int ok;
+        if (connect_options.MQTTVersion == 5)
+            ok = MQTTV5Deserialize_suback(&mypacketid, NULL, MQTT_MAX_SUBSCRIBE_FILTERS, &count, reasonCodes, readbuf, MAX_MQTT_PACKET_SIZE);
+        else
+            ok = MQTTDeserialize_suback(&mypacketid, MQTT_MAX_SUBSCRIBE_FILTERS, &count, reasonCodes, readbuf, MAX_MQTT_PACKET_SIZE);
+        if (ok != 1)
+        {
+            DBG("Error deserializing suback ...\r\n");
             continue;
         }
 
-        if ((rc = sendPacket(len)) != SUCCESS) {
-            DBG("Error sending subscribe packet [%d]\r\n", rc);
+        std::vector<PendingSubscribe>::iterator pending = pendingSubscribes.begin();
+        while (pending != pendingSubscribes.end() && pending->id != mypacketid)
+            pending++;
+        if (pending == pendingSubscribes.end())
+        {
+            DBG("Suback for unknown packet id [%d] ...\r\n", mypacketid);
             continue;
         }
 
-        DBG("Waiting for subscription ack ...\r\n");
-        // Wait for SUBACK, dropping packets read along the way ...
-        if (readUntil(SUBACK, COMMAND_TIMEOUT) == SUBACK) { // wait for suback
-            int count = 0, grantedQoS = -1;
-            unsigned short mypacketid;
-            if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
-                rc = grantedQoS; // 0, 1, 2 or 0x80
-            // For as long as we do not get 0x80 ..
-            if (rc != 0x80) 
+        std::map<std::string, QoS>::iterator it = pending->first;
+        for (int i = 0; i < pending->count; i++, it++)
+        {
+            // 0, 1, 2 or a failure code >= 0x80, the v3 
+            // deserializer returns it as signed char
+            int rc = (i < count) ? (reasonCodes[i] & 0xFF) : 0x80;
+            if (rc < 0x80)
             {
-                // Reset connection timers here ...
-                resetConnectionTimer();
+                if (rc < it->second)
+                    DBG("Server granted QoS %d for topic %s ...\r\n", rc, it->first.c_str());
                 DBG("Successfully subscribed to %s ...\r\n", it->first.c_str());
                 numsubscribed++;
-            } else {
-                DBG("Failed to subscribe to topic %s ... (not authorized?)\r\n", it->first.c_str());
             }
-        } else 
-            DBG("Failed to subscribe to topic %s (ack not received) ...\r\n", it->first.c_str());
-    } // end for loop
-    
-    return numsubscribed;    
-}
+            else
+                DBG("Failed to subscribe to topic %s ... (not authorized?)\r\n", it->first.c_str());
+        }
+        pendingSubscribes.erase(pending);
+        resetConnectionTimer();
+    }
 
-bool MQTTThreadedClient::isTopicMatched(char* topicFilter, MQTTString& topicName)
-{
-    char* curf = topicFilter;
-    char* curn = topicName.lenstring.data;
-    char* curn_end = curn + topicName.lenstring.len;
+    if (!pendingSubscribes.empty())
+        DBG("Failed to subscribe %d packets (ack not received) ...\r\n", pendingSubscribes.size());
+    pendingSubscribes.clear();
 
-    while (*curf && curn < curn_end)
-    {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
-        }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
+    // acks of the publishes read along the way
+    flushTx();
 
-    return (curn == curn_end) && (*curf == '\0');
+    {
+        CriticalSectionLock lock;
+        statSetupTime_ms = (uint32_t) (Kernel::get_ms_count() - sessionStart);
+        statSubscribed = numsubscribed;
+    }
+    
+    return numsubscribed;    
 }
 
 int MQTTThreadedClient::handlePublishMsg()
@@ -721,46 +1455,64 @@ int MQTTThreadedClient::handlePublishMsg()
     MQTTString topicName = MQTTString_initializer;
     Message msg;
     int intQoS;
+    int ok;
     DBG("Deserializing publish message ...\r\n");
-    if (MQTTDeserialize_publish((unsigned char*)&msg.dup, 
+    // v5: the properties are skipped, we allow no topic aliases from the server
+    if (connect_options.MQTTVersion == 5)
+        ok = MQTTV5Deserialize_publish((unsigned char*)&msg.dup, 
             &intQoS, 
             (unsigned char*)&msg.retained, 
             (unsigned short*)&msg.id, 
             &topicName,
+            NULL,
             (unsigned char**)&msg.payload, 
-            (int*)&msg.payloadlen, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+            (int*)&msg.payloadlen, readbuf, MAX_MQTT_PACKET_SIZE);
+    else
+        ok = MQTTDeserialize_publish((unsigned char*)&msg.dup, 
+            &intQoS, 
+            (unsigned char*)&msg.retained, 
+            (unsigned short*)&msg.id, 
+            &topicName,
+            (unsigned char**)&msg.payload, 
+            (int*)&msg.payloadlen, readbuf, MAX_MQTT_PACKET_SIZE);
+    if (ok != 1)
     {
         DBG("Error deserializing published message ...\r\n");
         return -1;
     }
 
-    std::string topic;
-    if (topicName.lenstring.len > 0)
-    {
-        topic = std::string((const char *) topicName.lenstring.data, (size_t) topicName.lenstring.len);
-    }else
-        topic = (const char *) topicName.cstring;
-    
-    DBG("Got message for topic [%s], QoS [%d] ...\r\n", topic.c_str(), intQoS);
+    DBG("Got message for topic [%.*s], QoS [%d] ...\r\n", topicName.lenstring.len, topicName.lenstring.data, intQoS);
     
     msg.qos = (QoS) intQoS;
 
-    
-    // Call the handlers for each topic 
-    if (topicCBMap.find(topic) != topicCBMap.end())
+    // QoS2 is delivered once: a DUP of a message that was not 
+    // released yet is only acknowledged again
+    bool deliver = true;
+    if (msg.qos == QOS2)
     {
-        // Call the callback function 
-        if (topicCBMap[topic].attached())
+        for (int i = 0; i < MQTT_MAX_QOS2_RECEIVED; i++)
         {
-            DBG("Invoking function handler for topic ...\r\n");
-            MessageData md(topicName, msg);            
-            topicCBMap[topic](md);
-            
-            return 1;
+            if (qos2Received[i] == msg.id)
+                deliver = false;
+        }
+        if (deliver)
+        {
+            qos2Received[qos2ReceivedNext] = msg.id;
+            qos2ReceivedNext = (qos2ReceivedNext + 1) % MQTT_MAX_QOS2_RECEIVED;
         }
     }
+
+    int rc = 0;
+    // Call the handlers of all matching filters, the topic is
+    // matched in readbuf 
+    if (deliver)
+    {
+        MessageData md(topicName, msg);
+        rc = topicTrie.dispatch(topicName.lenstring.data, topicName.lenstring.len, md);
+        DBG("Invoked %d handlers for topic ...\r\n", rc);
+    }
     
-    // TODO: depending on the QoS
+    // depending on the QoS
     // we send data to the server = PUBACK or PUBREC
     switch(intQoS)
     {
@@ -768,16 +1520,54 @@ int MQTTThreadedClient::handlePublishMsg()
             // We send back nothing ...
             break;
         case QOS1:
-            // TODO: implement
+            if (sendAck(PUBACK, msg.id) != SUCCESS)
+                return -1;
             break;
         case QOS2:
-            // TODO: implement
+            if (sendAck(PUBREC, msg.id) != SUCCESS)
+                return -1;
             break;
         default:
             break;
     }
     
-    return 0;
+    return rc;
+}
+
+/**
+ * Handles a packet from the server that is not the answer
+ * of a request, returns < 0 if the connection failed.
+ **/
+int MQTTThreadedClient::handlePacket(int packetType)
+{
+    switch(packetType) 
+    {
+        case PUBLISH: 
+            DBG("Publish received!....\r\n");
+            // We receive data from the MQTT server ..
+            if (handlePublishMsg() < 0) {
+                DBG("Error handling PUBLISH message ... \r\n");
+                return FAILURE;
+            }
+            break;
+        case PUBACK:
+        case PUBREC:
+        case PUBREL:
+        case PUBCOMP:
+            if (handleAckMsg(packetType) != SUCCESS)
+                return FAILURE;
+            resetConnectionTimer();
+            break;
+        case PINGRESP: 
+            DBG("Got ping response ...\r\n");
+            pingOutstanding = false;
+            resetConnectionTimer();
+            break;
+        default:
+            DBG("Unknown/Not handled message from server pType[%d]\r\n", packetType);
+    }
+
+    return SUCCESS;
 }
 
 void MQTTThreadedClient::resetConnectionTimer()
@@ -793,7 +1583,7 @@ bool MQTTThreadedClient::hasConnectionTimedOut()
 {
     if (keepAliveInterval > 0 ) {
         // Check connection timer
-        if (comTimer.read_ms() > keepAliveInterval)
+        if (comTimer.read_ms() >= keepAliveInterval)
             return true;
         else
             return false;
@@ -811,6 +1601,50 @@ void MQTTThreadedClient::sendPingRequest()
     }
 }
 
+/**
+ * Time until the next keepalive ping or retransmission in ms,
+ * osWaitForever if nothing is due.
+ **/
+uint32_t MQTTThreadedClient::nextTimeout()
+{
+    uint32_t timeout = osWaitForever;
+
+    if (keepAliveInterval > 0)
+    {
+        int left = (int) keepAliveInterval - comTimer.read_ms();
+        timeout = (left > 0) ? left : 0;
+    }
+
+    uint64_t now = Kernel::get_ms_count();
+    // v5 resends only after a reconnect, see resendInFlight()
+    for (int i = 0; connect_options.MQTTVersion != 5 && i < MQTT_MAX_INFLIGHT; i++)
+    {
+        if (inflight[i].message)
+        {
+            uint64_t due = inflight[i].sentTime + MQTT_RETRY_TIMEOUT;
+            uint32_t left = (due > now) ? (uint32_t) (due - now) : 0;
+            if (left < timeout)
+                timeout = left;
+        }
+    }
+
+    // the backlog waits for room in the window, an ack wakes us up
+    if (offlineLog && inflightCount < inflightLimit && !offlineLog->empty())
+    {
+        uint32_t left = (nextReplay > now) ? (uint32_t) (nextReplay - now) : 0;
+        if (left < timeout)
+            timeout = left;
+    }
+
+    return timeout;
+}
+
+// sigio, called from the network stack
+void MQTTThreadedClient::onSocketEvent()
+{
+    listenerFlags.set(FLAG_SOCKET);
+}
+
 void MQTTThreadedClient::startListener()
 {
     int pType;
@@ -822,116 +1656,138 @@ void MQTTThreadedClient::startListener()
         initTLS();
     }
             
-    while(true)
+    while(!stopRequested)
     {
 
-        // Attempt to reconnect and login
-        if ( connect() < 0 )
+        // Attempt to reconnect and login. A refused CONNACK returns its
+        // positive reason code, the broker is retried with the backoff too
+        if ( connect() != SUCCESS )
         {
             disconnect();
             // Wait for a few secs and reconnect ...
-            Thread::wait(6000);
+            waitReconnect();
             continue;
         }
         
         numsubs = processSubscriptions();
         DBG("Subscribed %d topics ...\r\n", numsubs);
+
+        // the outbox survived the disconnect, send the unacknowledged first
+        if (resendInFlight() != SUCCESS)
+            goto reconnect;
+
+        pingOutstanding = false;
+        nextReplay = Kernel::get_ms_count();
+        tcpSocket->sigio(mbed::callback(this, &MQTTThreadedClient::onSocketEvent));
+        // data or messages may be pending already
+        listenerFlags.set(FLAG_SOCKET | FLAG_OUTBOX);
          
-        // loop read    
+        // event loop, sleeps until something happens
         while(true) 
         {
-            pType = readPacket();
-            switch(pType) 
+            uint32_t flags = listenerFlags.wait_any(FLAG_SOCKET | FLAG_OUTBOX | FLAG_STOP, nextTimeout());
+            if (flags & osFlagsError)
+                flags = 0;      // timeout, a timer is due
+
+            if (flags & FLAG_STOP)
+                goto reconnect;
+
+            // read all packets available, TLS may have more buffered
+            while ((flags & FLAG_SOCKET) && (pType = readPacket(0)) != TIMEOUT)
             {
-                case TIMEOUT:
-                    // No data available from the network ...
-                    break;
-                case FAILURE:
-                    {
-                        DBG("readPacket returned failure \r\n");
-                        goto reconnect;
-                    }
-                case BUFFER_OVERFLOW: 
-                    {
-                        // TODO: Network error, do we disconnect and reconnect?
-                        DBG("Failure or buffer overflow problem ... \r\n");
-                        MBED_ASSERT(false);
-                    }
-                    break;
-                /**
-                *  The rest of the return codes below (all positive) is about MQTT
-                 * response codes
-                 **/
-                case CONNACK:
-                case PUBACK:
-                case SUBACK:
-                    break;
-                case PUBLISH: 
-                    {
-                        DBG("Publish received!....\r\n");
-                        // We receive data from the MQTT server ..
-                        if (handlePublishMsg() < 0) {
-                            DBG("Error handling PUBLISH message ... \r\n");
-                            break;
+                switch(pType) 
+                {
+                    case FAILURE:
+                        {
+                            DBG("readPacket returned failure \r\n");
+                            goto reconnect;
+                        }
+                    case BUFFER_OVERFLOW: 
+                        {
+                            // TODO: Network error, do we disconnect and reconnect?
+                            DBG("Failure or buffer overflow problem ... \r\n");
+                            MBED_ASSERT(false);
                         }
-                    }
-                    break;
-                case PINGRESP: 
-                    {
-                        DBG("Got ping response ...\r\n");
-                        resetConnectionTimer();
-                    }
-                    break;
-                default:
-                    DBG("Unknown/Not handled message from server pType[%d]\r\n", pType);
+                        break;
+                    /**
+                    *  The rest of the return codes below (all positive) is about MQTT
+                     * response codes
+                     **/
+                    case CONNACK:
+                    case SUBACK:
+                        break;
+                    default:
+                        if (handlePacket(pType) < 0)
+                            goto reconnect;
+                }
             }
 
             // Check if its time to send a keepAlive packet
             if (hasConnectionTimedOut()) {
-                // Queue the ping request so that other
-                // pending operations queued above will go first
-                queue.call(this, &MQTTThreadedClient::sendPingRequest);
-            }
-
-            // Check if we have messages on the message queue
-            osEvent evt = mqueue.get(10);
-            if (evt.status == osEventMessage) {
-
-                DBG("Got message to publish! ... \r\n");
-
-                // Unpack the message
-                PubMessage * message = (PubMessage *)evt.value.p;
-
-                // Send the packet, do not queue the call
-                // like the ping above ..
-                if ( sendPublish(*message) == SUCCESS) {
-                    // Reset timers if we have been able to send successfully
-                    resetConnectionTimer();
-                } else {
-                    // Disconnected?
+                if (pingOutstanding) {
+                    DBG("No ping response ... \r\n");
                     goto reconnect;
                 }
-
-                // Free the message from mempool  after using
-                mpool.free(message);
+                sendPingRequest();
+                pingOutstanding = true;
+                resetConnectionTimer();
             }
 
-            // Dispatch any queued events ...
-            queue.dispatch(100);
+            // Send the messages of the outbox and the retransmissions,
+            // then the backlog of the offline log
+            if (processOutbox() != SUCCESS || processBacklog() != SUCCESS) {
+                // Disconnected? The messages in flight are kept
+                goto reconnect;
+            }
         } // end while loop
 
 reconnect:
         // reconnect?
         DBG("Client disconnected!! ... retrying ...\r\n");
         disconnect();
+        connectionLost = Kernel::get_ms_count();
         
     };
 }
 
 void MQTTThreadedClient::stopListener()
 {
-    // TODO: Set a signal/flag that the running thread 
-    // will check if its ok to stop ...
+    // the listener thread disconnects and returns
+    stopRequested = true;
+    listenerFlags.set(FLAG_STOP);
+}
+
+void MQTTThreadedClient::getPublishStats(PublishStats* stats)
+{
+    CriticalSectionLock lock;
+    stats->messagesSent = statMessagesSent;
+    stats->bytesSent = statBytesSent;
+    stats->retransmissions = statRetransmissions;
+    stats->latencyMax_us = statLatencyMax_us;
+    stats->latencyAvg_us = statMessagesSent ? (uint32_t) (statLatencySum_us / statMessagesSent) : 0;
+}
+
+void MQTTThreadedClient::getSessionStats(SessionStats* stats)
+{
+    CriticalSectionLock lock;
+    stats->connects = statConnects;
+    stats->connectTime_ms = statConnectTime_ms;
+    stats->setupTime_ms = statSetupTime_ms;
+    stats->subscribed = statSubscribed;
+    stats->reconnectTime_ms = statReconnectTime_ms;
+    stats->reconnectTimeMax_ms = statReconnectTimeMax_ms;
+    stats->tlsFullHandshakes = statTLSFull;
+    stats->tlsResumedHandshakes = statTLSResumed;
+}
+
+void MQTTThreadedClient::resetPublishStats()
+{
+    CriticalSectionLock lock;
+    statMessagesSent = 0;
+    statBytesSent = 0;
+    statRetransmissions = 0;
+    statLatencyMax_us = 0;
+    statLatencySum_us = 0;
 }
 
 }
\ No newline at end of file
@@ -4,8 +4,14 @@
 #include "mbed.h"
 #include "rtos.h"
 #include "MQTTPacket.h"
+#include "MQTTV5Packet.h"
 #include "NetworkInterface.h"
 #include "FP.h"
+#include "PublishBuffer.h"
+#include "PublishRing.h"
+#include "TopicTrie.h"
+#include "TopicAliases.h"
+#include "OfflineLog.h"
 
 //#define MQTT_DEBUG 1
 
@@ -18,19 +24,81 @@
 #include <cstdio>
 #include <string>
 #include <map>
+#include <vector>
 
 #define COMMAND_TIMEOUT 5000
 #define DEFAULT_SOCKET_TIMEOUT 1000
 #define MAX_MQTT_PACKET_SIZE 200
 #define MAX_MQTT_PAYLOAD_SIZE 100
 
+// QoS1/QoS2 publish: number of messages sent but not yet acknowledged
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 4
+#endif
+// messages of PublishBuffer::alloc() waiting for the listener thread
+#ifndef MQTT_OUTBOX_SIZE
+#define MQTT_OUTBOX_SIZE 8
+#endif
+// bytes of the outbox ring, a power of 2. Holds the messages waiting for the
+// listener thread, and those of allocPublish() until they are acknowledged
+#ifndef MQTT_OUTBOX_RING_SIZE
+#define MQTT_OUTBOX_RING_SIZE 2048
+#endif
+// PUBLISH and ack packets are collected and written with one send call
+#ifndef MQTT_TX_BUFFER_SIZE
+#define MQTT_TX_BUFFER_SIZE 512
+#endif
+// ms without an acknowledge before a PUBLISH/PUBREL is sent again. MQTT v3.1.1
+// only, v5 resends only after a reconnect [MQTT-4.4.0-1]
+#ifndef MQTT_RETRY_TIMEOUT
+#define MQTT_RETRY_TIMEOUT 5000
+#endif
+// messages per second sent from the offline log after a reconnect
+#ifndef MQTT_OFFLINE_REPLAY_RATE
+#define MQTT_OFFLINE_REPLAY_RATE 50
+#endif
+// ms between connect attempts, doubled after every failed attempt
+#ifndef MQTT_RECONNECT_MIN_INTERVAL
+#define MQTT_RECONNECT_MIN_INTERVAL 1000
+#endif
+#ifndef MQTT_RECONNECT_MAX_INTERVAL
+#define MQTT_RECONNECT_MAX_INTERVAL 60000
+#endif
+// topic filters in one SUBSCRIBE packet, at least 4 bytes each
+#ifndef MQTT_MAX_SUBSCRIBE_FILTERS
+#define MQTT_MAX_SUBSCRIBE_FILTERS (MAX_MQTT_PACKET_SIZE / 4)
+#endif
+// received QoS2 packet ids waiting for PUBREL, used to drop duplicates
+#ifndef MQTT_MAX_QOS2_RECEIVED
+#define MQTT_MAX_QOS2_RECEIVED 8
+#endif
+
 namespace MQTT
 {
-    
-typedef enum { QOS0, QOS1, QOS2 } QoS;
+
+typedef struct
+{
+    uint32_t messagesSent;          ///< PUBLISH packets sent the first time
+    uint32_t bytesSent;             ///< bytes of these packets, header included
+    uint32_t retransmissions;       ///< PUBLISH/PUBREL packets sent again
+    uint32_t latencyMax_us;         ///< max. time from publish() to the send buffer
+    uint32_t latencyAvg_us;         ///< avg. time from publish() to the send buffer
+}PublishStats;
+
+typedef struct
+{
+    uint32_t connects;              ///< sessions established
+    uint32_t connectTime_ms;        ///< last session: TCP connected to CONNACK
+    uint32_t setupTime_ms;          ///< last session: TCP connected to all SUBACKs received
+    uint32_t subscribed;            ///< last session: topic filters granted
+    uint32_t reconnectTime_ms;      ///< last reconnect: connection lost to CONNACK
+    uint32_t reconnectTimeMax_ms;   ///< longest reconnect
+    uint32_t tlsFullHandshakes;     ///< TLS handshakes with certificate and key exchange
+    uint32_t tlsResumedHandshakes;  ///< TLS handshakes that resumed the saved session
+}SessionStats;
 
 // all failure return codes must be negative
-typedef enum { BUFFER_OVERFLOW = -3, TIMEOUT = -2, FAILURE = -1, SUCCESS = 0 } returnCode;
+typedef enum { OUTBOX_FULL = -4, BUFFER_OVERFLOW = -3, TIMEOUT = -2, FAILURE = -1, SUCCESS = 0 } returnCode;
 
 
 typedef struct
@@ -43,10 +111,8 @@ typedef struct
     size_t payloadlen;
 }Message, *pMessage;
 
-// TODO:
-// Merge this struct with the one above, in order to use the same
-// data structure for sending and receiving. I need to simplify
-// the PubMessage to not contain pointers like the one above.
+// Fixed size message for publish(PubMessage&), it is copied into
+// a PublishBuffer. Use PublishBuffer for larger payloads.
 typedef struct
 {
     char topic[100];
@@ -91,11 +157,36 @@ public:
         : network(aNetwork),
           ssl_ca_pem(pem),
           port((pem != NULL) ? 8883 : 1883),
-          queue(32 * EVENTS_EVENT_SIZE),
+          outboxWaiters(0),
           isConnected(false),          
           hasSavedSession(false),
+          pingOutstanding(false),
+          stopRequested(false),
+          reconnectAttempt(0),
+          backoffSeed(0),
+          connectionLost(0),
+          sessionExpiry(0),
+          offlineLog(NULL),
+          replayInterval(1000 / MQTT_OFFLINE_REPLAY_RATE),
+          nextReplay(0),
+          inflightCount(0),
+          inflightLimit(MQTT_MAX_INFLIGHT),
+          qos2ReceivedNext(0),
+          txlen(0),
           useTLS(pem != NULL)
     {
+        memset(inflight, 0, sizeof(inflight));
+        memset(qos2Received, 0, sizeof(qos2Received));
+        resetPublishStats();
+        sessionStart = 0;
+        statConnects = 0;
+        statConnectTime_ms = 0;
+        statSetupTime_ms = 0;
+        statSubscribed = 0;
+        statReconnectTime_ms = 0;
+        statReconnectTimeMax_ms = 0;
+        statTLSFull = 0;
+        statTLSResumed = 0;
         DRBG_PERS = "mbed TLS MQTT client";
         tcpSocket = new TCPSocket();
         setupTLS();
@@ -117,28 +208,99 @@ public:
      *  @param port - the port number to connect, 1883 for non secure connections, 8883 for 
      *                secure connections
      *  @param options - the connect data used for logging into the MQTT server.
+     *                  MQTTVersion 5 connects with MQTT v5, published topics
+     *                  are replaced by topic aliases if the server allows them.
      */
     void setConnectionParameters(const char * host, uint16_t port, MQTTPacket_connectData & options);
-    int publish(PubMessage& message);
+    /**
+     *  MQTT v5: seconds the server keeps the session after the connection
+     *  is closed, 0xFFFFFFFF = forever. With cleansession = 0 the expiry
+     *  must be > 0, otherwise the session ends with the connection.
+     */
+    void setSessionExpiry(uint32_t seconds) { sessionExpiry = seconds; };
+    /**
+     *  Allocates a message in the outbox ring, lock free and interrupt safe.
+     *  The payload is written in place and publish() hands the message to
+     *  the listener thread without a copy, the only RTOS call is the wake up.
+     *
+     *  @param topic - topic name, it is copied
+     *  @param maxLength - capacity of payload(), the record must fit
+     *                     into MQTT_OUTBOX_RING_SIZE
+     *  @param timeout - ms to wait for space, must be 0 in interrupt context
+     *  @return buffer for publish(), NULL if the outbox is full or the topic too long
+     */
+    PublishBuffer* allocPublish(const char * topic, size_t maxLength, uint32_t timeout = 0);
+    /**
+     *  Puts a message into the outbox, the listener thread sends it.
+     *
+     *  QoS1/QoS2 messages stay in the outbox until the server has acknowledged
+     *  them, also over reconnects. Up to MQTT_MAX_INFLIGHT of them are sent
+     *  without waiting for the acknowledge. The packet id is assigned by the client.
+     *  Use cleansession = 0 in the connect options, otherwise the server forgets
+     *  the QoS2 state of a message that was in flight during a reconnect.
+     *
+     *  The listener thread sends all queued messages in one pass, small
+     *  packets are collected and written with one send call. Payloads 
+     *  larger than MQTT_TX_BUFFER_SIZE are sent from the buffer, they 
+     *  are not copied.
+     *
+     *  @param message - buffer with topic, payload, qos and retained set,
+     *                   the reference of the caller is taken over. A buffer
+     *                   of allocPublish() is always accepted.
+     *  @param timeout - ms to wait for space if the outbox is full, 0 returns
+     *                   at once. Must be 0 in interrupt context.
+     *  @return SUCCESS, OUTBOX_FULL, or FAILURE if the topic is too long
+     */
+    int publish(PublishBuffer* message, uint32_t timeout = 0);
+    // copies the message into the outbox
+    int publish(PubMessage& message, uint32_t timeout = 0);
     
-    void addTopicHandler(const char * topic, void (*function)(MessageData &));
+    /**
+     *  Subscribes a topic filter, must be called before startListener.
+     *
+     *  The filter may contain the wildcards '+' and '#'. Several handlers
+     *  can be added for the same filter, all matching handlers are called.
+     *
+     *  @param topic - topic filter
+     *  @param qos - requested QoS, the highest of a filter is subscribed
+     *  @return false if the filter is invalid
+     */
+    bool addTopicHandler(const char * topic, void (*function)(MessageData &), QoS qos = QOS0);
     template<typename T>
-    void addTopicHandler(const char * topic, T *object, void (T::*member)(MessageData &))
+    bool addTopicHandler(const char * topic, T *object, void (T::*member)(MessageData &), QoS qos = QOS0)
     {
         FP<void,MessageData &> fp;
         fp.attach(object, member);
 
-        topicCBMap.insert(std::pair<std::string, FP<void,MessageData &> >(std::string(topic),fp));  
+        return addTopicHandler(topic, fp, qos);
     }
     
     // TODO: Add unsubscribe functionality.
     
-    // Start the listener thread and start polling 
-    // MQTT server.
+    // Start the listener thread. It sleeps until data arrives
+    // on the socket, a message is published or a timer is due.
     void startListener();
     // Stop the listerner thread and closes connection
     void stopListener();
 
+    /**
+     *  Stores published messages in a log while the broker is unreachable,
+     *  must be called before startListener.
+     *
+     *  After the reconnect, the log is sent at replayRate messages per second
+     *  in addition to the live messages, so these are not delayed by the backlog.
+     *
+     *  @param log - initialized log, e.g. on a SDIOBlockDevice
+     *  @param replayRate - messages per second
+     */
+    void setOfflineLog(OfflineLog* log, uint32_t replayRate = MQTT_OFFLINE_REPLAY_RATE);
+
+    // publish to wire latency of the messages sent so far
+    void getPublishStats(PublishStats* stats);
+    void resetPublishStats();
+    // setup time of the last session, the statistics are not reset
+    void getSessionStats(SessionStats* stats);
+
 protected:
 
     int handlePublishMsg();
@@ -157,24 +319,83 @@ private:
     std::string host;
     uint16_t port;
     MQTTPacket_connectData connect_options;
-    // Event queue
-    EventQueue queue;
+    // wakes up the listener thread
+    EventFlags listenerFlags;
+    // wakes up publishers waiting for space in the outbox
+    EventFlags outboxFlags;
+    volatile uint32_t outboxWaiters;
     bool isConnected;
     bool hasSavedSession;    
+    bool pingOutstanding;
+    volatile bool stopRequested;
+    // failed connect attempts since the last session
+    int reconnectAttempt;
+    uint32_t backoffSeed;
+    uint64_t connectionLost;        // ms, 0 = connected or never connected
+    // MQTT v5 session
+    uint32_t sessionExpiry;
+    TopicAliases topicAliases;
+
+    // handlers of the subscribed filters
+    TopicTrie<MessageData &> topicTrie;
+    // subscribed filters with the requested QoS
+    std::map<std::string, QoS> topicQoSMap;
+    // SUBSCRIBE packets sent with the CONNECT, waiting for the SUBACK
+    typedef struct
+    {
+        unsigned short id;
+        int count;
+        std::map<std::string, QoS>::iterator first;     // filters in map order
+    }PendingSubscribe;
+    std::vector<PendingSubscribe> pendingSubscribes;
 
-    // TODO: Because I'm using a map, I can only have one handler
-    // for each topic (one that's mapped to the topic string).
-    // Attaching another handler on the same topic is not possible.
-    // In the future, use a vector instead of maps to allow multiple
-    // handlers for the same topic.
-    std::map<std::string, FP<void, MessageData &> > topicCBMap;
+    // QoS1/QoS2 messages sent and waiting for PUBACK, PUBREC or PUBCOMP
+    typedef enum { WAIT_PUBACK, WAIT_PUBREC, WAIT_PUBCOMP } InFlightState;
+    typedef struct
+    {
+        PublishBuffer *message;     // NULL if the slot is free
+        InFlightState state;
+        uint64_t sentTime;          // ms, last (re)transmission
+    }InFlightMessage;
+
+    // store and forward while disconnected
+    OfflineLog *offlineLog;
+    uint32_t replayInterval;    // ms
+    uint64_t nextReplay;
+
+    InFlightMessage inflight[MQTT_MAX_INFLIGHT];
+    int inflightCount;
+    // MQTT_MAX_INFLIGHT or the Receive Maximum of the server
+    int inflightLimit;
+
+    // ring of received QoS2 packet ids, 0 = unused
+    unsigned short qos2Received[MQTT_MAX_QOS2_RECEIVED];
+    int qos2ReceivedNext;
     
     unsigned char sendbuf[MAX_MQTT_PACKET_SIZE];
+    // packets collected for the next send call
+    unsigned char txbuf[MQTT_TX_BUFFER_SIZE];
+    size_t txlen;
     unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
 
     unsigned int keepAliveInterval;
     Timer comTimer;
 
+    uint32_t statMessagesSent;
+    uint32_t statBytesSent;
+    uint32_t statRetransmissions;
+    uint32_t statLatencyMax_us;
+    uint64_t statLatencySum_us;
+    uint64_t sessionStart;          // ms, TCP connected
+    uint32_t statConnects;
+    uint32_t statConnectTime_ms;
+    uint32_t statSetupTime_ms;
+    uint32_t statSubscribed;
+    uint32_t statReconnectTime_ms;
+    uint32_t statReconnectTimeMax_ms;
+    uint32_t statTLSFull;
+    uint32_t statTLSResumed;
+
     // SSL/TLS functions
     bool useTLS;
     void setupTLS();
@@ -182,18 +403,37 @@ private:
     void freeTLS();
     int doTLSHandshake();
     
+    int sendSubscriptions();
     int processSubscriptions();
-    int readPacket();
+    int readPacket(int timeout = DEFAULT_SOCKET_TIMEOUT);
     int sendPacket(size_t length);
+    int sendSegment(const unsigned char * data, size_t length);
+    int appendTx(const unsigned char * data, size_t length);
+    int flushTx();
     int readPacketLength(int* value);
     int readUntil(int packetType, int timeout);
     int readBytesToBuffer(char * buffer, size_t size, int timeout);
     int sendBytesFromBuffer(char * buffer, size_t size, int timeout);
-    bool isTopicMatched(char* topic, MQTTString& topicName);
-    int  sendPublish(PubMessage& message);
+    bool addTopicHandler(const char * topic, FP<void, MessageData &> fp, QoS qos);
+    int  sendPublish(PublishBuffer& message, bool dup = false);
+    int  sendAck(int packetType, unsigned short packetId);
+    int  handleAckMsg(int packetType);
+    int  handlePacket(int packetType);
+    int  processOutbox();
+    void collectOutbox();
+    bool waitOutbox(uint64_t end);
+    int  sendMessage(PublishBuffer* message);
+    int  processBacklog();
+    void storeOutbox();
+    void waitReconnect();
+    uint32_t nextBackoff();
+    int  retransmit(InFlightMessage& entry);
+    int  resendInFlight();
     void resetConnectionTimer();
     void sendPingRequest();
     bool hasConnectionTimedOut();
+    uint32_t nextTimeout();
+    void onSocketEvent();
     int login();
 };
 
@@ -0,0 +1,304 @@
+#include "mbed.h"
+#include "OfflineLog.h"
+
+namespace MQTT {
+
+#define LOG_BLOCK_MAGIC     0x474c514d      // "MQLG"
+#define LOG_INDEX_MAGIC     0x58494c4d      // "MLIX"
+#define LOG_INDEX_BLOCKS    2
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t used;          // bytes including this header
+}LogBlockHeader;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headSeq;
+    uint32_t headOffset;
+    uint32_t tailSeq;
+    uint32_t crc;
+}LogIndex;
+
+// record: length (2), flags (1), topic length (1), topic, payload
+#define LOG_RECORD_HEADER   4
+#define LOG_FLAG_RETAINED   0x04
+
+static uint32_t crc32(const uint8_t * data, size_t length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    while (length--)
+    {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+OfflineLog::OfflineLog(BlockDevice * bd, bd_addr_t start, bd_size_t size)
+    : _bd(bd),
+      _start(start),
+      _size(size),
+      _blocks(0),
+      _headSeq(0),
+      _headOffset(sizeof(LogBlockHeader)),
+      _tailSeq(0),
+      _indexVersion(0),
+      _droppedBlocks(0),
+      _tailUsed(sizeof(LogBlockHeader)),
+      _tailDirty(false),
+      _headBlockSeq(0),
+      _headBlockValid(false)
+{
+}
+
+bd_addr_t OfflineLog::blockAddress(uint32_t seq)
+{
+    return _start + (bd_addr_t) (LOG_INDEX_BLOCKS + seq % _blocks) * MQTT_OFFLINE_BLOCK_SIZE;
+}
+
+int OfflineLog::init()
+{
+    int rc = _bd->init();
+    if (rc != 0)
+        return rc;
+
+    bd_size_t size = _size ? _size : _bd->size() - _start;
+    if (size / MQTT_OFFLINE_BLOCK_SIZE < LOG_INDEX_BLOCKS + 2)
+        return -1;
+    _blocks = size / MQTT_OFFLINE_BLOCK_SIZE - LOG_INDEX_BLOCKS;
+
+    // the newer of the two index copies
+    uint32_t version[LOG_INDEX_BLOCKS] = { 0, 0 };
+    int valid[LOG_INDEX_BLOCKS];
+    for (int slot = 0; slot < LOG_INDEX_BLOCKS; slot++)
+        valid[slot] = (readIndex(slot, &version[slot]) == 0);
+
+    int slot = -1;
+    if (valid[0] && (!valid[1] || (int32_t) (version[0] - version[1]) > 0))
+        slot = 0;
+    else if (valid[1])
+        slot = 1;
+    if (slot < 0)
+        return format();
+
+    readIndex(slot, &version[slot]);
+    LogIndex * index = (LogIndex *) _indexBlock;
+    _indexVersion = index->version;
+    _headSeq = index->headSeq;
+    _headOffset = index->headOffset;
+    _tailSeq = index->tailSeq;
+    _headBlockValid = false;
+    _tailDirty = false;
+
+    // the tail block knows how far it is filled
+    LogBlockHeader * header = (LogBlockHeader *) _tailBlock;
+    rc = _bd->read(_tailBlock, blockAddress(_tailSeq), MQTT_OFFLINE_BLOCK_SIZE);
+    if (rc == 0 && header->magic == LOG_BLOCK_MAGIC && header->seq == _tailSeq
+        && header->used >= sizeof(LogBlockHeader) && header->used <= MQTT_OFFLINE_BLOCK_SIZE)
+        _tailUsed = header->used;
+    else
+        _tailUsed = sizeof(LogBlockHeader);
+
+    return 0;
+}
+
+int OfflineLog::deinit()
+{
+    sync();
+    return _bd->deinit();
+}
+
+int OfflineLog::format()
+{
+    _headSeq = 0;
+    _headOffset = sizeof(LogBlockHeader);
+    _tailSeq = 0;
+    _tailUsed = sizeof(LogBlockHeader);
+    _tailDirty = false;
+    _headBlockValid = false;
+
+    // both copies, an old index must not come back
+    int rc = writeIndex();
+    if (rc == 0)
+        rc = writeIndex();
+    return rc;
+}
+
+int OfflineLog::readIndex(int slot, uint32_t * version)
+{
+    LogIndex * index = (LogIndex *) _indexBlock;
+    int rc = _bd->read(_indexBlock, _start + (bd_addr_t) slot * MQTT_OFFLINE_BLOCK_SIZE, MQTT_OFFLINE_BLOCK_SIZE);
+    if (rc != 0)
+        return rc;
+
+    if (index->magic != LOG_INDEX_MAGIC || index->crc != crc32(_indexBlock, offsetof(LogIndex, crc))
+        || (int32_t) (index->tailSeq - index->headSeq) < 0 || index->tailSeq - index->headSeq >= _blocks)
+        return -1;
+
+    *version = index->version;
+    return 0;
+}
+
+int OfflineLog::writeIndex()
+{
+    LogIndex * index = (LogIndex *) _indexBlock;
+
+    memset(_indexBlock, 0xFF, sizeof(_indexBlock));
+    index->magic = LOG_INDEX_MAGIC;
+    index->version = ++_indexVersion;
+    index->headSeq = _headSeq;
+    index->headOffset = _headOffset;
+    index->tailSeq = _tailSeq;
+    index->crc = crc32(_indexBlock, offsetof(LogIndex, crc));
+
+    return _bd->program(_indexBlock, _start + (bd_addr_t) (_indexVersion % LOG_INDEX_BLOCKS) * MQTT_OFFLINE_BLOCK_SIZE,
+                        MQTT_OFFLINE_BLOCK_SIZE);
+}
+
+int OfflineLog::writeTail()
+{
+    LogBlockHeader * header = (LogBlockHeader *) _tailBlock;
+
+    header->magic = LOG_BLOCK_MAGIC;
+    header->seq = _tailSeq;
+    header->used = _tailUsed;
+    memset(&_tailBlock[_tailUsed], 0xFF, MQTT_OFFLINE_BLOCK_SIZE - _tailUsed);
+
+    int rc = _bd->program(_tailBlock, blockAddress(_tailSeq), MQTT_OFFLINE_BLOCK_SIZE);
+    if (rc == 0)
+        _tailDirty = false;
+    return rc;
+}
+
+int OfflineLog::advanceTail()
+{
+    _tailSeq++;
+    _tailUsed = sizeof(LogBlockHeader);
+
+    // ring full: the oldest block is overwritten next
+    if (_tailSeq - _headSeq >= _blocks)
+    {
+        _headSeq = _tailSeq - _blocks + 1;
+        _headOffset = sizeof(LogBlockHeader);
+        _droppedBlocks++;
+    }
+
+    return writeIndex();
+}
+
+int OfflineLog::append(PublishBuffer * message)
+{
+    size_t topicLength = message->getTopicLength();
+    size_t length = LOG_RECORD_HEADER + topicLength + message->getPayloadLength();
+
+    if (topicLength > 255 || length > MQTT_OFFLINE_BLOCK_SIZE - sizeof(LogBlockHeader))
+        return -1;
+
+    if (_tailUsed + length > MQTT_OFFLINE_BLOCK_SIZE)
+    {
+        int rc = _tailDirty ? writeTail() : 0;
+        if (rc == 0)
+            rc = advanceTail();
+        if (rc != 0)
+            return rc;
+    }
+
+    uint8_t * record = &_tailBlock[_tailUsed];
+    record[0] = (uint8_t) length;
+    record[1] = (uint8_t) (length >> 8);
+    record[2] = (uint8_t) (message->qos | (message->retained ? LOG_FLAG_RETAINED : 0));
+    record[3] = (uint8_t) topicLength;
+    memcpy(&record[LOG_RECORD_HEADER], message->getTopic(), topicLength);
+    memcpy(&record[LOG_RECORD_HEADER + topicLength], message->payload(), message->getPayloadLength());
+    _tailUsed += length;
+    _tailDirty = true;
+
+    return 0;
+}
+
+int OfflineLog::sync()
+{
+    return _tailDirty ? writeTail() : 0;
+}
+
+bool OfflineLog::empty()
+{
+    return (_headSeq == _tailSeq) && (_headOffset >= _tailUsed);
+}
+
+PublishBuffer * OfflineLog::pop()
+{
+    while (true)
+    {
+        const uint8_t * block;
+        uint32_t used;
+
+        if (_headSeq == _tailSeq)
+        {
+            // the tail block in RAM is up to date
+            block = _tailBlock;
+            used = _tailUsed;
+        }
+        else
+        {
+            LogBlockHeader * header = (LogBlockHeader *) _headBlock;
+            if (!_headBlockValid || _headBlockSeq != _headSeq)
+            {
+                if (_bd->read(_headBlock, blockAddress(_headSeq), MQTT_OFFLINE_BLOCK_SIZE) != 0)
+                    return NULL;
+                _headBlockSeq = _headSeq;
+                _headBlockValid = true;
+            }
+            block = _headBlock;
+            // a broken block is skipped
+            used = (header->magic == LOG_BLOCK_MAGIC && header->seq == _headSeq
+                    && header->used <= MQTT_OFFLINE_BLOCK_SIZE) ? header->used : 0;
+        }
+
+        if (_headOffset + LOG_RECORD_HEADER > used)
+        {
+            if (_headSeq == _tailSeq)
+                return NULL;
+
+            // block done, save the progress
+            _headSeq++;
+            _headOffset = sizeof(LogBlockHeader);
+            writeIndex();
+            continue;
+        }
+
+        const uint8_t * record = &block[_headOffset];
+        uint32_t length = record[0] | (record[1] << 8);
+        uint32_t topicLength = record[3];
+        if (length < LOG_RECORD_HEADER + topicLength || _headOffset + length > used)
+        {
+            _headOffset = used;         // broken record, skip the rest of the block
+            continue;
+        }
+
+        char topic[256];
+        memcpy(topic, &record[LOG_RECORD_HEADER], topicLength);
+        topic[topicLength] = '\0';
+
+        size_t payloadLength = length - LOG_RECORD_HEADER - topicLength;
+        PublishBuffer * message = PublishBuffer::alloc(topic, payloadLength);
+        if (message == NULL)
+            return NULL;
+
+        memcpy(message->payload(), &record[LOG_RECORD_HEADER + topicLength], payloadLength);
+        message->setPayloadLength(payloadLength);
+        message->qos = (QoS) (record[2] & 0x03);
+        message->retained = (record[2] & LOG_FLAG_RETAINED) != 0;
+
+        _headOffset += length;
+        return message;
+    }
+}
+
+}
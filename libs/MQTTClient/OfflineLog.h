@@ -0,0 +1,110 @@
+#ifndef _MQTT_OFFLINE_LOG_H_
+#define _MQTT_OFFLINE_LOG_H_
+
+#include "mbed.h"
+#include "BlockDevice.h"
+#include "PublishBuffer.h"
+
+// unit of all reads and writes, a multiple of the program size of the device
+#ifndef MQTT_OFFLINE_BLOCK_SIZE
+#define MQTT_OFFLINE_BLOCK_SIZE 512
+#endif
+
+namespace MQTT
+{
+
+/**
+ * \brief OfflineLog stores messages on a block device while the broker is unreachable.
+ *
+ * The log is a ring of blocks in a region of the device. Messages are
+ * appended to the tail block in RAM, the block is written as a whole when
+ * it is full or on sync(). Two index blocks at the start of the region
+ * hold head and tail, they are written alternately when head or tail
+ * move to another block, so init() finds both with three block reads.
+ *
+ * A record takes 4 bytes + topic + payload and does not span blocks.
+ * With 512 byte blocks and 60 byte messages, a week of 1 Hz telemetry
+ * needs about 45 MB. When the ring is full, the oldest block is dropped.
+ *
+ * The read position inside a block is saved when the block is done, after
+ * a reset the messages of a partly replayed block are sent again.
+ *
+ * Not thread safe, MQTTThreadedClient uses it from the listener thread.
+ */
+class OfflineLog
+{
+public:
+    /**
+     *  @param bd - block device, e.g. SDIOBlockDevice. The region is written 
+     *              raw, it must not overlap a filesystem.
+     *  @param start - start of the region in bytes, a multiple of MQTT_OFFLINE_BLOCK_SIZE
+     *  @param size - size of the region in bytes, 0 = up to the end of the device
+     */
+    OfflineLog(BlockDevice * bd, bd_addr_t start = 0, bd_size_t size = 0);
+
+    /**
+     *  Initializes the device and recovers head and tail from the index,
+     *  an empty log is created if there is no valid index.
+     *
+     *  @return 0 on success or a negative error code
+     */
+    int init();
+    int deinit();
+
+    // drops all messages
+    int format();
+
+    /**
+     *  Appends topic, payload, qos and retained of a message.
+     *
+     *  @return 0 on success, -1 if the message does not fit into a
+     *          block, or a block device error
+     */
+    int append(PublishBuffer * message);
+
+    // writes the tail block if it has unwritten messages
+    int sync();
+
+    /**
+     *  Removes the oldest message.
+     *
+     *  @return new buffer with a reference count of 1, NULL if 
+     *          the log is empty or out of memory
+     */
+    PublishBuffer * pop();
+
+    bool empty();
+
+    // blocks dropped because the ring was full
+    uint32_t getDroppedBlocks() { return _droppedBlocks; };
+
+private:
+    bd_addr_t blockAddress(uint32_t seq);
+    int writeTail();
+    int advanceTail();
+    int writeIndex();
+    int readIndex(int slot, uint32_t * version);
+
+    BlockDevice * _bd;
+    bd_addr_t _start;
+    bd_size_t _size;
+    uint32_t _blocks;               // data blocks in the ring
+
+    // head and tail as block sequence numbers, they only grow
+    uint32_t _headSeq;
+    uint32_t _headOffset;
+    uint32_t _tailSeq;
+    uint32_t _indexVersion;
+    uint32_t _droppedBlocks;
+
+    uint8_t _tailBlock[MQTT_OFFLINE_BLOCK_SIZE];
+    uint32_t _tailUsed;
+    bool _tailDirty;
+    uint8_t _headBlock[MQTT_OFFLINE_BLOCK_SIZE];
+    uint32_t _headBlockSeq;
+    bool _headBlockValid;
+    uint8_t _indexBlock[MQTT_OFFLINE_BLOCK_SIZE];
+};
+
+}
+#endif
@@ -0,0 +1,103 @@
+#include "mbed.h"
+#include "PublishBuffer.h"
+#include "PublishRing.h"
+
+namespace MQTT {
+
+// buffer object, topic and payload in one block
+typedef struct
+{
+    uint32_t mem[(sizeof(PublishBuffer) + MQTT_PUBLISH_POOL_BUFFER_SIZE + 3) / 4];
+}PublishBlock;
+
+static MemoryPool<PublishBlock, MQTT_PUBLISH_POOL_SIZE> publishPool;
+
+PublishBuffer* PublishBuffer::allocBlock(const char * topic, size_t capacity)
+{
+    uint8_t storage = HEAP;
+    void * mem = NULL;
+    size_t topicLength = strlen(topic);
+    size_t size = topicLength + 1 + capacity;
+
+    if (size <= MQTT_PUBLISH_POOL_BUFFER_SIZE)
+    {
+        mem = publishPool.alloc();
+        if (mem)
+            storage = POOL;
+    }
+    if (!mem)
+    {
+        mem = malloc(sizeof(PublishBuffer) + size);
+        if (!mem)
+            return NULL;
+    }
+
+    return construct(mem, topic, topicLength, capacity, storage);
+}
+
+PublishBuffer* PublishBuffer::construct(void * mem, const char * topic, size_t topicLength,
+                                        size_t capacity, uint8_t storage)
+{
+    PublishBuffer * buffer = new (mem) PublishBuffer();
+    char * topicCopy = (char *) mem + sizeof(PublishBuffer);
+    memcpy(topicCopy, topic, topicLength + 1);
+
+    buffer->_refCount = 1;
+    buffer->_storage = storage;
+    buffer->_topic = topicCopy;
+    buffer->_topicLength = topicLength;
+    buffer->_payload = (uint8_t *) topicCopy + topicLength + 1;
+    buffer->_capacity = capacity;
+    buffer->_length = 0;
+    buffer->qos = QOS0;
+    buffer->retained = false;
+    buffer->id = 0;
+    buffer->timestamp = 0;
+
+    return buffer;
+}
+
+PublishBuffer* PublishBuffer::alloc(const char * topic, size_t maxLength)
+{
+    return allocBlock(topic, maxLength);
+}
+
+PublishBuffer* PublishBuffer::attach(const char * topic, const void * payload, size_t length,
+                                     Callback<void(const void *)> done)
+{
+    PublishBuffer * buffer = allocBlock(topic, 0);
+    if (buffer)
+    {
+        buffer->_payload = (uint8_t *) payload;
+        buffer->_capacity = length;
+        buffer->_length = length;
+        buffer->_done = done;
+    }
+
+    return buffer;
+}
+
+void PublishBuffer::acquire()
+{
+    core_util_atomic_incr_u32(&_refCount, 1);
+}
+
+void PublishBuffer::release()
+{
+    if (core_util_atomic_decr_u32(&_refCount, 1) == 0)
+    {
+        if (_done)
+            _done(_payload);
+
+        uint8_t storage = _storage;
+        this->~PublishBuffer();
+        if (storage == POOL)
+            publishPool.free((PublishBlock *) this);
+        else if (storage == RING)
+            PublishRing::release(this);
+        else
+            free(this);
+    }
+}
+
+}
@@ -0,0 +1,100 @@
+#ifndef _MQTT_PUBLISH_BUFFER_H_
+#define _MQTT_PUBLISH_BUFFER_H_
+
+#include "mbed.h"
+
+// messages with up to n bytes topic + payload are taken from a pool, larger ones from the heap
+#ifndef MQTT_PUBLISH_POOL_BUFFER_SIZE
+#define MQTT_PUBLISH_POOL_BUFFER_SIZE 128
+#endif
+
+// number of pooled messages
+#ifndef MQTT_PUBLISH_POOL_SIZE
+#define MQTT_PUBLISH_POOL_SIZE 8
+#endif
+
+namespace MQTT
+{
+
+typedef enum { QOS0, QOS1, QOS2 } QoS;
+
+/**
+ * \brief PublishBuffer holds the topic and payload of a message to publish.
+ *
+ * The producer gets a buffer with alloc(), writes the payload in place and
+ * hands it to MQTTThreadedClient::publish(). The client sends the payload
+ * directly from the buffer and keeps it until the message is acknowledged,
+ * so the payload is never copied.
+ *
+ * Payloads that live elsewhere (flash, a file buffer) can be published
+ * with attach(), then only the topic is copied.
+ *
+ * MQTTThreadedClient::allocPublish() places the buffer in the outbox ring
+ * instead, without a lock, also in interrupt context.
+ *
+ * The buffer is reference counted, the last release() frees the memory.
+ */
+class PublishBuffer
+{
+public:
+    /**
+     *  Allocate a buffer for a payload of up to maxLength bytes
+     *
+     *  @param topic - topic name, it is copied
+     *  @param maxLength - capacity of payload()
+     *  @return buffer with a reference count of 1, NULL if out of memory
+     */
+    static PublishBuffer* alloc(const char * topic, size_t maxLength);
+
+    /**
+     *  Allocate a buffer that references an external payload
+     *
+     *  @param topic - topic name, it is copied
+     *  @param payload - must stay valid until done is called
+     *  @param length - length of the payload
+     *  @param done - called with payload when the buffer is freed
+     *  @return buffer with a reference count of 1, NULL if out of memory
+     */
+    static PublishBuffer* attach(const char * topic, const void * payload, size_t length,
+                                 Callback<void(const void *)> done = NULL);
+
+    void acquire();
+    void release();
+
+    const char * getTopic() { return _topic; };
+    size_t getTopicLength() { return _topicLength; };
+
+    uint8_t * payload() { return _payload; };
+    size_t getPayloadCapacity() { return _capacity; };
+    size_t getPayloadLength() { return _length; };
+    // the payload written to payload(), must not exceed the capacity
+    void setPayloadLength(size_t length) { _length = (length < _capacity) ? length : _capacity; };
+
+    QoS qos;
+    bool retained;
+    unsigned short id;      // assigned by the client
+    uint32_t timestamp;     // us_ticker_read() at publish(), for the latency stats
+
+private:
+    friend class PublishRing;
+    enum { HEAP, POOL, RING };
+
+    PublishBuffer() {};
+    ~PublishBuffer() {};
+    static PublishBuffer* allocBlock(const char * topic, size_t capacity);
+    // buffer, topic and payload in mem
+    static PublishBuffer* construct(void * mem, const char * topic, size_t topicLength,
+                                    size_t capacity, uint8_t storage);
+
+    volatile uint32_t _refCount;
+    uint8_t _storage;
+    const char * _topic;
+    size_t _topicLength;
+    uint8_t * _payload;
+    size_t _capacity;
+    size_t _length;
+    Callback<void(const void *)> _done;
+};
+
+}
+#endif
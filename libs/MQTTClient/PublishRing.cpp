@@ -0,0 +1,165 @@
+#include "mbed.h"
+#include "PublishRing.h"
+
+namespace MQTT {
+
+PublishRing::PublishRing(void * memory, uint32_t size, uint32_t maxPointers)
+{
+    MBED_ASSERT((size & (size - 1)) == 0);
+
+    _memory = (uint8_t *) memory;
+    _size = size;
+    _mask = size - 1;
+    _head = 0;
+    _tail = 0;
+    _read = 0;
+    _pointers = 0;
+    _maxPointers = maxPointers;
+    memset(_memory, 0, _size);
+}
+
+PublishRing::Record* PublishRing::reserve(size_t length)
+{
+    if (length > _size)
+        return NULL;
+
+    uint32_t size = (sizeof(Record) + length + 7) & ~7UL;
+    while (true)
+    {
+        uint32_t head = _head;
+        uint32_t tail = _tail;
+        uint32_t offset = head & _mask;
+
+        if (offset + size <= _size)
+        {
+            if (head + size - tail > _size)
+                return NULL;
+            if (core_util_atomic_cas_u32(&_head, &head, head + size))
+            {
+                Record * record = at(head);
+                record->size = size;
+                return record;
+            }
+        }
+        else
+        {
+            // a record does not wrap, the end of the ring is skipped by a
+            // padding record. It is reserved alone, the record may not fit
+            // until the consumer has freed the padding.
+            uint32_t pad = _size - offset;
+            if (head + pad - tail > _size)
+                return NULL;
+            if (core_util_atomic_cas_u32(&_head, &head, head + pad))
+            {
+                Record * padding = at(head);
+                padding->size = pad;
+                __DMB();
+                padding->state = DONE;
+            }
+        }
+    }
+}
+
+PublishBuffer* PublishRing::alloc(const char * topic, size_t maxLength)
+{
+    size_t topicLength = strlen(topic);
+    Record * record = reserve(sizeof(PublishBuffer) + topicLength + 1 + maxLength);
+    if (record == NULL)
+        return NULL;
+
+    return PublishBuffer::construct(record + 1, topic, topicLength, maxLength, PublishBuffer::RING);
+}
+
+bool PublishRing::push(PublishBuffer * message)
+{
+    Record * record;
+    uint32_t state;
+
+    if (message->_storage == PublishBuffer::RING)
+    {
+        record = (Record *) message - 1;
+        state = READY_BUFFER;
+    }
+    else
+    {
+        if (core_util_atomic_incr_u32(&_pointers, 1) > _maxPointers)
+        {
+            core_util_atomic_decr_u32(&_pointers, 1);
+            return false;
+        }
+        record = reserve(sizeof(PublishBuffer *));
+        if (record == NULL)
+        {
+            core_util_atomic_decr_u32(&_pointers, 1);
+            return false;
+        }
+        *(PublishBuffer **) (record + 1) = message;
+        state = READY_POINTER;
+    }
+
+    // the message is written before the consumer sees the state
+    __DMB();
+    record->state = state;
+    return true;
+}
+
+PublishBuffer* PublishRing::pop()
+{
+    while (_read != _head)
+    {
+        Record * record = at(_read);
+        uint32_t state = record->state;
+        __DMB();
+        if (state == RESERVED)
+            return NULL;        // the order is kept, wait for the commit
+
+        _read += record->size;
+        if (state == READY_BUFFER)
+        {
+            record->state = TAKEN;
+            return (PublishBuffer *) (record + 1);
+        }
+        if (state == READY_POINTER)
+        {
+            PublishBuffer * message = *(PublishBuffer **) (record + 1);
+            record->state = DONE;
+            core_util_atomic_decr_u32(&_pointers, 1);
+            return message;
+        }
+        // DONE: padding or a buffer released without push
+    }
+
+    return NULL;
+}
+
+bool PublishRing::collect()
+{
+    uint32_t tail = _tail;
+    while (tail != _read)
+    {
+        Record * record = at(tail);
+        if (record->state != DONE)
+            break;
+
+        // the next records may start anywhere in this space
+        uint32_t size = record->size;
+        memset(record, 0, size);
+        tail += size;
+    }
+
+    if (tail == _tail)
+        return false;
+
+    __DMB();
+    _tail = tail;
+    return true;
+}
+
+void PublishRing::release(PublishBuffer * buffer)
+{
+    Record * record = (Record *) buffer - 1;
+    __DMB();
+    record->state = DONE;
+}
+
+}
@@ -0,0 +1,89 @@
+#ifndef _MQTT_PUBLISH_RING_H_
+#define _MQTT_PUBLISH_RING_H_
+
+#include "mbed.h"
+#include "PublishBuffer.h"
+
+namespace MQTT
+{
+
+/**
+ * \brief PublishRing is the outbox of MQTTThreadedClient, a lock free ring
+ * of variable length records from the publishing threads and interrupts
+ * to the listener thread.
+ *
+ * alloc() places a PublishBuffer with topic and payload in the ring, the
+ * producer writes the payload there and push() commits it. Nothing is copied
+ * and there is no RTOS call. Buffers from PublishBuffer::alloc() or attach()
+ * are pushed as a record with the pointer.
+ *
+ * Any number of producers, also in interrupt context: the space is reserved
+ * by a compare and swap of the head, the record is committed by setting its
+ * state. The consumer takes the records in the order of the reservation and
+ * stops at a record that is not committed yet. A buffer taken from the ring
+ * keeps its space until it is released, QoS1/QoS2 messages until they are
+ * acknowledged, and collect() frees the space in ring order.
+ */
+class PublishRing
+{
+public:
+    /**
+     *  @param memory - 8 byte aligned, used for the records
+     *  @param size - bytes, a power of 2
+     *  @param maxPointers - buffers of PublishBuffer::alloc() waiting in the ring,
+     *                       they hold memory outside of the ring
+     */
+    PublishRing(void * memory, uint32_t size, uint32_t maxPointers);
+
+    /**
+     *  Allocate a buffer in the ring, any thread or interrupt
+     *
+     *  @param topic - topic name, it is copied
+     *  @param maxLength - capacity of payload()
+     *  @return buffer with a reference count of 1, NULL if the ring is full
+     */
+    PublishBuffer* alloc(const char * topic, size_t maxLength);
+
+    /**
+     *  Commit a message for the consumer, any thread or interrupt
+     *
+     *  @param message - buffer of alloc(), or of PublishBuffer::alloc()/attach()
+     *  @return false if the ring is full or maxPointers are waiting, only for the latter
+     */
+    bool push(PublishBuffer * message);
+
+    // consumer thread: next message in push order, the reference goes to the caller
+    PublishBuffer* pop();
+    // consumer thread: frees the space of the released records, true if any
+    bool collect();
+
+    // the last reference of a buffer of alloc() is gone
+    static void release(PublishBuffer * buffer);
+
+private:
+    typedef struct
+    {
+        volatile uint32_t state;
+        uint32_t size;          // bytes with this header and the padding
+    }Record;
+
+    // all free space is zero, a reserved record is RESERVED until committed
+    enum { RESERVED = 0, READY_BUFFER, READY_POINTER, TAKEN, DONE };
+
+    Record* reserve(size_t length);
+    Record* at(uint32_t position) { return (Record *) (_memory + (position & _mask)); };
+
+    uint8_t * _memory;
+    uint32_t _size;
+    uint32_t _mask;
+    // free running byte positions: reserved up to _head, taken up to _read,
+    // freed up to _tail
+    volatile uint32_t _head;
+    volatile uint32_t _tail;
+    uint32_t _read;
+    volatile uint32_t _pointers;
+    uint32_t _maxPointers;
+};
+
+}
+#endif
@@ -0,0 +1,101 @@
+#ifndef _MQTT_TOPIC_ALIASES_H_
+#define _MQTT_TOPIC_ALIASES_H_
+
+#include <stdint.h>
+#include <string.h>
+
+// topic aliases of the client, the server may allow less
+#ifndef MQTT_MAX_TOPIC_ALIASES
+#define MQTT_MAX_TOPIC_ALIASES 8
+#endif
+// longer topics are always sent as string
+#ifndef MQTT_TOPIC_ALIAS_LENGTH
+#define MQTT_TOPIC_ALIAS_LENGTH 64
+#endif
+
+namespace MQTT
+{
+
+/**
+ * \brief TopicAliases assigns MQTT v5 topic aliases to the published topics.
+ *
+ * The first PUBLISH of a topic carries the topic and the new alias, the
+ * following ones only the alias. When all aliases are taken, the least
+ * recently used one is given to the new topic, so the aliases stay with
+ * the topics that are published most often.
+ *
+ * Aliases are valid for one network connection, reset() must be called
+ * after every CONNACK.
+ */
+class TopicAliases
+{
+public:
+    TopicAliases() : maximum(0), clock(0)
+    {
+        memset(entries, 0, sizeof(entries));
+    };
+
+    // clears the table, maximum is the Topic Alias Maximum of the server
+    void reset(uint16_t serverMaximum)
+    {
+        maximum = (serverMaximum < MQTT_MAX_TOPIC_ALIASES) ? serverMaximum : MQTT_MAX_TOPIC_ALIASES;
+        clock = 0;
+        memset(entries, 0, sizeof(entries));
+    };
+
+    /**
+     *  Returns the alias for a topic
+     *
+     *  @param known - true if the server knows the alias already, the
+     *                 topic can be left out
+     *  @return alias, 0 if the topic is sent without alias
+     */
+    uint16_t get(const char * topic, size_t length, bool * known)
+    {
+        *known = false;
+        // an alias takes 3 bytes in the properties
+        if (maximum == 0 || length <= 3 || length > MQTT_TOPIC_ALIAS_LENGTH)
+            return 0;
+
+        uint32_t hash = 2166136261u;    // FNV-1a
+        for (size_t i = 0; i < length; i++)
+            hash = (hash ^ (uint8_t) topic[i]) * 16777619u;
+
+        int oldest = 0;
+        for (int i = 0; i < maximum; i++)
+        {
+            Entry& entry = entries[i];
+            if (entry.length == length && entry.hash == hash && memcmp(entry.topic, topic, length) == 0)
+            {
+                entry.lastUsed = ++clock;
+                *known = true;
+                return i + 1;
+            }
+            if (entry.lastUsed < entries[oldest].lastUsed)
+                oldest = i;
+        }
+
+        Entry& entry = entries[oldest];
+        entry.hash = hash;
+        entry.length = length;
+        entry.lastUsed = ++clock;
+        memcpy(entry.topic, topic, length);
+        return oldest + 1;
+    };
+
+private:
+    typedef struct
+    {
+        uint32_t hash;
+        uint32_t lastUsed;          // 0 = free
+        uint16_t length;
+        char topic[MQTT_TOPIC_ALIAS_LENGTH];
+    }Entry;
+
+    Entry entries[MQTT_MAX_TOPIC_ALIASES];
+    uint16_t maximum;
+    uint32_t clock;
+};
+
+}
+#endif
@@ -0,0 +1,225 @@
+#ifndef _MQTT_TOPIC_TRIE_H_
+#define _MQTT_TOPIC_TRIE_H_
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include "FP.h"
+
+namespace MQTT
+{
+
+/**
+ * \brief TopicTrie maps topic filters to handlers and dispatches topic names.
+ *
+ * Every level of a filter is a node, '+' and '#' are extra children of
+ * their parent node. A node can have any number of handlers, so several
+ * handlers can subscribe the same filter.
+ *
+ * dispatch() walks the levels of the topic name in place, the cost
+ * grows with the number of levels, not with the number of filters,
+ * and no memory is allocated. Topics starting with '$' are not matched
+ * by a wildcard in the first level.
+ */
+template<typename Arg>
+class TopicTrie
+{
+public:
+    typedef FP<void, Arg> Handler;
+
+    TopicTrie() {};
+    ~TopicTrie() { clear(&root); };
+
+    /**
+     *  Adds a handler for a topic filter
+     *
+     *  @param filter - topic filter, may contain '+' and '#' as last level
+     *  @return false if the filter is invalid
+     */
+    bool add(const char * filter, Handler handler)
+    {
+        Node * node = &root;
+        const char * level = filter;
+        const char * end = filter + strlen(filter);
+
+        while (true)
+        {
+            const char * next = (const char *) memchr(level, '/', end - level);
+            size_t length = (next ? next : end) - level;
+
+            if (length == 1 && *level == '#')
+            {
+                if (next)
+                    return false;   // '#' must be the last level
+                if (!node->hash)
+                    node->hash = new Node();
+                node = node->hash;
+            }
+            else if (length == 1 && *level == '+')
+            {
+                if (!node->plus)
+                    node->plus = new Node();
+                node = node->plus;
+            }
+            else
+            {
+                if (memchr(level, '+', length) || memchr(level, '#', length))
+                    return false;   // wildcards must occupy a whole level
+                node = insertChild(node, level, length);
+            }
+
+            if (!next)
+                break;
+            level = next + 1;
+        }
+
+        node->handlers.push_back(handler);
+        return true;
+    }
+
+    /**
+     *  Calls the handlers of all filters matching a topic name
+     *
+     *  @param topic - topic name, not NUL terminated
+     *  @param length - length of the topic name
+     *  @param arg - passed to the handlers
+     *  @return number of handlers called
+     */
+    int dispatch(const char * topic, size_t length, Arg arg)
+    {
+        return dispatch(&root, topic, topic + length, true, arg);
+    }
+
+    bool empty() { return root.children.empty() && !root.plus && !root.hash && root.handlers.empty(); };
+
+    // removes all filters
+    void clear() { clear(&root); };
+
+private:
+    struct Node
+    {
+        Node() : plus(NULL), hash(NULL) {};
+
+        std::string level;
+        std::vector<Node *> children;   // sorted by level
+        Node * plus;
+        Node * hash;
+        std::vector<Handler> handlers;
+    };
+
+    Node root;
+
+    static int compare(const std::string& a, const char * b, size_t length)
+    {
+        size_t n = (a.size() < length) ? a.size() : length;
+        int rc = memcmp(a.data(), b, n);
+        if (rc != 0)
+            return rc;
+        return (a.size() < length) ? -1 : (a.size() > length);
+    }
+
+    // index of the first child not less than level
+    static size_t lowerBound(Node * node, const char * level, size_t length)
+    {
+        size_t lo = 0;
+        size_t hi = node->children.size();
+        while (lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            if (compare(node->children[mid]->level, level, length) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    static Node * findChild(Node * node, const char * level, size_t length)
+    {
+        size_t i = lowerBound(node, level, length);
+        if (i < node->children.size() && compare(node->children[i]->level, level, length) == 0)
+            return node->children[i];
+        return NULL;
+    }
+
+    static Node * insertChild(Node * node, const char * level, size_t length)
+    {
+        size_t i = lowerBound(node, level, length);
+        if (i < node->children.size() && compare(node->children[i]->level, level, length) == 0)
+            return node->children[i];
+
+        Node * child = new Node();
+        child->level.assign(level, length);
+        node->children.insert(node->children.begin() + i, child);
+        return child;
+    }
+
+    static int call(Node * node, Arg arg)
+    {
+        int count = 0;
+        for (size_t i = 0; i < node->handlers.size(); i++)
+        {
+            if (node->handlers[i].attached())
+            {
+                node->handlers[i](arg);
+                count++;
+            }
+        }
+        return count;
+    }
+
+    // the topic ends at node: its handlers, and "x/#" also matches "x"
+    static int deliver(Node * node, Arg arg)
+    {
+        int count = call(node, arg);
+        if (node->hash)
+            count += call(node->hash, arg);
+        return count;
+    }
+
+    static int dispatch(Node * node, const char * level, const char * end, bool first, Arg arg)
+    {
+        int count = 0;
+        const char * next = (const char *) memchr(level, '/', end - level);
+        size_t length = (next ? next : end) - level;
+        bool wildcards = !(first && length > 0 && *level == '$');
+
+        if (wildcards && node->hash)
+            count += call(node->hash, arg);
+
+        if (wildcards && node->plus)
+            count += next ? dispatch(node->plus, next + 1, end, false, arg) : deliver(node->plus, arg);
+
+        Node * child = findChild(node, level, length);
+        if (child)
+            count += next ? dispatch(child, next + 1, end, false, arg) : deliver(child, arg);
+
+        return count;
+    }
+
+    static void clear(Node * node)
+    {
+        for (size_t i = 0; i < node->children.size(); i++)
+        {
+            clear(node->children[i]);
+            delete node->children[i];
+        }
+        node->children.clear();
+        if (node->plus)
+        {
+            clear(node->plus);
+            delete node->plus;
+            node->plus = NULL;
+        }
+        if (node->hash)
+        {
+            clear(node->hash);
+            delete node->hash;
+            node->hash = NULL;
+        }
+        node->handlers.clear();
+    }
+};
+
+}
+#endif
@@ -0,0 +1,306 @@
+/*******************************************************************************
+ * Copyright (c) 2019
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    MQTT v5 properties for MQTTThreadedClient
+ *******************************************************************************/
+
+#include "MQTTProperties.h"
+#include "StackTrace.h"
+
+#include <string.h>
+
+static const struct
+{
+	unsigned char identifier;
+	unsigned char type;
+} propertyTypes[] =
+{
+	{MQTTPROPERTY_CODE_PAYLOAD_FORMAT_INDICATOR, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_CONTENT_TYPE, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_RESPONSE_TOPIC, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_CORRELATION_DATA, MQTTPROPERTY_TYPE_BINARY_DATA},
+	{MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIER, MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_ASSIGNED_CLIENT_IDENTIFER, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_AUTHENTICATION_METHOD, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_AUTHENTICATION_DATA, MQTTPROPERTY_TYPE_BINARY_DATA},
+	{MQTTPROPERTY_CODE_REQUEST_PROBLEM_INFORMATION, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_WILL_DELAY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_REQUEST_RESPONSE_INFORMATION, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_RESPONSE_INFORMATION, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_SERVER_REFERENCE, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_REASON_STRING, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_RECEIVE_MAXIMUM, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_TOPIC_ALIAS, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_MAXIMUM_QOS, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_RETAIN_AVAILABLE, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_USER_PROPERTY, MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR},
+	{MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_WILDCARD_SUBSCRIPTION_AVAILABLE, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIERS_AVAILABLE, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_SHARED_SUBSCRIPTION_AVAILABLE, MQTTPROPERTY_TYPE_BYTE}
+};
+
+
+int MQTTProperty_getType(int identifier)
+{
+	int i;
+
+	for (i = 0; i < (int) (sizeof(propertyTypes) / sizeof(propertyTypes[0])); ++i)
+	{
+		if (propertyTypes[i].identifier == identifier)
+			return propertyTypes[i].type;
+	}
+	return -1;
+}
+
+
+/**
+ * Length of the encoded value of a variable byte integer
+ */
+static int varIntLength(unsigned int value)
+{
+	return (value < 128) ? 1 : (value < 16384) ? 2 : (value < 2097152) ? 3 : 4;
+}
+
+
+/**
+ * Decodes a variable byte integer without reading beyond enddata
+ * @return 1 if successful, 0 if not
+ */
+static int readVarInt(unsigned int* value, unsigned char** pptr, unsigned char* enddata)
+{
+	unsigned int multiplier = 1;
+	int count = 0;
+	unsigned char c;
+
+	*value = 0;
+	do
+	{
+		if (*pptr >= enddata || ++count > 4)
+			return 0;
+		c = *(*pptr)++;
+		*value += (c & 127) * multiplier;
+		multiplier *= 128;
+	} while ((c & 128) != 0);
+	return 1;
+}
+
+
+static int propertyLength(MQTTProperty* prop)
+{
+	switch (MQTTProperty_getType(prop->identifier))
+	{
+	case MQTTPROPERTY_TYPE_BYTE:
+		return 1;
+	case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+		return 2;
+	case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+		return 4;
+	case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+		return varIntLength(prop->value.integer4);
+	case MQTTPROPERTY_TYPE_BINARY_DATA:
+	case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+		return 2 + prop->value.data.len;
+	case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+		return 2 + prop->value.data.len + 2 + prop->value.value.len;
+	}
+	return 0;
+}
+
+
+int MQTTProperties_len(MQTTProperties* props)
+{
+	if (props == NULL)
+		return 1;
+	return props->length + varIntLength(props->length);
+}
+
+
+int MQTTProperties_add(MQTTProperties* props, MQTTProperty* prop)
+{
+	int rc = -1;
+
+	FUNC_ENTRY;
+	if (props->count < props->max_count && MQTTProperty_getType(prop->identifier) >= 0)
+	{
+		props->array[props->count++] = *prop;
+		/* the identifier is a variable byte integer, all defined ones take one byte */
+		props->length += 1 + propertyLength(prop);
+		rc = 0;
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+static void writeLenString(unsigned char** pptr, MQTTLenString* string)
+{
+	writeInt(pptr, string->len);
+	if (string->len > 0)
+		memcpy(*pptr, string->data, string->len);
+	*pptr += string->len;
+}
+
+
+int MQTTProperties_write(unsigned char** pptr, MQTTProperties* properties)
+{
+	unsigned char* start = *pptr;
+	int i;
+
+	FUNC_ENTRY;
+	if (properties == NULL)
+	{
+		writeChar(pptr, 0);
+		goto exit;
+	}
+
+	*pptr += MQTTPacket_encode(*pptr, properties->length);
+	for (i = 0; i < properties->count; ++i)
+	{
+		MQTTProperty* prop = &properties->array[i];
+
+		writeChar(pptr, (char) prop->identifier);
+		switch (MQTTProperty_getType(prop->identifier))
+		{
+		case MQTTPROPERTY_TYPE_BYTE:
+			writeChar(pptr, prop->value.byte);
+			break;
+		case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+			writeInt(pptr, prop->value.integer2);
+			break;
+		case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+			writeInt(pptr, prop->value.integer4 >> 16);
+			writeInt(pptr, prop->value.integer4 & 0xFFFF);
+			break;
+		case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+			*pptr += MQTTPacket_encode(*pptr, prop->value.integer4);
+			break;
+		case MQTTPROPERTY_TYPE_BINARY_DATA:
+		case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+			writeLenString(pptr, &prop->value.data);
+			break;
+		case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+			writeLenString(pptr, &prop->value.data);
+			writeLenString(pptr, &prop->value.value);
+			break;
+		}
+	}
+
+exit:
+	FUNC_EXIT;
+	return *pptr - start;
+}
+
+
+static int readLenString(MQTTLenString* string, unsigned char** pptr, unsigned char* enddata)
+{
+	MQTTString mqttstring = MQTTString_initializer;
+
+	if (!readMQTTLenString(&mqttstring, pptr, enddata))
+		return 0;
+	*string = mqttstring.lenstring;
+	return 1;
+}
+
+
+int MQTTProperties_read(MQTTProperties* properties, unsigned char** pptr, unsigned char* enddata)
+{
+	unsigned int length = 0;
+	unsigned char* propend;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (properties)
+	{
+		properties->count = 0;
+		properties->length = 0;
+	}
+
+	/* a missing property length is a length of 0, e.g. in a short PUBACK */
+	if (*pptr == enddata)
+	{
+		rc = 1;
+		goto exit;
+	}
+	if (!readVarInt(&length, pptr, enddata) || length > (unsigned int) (enddata - *pptr))
+		goto exit;
+
+	propend = *pptr + length;
+	while (*pptr < propend)
+	{
+		MQTTProperty prop;
+		unsigned int value = 0;
+
+		memset(&prop, 0, sizeof(prop));
+		prop.identifier = readChar(pptr);
+		switch (MQTTProperty_getType(prop.identifier))
+		{
+		case MQTTPROPERTY_TYPE_BYTE:
+			if (propend - *pptr < 1)
+				goto exit;
+			prop.value.byte = readChar(pptr);
+			break;
+		case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+			if (propend - *pptr < 2)
+				goto exit;
+			prop.value.integer2 = readInt(pptr);
+			break;
+		case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+			if (propend - *pptr < 4)
+				goto exit;
+			value = readInt(pptr);
+			prop.value.integer4 = (value << 16) | readInt(pptr);
+			break;
+		case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+			if (!readVarInt(&prop.value.integer4, pptr, propend))
+				goto exit;
+			break;
+		case MQTTPROPERTY_TYPE_BINARY_DATA:
+		case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+			if (!readLenString(&prop.value.data, pptr, propend))
+				goto exit;
+			break;
+		case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+			if (!readLenString(&prop.value.data, pptr, propend) || !readLenString(&prop.value.value, pptr, propend))
+				goto exit;
+			break;
+		default:
+			goto exit;	/* unknown property, the rest can not be parsed */
+		}
+
+		if (properties && properties->count < properties->max_count)
+			MQTTProperties_add(properties, &prop);
+	}
+	rc = 1;
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+MQTTProperty* MQTTProperties_get(MQTTProperties* props, int identifier)
+{
+	int i;
+
+	for (i = 0; props && i < props->count; ++i)
+	{
+		if (props->array[i].identifier == identifier)
+			return &props->array[i];
+	}
+	return NULL;
+}
@@ -0,0 +1,123 @@
+/*******************************************************************************
+ * Copyright (c) 2019
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    MQTT v5 properties for MQTTThreadedClient
+ *******************************************************************************/
+
+#ifndef MQTTPROPERTIES_H_
+#define MQTTPROPERTIES_H_
+
+#if defined(__cplusplus) /* If this is a C++ compiler, use C linkage */
+extern "C" {
+#endif
+
+#include "MQTTPacket.h"
+
+enum MQTTPropertyCodes
+{
+	MQTTPROPERTY_CODE_PAYLOAD_FORMAT_INDICATOR = 1,
+	MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL = 2,
+	MQTTPROPERTY_CODE_CONTENT_TYPE = 3,
+	MQTTPROPERTY_CODE_RESPONSE_TOPIC = 8,
+	MQTTPROPERTY_CODE_CORRELATION_DATA = 9,
+	MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIER = 11,
+	MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL = 17,
+	MQTTPROPERTY_CODE_ASSIGNED_CLIENT_IDENTIFER = 18,
+	MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE = 19,
+	MQTTPROPERTY_CODE_AUTHENTICATION_METHOD = 21,
+	MQTTPROPERTY_CODE_AUTHENTICATION_DATA = 22,
+	MQTTPROPERTY_CODE_REQUEST_PROBLEM_INFORMATION = 23,
+	MQTTPROPERTY_CODE_WILL_DELAY_INTERVAL = 24,
+	MQTTPROPERTY_CODE_REQUEST_RESPONSE_INFORMATION = 25,
+	MQTTPROPERTY_CODE_RESPONSE_INFORMATION = 26,
+	MQTTPROPERTY_CODE_SERVER_REFERENCE = 28,
+	MQTTPROPERTY_CODE_REASON_STRING = 31,
+	MQTTPROPERTY_CODE_RECEIVE_MAXIMUM = 33,
+	MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM = 34,
+	MQTTPROPERTY_CODE_TOPIC_ALIAS = 35,
+	MQTTPROPERTY_CODE_MAXIMUM_QOS = 36,
+	MQTTPROPERTY_CODE_RETAIN_AVAILABLE = 37,
+	MQTTPROPERTY_CODE_USER_PROPERTY = 38,
+	MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE = 39,
+	MQTTPROPERTY_CODE_WILDCARD_SUBSCRIPTION_AVAILABLE = 40,
+	MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIERS_AVAILABLE = 41,
+	MQTTPROPERTY_CODE_SHARED_SUBSCRIPTION_AVAILABLE = 42
+};
+
+enum MQTTPropertyTypes
+{
+	MQTTPROPERTY_TYPE_BYTE,
+	MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER,
+	MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER,
+	MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER,
+	MQTTPROPERTY_TYPE_BINARY_DATA,
+	MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING,
+	MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR
+};
+
+/**
+ * One property, strings and binary data point into the packet buffer.
+ */
+typedef struct
+{
+	int identifier;	/**< MQTTPropertyCodes */
+	union
+	{
+		unsigned char byte;
+		unsigned short integer2;
+		unsigned int integer4;
+		struct
+		{
+			MQTTLenString data;
+			MQTTLenString value;	/**< only for user properties */
+		};
+	} value;
+} MQTTProperty;
+
+/**
+ * A list of properties in an array of the caller, nothing is allocated.
+ */
+typedef struct
+{
+	int count;			/**< number of properties in the array */
+	int max_count;		/**< size of the array */
+	int length;			/**< serialized length, without the length field itself */
+	MQTTProperty* array;
+} MQTTProperties;
+
+#define MQTTProperties_initializer {0, 0, 0, NULL}
+
+/* returns the MQTTPropertyTypes of an identifier, -1 if unknown */
+int MQTTProperty_getType(int identifier);
+
+/* serialized length of the properties including the length field */
+int MQTTProperties_len(MQTTProperties* props);
+
+/* appends a property, returns 0 on success, -1 if the array is full or the identifier is unknown */
+int MQTTProperties_add(MQTTProperties* props, MQTTProperty* prop);
+
+/* writes the length field and the properties, returns the number of bytes written */
+int MQTTProperties_write(unsigned char** pptr, MQTTProperties* properties);
+
+/* reads the length field and the properties, the ones that do not fit into the array are
+   skipped. properties may be NULL to skip all. Returns 1 if successful, 0 if not */
+int MQTTProperties_read(MQTTProperties* properties, unsigned char** pptr, unsigned char* enddata);
+
+/* returns the property with the identifier, NULL if it is not in the list */
+MQTTProperty* MQTTProperties_get(MQTTProperties* props, int identifier);
+
+#ifdef __cplusplus /* If this is a C++ compiler, use C linkage */
+}
+#endif
+
+#endif /* MQTTPROPERTIES_H_ */
@@ -47,7 +47,7 @@ int MQTTDeserialize_subscribe(unsigned char* dup, unsigned short* packetid, int
 		goto exit;
 	*dup = header.bits.dup;
 
-	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
 	enddata = curdata + mylen;
 
 	*packetid = readInt(&curdata);
@@ -55,6 +55,8 @@ int MQTTDeserialize_subscribe(unsigned char* dup, unsigned short* packetid, int
 	*count = 0;
 	while (curdata < enddata)
 	{
+		if (*count >= maxcount) /* more filters than the caller can take */
+			goto exit;
 		if (!readMQTTLenString(&topicFilters[*count], &curdata, enddata))
 			goto exit;
 		if (curdata >= enddata) /* do we have enough data to read the req_qos version byte? */
@@ -0,0 +1,422 @@
+/*******************************************************************************
+ * Copyright (c) 2019
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    MQTT v5 packets for MQTTThreadedClient
+ *******************************************************************************/
+
+#include "MQTTV5Packet.h"
+#include "StackTrace.h"
+
+#include <string.h>
+
+
+/**
+  * Serializes the connect options and properties into the buffer as MQTT v5 CONNECT.
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param options the options to be used to build the connect packet
+  * @param connectProperties the CONNECT properties, may be NULL
+  * @param willProperties the will properties, may be NULL
+  * @return serialized length, or error if 0
+  */
+int MQTTV5Serialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData* options,
+		MQTTProperties* connectProperties, MQTTProperties* willProperties)
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+	MQTTConnectFlags flags = {0};
+	int len = 0;
+	int rc = -1;
+
+	FUNC_ENTRY;
+	len = 10 + MQTTProperties_len(connectProperties) + MQTTstrlen(options->clientID) + 2;
+	if (options->willFlag)
+		len += MQTTProperties_len(willProperties) + MQTTstrlen(options->will.topicName) + 2 + MQTTstrlen(options->will.message) + 2;
+	if (options->username.cstring || options->username.lenstring.data)
+		len += MQTTstrlen(options->username) + 2;
+	if (options->password.cstring || options->password.lenstring.data)
+		len += MQTTstrlen(options->password) + 2;
+
+	if (MQTTPacket_len(len) > buflen)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.byte = 0;
+	header.bits.type = CONNECT;
+	writeChar(&ptr, header.byte); /* write header */
+
+	ptr += MQTTPacket_encode(ptr, len); /* write remaining length */
+
+	writeCString(&ptr, "MQTT");
+	writeChar(&ptr, (char) 5);
+
+	flags.all = 0;
+	flags.bits.cleansession = options->cleansession;
+	flags.bits.will = (options->willFlag) ? 1 : 0;
+	if (flags.bits.will)
+	{
+		flags.bits.willQoS = options->will.qos;
+		flags.bits.willRetain = options->will.retained;
+	}
+
+	if (options->username.cstring || options->username.lenstring.data)
+		flags.bits.username = 1;
+	if (options->password.cstring || options->password.lenstring.data)
+		flags.bits.password = 1;
+
+	writeChar(&ptr, flags.all);
+	writeInt(&ptr, options->keepAliveInterval);
+	MQTTProperties_write(&ptr, connectProperties);
+	writeMQTTString(&ptr, options->clientID);
+	if (options->willFlag)
+	{
+		MQTTProperties_write(&ptr, willProperties);
+		writeMQTTString(&ptr, options->will.topicName);
+		writeMQTTString(&ptr, options->will.message);
+	}
+	if (flags.bits.username)
+		writeMQTTString(&ptr, options->username);
+	if (flags.bits.password)
+		writeMQTTString(&ptr, options->password);
+
+	rc = ptr - buf;
+
+	exit: FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Deserializes the supplied (wire) buffer into connack data - reason code and properties
+  * @param connackProperties the returned properties, may be NULL
+  * @param sessionPresent the session present flag returned
+  * @param connack_rc returned integer value of the connack reason code
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @return error code.  1 is success, 0 is failure
+  */
+int MQTTV5Deserialize_connack(MQTTProperties* connackProperties, unsigned char* sessionPresent,
+		unsigned char* connack_rc, unsigned char* buf, int buflen)
+{
+	MQTTHeader header = {0};
+	unsigned char* curdata = buf;
+	unsigned char* enddata = NULL;
+	int rc = 0;
+	int mylen;
+	MQTTConnackFlags flags = {0};
+
+	FUNC_ENTRY;
+	header.byte = readChar(&curdata);
+	if (header.bits.type != CONNACK)
+		goto exit;
+
+	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
+	enddata = curdata + mylen;
+	if (enddata - curdata < 2 || enddata > buf + buflen)
+		goto exit;
+
+	flags.all = readChar(&curdata);
+	*sessionPresent = flags.bits.sessionpresent;
+	*connack_rc = readChar(&curdata);
+
+	rc = MQTTProperties_read(connackProperties, &curdata, enddata);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Serializes the supplied publish data into the supplied buffer, ready for sending
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param topicName MQTTString - the MQTT topic in the publish, empty if a topic alias is used
+  * @param properties the PUBLISH properties, may be NULL
+  * @param payload byte buffer - the MQTT publish payload
+  * @param payloadlen integer - the length of the MQTT payload
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTV5Serialize_publish(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+		unsigned short packetid, MQTTString topicName, MQTTProperties* properties, unsigned char* payload, int payloadlen)
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+	int rem_len = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	rem_len = 2 + MQTTstrlen(topicName) + MQTTProperties_len(properties) + payloadlen;
+	if (qos > 0)
+		rem_len += 2; /* packetid */
+	if (MQTTPacket_len(rem_len) > buflen)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.bits.type = PUBLISH;
+	header.bits.dup = dup;
+	header.bits.qos = qos;
+	header.bits.retain = retained;
+	writeChar(&ptr, header.byte); /* write header */
+
+	ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */;
+
+	writeMQTTString(&ptr, topicName);
+
+	if (qos > 0)
+		writeInt(&ptr, packetid);
+
+	MQTTProperties_write(&ptr, properties);
+
+	memcpy(ptr, payload, payloadlen);
+	ptr += payloadlen;
+
+	rc = ptr - buf;
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Deserializes the supplied (wire) buffer into publish data
+  * @param properties returned PUBLISH properties, may be NULL
+  * @return error code.  1 is success
+  * @see MQTTDeserialize_publish for the other parameters
+  */
+int MQTTV5Deserialize_publish(unsigned char* dup, int* qos, unsigned char* retained, unsigned short* packetid,
+		MQTTString* topicName, MQTTProperties* properties, unsigned char** payload, int* payloadlen, unsigned char* buf, int buflen)
+{
+	MQTTHeader header = {0};
+	unsigned char* curdata = buf;
+	unsigned char* enddata = NULL;
+	int rc = 0;
+	int mylen = 0;
+
+	FUNC_ENTRY;
+	header.byte = readChar(&curdata);
+	if (header.bits.type != PUBLISH)
+		goto exit;
+	*dup = header.bits.dup;
+	*qos = header.bits.qos;
+	*retained = header.bits.retain;
+
+	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
+	enddata = curdata + mylen;
+	if (enddata > buf + buflen)
+		goto exit;
+
+	if (!readMQTTLenString(topicName, &curdata, enddata))
+		goto exit;
+
+	if (*qos > 0)
+	{
+		if (enddata - curdata < 2)
+			goto exit;
+		*packetid = readInt(&curdata);
+	}
+
+	/* the property length is not optional in a PUBLISH */
+	if (curdata >= enddata || !MQTTProperties_read(properties, &curdata, enddata))
+		goto exit;
+
+	*payloadlen = enddata - curdata;
+	*payload = curdata;
+	rc = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Serializes a PUBACK, PUBREC, PUBREL or PUBCOMP with reason code and properties.
+  * The short form of a successful ack without properties is used if possible.
+  * @return serialized length, or error if 0
+  */
+int MQTTV5Serialize_ack(unsigned char* buf, int buflen, unsigned char packettype, unsigned char dup, unsigned short packetid,
+		unsigned char reasonCode, MQTTProperties* properties)
+{
+	MQTTHeader header = {0};
+	unsigned char *ptr = buf;
+	int rem_len = 2;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (reasonCode != MQTTREASONCODE_SUCCESS || (properties && properties->count > 0))
+		rem_len += 1 + MQTTProperties_len(properties);
+	if (MQTTPacket_len(rem_len) > buflen)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.bits.type = packettype;
+	header.bits.dup = dup;
+	header.bits.qos = (packettype == PUBREL) ? 1 : 0;
+	writeChar(&ptr, header.byte); /* write header */
+
+	ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */
+	writeInt(&ptr, packetid);
+	if (rem_len > 2)
+	{
+		writeChar(&ptr, reasonCode);
+		MQTTProperties_write(&ptr, properties);
+	}
+	rc = ptr - buf;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Deserializes the supplied (wire) buffer into an ack
+  * @param reasonCode returned reason code, MQTTREASONCODE_SUCCESS for the short form
+  * @param properties returned properties, may be NULL
+  * @return error code.  1 is success, 0 is failure
+  * @see MQTTDeserialize_ack for the other parameters
+  */
+int MQTTV5Deserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned short* packetid,
+		unsigned char* reasonCode, MQTTProperties* properties, unsigned char* buf, int buflen)
+{
+	MQTTHeader header = {0};
+	unsigned char* curdata = buf;
+	unsigned char* enddata = NULL;
+	int rc = 0;
+	int mylen;
+
+	FUNC_ENTRY;
+	header.byte = readChar(&curdata);
+	*dup = header.bits.dup;
+	*packettype = header.bits.type;
+
+	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
+	enddata = curdata + mylen;
+
+	if (enddata - curdata < 2 || enddata > buf + buflen)
+		goto exit;
+	*packetid = readInt(&curdata);
+
+	*reasonCode = MQTTREASONCODE_SUCCESS;
+	if (curdata < enddata)
+		*reasonCode = readChar(&curdata);
+
+	rc = MQTTProperties_read(properties, &curdata, enddata);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Serializes the supplied subscribe data into the supplied buffer, ready for sending
+  * @param properties the SUBSCRIBE properties, may be NULL
+  * @param options array of subscription options, the requested QoS in bits 0-1
+  * @return the length of the serialized data.  <= 0 indicates error
+  * @see MQTTSerialize_subscribe for the other parameters
+  */
+int MQTTV5Serialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[], unsigned char options[])
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+	int rem_len = 2 + MQTTProperties_len(properties);
+	int rc = 0;
+	int i = 0;
+
+	FUNC_ENTRY;
+	for (i = 0; i < count; ++i)
+		rem_len += 2 + MQTTstrlen(topicFilters[i]) + 1; /* length + topic + options */
+
+	if (MQTTPacket_len(rem_len) > buflen)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.byte = 0;
+	header.bits.type = SUBSCRIBE;
+	header.bits.dup = dup;
+	header.bits.qos = 1;
+	writeChar(&ptr, header.byte); /* write header */
+
+	ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */;
+
+	writeInt(&ptr, packetid);
+	MQTTProperties_write(&ptr, properties);
+
+	for (i = 0; i < count; ++i)
+	{
+		writeMQTTString(&ptr, topicFilters[i]);
+		writeChar(&ptr, options[i]);
+	}
+
+	rc = ptr - buf;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Deserializes the supplied (wire) buffer into suback data
+  * @param properties returned properties, may be NULL
+  * @param reasonCodes returned array of reason codes, the granted QoS or >= 0x80
+  * @return error code.  1 is success, 0 is failure
+  * @see MQTTDeserialize_suback for the other parameters
+  */
+int MQTTV5Deserialize_suback(unsigned short* packetid, MQTTProperties* properties,
+		int maxcount, int* count, int reasonCodes[], unsigned char* buf, int buflen)
+{
+	MQTTHeader header = {0};
+	unsigned char* curdata = buf;
+	unsigned char* enddata = NULL;
+	int rc = 0;
+	int mylen;
+
+	FUNC_ENTRY;
+	header.byte = readChar(&curdata);
+	if (header.bits.type != SUBACK)
+		goto exit;
+
+	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
+	enddata = curdata + mylen;
+	if (enddata - curdata < 2 || enddata > buf + buflen)
+		goto exit;
+
+	*packetid = readInt(&curdata);
+	if (!MQTTProperties_read(properties, &curdata, enddata))
+		goto exit;
+
+	*count = 0;
+	while (curdata < enddata)
+	{
+		if (*count >= maxcount)
+			goto exit;
+		reasonCodes[(*count)++] = (unsigned char) readChar(&curdata);
+	}
+
+	rc = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
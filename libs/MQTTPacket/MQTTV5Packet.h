@@ -0,0 +1,64 @@
+/*******************************************************************************
+ * Copyright (c) 2019
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    MQTT v5 packets for MQTTThreadedClient
+ *******************************************************************************/
+
+#ifndef MQTTV5PACKET_H_
+#define MQTTV5PACKET_H_
+
+#if defined(__cplusplus) /* If this is a C++ compiler, use C linkage */
+extern "C" {
+#endif
+
+#include "MQTTPacket.h"
+#include "MQTTProperties.h"
+
+/* reason codes >= 0x80 are errors */
+#define MQTTREASONCODE_SUCCESS 0x00
+#define MQTTREASONCODE_NO_MATCHING_SUBSCRIBERS 0x10
+#define MQTTREASONCODE_UNSPECIFIED_ERROR 0x80
+#define MQTTREASONCODE_TOPIC_ALIAS_INVALID 0x94
+#define MQTTREASONCODE_RECEIVE_MAXIMUM_EXCEEDED 0x93
+
+/*
+ * The properties are passed in MQTTProperties, NULL writes an empty list.
+ * Connect options with MQTTVersion 5 are serialized as v5 CONNECT,
+ * cleansession is the Clean Start flag.
+ */
+DLLExport int MQTTV5Serialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData* options,
+		MQTTProperties* connectProperties, MQTTProperties* willProperties);
+DLLExport int MQTTV5Deserialize_connack(MQTTProperties* connackProperties, unsigned char* sessionPresent,
+		unsigned char* connack_rc, unsigned char* buf, int buflen);
+
+DLLExport int MQTTV5Serialize_publish(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+		unsigned short packetid, MQTTString topicName, MQTTProperties* properties, unsigned char* payload, int payloadlen);
+DLLExport int MQTTV5Deserialize_publish(unsigned char* dup, int* qos, unsigned char* retained, unsigned short* packetid,
+		MQTTString* topicName, MQTTProperties* properties, unsigned char** payload, int* payloadlen, unsigned char* buf, int buflen);
+
+DLLExport int MQTTV5Serialize_ack(unsigned char* buf, int buflen, unsigned char type, unsigned char dup, unsigned short packetid,
+		unsigned char reasonCode, MQTTProperties* properties);
+DLLExport int MQTTV5Deserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned short* packetid,
+		unsigned char* reasonCode, MQTTProperties* properties, unsigned char* buf, int buflen);
+
+/* the subscription options carry the QoS in bits 0-1 */
+DLLExport int MQTTV5Serialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[], unsigned char options[]);
+DLLExport int MQTTV5Deserialize_suback(unsigned short* packetid, MQTTProperties* properties,
+		int maxcount, int* count, int reasonCodes[], unsigned char* buf, int buflen);
+
+#ifdef __cplusplus /* If this is a C++ compiler, use C linkage */
+}
+#endif
+
+#endif /* MQTTV5PACKET_H_ */
@@ -16,7 +16,17 @@
 
 #define INFO(x, ...) printf("[WebSocket : INFO]" x "\r\n", ##__VA_ARGS__); 
 
+#define RX_MASK (WEBSOCKET_CLIENT_RX_BUFFER_SIZE - 1)
+
 Websocket::Websocket(char * url, NetworkInterface * iface) {
+    MBED_STATIC_ASSERT((WEBSOCKET_CLIENT_RX_BUFFER_SIZE & RX_MASK) == 0, "WEBSOCKET_CLIENT_RX_BUFFER_SIZE must be a power of 2");
+
+    connected = false;
+    rxHead = 0;
+    rxTail = 0;
+    rxInFrame = false;
+    rxMessageLen = 0;
+    rxMessageOpcode = OP_CONT;
     fillFields(url);
     socket.open(iface);
     socket.set_timeout(400);
@@ -129,178 +139,324 @@ bool Websocket::connect() {
         return false;
     }
 
-    // sent http header to upgrade to the ws protocol
-    sprintf(cmd, "GET %s HTTP/1.1\r\n", path);
-    write(cmd, strlen(cmd));
-    
-    sprintf(cmd, "Host: %s:%d\r\n", host, port);
-    write(cmd, strlen(cmd));
-
-    sprintf(cmd, "Upgrade: WebSocket\r\n");
-    write(cmd, strlen(cmd));
-
-    sprintf(cmd, "Connection: Upgrade\r\n");
-    write(cmd, strlen(cmd));
-
-    sprintf(cmd, "Sec-WebSocket-Key: L159VM0TWUzyDxwJEIEzjw==\r\n");
-    write(cmd, strlen(cmd));
-
-    sprintf(cmd, "Sec-WebSocket-Version: 13\r\n\r\n");
-    int ret = write(cmd, strlen(cmd));
-    if (ret != strlen(cmd)) {
+    // sent http header to upgrade to the ws protocol, one TCP segment
+    int len = snprintf(cmd, sizeof(cmd),
+                       "GET %s HTTP/1.1\r\n"
+                       "Host: %s:%d\r\n"
+                       "Upgrade: WebSocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: L159VM0TWUzyDxwJEIEzjw==\r\n"
+                       "Sec-WebSocket-Version: 13\r\n\r\n", path, host, port);
+    int ret = write(cmd, len);
+    if (ret != len) {
         close();
         ERR("Could not send request");
         return false;
     }
 
-    ret = read(cmd, 200, 100);
-    if (ret < 0) {
-        close();
-        ERR("Could not receive answer\r\n");
-        return false;
+    // read the response header, data behind it belongs to the first frames
+    rxHead = 0;
+    rxTail = 0;
+    rxInFrame = false;
+    rxMessageLen = 0;
+    char* end = NULL;
+    len = 0;
+    while (end == NULL) {
+        ret = read(cmd + len, sizeof(cmd) - 1 - len, 1);
+        if (ret <= 0) {
+            close();
+            ERR("Could not receive answer\r\n");
+            return false;
+        }
+        len += ret;
+        cmd[len] = '\0';
+        end = strstr(cmd, "\r\n\r\n");
+        if ((end == NULL) && (len >= (int)sizeof(cmd) - 1)) {
+            break;
+        }
     }
-
-    cmd[ret] = '\0';
     DBG("recv: %s\r\n", cmd);
 
-    if ( strstr(cmd, "DdLWT/1JcX+nQFHebYP+rqEx5xI=") == NULL ) {
+    if ((end == NULL) || (strstr(cmd, "DdLWT/1JcX+nQFHebYP+rqEx5xI=") == NULL)) {
         ERR("Wrong answer from server, got \"%s\" instead\r\n", cmd);
-        do {
-            ret = read(cmd, 200, 100);
-            if (ret < 0) {
-                ERR("Could not receive answer\r\n");
-                return false;
-            }
-            cmd[ret] = '\0';
-        } while (ret > 0);
         close();
         return false;
     }
 
+    end += 4;
+    while (end < cmd + len) {
+        rxBuffer[rxTail++ & RX_MASK] = *end++;
+    }
+    connected = true;
+
     INFO("\r\nhost: %s\r\npath: %s\r\nport: %d\r\n\r\n", host, path, port);
     return true;
 }
 
-int Websocket::sendLength(uint32_t len, char * msg) {
+/*
+ * client frames must be masked, the mask key is 0 so the payload is sent unmodified
+ */
+int Websocket::createHeader(uint8_t * header, uint8_t opcode, size_t len) {
+    int idx = 0;
 
+    header[idx++] = 0x80 | (opcode & 0x0f);
     if (len < 126) {
-        msg[0] = len | (1<<7);
-        return 1;
-    } else if (len < 65535) {
-        msg[0] = 126 | (1<<7);
-        msg[1] = (len >> 8) & 0xff;
-        msg[2] = len & 0xff;
-        return 3;
+        header[idx++] = len | (1<<7);
+    } else if (len < 65536) {
+        header[idx++] = 126 | (1<<7);
+        header[idx++] = (len >> 8) & 0xff;
+        header[idx++] = len & 0xff;
     } else {
-        msg[0] = 127 | (1<<7);
-        for (int i = 0; i < 8; i++) {
-            msg[i+1] = (len >> i*8) & 0xff;
+        header[idx++] = 127 | (1<<7);
+        for (int i = 7; i >= 0; i--) {
+            header[idx++] = ((uint64_t)len >> i*8) & 0xff;
         }
-        return 9;
     }
-}
+    for (int i = 0; i < 4; i++) {
+        header[idx++] = 0;
+    }
 
-int Websocket::readChar(char * pC, bool block) {
-    return read(pC, 1, 1);
+    return idx;
 }
 
-int Websocket::sendOpcode(uint8_t opcode, char * msg) {
-    msg[0] = 0x80 | (opcode & 0x0f);
-    return 1;
+int Websocket::send(char * str) {
+    return send(str, strlen(str), OP_TEXT);
 }
 
-int Websocket::sendMask(char * msg) {
-    for (int i = 0; i < 4; i++) {
-        msg[i] = 0;
+int Websocket::send(const void * data, size_t len, Opcode opcode) {
+    int res;
+
+    txMutex.lock();
+    int headerLen = createHeader(txBuffer, opcode, len);
+    if (len <= WEBSOCKET_CLIENT_TX_COALESCE_SIZE) {
+        memcpy(txBuffer + headerLen, data, len);
+        res = write((char*)txBuffer, headerLen + len);
+        res = (res == (int)(headerLen + len)) ? (int)len : -1;
+    } else {
+        res = write((char*)txBuffer, headerLen);
+        if (res == headerLen) {
+            res = write((const char*)data, len);
+            res = (res == (int)len) ? (int)len : -1;
+        } else {
+            res = -1;
+        }
     }
-    return 4;
+    txMutex.unlock();
+
+    return res;
 }
 
-int Websocket::send(char * str) {
-    char msg[strlen(str) + 15];
-    int idx = 0;
-    idx = sendOpcode(0x01, msg);
-    idx += sendLength(strlen(str), msg + idx);
-    idx += sendMask(msg + idx);
-    memcpy(msg+idx, str, strlen(str));
-    int res = write(msg, idx + strlen(str));
+/*
+ * one socket read for all data which is available
+ *
+ * @return number of bytes received, 0 on timeout, -1 if closed
+ */
+int Websocket::fillRxBuffer(int timeout_ms) {
+    uint32_t used = rxTail - rxHead;
+    uint32_t space = WEBSOCKET_CLIENT_RX_BUFFER_SIZE - used;
+    uint32_t contiguous = WEBSOCKET_CLIENT_RX_BUFFER_SIZE - (rxTail & RX_MASK);
+    if (contiguous > space) {
+        contiguous = space;
+    }
+    if (contiguous == 0) {
+        return 0;
+    }
+
+    socket.set_timeout(timeout_ms);
+    nsapi_size_or_error_t res = socket.recv(&rxBuffer[rxTail & RX_MASK], contiguous);
+    if (res == NSAPI_ERROR_WOULD_BLOCK) {
+        return 0;
+    }
+    if (res <= 0) {
+        connected = false;
+        return -1;
+    }
+    rxTail += res;
+
     return res;
 }
 
+/*
+ * decode the next frame header if it is complete in the ring buffer
+ */
+bool Websocket::decodeHeader() {
+    uint32_t used = rxTail - rxHead;
+    if (used < 2) {
+        return false;
+    }
 
-bool Websocket::read(char * message) {
-    int i = 0;
-    uint32_t len_msg;
-    char opcode = 0;
-    char c;
-    char mask[4] = {0, 0, 0, 0};
-    bool is_masked = false;
-    Timer tmr;
+    uint8_t b0 = rxBuffer[rxHead & RX_MASK];
+    uint8_t b1 = rxBuffer[(rxHead + 1) & RX_MASK];
+    uint32_t headerLen = 2;
+    uint64_t len = b1 & 0x7f;
+    bool masked = (b1 & 0x80) != 0;
 
-    // read the opcode
-    tmr.start();
-    while (true) {
-        if (tmr.read() > 3) {
-            DBG("timeout ws\r\n");
-            return false;
+    if (len == 126) {
+        headerLen += 2;
+    } else if (len == 127) {
+        headerLen += 8;
+    }
+    if (masked) {
+        headerLen += 4;
+    }
+    if (used < headerLen) {
+        return false;
+    }
+
+    uint32_t idx = rxHead + 2;
+    if (len >= 126) {
+        int n = (len == 126) ? 2 : 8;
+        len = 0;
+        for (int i = 0; i < n; i++) {
+            len = (len << 8) | rxBuffer[idx++ & RX_MASK];
         }
+    }
+    for (int i = 0; i < 4; i++) {
+        rxMaskKey[i] = masked ? rxBuffer[idx++ & RX_MASK] : 0;
+    }
+    rxHead += headerLen;
+
+    rxFin = (b0 & 0x80) != 0;
+    rxOpcode = b0 & 0x0f;
+    rxRemaining = len;
+    rxMasked = masked;
+    rxMaskPos = 0;
+    rxControlLen = 0;
+    rxInFrame = true;
+
+    if ((rxOpcode == OP_TEXT) || (rxOpcode == OP_BINARY)) {
+        rxMessageOpcode = rxOpcode;             // first fragment of a message
+        rxMessageLen = 0;
+    }
 
-        socket.set_timeout(1);
-        if (socket.recv(&opcode, 1) != 1) {
-            socket.set_timeout(2000);
-            return false;
+    return true;
+}
+
+/*
+ * copy payload of the current frame from the ring buffer
+ */
+size_t Websocket::readPayload(uint8_t * buf, size_t len) {
+    size_t done = 0;
+
+    while ((done < len) && (rxRemaining > 0) && (rxTail != rxHead)) {
+        uint32_t n = rxTail - rxHead;
+        uint32_t contiguous = WEBSOCKET_CLIENT_RX_BUFFER_SIZE - (rxHead & RX_MASK);
+        if (n > contiguous) {
+            n = contiguous;
+        }
+        if (n > len - done) {
+            n = len - done;
         }
+        if (n > rxRemaining) {
+            n = rxRemaining;
+        }
+
+        memcpy(buf + done, &rxBuffer[rxHead & RX_MASK], n);
+        if (rxMasked) {
+            for (uint32_t i = 0; i < n; i++) {
+                buf[done + i] ^= rxMaskKey[rxMaskPos++ & 3];
+            }
+        }
+        rxHead += n;
+        rxRemaining -= n;
+        done += n;
+    }
 
-        socket.set_timeout(2000);
+    return done;
+}
 
-        if (opcode == 0x81)
+void Websocket::discardPayload() {
+    uint32_t n = rxTail - rxHead;
+    if (n > rxRemaining) {
+        n = rxRemaining;
+    }
+    rxHead += n;
+    rxRemaining -= n;
+}
+
+/*
+ * @return false if the connection was closed by the server
+ */
+bool Websocket::handleControlFrame() {
+    switch (rxOpcode) {
+        case OP_PING:
+            send(rxControl, rxControlLen, OP_PONG);
+            break;
+        case OP_CLOSE:
+            // echo the status code and close
+            send(rxControl, rxControlLen >= 2 ? 2 : 0, OP_CLOSE);
+            close();
+            return false;
+        default:
             break;
     }
-    DBG("opcode: 0x%X\r\n", opcode);
-
-    readChar(&c);
-    len_msg = c & 0x7f;
-    is_masked = c & 0x80;
-    if (len_msg == 126) {
-        readChar(&c);
-        len_msg = c << 8;
-        readChar(&c);
-        len_msg += c;
-    } else if (len_msg == 127) {
-        len_msg = 0;
-        for (int i = 0; i < 8; i++) {
-            readChar(&c);
-            len_msg += (c << (7-i)*8);
+    return true;
+}
+
+int Websocket::readMessage(uint8_t * buf, size_t size, Opcode * opcode, int timeout_ms) {
+    Timer tmr;
+    tmr.start();
+
+    while (true) {
+        if (!rxInFrame && !decodeHeader()) {
+            // header incomplete, need more data
+        } else if (rxOpcode & 0x08) {
+            // control frame, max. 125 bytes, can come between fragments
+            if (rxRemaining > sizeof(rxControl) - rxControlLen) {
+                ERR("control frame too long");
+                close();
+                return -1;
+            }
+            rxControlLen += readPayload(rxControl + rxControlLen, sizeof(rxControl) - rxControlLen);
+            if (rxRemaining == 0) {
+                rxInFrame = false;
+                if (!handleControlFrame()) {
+                    return -1;
+                }
+                continue;
+            }
+        } else {
+            rxMessageLen += readPayload(buf + rxMessageLen, size - rxMessageLen);
+            if (rxMessageLen == size) {
+                discardPayload();               // truncate
+            }
+            if (rxRemaining == 0) {
+                rxInFrame = false;
+                if (rxFin) {
+                    size_t len = rxMessageLen;
+                    rxMessageLen = 0;
+                    *opcode = (Opcode)rxMessageOpcode;
+                    return len;
+                }
+                continue;
+            }
         }
-    }
 
-    if (len_msg == 0) {
-        return false;
-    }
-    DBG("length: %d\r\n", len_msg);
-    
-    if (is_masked) {
-        for (i = 0; i < 4; i++) {
-          readChar(&c);
-          mask[i] = c;
+        int remaining_ms = timeout_ms - tmr.read_ms();
+        if (remaining_ms <= 0) {
+            return 0;
+        }
+        if (fillRxBuffer(remaining_ms) < 0) {
+            return -1;
         }
     }
+}
 
-    int nb = read(message, len_msg, len_msg);
-    if (nb != len_msg)
-        return false;
+bool Websocket::read(char * message) {
+    Opcode opcode;
 
-    for (i = 0; i < len_msg; i++) {
-        message[i] = message[i] ^ mask[i % 4];
+    int len = readMessage((uint8_t*)message, WEBSOCKET_CLIENT_MAX_MESSAGE_SIZE, &opcode);
+    if ((len <= 0) || (opcode != OP_TEXT)) {
+        return false;
     }
-
-    message[len_msg] = '\0';
+    message[len] = '\0';
 
     return true;
 }
 
 bool Websocket::close() {
 
+    connected = false;
     int ret = socket.close();
     if (ret < 0) {
         ERR("Could not disconnect");
@@ -313,7 +469,7 @@ char* Websocket::getPath() {
     return path;
 }
 
-int Websocket::write(char * str, int len) {
+int Websocket::write(const char * str, int len) {
     int res = 0, idx = 0;
     
     for (int j = 0; j < MAX_TRY_WRITE; j++) {
@@ -333,14 +489,16 @@ int Websocket::write(char * str, int len) {
 int Websocket::read(char * str, int len, int min_len) {
     int res = 0, idx = 0;
     
-    for (int j = 0; j < MAX_TRY_WRITE; j++) {
+    for (int j = 0; j < MAX_TRY_READ; j++) {
 
         if ((res = socket.recv(str + idx, len - idx)) < 0)
           continue;
+        if (res == 0)
+          break;
 
         idx += res;
         
-        if (idx == len || (min_len != -1 && idx > min_len))
+        if (idx == len || (min_len != -1 && idx >= min_len))
             return idx;
     }
     
@@ -33,7 +33,26 @@
 
 #include "mbed.h"
 
+// size of the receive ring buffer, must be a power of 2
+#ifndef WEBSOCKET_CLIENT_RX_BUFFER_SIZE
+#define WEBSOCKET_CLIENT_RX_BUFFER_SIZE (1024)
+#endif
+
+// payloads up to this size are copied behind the header and sent with one socket send
+#ifndef WEBSOCKET_CLIENT_TX_COALESCE_SIZE
+#define WEBSOCKET_CLIENT_TX_COALESCE_SIZE (128)
+#endif
+
+// max. message size of read(char* message)
+#ifndef WEBSOCKET_CLIENT_MAX_MESSAGE_SIZE
+#define WEBSOCKET_CLIENT_MAX_MESSAGE_SIZE (512)
+#endif
+
 /** Websocket client Class.
+ *
+ * Received data is collected in a ring buffer with as few socket reads as
+ * possible and decoded by a streaming frame decoder: text and binary frames,
+ * fragmented messages, extended payload lengths and ping/pong.
  *
  * Example (ethernet network):
  * @code
@@ -43,15 +62,15 @@
  *
  * int main() {
  *    EthernetInterface eth;
- *    eth.init(); //Use DHCP
  *    eth.connect();
- *    printf("IP Address is %s\n\r", eth.getIPAddress());
+ *    printf("IP Address is %s\n\r", eth.get_ip_address());
  *   
- *    Websocket ws("ws://sockets.mbed.org:443/ws/demo/rw");
+ *    Websocket ws("ws://sockets.mbed.org:443/ws/demo/rw", &eth);
  *    ws.connect();
  *   
  *    while (1) {
  *        int res = ws.send("WebSocket Hello World!");
+ *        res = ws.send(samples, sizeof(samples), Websocket::OP_BINARY);
  *
  *        if (ws.read(recv)) {
  *            printf("rcv: %s\r\n", recv);
@@ -66,6 +85,15 @@
 class Websocket
 {
     public:
+        enum Opcode {
+            OP_CONT     = 0x0,
+            OP_TEXT     = 0x1,
+            OP_BINARY   = 0x2,
+            OP_CLOSE    = 0x8,
+            OP_PING     = 0x9,
+            OP_PONG     = 0xA
+        };
+
         /**
         * Constructor
         *
@@ -90,14 +118,41 @@ class Websocket
         int send(char * str);
 
         /**
-        * Read a websocket message
+        * Send a message, the payload is not copied unless it is small enough
+        * to go out with the header in one socket send
         *
-        * @param message pointer to the string to be read (null if drop frame)
+        * @param data payload, not modified (the client uses a zero mask key)
+        * @param len length of the payload
+        * @param opcode OP_TEXT, OP_BINARY or a control opcode
         *
-        * @return true if a websocket frame has been read
+        * @returns the number of payload bytes sent, -1 on error
+        */
+        int send(const void * data, size_t len, Opcode opcode = OP_BINARY);
+
+        /**
+        * Read a websocket text message
+        *
+        * @param message pointer to the string to be read, at least WEBSOCKET_CLIENT_MAX_MESSAGE_SIZE + 1 bytes
+        *
+        * @return true if a websocket text message has been read
         */
         bool read(char * message);
 
+        /**
+        * Read a complete message, fragments are joined. Pings are answered
+        * and pongs are dropped while waiting.
+        * If the timeout expires in the middle of a message, call it again
+        * with the same buffer to continue.
+        *
+        * @param buf buffer for the payload, longer messages are truncated
+        * @param size size of buf
+        * @param opcode receives OP_TEXT or OP_BINARY
+        * @param timeout_ms max. time to wait
+        *
+        * @return length of the message, 0 on timeout, -1 if the connection was closed
+        */
+        int readMessage(uint8_t * buf, size_t size, Opcode * opcode, int timeout_ms = 3000);
+
         /**
         * Close the websocket connection
         *
@@ -105,6 +160,8 @@ class Websocket
         */
         bool close();
 
+        bool isConnected() { return connected; }
+
         /*
         * Accessor: get path from the websocket url
         *
@@ -115,10 +172,12 @@ class Websocket
     private:
         void fillFields(char * url);
         int parseURL(const char* url, char* scheme, size_t maxSchemeLen, char* host, size_t maxHostLen, uint16_t* port, char* path, size_t maxPathLen); //Parse URL
-        int sendOpcode(uint8_t opcode, char * msg);
-        int sendLength(uint32_t len, char * msg);
-        int sendMask(char * msg);
-        int readChar(char * pC, bool block = true);
+        int createHeader(uint8_t * header, uint8_t opcode, size_t len);
+        int fillRxBuffer(int timeout_ms);
+        bool decodeHeader();
+        size_t readPayload(uint8_t * buf, size_t len);
+        void discardPayload();
+        bool handleControlFrame();
         
         char scheme[8];
         uint16_t port;
@@ -126,9 +185,30 @@ class Websocket
         char path[64];
         
         TCPSocket socket;
+        bool connected;
+        Mutex txMutex;
+        uint8_t txBuffer[14 + WEBSOCKET_CLIENT_TX_COALESCE_SIZE];
+
+        // receive ring buffer, head and tail are free running
+        uint8_t rxBuffer[WEBSOCKET_CLIENT_RX_BUFFER_SIZE];
+        uint32_t rxHead;
+        uint32_t rxTail;
+
+        // frame decoder
+        bool rxInFrame;                 // header decoded, payload follows
+        bool rxFin;
+        uint8_t rxOpcode;
+        uint64_t rxRemaining;           // payload bytes left in the current frame
+        bool rxMasked;
+        uint8_t rxMaskKey[4];
+        uint32_t rxMaskPos;
+        uint8_t rxMessageOpcode;        // opcode of the first fragment
+        size_t rxMessageLen;            // bytes of the current message already in the user buffer
+        uint8_t rxControl[125];
+        size_t rxControlLen;
 
         int read(char * buf, int len, int min_len = -1);
-        int write(char * buf, int len);
+        int write(const char * buf, int len);
 };
 
 #endif
@@ -13,36 +13,69 @@
 #define OP_PING		0x9
 #define OP_PONG		0xA
 
-WebSocketConnection::WebSocketConnection(WebSocketServer* server)
+typedef struct {
+	uint8_t buffer[WEBSOCKETS_MAX_HEADER_SIZE + WEBSOCKETS_FRAME_BUFFER_SIZE];
+} FrameBuffer_t;
+
+static MemoryPool<FrameBuffer_t, WEBSOCKETS_FRAME_BUFFER_COUNT> frameBufferPool;
+
+WebSocketConnection::WebSocketConnection(WebSocketServer* server) :
+	mThread(osPriorityNormal, WEBSOCKETS_CONNECTION_STACK_SIZE, nullptr, "WSConnection"),
+	mSemWaitForSocket(0)
 {
 	mServer = server;
+	mConnection = NULL;
+	mHandler = NULL;
+	mHandlerCreated = false;
+	mHandlerOpen = false;
+	mPrevFin = true;
 	_cIsClient = false;
+	mSocketIsOpen = false;
+
+	mThread.start(callback(this, &WebSocketConnection::threadFn));
 }
 
 WebSocketConnection::~WebSocketConnection()
 {
+	mThread.terminate();
+}
+
+void WebSocketConnection::start(TCPSocket *sock)
+{
+	mConnection = sock;
+	mSocketIsOpen = true;
+	mSemWaitForSocket.release();
+}
+
+void WebSocketConnection::threadFn()
+{
+	while (true) {
+		mSemWaitForSocket.acquire();
+		run();
+		mSocketIsOpen = false;			// connection can be reused
+	}
 }
 
 void WebSocketConnection::run()
 {
-	char buf[1024];
+	char* buf = mBuffer;
 	bool isWebSocket = false;
 
 	mConnection->set_blocking(true);
 
 	// while (mConnection->is_connected()) {
 	while (1) {
-		int ret = mConnection->recv(buf, sizeof(buf));
+		int ret = mConnection->recv(buf, sizeof(mBuffer));
 		if (ret == 0) {
-			// printf("No data to receive\r\n");
-			continue;
+			// printf("Closed by peer\r\n");
+			break;
 		}
 		if (ret < 0) {
 			printf("ERROR: Failed to receive %d\r\n", ret);
 			break;
 		}
 		if (!isWebSocket) {
-			if (this->handleHTTP(buf, ret, sizeof(buf))) {
+			if (this->handleHTTP(buf, ret, sizeof(mBuffer))) {
 				isWebSocket = true;
 			} else {
 				printf("ERROR: Non websocket\r\n");
@@ -55,9 +88,23 @@ void WebSocketConnection::run()
 		}
 	}
 	// printf("Closed\r\n");
+	closeHandler();
 	mConnection->close();
 }
 
+void WebSocketConnection::closeHandler()
+{
+	if (mHandler && mHandlerOpen) {
+		mHandler->onClose();
+	}
+	if (mHandlerCreated) {
+		delete mHandler;
+	}
+	mHandler = NULL;
+	mHandlerCreated = false;
+	mHandlerOpen = false;
+}
+
 bool WebSocketConnection::handleHTTP(char* buf, int size, int sizeMax)
 {
 	char* line = &buf[0];
@@ -72,12 +119,8 @@ bool WebSocketConnection::handleHTTP(char* buf, int size, int sizeMax)
     while((0 == strstr(buf, "\r\n\r\n")) && (size < sizeMax) ) {
         int sizeRemaining = sizeMax - size;
         int ret = mConnection->recv(&buf[size], sizeRemaining);
-		if (ret == 0) {
-			// printf("No data to receive\r\n");
-			continue;
-		}
-		if (ret < 0) {
-            return false;       // connection was reset
+		if (ret <= 0) {
+            return false;       // connection was closed or reset
 		}
         size += ret;            // add received data
     }
@@ -94,7 +137,8 @@ bool WebSocketConnection::handleHTTP(char* buf, int size, int sizeMax)
 				char* path = strtok(NULL, " ");
 				char* version = strtok(NULL, " ");
 				// printf("[%s] [%s] [%s]\r\n", method, path, version);
-				mHandler = mServer->getHandler(path);
+				closeHandler();
+				mHandler = mServer->getHandler(path, &mHandlerCreated);
 				if (!mHandler) {
 					printf("ERROR: Handler not found for %s\r\n", path);
 					return false;
@@ -121,6 +165,7 @@ bool WebSocketConnection::handleHTTP(char* buf, int size, int sizeMax)
 		if (mHandler) {
             mHandler->setOrigin(origin);
 			mHandler->onOpen(this);
+			mHandlerOpen = true;
 		}
 		mPrevFin = true;
 		return true;
@@ -142,10 +187,7 @@ bool WebSocketConnection::handleWebSocket(char* buf, int size)
 		return true;
 	}
 	if (opcode == OP_CLOSE) {
-		if (mHandler) {
-			mHandler->onClose();
-		}
-		return false;
+		return false;			// onClose() is called by run()
 	}
 	ptr++;
 
@@ -419,12 +461,10 @@ bool WebSocketConnection::sendFrame( WSopcode_t opcode, uint8_t * payload, size_
         headerSize += 4;
     }
 
-//#ifdef WEBSOCKETS_USE_BIG_MEM
-    // only for ESP since AVR has less HEAP
-    // try to send data in one TCP package (only if some free Heap is there)
-    if(!headerToPayload && ((length > 0) && (length < 1400)) ) { // Todo: && (GET_FREE_HEAP > 6000)) {
+    // try to send data in one TCP package, copy to a preallocated buffer
+    if(!headerToPayload && ((length > 0) && (length <= WEBSOCKETS_FRAME_BUFFER_SIZE)) ) {
         DEBUG_WEBSOCKETS("[WS][sendFrame] pack to one TCP package...\n");
-        uint8_t * dataPtr = (uint8_t *)malloc(length + WEBSOCKETS_MAX_HEADER_SIZE);
+        uint8_t * dataPtr = allocFrameBuffer();
         if(dataPtr) {
             memcpy((dataPtr + WEBSOCKETS_MAX_HEADER_SIZE), payload, length);
             headerToPayload = true;
@@ -432,7 +472,6 @@ bool WebSocketConnection::sendFrame( WSopcode_t opcode, uint8_t * payload, size_
             payloadPtr      = dataPtr;
         }
     }
-//#endif
 
     // set Header Pointer
     if(headerToPayload) {
@@ -489,11 +528,21 @@ bool WebSocketConnection::sendFrame( WSopcode_t opcode, uint8_t * payload, size_
 
     //DEBUG_WEBSOCKETS("[WS][sendFrame] sending Frame Done (%luus).\n", (micros() - start));
 
-//#ifdef WEBSOCKETS_USE_BIG_MEM
     if(useInternBuffer && payloadPtr) {
-        free(payloadPtr);
+        freeFrameBuffer(payloadPtr);
     }
-//#endif
 
     return ret;
 }
+
+/**
+ * @return buffer of WEBSOCKETS_MAX_HEADER_SIZE + WEBSOCKETS_FRAME_BUFFER_SIZE bytes, NULL if all are in use
+ */
+uint8_t* WebSocketConnection::allocFrameBuffer() {
+    FrameBuffer_t* frameBuffer = frameBufferPool.alloc();
+    return frameBuffer ? frameBuffer->buffer : NULL;
+}
+
+void WebSocketConnection::freeFrameBuffer(uint8_t* buffer) {
+    frameBufferPool.free((FrameBuffer_t*)buffer);
+}
@@ -13,6 +13,25 @@
 // max size of the WS Message Header
 #define WEBSOCKETS_MAX_HEADER_SIZE (14)
 
+// max payload of a preallocated frame buffer, larger frames are sent in two parts
+#ifndef WEBSOCKETS_FRAME_BUFFER_SIZE
+#define WEBSOCKETS_FRAME_BUFFER_SIZE (512)
+#endif
+
+// stack of the connection thread, the receive buffer is a member
+#ifndef WEBSOCKETS_CONNECTION_STACK_SIZE
+#define WEBSOCKETS_CONNECTION_STACK_SIZE (2 * 1024)
+#endif
+
+#ifndef WEBSOCKETS_RECEIVE_BUFFER_SIZE
+#define WEBSOCKETS_RECEIVE_BUFFER_SIZE (1024)
+#endif
+
+// number of preallocated frame buffers
+#ifndef WEBSOCKETS_FRAME_BUFFER_COUNT
+#define WEBSOCKETS_FRAME_BUFFER_COUNT (4)
+#endif
+
 typedef enum {
     WSC_NOT_CONNECTED,
     WSC_HEADER,
@@ -68,6 +87,11 @@ public:
     WebSocketConnection(WebSocketServer* server);
     virtual ~WebSocketConnection();
 
+    // serve sock in the thread of this connection
+    void start(TCPSocket *sock);
+    bool isIdle() { return !mSocketIsOpen; };
+
+    // serve the connection in the calling thread
     void run();
     //TCPSocket& getTCPSocketConnection() { return mConnection; }
     void setTCPSocketConnection(TCPSocket *sock) { mConnection = sock; }
@@ -76,18 +100,32 @@ public:
     bool sendFrameHeader(WSopcode_t opcode, size_t length = 0, bool fin = true);
     bool sendFrame(WSopcode_t opcode, uint8_t * payload = NULL, size_t length = 0, bool fin = true, bool headerToPayload = false);
 
+    // frame buffer with WEBSOCKETS_MAX_HEADER_SIZE bytes headroom, the payload starts behind it.
+    // Send it with sendFrame(opcode, buffer, length, fin, true), no copy and no heap.
+    static uint8_t* allocFrameBuffer();
+    static void freeFrameBuffer(uint8_t* buffer);
+
 
 private:
+    void threadFn();
     bool handleHTTP(char* buf, int size, int sizeMax);
     bool handleWebSocket(char* buf, int size);
     bool sendUpgradeResponse(char* key);
+    void closeHandler();
 
 
     WebSocketServer* mServer;
     TCPSocket *mConnection;
     WebSocketHandler* mHandler;
+    bool mHandlerCreated;
+    bool mHandlerOpen;
     bool mPrevFin;
     bool _cIsClient;
+
+    Thread mThread;
+    Semaphore mSemWaitForSocket;
+    volatile bool mSocketIsOpen;
+    char mBuffer[WEBSOCKETS_RECEIVE_BUFFER_SIZE];
 };
 
 #endif
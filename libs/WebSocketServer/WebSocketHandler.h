@@ -6,6 +6,7 @@ class WebSocketConnection;
 class WebSocketHandler
 {
 public:
+    virtual ~WebSocketHandler() {};
     virtual void onOpen(WebSocketConnection *webSocketConnection) { _webSocketConnection = webSocketConnection; };
     virtual void onClose() {};
     // to receive text message
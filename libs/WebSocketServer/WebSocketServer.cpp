@@ -1,12 +1,16 @@
 #include "WebSocketServer.h"
 #include "WebSocketConnection.h"
 
-WebSocketServer::WebSocketServer()
+WebSocketServer::WebSocketServer(int nConnections)
 {
+	mnConnections = nConnections;
 }
 
 WebSocketServer::~WebSocketServer()
 {
+	for (size_t i = 0; i < mConnections.size(); i++) {
+		delete mConnections[i];
+	}
 }
 
 bool WebSocketServer::init(NetworkInterface *net, int port)
@@ -21,43 +25,85 @@ bool WebSocketServer::init(NetworkInterface *net, int port)
 		printf("ERROR: Failed to bind %d\r\n", ret);
 		return false;
 	}
-	ret = mTCPSocketServer.listen();
+	ret = mTCPSocketServer.listen(mnConnections);
 	if (ret != 0) {
 		printf("ERROR: Failed to listen %d\r\n", ret);
 		return false;
 	}
 
+	// create the connections, they are reused for the next client
+	// needs RAM for buffers and thread stacks!
+	mConnections.reserve(mnConnections);
+	for (int i = 0; i < mnConnections; i++) {
+		WebSocketConnection* connection = new WebSocketConnection(this);
+		MBED_ASSERT(connection);
+		mConnections.push_back(connection);
+	}
+
 	return true;
 }
 
 void WebSocketServer::run()
 {
-	WebSocketConnection connection(this);
-
 	while (true) {
 		// printf("accepting\r\n");
 		nsapi_error_t ret = 0;
 		TCPSocket *sock = mTCPSocketServer.accept(&ret);
-		connection.setTCPSocketConnection(sock);
 		if (ret != 0) {
 			continue;
 		}
-		connection.run();
+
+		// find idle connection
+		WebSocketConnection* connection = NULL;
+		for (size_t i = 0; i < mConnections.size(); i++) {
+			if (mConnections[i]->isIdle()) {
+				connection = mConnections[i];
+				break;
+			}
+		}
+
+		if (connection) {
+			connection->start(sock);
+		} else {
+			printf("ERROR: no free connection\r\n");
+			sock->close();
+		}
 	}
 }
 
 void WebSocketServer::setHandler(const char* path, WebSocketHandler* handler)
 {
-	mHandlers[path] = handler;
+	WebSocketHandlerEntry entry = { handler, NULL };
+	mHandlers[path] = entry;
+}
+
+void WebSocketServer::setHandler(const char* path, CreateHandlerFn createFn)
+{
+	WebSocketHandlerEntry entry = { NULL, createFn };
+	mHandlers[path] = entry;
 }
 
-WebSocketHandler* WebSocketServer::getHandler(const char* path)
+/**
+ * @param created   set true if the handler was created for this connection and must be deleted
+ */
+WebSocketHandler* WebSocketServer::getHandler(const char* path, bool* created)
 {
 	WebSocketHandlerContainer::iterator it;
 
+	if (created) {
+		*created = false;
+	}
+
 	it = mHandlers.find(path);
 	if (it != mHandlers.end()) {
-		return it->second;
+		if (it->second.createFn) {
+			if (!created) {
+				return NULL;		// caller can't delete it
+			}
+			*created = true;
+			return it->second.createFn();
+		}
+		return it->second.handler;
 	}
 	return NULL;
 }
@@ -5,23 +5,44 @@
 #include "WebSocketHandler.h"
 #include <string>
 #include <map>
+#include <vector>
+
+// number of connections served at the same time, each has its own thread
+#ifndef WEBSOCKETS_MAX_CONNECTIONS
+#define WEBSOCKETS_MAX_CONNECTIONS (4)
+#endif
+
+class WebSocketConnection;
+
+// creates a handler for each connection of a path
+typedef WebSocketHandler* (*CreateHandlerFn)();
 
 class WebSocketServer
 {
 public:
-    WebSocketServer();
+    WebSocketServer(int nConnections = WEBSOCKETS_MAX_CONNECTIONS);
     virtual ~WebSocketServer();
 
     bool init(NetworkInterface *net, int port);
     void run();
+
+    // the handler is shared by all connections of this path
     void setHandler(const char* path, WebSocketHandler* handler);
-    WebSocketHandler* getHandler(const char* path);
+    // every connection of this path gets its own handler, deleted on close
+    void setHandler(const char* path, CreateHandlerFn createFn);
+    WebSocketHandler* getHandler(const char* path, bool* created = NULL);
 
 private:
-    typedef std::map<std::string, WebSocketHandler*> WebSocketHandlerContainer;
+    typedef struct {
+        WebSocketHandler* handler;
+        CreateHandlerFn createFn;
+    } WebSocketHandlerEntry;
+    typedef std::map<std::string, WebSocketHandlerEntry> WebSocketHandlerContainer;
 
     TCPSocket mTCPSocketServer;
     WebSocketHandlerContainer mHandlers;
+    int mnConnections;
+    std::vector<WebSocketConnection*> mConnections;
 };
 
 #endif
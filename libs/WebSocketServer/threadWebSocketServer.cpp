@@ -22,7 +22,7 @@
 
 #include "threadWebSocketServer.h"
 
-#define STACKSIZE   (6 * 1024)
+#define STACKSIZE   (2 * 1024)
 #define THREADNAME  "WebSocketServer"
 
 
@@ -37,6 +37,8 @@ public:
     virtual void onMessage(char* data, size_t size);
     virtual void onOpen(WebSocketConnection *webSocketConnection);
     virtual void onClose();
+
+    static WebSocketHandler* createHandler() { return new WSHandler(); };
 };
 
 void WSHandler::onMessage(char* text)
@@ -91,15 +93,15 @@ void ThreadWebSocketServer::myThreadFn()
 {
     // thread local objects
     // take care of thread stacksize !
+    // the connections have their own threads
 
     WebSocketServer ws_server;
-    WSHandler handler;
 
     if (!ws_server.init(_network, _portNo)) {
         printf("Failed to init server\r\n");
     }
 
-    ws_server.setHandler("/ws/", &handler);
+    ws_server.setHandler("/ws/", WSHandler::createHandler);
     ws_server.run();
 }
 
@@ -22,6 +22,8 @@
 
 #include "ClientConnection.h"
 #include "http_server.h"
+#include "WebSocketFrame.h"
+#include "WebSocketBroadcast.h"
 
 #include "sha1_ws.h"
 
@@ -34,6 +36,20 @@
 #define OP_PING		0x9
 #define OP_PONG		0xA
 
+#define PERMESSAGE_DEFLATE  "permessage-deflate"
+
+#if WEBSOCKET_DEFLATE
+// only one connection inflates at a time, the huffman tables are shared
+static WebSocketInflater inflater;
+static Mutex inflaterMutex;
+#endif
+
+// event flags of the websocket loop
+#define WS_FLAG_SOCKET      (1UL << 0)
+#define WS_FLAG_TX          (1UL << 1)
+#define WS_FLAG_CLOSE       (1UL << 2)
+#define WS_FLAG_KEEPALIVE   (1UL << 3)
+
 
 
 ClientConnection::ClientConnection(HttpServer* server, Callback<void(ParsedHttpRequest* request, TCPSocket* socket)> handler) :
@@ -45,6 +61,17 @@ ClientConnection::ClientConnection(HttpServer* server, Callback<void(ParsedHttpR
     _handler = handler; 
     _cIsClient = false;
     _socketIsOpen = false;
+    _webSocketHandler = nullptr;
+    memset(_txControl, 0, sizeof(_txControl));
+    _txFrame = nullptr;
+    _txOffset = 0;
+    _txBufferLen = 0;
+    _txBufferFrameCount = 0;
+    _bufferedAmount = 0;
+    _broadcast = nullptr;
+    _deflate = false;
+    _deflateServerContextTakeover = false;
+    _subprotocol = nullptr;
     _semWaitForSocket.try_acquire();
     _threadClientConnection.start(callback(this, &ClientConnection::receiveData));
 };
@@ -69,11 +96,6 @@ void ClientConnection::receiveData() {
         while(_socketIsOpen) {
             nsapi_size_or_error_t recv_ret;
             while ((recv_ret = _socket->recv(_recv_buffer, HTTP_RECEIVE_BUFFER_SIZE)) > 0) {
-                // Websocket must not be parsed
-                if (_isWebSocket) {
-                    break;
-                }
-
                 // Pass the chunk into the http_parser
                 int nparsed = _parser.execute((const char*)_recv_buffer, recv_ret);
                 if (nparsed != recv_ret) {
@@ -88,28 +110,454 @@ void ClientConnection::receiveData() {
             }
             
             if (recv_ret > 0) {
-                if (_isWebSocket) { 
-                    _isWebSocket = handleWebSocket(recv_ret);               // I'm alread a Websocket
-                    if(!_isWebSocket)
-                        _server->decWebsocketCount();                       // websocket was closed, decrement websocket count
-                } else {
-                    if (_response.get_Upgrade()) {                 
-                        handleUpgradeRequest();                             // handle upgrade request 
-                    } else {                                                
-                        _parser.finish();                                   // no websocket, normal http handling
-                        _handler(&_response, _socket);
-                    } 
+                if (_response.get_Upgrade()) {                 
+                    handleUpgradeRequest();                                 // handle upgrade request 
+                    if (_isWebSocket) {
+                        runWebSocket();                                     // returns when the websocket is closed
+                    }
+                } else {                                                
+                    _parser.finish();                                       // no websocket, normal http handling
+                    _handler(&_response, _socket);
                 } 
             }
 
-            if (!_isWebSocket || (recv_ret == 0)) {
-                // close socket. Because allocated by accept(), it will be deleted by itself
-                _isWebSocket = false;
-                _socket->close();
-                _socketIsOpen = false;
+            // close socket. Because allocated by accept(), it will be deleted by itself
+            _isWebSocket = false;
+            _deflate = false;
+            _deflateServerContextTakeover = false;
+            _subprotocol = nullptr;
+            _socket->close();
+            _socketIsOpen = false;
+        }
+    }
+}
+
+/*
+ * websocket main loop, runs in the connection thread
+ * The socket is non blocking, the thread sleeps until the socket signals
+ * data/free space or another thread has queued a frame for sending.
+ */
+void ClientConnection::runWebSocket() {
+    _broadcast = _server->getWSBroadcast(_response.get_url().c_str());
+    memset(&_txStats, 0, sizeof(_txStats));
+    _txLatencySum_us = 0;
+    _broadcast->join(this);
+    _rxEnd = 0;
+    _rxMessageLen = 0;
+    _rxMessageOpcode = 0;
+    _rxInFrame = false;
+    _rxStreaming = false;
+    _closeSent = false;
+    _missedPongs = 0;
+    _webSocketHandler->onOpen(this);                                        // handler callback for onOpen()
+
+    _socket->set_blocking(false);
+    _socket->sigio(callback(this, &ClientConnection::onSocketEvent));
+    _wsFlags.set(WS_FLAG_SOCKET);                                           // data may be pending already
+
+    while (_isWebSocket) {
+        uint32_t flags = _wsFlags.wait_any(WS_FLAG_SOCKET | WS_FLAG_TX | WS_FLAG_CLOSE | WS_FLAG_KEEPALIVE);
+        if (flags & osFlagsError) {
+            continue;
+        }
+
+        if (flags & WS_FLAG_CLOSE) {
+            _isWebSocket = false;
+            break;
+        }
+
+        if (flags & WS_FLAG_SOCKET) {
+            nsapi_size_or_error_t recv_ret;
+            while (_isWebSocket && ((recv_ret = _socket->recv(&_recv_buffer[_rxEnd], HTTP_RECEIVE_BUFFER_SIZE - _rxEnd)) > 0)) {
+                _isWebSocket = handleWebSocket(recv_ret);
+            }
+            if (_isWebSocket && (recv_ret != NSAPI_ERROR_WOULD_BLOCK)) {
+                _isWebSocket = false;                                       // closed by peer or socket error
+            }
+        }
+
+        if (_isWebSocket && (flags & WS_FLAG_KEEPALIVE)) {
+            if (_missedPongs >= _server->getWSKeepaliveMaxMissed()) {
+                printf("WARN: websocket peer not responding, closed\r\n");
+                _isWebSocket = false;                                       // half open connection, free the slot
+                break;
             }
+            if (sendFrame(WSop_ping)) {
+                _missedPongs++;                                             // only a ping on its way can go unanswered
+            }
+        }
+
+        if (_isWebSocket) {
+            _isWebSocket = flushTxQueue();
         }
     }
+
+    _broadcast->leave(this);                                                // no more frames from the broadcast
+    _broadcast = nullptr;
+    _socket->sigio(nullptr);
+    if (_closeSent) {
+        _socket->set_timeout(WEBSOCKET_CLOSE_TIMEOUT);                      // deliver the close frame, but don't hang on a dead peer
+        flushTxQueue();
+    }
+    _socket->set_blocking(true);
+    clearTxQueue();
+    _wsFlags.clear();
+
+    if (_rxStreaming) {
+        _webSocketHandler->onError();                                       // streamed message is incomplete
+        _rxStreaming = false;
+    }
+    _webSocketHandler->onClose();
+    delete _webSocketHandler;
+    _webSocketHandler = nullptr;
+
+    _server->decWebsocketCount();                                           // websocket was closed, decrement websocket count
+}
+
+void ClientConnection::onSocketEvent() {
+    _wsFlags.set(WS_FLAG_SOCKET);
+}
+
+/*
+ * called by the keepalive ticker of HttpServer (interrupt context),
+ * the ping is sent by the connection thread
+ */
+void ClientConnection::keepaliveTick() {
+    if (_isWebSocket) {
+        _wsFlags.set(WS_FLAG_KEEPALIVE);
+    }
+}
+
+/*
+ * write queued frames until the queue is empty or the socket would block
+ * Small frames are copied to _txBuffer and go out with one send call,
+ * a frame that doesn't fit is sent directly from the frame buffer.
+ * @return false on socket error
+ */
+bool ClientConnection::flushTxQueue() {
+    while (true) {
+        const uint8_t* data;
+        size_t size;
+
+        if (_txBufferLen > 0) {
+            data = _txBuffer;
+            size = _txBufferLen;
+        } else if (_txFrame) {
+            data = _txFrame->data();
+            size = _txFrame->size();
+        } else {
+            fillTxBuffer();
+            if ((_txBufferLen == 0) && !_txFrame) {
+                return true;                                                // all sent
+            }
+            continue;
+        }
+
+        nsapi_size_or_error_t ret = _socket->send(data + _txOffset, size - _txOffset);
+        if (ret == NSAPI_ERROR_WOULD_BLOCK) {
+            return true;                                                    // sigio will wake us up again
+        }
+        if (ret < 0) {
+            return false;
+        }
+
+        core_util_atomic_decr_u32(&_bufferedAmount, ret);
+        _txStats.socketSends++;
+        _txOffset += ret;
+        if (_txOffset < size) {
+            continue;
+        }
+
+        _txOffset = 0;
+        if (_txBufferLen > 0) {
+            for (int i = 0; i < _txBufferFrameCount; i++) {
+                frameSent(_txBufferFrames[i].timestamp, _txBufferFrames[i].broadcast);
+            }
+            _txBufferLen = 0;
+            _txBufferFrameCount = 0;
+        } else {
+            frameSent(_txFrame->getTimestamp(), _txFrame->getBroadcast());
+            _txFrame->release();
+            _txFrame = nullptr;
+        }
+    }
+}
+
+/*
+ * take the oldest complete data message out of _txQueue, the other frames keep
+ * their order. Control frames and fragments of a message are never dropped.
+ * Called in the critical section of queueFrame().
+ * @return the message, nullptr if the queue has none
+ */
+WebSocketFrame* ClientConnection::removeOldestMessage() {
+    WebSocketFrame* oldest = nullptr;
+    WebSocketFrame* frame;
+
+    for (int count = _txQueue.size(); count > 0; count--) {
+        _txQueue.pop(frame);
+        // with server context takeover the client needs every compressed message for its window
+        if (!oldest && frame->isMessage() && !(_deflateServerContextTakeover && frame->isCompressed())) {
+            oldest = frame;
+        } else {
+            _txQueue.push(frame);
+        }
+    }
+
+    return oldest;
+}
+
+/*
+ * move frames from the queue to _txBuffer until the buffer or _txBufferFrames
+ * is full, the others stay queued
+ */
+void ClientConnection::fillTxBuffer() {
+    WebSocketFrame* frame;
+
+    while (_txBufferFrameCount < WEBSOCKET_TX_QUEUE_SIZE) {
+        core_util_critical_section_enter();
+        if (_txControl[0] || _txControl[1]) {
+            frame = _txControl[0] ? _txControl[0] : _txControl[1];          // pong and ping go between queued frames
+            _txControl[_txControl[0] ? 0 : 1] = nullptr;
+        } else if (!_txQueue.pop(frame)) {
+            frame = _txControl[2];                                          // close only after the queued frames
+            _txControl[2] = nullptr;
+        }
+        core_util_critical_section_exit();
+        if (!frame) {
+            break;
+        }
+
+        if (frame->size() > (WEBSOCKET_TX_COALESCE_SIZE - _txBufferLen)) {
+            _txFrame = frame;                                               // sent after the buffer
+            return;
+        }
+
+        memcpy(&_txBuffer[_txBufferLen], frame->data(), frame->size());
+        _txBufferLen += frame->size();
+        _txBufferFrames[_txBufferFrameCount].timestamp = frame->getTimestamp();
+        _txBufferFrames[_txBufferFrameCount].broadcast = frame->getBroadcast();
+        _txBufferFrameCount++;
+        frame->release();
+    }
+}
+
+void ClientConnection::frameSent(uint32_t timestamp, WebSocketBroadcast* broadcast) {
+    uint32_t latency = us_ticker_read() - timestamp;
+
+    if (broadcast) {
+        broadcast->frameDelivered(latency);
+    }
+
+    CriticalSectionLock lock;
+    _txStats.framesSent++;
+    _txLatencySum_us += latency;
+    if (latency > _txStats.latencyMax_us) {
+        _txStats.latencyMax_us = latency;
+    }
+}
+
+void ClientConnection::getTxStats(WSTxStats_t* stats) {
+    CriticalSectionLock lock;
+    *stats = _txStats;
+    stats->latencyAvg_us = _txStats.framesSent ? (uint32_t)(_txLatencySum_us / _txStats.framesSent) : 0;
+}
+
+void ClientConnection::clearTxQueue() {
+    WebSocketFrame* frame;
+
+    if (_txFrame) {
+        _txFrame->release();
+        _txFrame = nullptr;
+    }
+    for (size_t i = 0; i < (sizeof(_txControl) / sizeof(_txControl[0])); i++) {
+        if (_txControl[i]) {
+            _txControl[i]->release();
+            _txControl[i] = nullptr;
+        }
+    }
+    while (_txQueue.pop(frame)) {
+        frame->release();
+    }
+    _txOffset = 0;
+    _txBufferLen = 0;
+    _txBufferFrameCount = 0;
+    _bufferedAmount = 0;
+}
+
+/*
+ * @param frame WebSocketFrame *    encoded frame, the queue takes its own reference
+ * @param policy WSoverflow_t       what to do when the queue is full
+ * @return WSqueue_ok or WSqueue_droppedOldest if the frame was queued
+ */
+WSqueueResult_t ClientConnection::queueFrame(WebSocketFrame* frame, WSoverflow_t policy) {
+    WebSocketFrame* dropped = nullptr;
+    WSqueueResult_t result = WSqueue_ok;
+
+    core_util_critical_section_enter();
+    if (!_isWebSocket) {
+        result = WSqueue_notConnected;                                      // checked here, teardown clears the queue after _isWebSocket is reset
+    } else if (_txQueue.full()) {
+        switch (policy) {
+            case WSoverflow_dropOldest:
+                dropped = removeOldestMessage();
+                result = dropped ? WSqueue_droppedOldest : WSqueue_rejected;
+                break;
+            case WSoverflow_disconnect:
+                result = WSqueue_disconnect;
+                break;
+            default:
+                result = WSqueue_rejected;
+                break;
+        }
+    }
+    if ((result == WSqueue_ok) || (result == WSqueue_droppedOldest)) {
+        frame->acquire();
+        _txQueue.push(frame);
+        _bufferedAmount += frame->size();
+        _txStats.framesQueued++;
+    }
+    if (dropped) {
+        _bufferedAmount -= dropped->size();
+    }
+    if (result != WSqueue_ok) {
+        _txStats.framesDropped++;
+    }
+    core_util_critical_section_exit();
+
+    if (dropped) {
+        dropped->release();                                                 // free outside of the critical section
+    }
+
+    if (result == WSqueue_disconnect) {
+        _wsFlags.set(WS_FLAG_CLOSE);
+    } else if ((result == WSqueue_ok) || (result == WSqueue_droppedOldest)) {
+        _wsFlags.set(WS_FLAG_TX);
+    }
+
+    return result;
+}
+
+/*
+ * queue a ping, pong or close frame, takes a reference. Can be called from any thread
+ * A full _txQueue doesn't reject it, each kind has its own slot. fillTxBuffer sends
+ * a pong or ping before the next queued frame and the close frame after the last one.
+ * A newer frame replaces a waiting one of the same kind, so a pong answers the most
+ * recent ping.
+ * @return false if the websocket isn't connected
+ */
+bool ClientConnection::queueControlFrame(WebSocketFrame* frame) {
+    WebSocketFrame* replaced = nullptr;
+    bool queued = false;
+    int slot;
+
+    switch (frame->data()[0] & 0x0F) {
+        case WSop_pong:     slot = 0;   break;
+        case WSop_ping:     slot = 1;   break;
+        default:            slot = 2;   break;
+    }
+
+    core_util_critical_section_enter();
+    if (_isWebSocket) {
+        replaced = _txControl[slot];
+        frame->acquire();
+        _txControl[slot] = frame;
+        _bufferedAmount += frame->size();
+        _txStats.framesQueued++;
+        if (replaced) {
+            _bufferedAmount -= replaced->size();
+            _txStats.framesDropped++;
+        }
+        queued = true;
+    }
+    core_util_critical_section_exit();
+
+    if (replaced) {
+        replaced->release();                                                // free outside of the critical section
+    }
+    if (queued) {
+        _wsFlags.set(WS_FLAG_TX);
+    }
+
+    return queued;
+}
+
+/**
+ * With server context takeover the payload is compressed against the previous
+ * messages of this connection. The client decodes them in queue order, so
+ * compressing, queueing and adding to the history is one step, and compressed
+ * frames are never dropped by WSoverflow_dropOldest.
+ *
+ * @param plain     uncompressed frame, queued if the payload doesn't get smaller.
+ *                  Its broadcast is set on the compressed frame.
+ * @return result of queueFrame(), WSqueue_rejected if out of memory
+ */
+WSqueueResult_t ClientConnection::queueMessage(WSopcode_t opcode, const uint8_t* payload, size_t length, WebSocketFrame* plain,
+                                               WSoverflow_t policy) {
+    WSqueueResult_t result = WSqueue_rejected;
+
+#if WEBSOCKET_DEFLATE
+    if (_deflate) {
+        const WSDeflateWindow_t* history = NULL;
+#if WEBSOCKET_DEFLATE_SERVER_CONTEXT_TAKEOVER
+        if (_deflateServerContextTakeover) {
+            history = &_deflateHistory;
+        }
+#endif
+        _deflateMutex.lock();
+        WebSocketFrame* deflated = WebSocketFrame::createDeflated(opcode, payload, length, true, history);
+        if (deflated) {
+            deflated->setBroadcast(plain ? plain->getBroadcast() : NULL);
+            result = queueFrame(deflated, policy);
+#if WEBSOCKET_DEFLATE_SERVER_CONTEXT_TAKEOVER
+            if (history && ((result == WSqueue_ok) || (result == WSqueue_droppedOldest))) {
+                WebSocketDeflater::addHistory(&_deflateHistory, payload, length);
+            }
+#endif
+            deflated->release();
+        }
+        _deflateMutex.unlock();
+
+        if (deflated) {
+            return result;
+        }
+    }
+#endif
+
+    if (plain) {
+        return queueFrame(plain, policy);
+    }
+
+    plain = WebSocketFrame::create(opcode, payload, length);
+    if (plain) {
+        result = queueFrame(plain, policy);
+        plain->release();                                                   // queue holds its own reference
+    }
+
+    return result;
+}
+
+/*
+ * @param list      comma separated header value like "chat, rpc.msgpack"
+ * @return true if token is one of the list entries
+ */
+static bool hasToken(const char* list, const char* token)
+{
+    size_t tokenLen = strlen(token);
+
+    while (*list) {
+        while (*list == ' ' || *list == '\t' || *list == ',') {
+            list++;
+        }
+        const char* end = list;
+        while (*end && *end != ',' && *end != ' ' && *end != '\t') {
+            end++;
+        }
+        if (((size_t)(end - list) == tokenLen) && (strncmp(list, token, tokenLen) == 0)) {
+            return true;
+        }
+        list = end;
+    }
+    return false;
 }
 
 void ClientConnection::handleUpgradeRequest() {
@@ -141,76 +589,469 @@ void ClientConnection::handleUpgradeRequest() {
     }
 
     CreateHandlerFn createFn = _server->getWSHandler(_response.get_url().c_str());
-    _webSocketHandler = createFn();    // handler for this url available?
 
-    if (upgradeWebsocketfound && secWebsocketKeyFound && _webSocketHandler) {   // neccessary header keys found?
-        if (_server->isWebsocketAvailable()) {                                  // Websockets available?
-            _isWebSocket = sendUpgradeResponse(secWebsocketKey);                // do upgrade handshake
+    // a path with subprotocol accepts only clients offering it
+    const char* subprotocol = _server->getWSSubprotocol(_response.get_url().c_str());
+    bool subprotocolFound = (subprotocol == NULL);
+    for (i = 0; !subprotocolFound && (i < headerFields.size()); i++) {
+        if (strcasecmp(headerFields[i]->c_str(), "Sec-WebSocket-Protocol") == 0) {
+            subprotocolFound = hasToken(headerValues[i]->c_str(), subprotocol);
+        }
+    }
+
+    if (upgradeWebsocketfound && secWebsocketKeyFound && createFn && subprotocolFound) {   // neccessary header keys and handler for this url found?
+        if (_server->incWebsocketCount()) {                                     // Websockets available?
+            _webSocketHandler = createFn();
+
+            char extensions[96] = "";
+#if WEBSOCKET_DEFLATE
+            // a compressed message is inflated as a whole, a streaming handler
+            // takes uploads larger than the receive buffer: no deflate for it
+            for (i = 0; !_webSocketHandler->isStreaming() && (i < headerFields.size()); i++) {
+                if (strcasecmp(headerFields[i]->c_str(), "Sec-WebSocket-Extensions") == 0) {
+                    _deflate = negotiateDeflate(headerValues[i]->c_str(), extensions, sizeof(extensions));
+                    break;
+                }
+            }
+#endif
+            _isWebSocket = sendUpgradeResponse(secWebsocketKey, extensions, subprotocol);  // do upgrade handshake
 
             if (_isWebSocket) {                                                 // if successful
-                _server->incWebsocketCount();
+                _subprotocol = subprotocol;
                 //mHandler->setOrigin(origin);
-                _webSocketHandler->onOpen(this);                                // handler callback for onOpen()
-            } 
+            } else {
+                delete _webSocketHandler;
+                _webSocketHandler = nullptr;
+                _deflate = false;
+                _deflateServerContextTakeover = false;
+                _server->decWebsocketCount();
+            }
         }
     }
 }
 
+/*
+ * Frame decoder, runs for every chunk from recv(). Frames may be split over
+ * several chunks or several frames may come in one chunk.
+ * _recv_buffer holds the payload of the message assembled so far, followed by
+ * the received bytes not yet parsed. A streaming handler gets the payload right
+ * from the receive buffer, so its messages do not need to fit the buffer.
+ *
+ * @param size      bytes received at _recv_buffer + _rxEnd
+ * @return false if the websocket is closed
+ */
 bool ClientConnection::handleWebSocket(int size)
 {
-	uint8_t* ptr = _recv_buffer;
+    size_t pos = _rxMessageLen;
+    _rxEnd += size;
+
+    while (pos < _rxEnd) {
+        if (!_rxInFrame) {
+            int headerSize = decodeFrameHeader(&_recv_buffer[pos], _rxEnd - pos);
+            if (headerSize == 0) {
+                break;                                                      // header incomplete
+            }
+            if ((headerSize < 0) || !beginFrame()) {
+                return failWebSocket(_closeCode);
+            }
+            pos += headerSize;
+        } else {
+            size_t length = _rxEnd - pos;
+            if (length > _rxRemaining) {
+                length = _rxRemaining;
+            }
+            uint8_t* data = &_recv_buffer[pos];
+            if ((_rxOpcode < OP_CLOSE) && (_rxMessageOpcode == OP_TEXT) && !_rxCompressed) {
+                // text is checked while unmasking, the payload is touched only once
+                if (!_rxUtf8.unmaskValidate(data, length, _rxMaskKey, &_rxMaskPos)) {
+                    return failWebSocket(1007);
+                }
+            } else {
+                WebSocketUtf8Validator::unmask(data, length, _rxMaskKey, &_rxMaskPos);
+            }
+            pos += length;
+            _rxRemaining -= length;
+
+            if (_rxOpcode >= OP_CLOSE) {
+                memcpy(&_rxControl[_rxControlLen], data, length);
+                _rxControlLen += length;
+            } else if (_rxStreaming) {
+                if (length > 0) {
+                    static_cast<WebSocketStreamHandler*>(_webSocketHandler)->onMessageData(data, length);
+                }
+            } else {
+                memmove(&_recv_buffer[_rxMessageLen], data, length);     // append to the message, no overlap problem: data is behind
+                _rxMessageLen += length;
+            }
+        }
 
-	bool fin = (*ptr & 0x80) == 0x80;
-	uint8_t opcode = *ptr & 0xF;
+        if (_rxInFrame && (_rxRemaining == 0)) {
+            _rxInFrame = false;
+            if (!endFrame()) {
+                return false;
+            }
+        }
+    }
 
-	if (opcode == OP_PING) {
-		*ptr = ((*ptr & 0xF0) | OP_PONG);
-		_socket->send(_recv_buffer, size);
-		return true;
-	}
-	if (opcode == OP_CLOSE) {
-		if (_webSocketHandler) {
-			_webSocketHandler->onClose();
-		}
-		return false;
-	}
-	ptr++;
+    // keep the incomplete header behind the assembled message
+    size_t tail = _rxEnd - pos;
+    memmove(&_recv_buffer[_rxMessageLen], &_recv_buffer[pos], tail);
+    _rxEnd = _rxMessageLen + tail;
 
-	if (!fin || !_mPrevFin) {	
-		printf("WARN: Data consists of multiple frame not supported\r\n");
-		_mPrevFin = fin;
-		return true; // not an error, just discard it
-	}
-	_mPrevFin = fin;
-
-	bool mask = (*ptr & 0x80) == 0x80;
-	uint8_t len = *ptr & 0x7F;
-	ptr++;
-	
-	if (len > 125) {
-		printf("WARN: Extended payload length not supported\r\n");
-		return true; // not an error, just discard it
-	}
+    if (_rxEnd >= HTTP_RECEIVE_BUFFER_SIZE - 1) {                           // -1 for NUL of text messages
+        printf("WARN: websocket message too big\r\n");
+        return failWebSocket(1009);
+    }
+    return true;
+}
+
+/*
+ * @return header size, 0 if incomplete, -1 on protocol error
+ */
+int ClientConnection::decodeFrameHeader(const uint8_t* ptr, size_t size)
+{
+    if (size < 2) {
+        return 0;
+    }
+
+    bool mask = (ptr[1] & 0x80) == 0x80;
+    int headerSize = 2 + (mask ? 4 : 0);
+    uint8_t len = ptr[1] & 0x7F;
+    if (len == 126) {
+        headerSize += 2;
+    } else if (len == 127) {
+        headerSize += 8;
+    }
+    if (size < (size_t)headerSize) {
+        return 0;
+    }
 
-	char* data;
-	if (mask) {
-		char* maskingKey = (char*)ptr;
-		data = (char*)(ptr + 4);
-		for (int i = 0; i < len; i++) {
-        	data[i] = data[i] ^ maskingKey[(i % 4)];
+    _closeCode = 1002;
+    if ((ptr[0] & 0x30) || (mask == _cIsClient)) {                          // RSV2/RSV3, client frames must be masked
+        return -1;
+    }
+
+    _rxFin = (ptr[0] & 0x80) == 0x80;
+    _rxRsv1 = (ptr[0] & 0x40) == 0x40;
+    _rxOpcode = ptr[0] & 0x0F;
+
+    const uint8_t* p = ptr + 2;
+    if (len == 126) {
+        _rxRemaining = ((uint16_t)p[0] << 8) | p[1];
+        p += 2;
+    } else if (len == 127) {
+        if (p[0] & 0x80) {
+            return -1;                                                      // MSB must be 0
         }
-	} else {
-		data = (char*)ptr;
-	}
-	if (_webSocketHandler) {
-		if (opcode == OP_TEXT) {
-			data[len] = '\0';
-			_webSocketHandler->onMessage(data);
-		} else if (opcode == OP_BINARY) {
-			_webSocketHandler->onMessage(data, len);
-		}
-	}
-	return true;
+        _rxRemaining = 0;
+        for (int i = 0; i < 8; i++) {
+            _rxRemaining = (_rxRemaining << 8) | p[i];
+        }
+        p += 8;
+    } else {
+        _rxRemaining = len;
+    }
+
+    if (mask) {
+        memcpy(_rxMaskKey, p, 4);
+    } else {
+        memset(_rxMaskKey, 0, 4);
+    }
+    _rxMaskPos = 0;
+
+    return headerSize;
+}
+
+/*
+ * check the frame sequence after a header, starts a new message
+ * @return false on protocol error, _closeCode is set
+ */
+bool ClientConnection::beginFrame()
+{
+    _closeCode = 1002;
+    _rxInFrame = true;
+
+    if (_rxOpcode >= OP_CLOSE) {
+        if (!_rxFin || _rxRsv1 || (_rxRemaining > sizeof(_rxControl))
+                || ((_rxOpcode != OP_CLOSE) && (_rxOpcode != OP_PING) && (_rxOpcode != OP_PONG))) {
+            return false;                                                   // control frames are short and not fragmented
+        }
+        _rxControlLen = 0;
+        return true;
+    }
+
+    if (_rxOpcode == OP_CONT) {
+        return (_rxMessageOpcode != 0) && !_rxRsv1;
+    }
+
+    if (((_rxOpcode != OP_TEXT) && (_rxOpcode != OP_BINARY)) || (_rxMessageOpcode != 0) || (_rxRsv1 && !_deflate)) {
+        return false;                                                       // reserved opcode or previous message not finished
+    }
+
+    _rxMessageOpcode = _rxOpcode;
+    _rxCompressed = _rxRsv1;
+    _rxUtf8.reset();
+    _rxStreaming = !_rxCompressed && _webSocketHandler && _webSocketHandler->isStreaming();
+    _rxMessageLen = 0;
+    if (_rxStreaming) {
+        static_cast<WebSocketStreamHandler*>(_webSocketHandler)->onMessageBegin(_rxOpcode, _rxFin ? (size_t)_rxRemaining : WEBSOCKET_LENGTH_UNKNOWN);
+    } else if (_rxRemaining >= HTTP_RECEIVE_BUFFER_SIZE - 1) {
+        _closeCode = 1009;                                                  // will not fit, don't wait for it
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * frame payload complete
+ * @return false if the websocket is closed
+ */
+bool ClientConnection::endFrame()
+{
+    if (_rxOpcode >= OP_CLOSE) {
+        return handleControlFrame();
+    }
+    if (!_rxFin) {
+        return true;
+    }
+
+    // message complete
+    int opcode = _rxMessageOpcode;
+    _rxMessageOpcode = 0;
+
+    if (_rxStreaming) {
+        if ((opcode == OP_TEXT) && !_rxUtf8.isComplete()) {
+            return failWebSocket(1007);                                     // onError() follows
+        }
+        _rxStreaming = false;
+        static_cast<WebSocketStreamHandler*>(_webSocketHandler)->onMessageEnd();
+        return true;
+    }
+
+    uint8_t* data = _recv_buffer;
+    int len = _rxMessageLen;
+    _rxMessageLen = 0;                                                      // the next frames are behind the message
+
+    if (_rxCompressed) {
+        len = inflateMessage(data, len);
+        if (len == WebSocketInflater::INFLATE_OVERFLOW) {
+            return failWebSocket(1009);                                     // larger than WEBSOCKET_DEFLATE_BUFFER_SIZE
+        }
+        if (len < 0) {
+            printf("ERROR: inflate failed\r\n");
+            return failWebSocket(1007);
+        }
+#if WEBSOCKET_DEFLATE
+        data = _inflateBuffer;
+#endif
+        if (opcode == OP_TEXT) {
+            _rxUtf8.validate(data, len);
+        }
+    }
+    if ((opcode == OP_TEXT) && !_rxUtf8.isComplete()) {
+        return failWebSocket(1007);                                         // ends inside a code point
+    }
+
+    if (!_webSocketHandler) {
+        return true;
+    }
+    if (_webSocketHandler->isStreaming()) {
+        WebSocketStreamHandler* handler = static_cast<WebSocketStreamHandler*>(_webSocketHandler);
+        handler->onMessageBegin(opcode, len);
+        handler->onMessageData(data, len);
+        handler->onMessageEnd();
+    } else if (opcode == OP_TEXT) {
+        uint8_t next = data[len];                                           // may be the start of the next frame
+        data[len] = '\0';
+        _webSocketHandler->onMessage((char*)data);
+        data[len] = next;
+    } else {
+        _webSocketHandler->onMessage((char*)data, len);
+    }
+    return true;
+}
+
+bool ClientConnection::handleControlFrame()
+{
+    switch (_rxOpcode) {
+        case OP_PING:
+            // answer with the same application data, goes through the send queue
+            sendFrame(WSop_pong, _rxControl, _rxControlLen);
+            return true;
+
+        case OP_PONG:
+            _missedPongs = 0;                                               // peer is alive
+            return true;
+
+        default: {
+            // close: answer with the status code of the peer
+            uint16_t code = 1000;
+            if (_rxControlLen == 1) {
+                return failWebSocket(1002);
+            }
+            if (_rxControlLen >= 2) {
+                code = ((uint16_t)_rxControl[0] << 8) | _rxControl[1];
+                if ((code < 1000) || (code == 1004) || (code == 1005) || (code == 1006)
+                        || ((code > 1011) && (code < 3000)) || (code > 4999)) {
+                    return failWebSocket(1002);
+                }
+                WebSocketUtf8Validator reason;
+                if (!reason.validate(&_rxControl[2], _rxControlLen - 2) || !reason.isComplete()) {
+                    return failWebSocket(1007);
+                }
+            }
+            return failWebSocket(_rxControlLen ? code : 0);
+        }
+    }
+}
+
+/*
+ * queue a close frame, it is flushed before the socket is closed
+ * If it can't be queued the socket is closed without waiting for it.
+ * @param code      status code, 0 for a close frame without payload
+ * @return false, the websocket ends
+ */
+bool ClientConnection::failWebSocket(uint16_t code)
+{
+    uint8_t payload[2] = { (uint8_t)(code >> 8), (uint8_t)code };
+
+    _closeSent = sendFrame(WSop_close, payload, code ? 2 : 0);
+
+    return false;
+}
+
+/*
+ * Accept the first permessage-deflate offer of the Sec-WebSocket-Extensions header
+ * which fits the configured window sizes.
+ * The server keeps its compression context across messages unless the client sends
+ * server_no_context_takeover or WEBSOCKET_DEFLATE_SERVER_CONTEXT_TAKEOVER is 0.
+ * With context takeover every message is compressed against the history of this
+ * connection, under _deflateMutex and in queue order, so a broadcast compresses
+ * once per connection. Without it an encoded frame is the same for all connections
+ * and a broadcast shares it.
+ *
+ * @param offers            value of the Sec-WebSocket-Extensions header
+ * @param response          receives the Sec-WebSocket-Extensions value of the response
+ * @return true if permessage-deflate is used
+ */
+bool ClientConnection::negotiateDeflate(const char* offers, char* response, size_t responseSize)
+{
+#if WEBSOCKET_DEFLATE
+    char buf[128];
+    char* offerPtr;
+
+    strncpy(buf, offers, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    for (char* offer = strtok_r(buf, ",", &offerPtr); offer; offer = strtok_r(NULL, ",", &offerPtr)) {
+        char* paramPtr;
+        char* name = strtok_r(offer, "; ", &paramPtr);
+        if (!name || strcmp(name, PERMESSAGE_DEFLATE) != 0) {
+            continue;
+        }
+
+        bool accept = true;
+        bool serverBitsOffered = false;
+        bool clientBitsOffered = false;
+        bool serverNoContextTakeover = false;
+        bool clientNoContextTakeover = false;
+        int clientBits = 15;
+
+        for (char* param = strtok_r(NULL, "; ", &paramPtr); param; param = strtok_r(NULL, "; ", &paramPtr)) {
+            char* value = strchr(param, '=');
+            int bits = 0;
+            if (value) {
+                *value++ = '\0';
+                if (*value == '"') {
+                    value++;
+                }
+                bits = atoi(value);
+            }
+
+            if (strcmp(param, "server_no_context_takeover") == 0) {
+                serverNoContextTakeover = true;
+            } else if (strcmp(param, "client_no_context_takeover") == 0) {
+                clientNoContextTakeover = true;
+            } else if (strcmp(param, "server_max_window_bits") == 0) {
+                // the configured window is used for all connections
+                serverBitsOffered = true;
+                accept &= (bits >= WEBSOCKET_DEFLATE_SERVER_MAX_WINDOW_BITS) && (bits <= 15);
+            } else if (strcmp(param, "client_max_window_bits") == 0) {
+                clientBitsOffered = true;
+                if (value) {
+                    accept &= (bits >= 8) && (bits <= 15);
+                    clientBits = bits;
+                }
+            } else {
+                accept = false;                                 // unknown parameter, decline this offer
+            }
+        }
+
+        // the client window can only be limited if the client offers it
+        if (!clientBitsOffered && (WEBSOCKET_DEFLATE_CLIENT_MAX_WINDOW_BITS < 15)) {
+            accept = false;
+        }
+        if (!accept) {
+            continue;
+        }
+
+        if (clientBits > WEBSOCKET_DEFLATE_CLIENT_MAX_WINDOW_BITS) {
+            clientBits = WEBSOCKET_DEFLATE_CLIENT_MAX_WINDOW_BITS;
+        }
+        // zlib can't deflate with 8 bits and uses 9, use the larger window if we have it
+        _deflateClientWindowBits = (clientBits < 9) && (WEBSOCKET_DEFLATE_CLIENT_MAX_WINDOW_BITS >= 9) ? 9 : clientBits;
+        _deflateClientContextTakeover = WEBSOCKET_DEFLATE_CLIENT_CONTEXT_TAKEOVER && !clientNoContextTakeover;
+        WebSocketInflater::resetWindow(&_inflateWindow);
+#if WEBSOCKET_DEFLATE_SERVER_CONTEXT_TAKEOVER
+        _deflateServerContextTakeover = !serverNoContextTakeover;
+        WebSocketDeflater::resetHistory(&_deflateHistory);
+#else
+        (void)serverNoContextTakeover;
+#endif
+
+        int len = snprintf(response, responseSize, PERMESSAGE_DEFLATE);
+        if (!_deflateServerContextTakeover) {
+            len += snprintf(response + len, responseSize - len, "; server_no_context_takeover");
+        }
+        if (clientBitsOffered) {
+            // not allowed in the response if the client didn't offer it (RFC 7692 7.1.2.2)
+            len += snprintf(response + len, responseSize - len, "; client_max_window_bits=%d", clientBits);
+        }
+        if (serverBitsOffered) {
+            len += snprintf(response + len, responseSize - len, "; server_max_window_bits=%d", WEBSOCKET_DEFLATE_SERVER_MAX_WINDOW_BITS);
+        }
+        if (!_deflateClientContextTakeover) {
+            len += snprintf(response + len, responseSize - len, "; client_no_context_takeover");
+        }
+
+        return len < (int)responseSize;
+    }
+#endif
+
+    response[0] = '\0';
+    return false;
+}
+
+/*
+ * @return size of the message in _inflateBuffer, WebSocketInflater::INFLATE_ERROR
+ *         or INFLATE_OVERFLOW
+ */
+int ClientConnection::inflateMessage(const uint8_t* data, size_t length)
+{
+#if WEBSOCKET_DEFLATE
+    if (!_deflateClientContextTakeover) {
+        WebSocketInflater::resetWindow(&_inflateWindow);
+    }
+
+    inflaterMutex.lock();
+    int ret = inflater.inflate(&_inflateWindow, _deflateClientWindowBits, data, length, _inflateBuffer, WEBSOCKET_DEFLATE_BUFFER_SIZE);
+    inflaterMutex.unlock();
+
+    return ret;
+#else
+    return WebSocketInflater::INFLATE_ERROR;
+#endif
 }
 
 char* ClientConnection::base64Encode(const uint8_t* data, size_t size,
@@ -253,7 +1094,7 @@ char* ClientConnection::base64Encode(const uint8_t* data, size_t size,
     return outputBuffer;
 }
 
-bool ClientConnection::sendUpgradeResponse(const char* key)
+bool ClientConnection::sendUpgradeResponse(const char* key, const char* extensions, const char* subprotocol)
 {
 	char buf[128];
 
@@ -272,17 +1113,22 @@ bool ClientConnection::sendUpgradeResponse(const char* key)
 	char encoded[30];
     base64Encode(hash, 20, encoded, sizeof(encoded));
 
-    char resp[] = "HTTP/1.1 101 Switching Protocols\r\n" \
+    char resp[256];
+    int len = snprintf(resp, sizeof(resp), "HTTP/1.1 101 Switching Protocols\r\n" \
 	    "Upgrade: websocket\r\n" \
     	"Connection: Upgrade\r\n" \
-    	"Sec-WebSocket-Accept: XXXXXXXXXXXXXXXXXXXXXXXXXXXXXX\r\n\r\n";
-    char* ptr = strstr(resp, "XXXXX");
-    strcpy(ptr, encoded);
-    strcpy(ptr+strlen(encoded), "\r\n\r\n");
+    	"Sec-WebSocket-Accept: %s\r\n", encoded);
+    if (extensions && *extensions) {
+        len += snprintf(resp + len, sizeof(resp) - len, "Sec-WebSocket-Extensions: %s\r\n", extensions);
+    }
+    if (subprotocol) {
+        len += snprintf(resp + len, sizeof(resp) - len, "Sec-WebSocket-Protocol: %s\r\n", subprotocol);
+    }
+    len += snprintf(resp + len, sizeof(resp) - len, "\r\n");
 
     //printf(resp);
 
-    int ret = _socket->send(resp, strlen(resp));
+    int ret = _socket->send(resp, len);
     if (ret < 0) {
     	printf("ERROR: Failed to send response\r\n");
     	return false;
@@ -378,7 +1224,6 @@ uint8_t ClientConnection::createHeader(uint8_t * headerPtr, WSopcode_t opcode, s
 
 /**
  *
- * @param client WSclient_t *   ptr to the client struct
  * @param opcode WSopcode_t
  * @param length size_t         length of the payload
  * @param fin bool              can be used to send data in more then one frame (set fin on the last frame)
@@ -390,30 +1235,31 @@ bool ClientConnection::sendFrameHeader(WSopcode_t opcode, int length, bool fin)
 
     int headerSize = createHeader(&buffer[0], opcode, length, _cIsClient, maskKey, fin);
 
-    if(_socket->send(&buffer[0], headerSize) != headerSize) {
+    WebSocketFrame* frame = WebSocketFrame::alloc(headerSize);
+    if (!frame) {
         return false;
     }
+    memcpy(frame->buffer(), buffer, headerSize);
 
-    return true;
+    bool ret = (queueFrame(frame) == WSqueue_ok);
+    frame->release();
+
+    return ret;
 }
 
 /**
+ * The frame is encoded into a WebSocketFrame and queued, the connection thread
+ * writes it to the socket. So sendFrame never blocks and can be called from any thread.
  *
- * @param client WSclient_t *   ptr to the client struct
  * @param opcode WSopcode_t
  * @param payload uint8_t *     ptr to the payload
  * @param length size_t         length of the payload
  * @param fin bool              can be used to send data in more then one frame (set fin on the last frame)
- * @param headerToPayload bool  set true if the payload has reserved 14 Byte at the beginning to dynamically add the Header (payload neet to be in RAM!)
- * @return true if ok
+ * @param headerToPayload bool  set true if the payload has reserved 14 Byte at the beginning (kept for compatibility)
+ * @return true if the frame was queued
  */
 bool ClientConnection::sendFrame( WSopcode_t opcode, uint8_t * payload, int length, bool fin, bool headerToPayload) {
-    if (0) {  // Todo: isConnected()    (client->tcp && !client->tcp->connected()) {
-        DEBUG_WEBSOCKETS("[WS][sendFrame] not Connected!?\n");
-        return false;
-    }
-
-    if (0) {  // Todo: isWCSconnected  (client->status != WSC_CONNECTED) {
+    if (!_isWebSocket) {
         DEBUG_WEBSOCKETS("[WS][sendFrame] not in WSC_CONNECTED state!?\n");
         return false;
     }
@@ -421,107 +1267,56 @@ bool ClientConnection::sendFrame( WSopcode_t opcode, uint8_t * payload, int leng
     DEBUG_WEBSOCKETS("[WS][sendFrame] ------- send message frame -------\n");
     DEBUG_WEBSOCKETS("[WS][sendFrame] fin: %u opCode: %u mask: %u length: %u headerToPayload: %u\n", fin, opcode, _cIsClient, length, headerToPayload);
 
-    if(opcode == WSop_text) {
-        DEBUG_WEBSOCKETS("[WS][sendFrame] text: %s\n", (payload + (headerToPayload ? 14 : 0)));
+    if(headerToPayload && payload) {
+        payload += WEBSOCKETS_MAX_HEADER_SIZE;
     }
 
-    uint8_t maskKey[4]                         = { 0x00, 0x00, 0x00, 0x00 };
-    uint8_t buffer[WEBSOCKETS_MAX_HEADER_SIZE] = { 0 };
-
-    int headerSize;
-    uint8_t * headerPtr;
-    uint8_t * payloadPtr = payload;
-    bool useInternBuffer = false;
-    bool ret             = true;
-
-    // calculate header Size
-    if(length < 126) {
-        headerSize = 2;
-    } else if(length < 0xFFFF) {
-        headerSize = 4;
-    } else {
-        headerSize = 10;
+    // only complete data messages are compressed, RSV1 is set on the first frame of a message
+    if (fin && ((opcode == WSop_text) || (opcode == WSop_binary))) {
+        return (queueMessage(opcode, payload, length, NULL) == WSqueue_ok);
     }
 
-    if(_cIsClient) {
-        headerSize += 4;
-    }
-
-//#ifdef WEBSOCKETS_USE_BIG_MEM
-    // only for ESP since AVR has less HEAP
-    // try to send data in one TCP package (only if some free Heap is there)
-    if(!headerToPayload && ((length > 0) && (length < 1400)) ) { // Todo: && (GET_FREE_HEAP > 6000)) {
-        DEBUG_WEBSOCKETS("[WS][sendFrame] pack to one TCP package...\n");
-        uint8_t * dataPtr = (uint8_t *)malloc(length + WEBSOCKETS_MAX_HEADER_SIZE);
-        if(dataPtr) {
-            memcpy((dataPtr + WEBSOCKETS_MAX_HEADER_SIZE), payload, length);
-            headerToPayload = true;
-            useInternBuffer = true;
-            payloadPtr      = dataPtr;
-        }
+    WebSocketFrame* frame = WebSocketFrame::create(opcode, payload, length, fin);
+    if (!frame) {
+        DEBUG_WEBSOCKETS("[WS][sendFrame] out of memory\n");
+        return false;
     }
-//#endif
 
-    // set Header Pointer
-    if(headerToPayload) {
-        // calculate offset in payload
-        headerPtr = (payloadPtr + (WEBSOCKETS_MAX_HEADER_SIZE - headerSize));
+    bool ret;
+    if (opcode & 0x08) {
+        ret = queueControlFrame(frame);                                     // never rejected by a full queue
     } else {
-        headerPtr = &buffer[0];
+        ret = (queueFrame(frame) == WSqueue_ok);
     }
+    frame->release();                                                       // queue holds its own reference
 
-    if(_cIsClient && useInternBuffer) {
-        // if we use a Intern Buffer we can modify the data
-        // by this fact its possible the do the masking
-        for(uint8_t x = 0; x < sizeof(maskKey); x++) {
-            maskKey[x] = random() & 0xff;
-        }
-    }
-
-    createHeader(headerPtr, opcode, length, _cIsClient, maskKey, fin);
-
-    if(useInternBuffer) {
-        uint8_t * dataMaskPtr;
+    return ret;
+}
 
-        if(headerToPayload) {
-            dataMaskPtr = (payloadPtr + WEBSOCKETS_MAX_HEADER_SIZE);
+/**
+ * Send a frame from WebSocketFrame::allocPayload(), the payload was written in place.
+ * The header goes into the headroom of the frame, so there is no copy and no heap
+ * allocation for payloads up to WEBSOCKET_FRAME_POOL_BUFFER_SIZE.
+ *
+ * @param frame WebSocketFrame * frame with the payload, the reference of the caller is taken over
+ * @param opcode WSopcode_t
+ * @param length size_t         length of the payload
+ * @param fin bool              can be used to send data in more then one frame (set fin on the last frame)
+ * @return true if the frame was queued
+ */
+bool ClientConnection::sendFrame(WebSocketFrame* frame, WSopcode_t opcode, size_t length, bool fin) {
+    bool ret = false;
+
+    if (_isWebSocket && frame->encodeHeader(opcode, length, fin)) {
+        if (fin && ((opcode == WSop_text) || (opcode == WSop_binary))) {
+            ret = (queueMessage(opcode, frame->payload(), length, frame) == WSqueue_ok);
+        } else if (opcode & 0x08) {
+            ret = queueControlFrame(frame);
         } else {
-            dataMaskPtr = payloadPtr;
-        }
-
-        for(int x = 0; x < length; x++) {
-            dataMaskPtr[x] = (dataMaskPtr[x] ^ maskKey[x % 4]);
-        }
-    }
-
-    if(headerToPayload) {
-        // header has be added to payload
-        // payload is forced to reserved 14 Byte but we may not need all based on the length and mask settings
-        // offset in payload is calculatetd 14 - headerSize
-        if(_socket->send(&payloadPtr[(WEBSOCKETS_MAX_HEADER_SIZE - headerSize)], (length + headerSize)) != (length + headerSize)) {
-            ret = false;
-        }
-    } else {
-        // send header
-        if(_socket->send(&buffer[0], headerSize) != headerSize) {
-            ret = false;
-        }
-
-        if(payloadPtr && length > 0) {
-            // send payload
-            if(_socket->send(&payloadPtr[0], length) != length) {
-                ret = false;
-            }
+            ret = (queueFrame(frame) == WSqueue_ok);
         }
     }
-
-    //DEBUG_WEBSOCKETS("[WS][sendFrame] sending Frame Done (%luus).\n", (micros() - start));
-
-//#ifdef WEBSOCKETS_USE_BIG_MEM
-    if(useInternBuffer && payloadPtr) {
-        free(payloadPtr);
-    }
-//#endif
+    frame->release();
 
     return ret;
 }
@@ -26,12 +26,39 @@
 #include "mbed.h"
 #include "http_request_parser.h"
 #include "WebSocketHandler.h"
+#include "WebSocketDeflate.h"
+#include "WebSocketUtf8.h"
 #include <string>
 #include <map>
 
 // max size of the WS Message Header
 #define WEBSOCKETS_MAX_HEADER_SIZE (14)
 
+// number of frames that can be queued for sending per websocket
+#ifndef WEBSOCKET_TX_QUEUE_SIZE
+#define WEBSOCKET_TX_QUEUE_SIZE (8)
+#endif
+
+// small frames are collected in a buffer of this size and written with one send
+#ifndef WEBSOCKET_TX_COALESCE_SIZE
+#define WEBSOCKET_TX_COALESCE_SIZE (536)
+#endif
+
+// permessage-deflate (RFC 7692), window and buffer sizes see WebSocketDeflate.h
+#ifndef WEBSOCKET_DEFLATE
+#define WEBSOCKET_DEFLATE (1)
+#endif
+
+// keep the inflate window between client messages, else client_no_context_takeover is requested
+#ifndef WEBSOCKET_DEFLATE_CLIENT_CONTEXT_TAKEOVER
+#define WEBSOCKET_DEFLATE_CLIENT_CONTEXT_TAKEOVER (1)
+#endif
+
+// max. time in ms for sending the close frame when the websocket ends
+#ifndef WEBSOCKET_CLOSE_TIMEOUT
+#define WEBSOCKET_CLOSE_TIMEOUT (1000)
+#endif
+
 typedef enum {
     WSC_NOT_CONNECTED,
     WSC_HEADER,
@@ -77,11 +104,37 @@ typedef struct {
     uint8_t * maskKey;
 } WSMessageHeader_t;
 
+typedef enum {
+    WSoverflow_reject,          ///< queue full: the new frame is not queued
+    WSoverflow_dropOldest,      ///< queue full: the oldest queued complete data message is dropped,
+                                ///< control frames and fragments are kept. Rejected if there is none.
+    WSoverflow_disconnect       ///< queue full: the slow connection is closed
+} WSoverflow_t;
+
+typedef enum {
+    WSqueue_ok,
+    WSqueue_droppedOldest,
+    WSqueue_rejected,
+    WSqueue_disconnect,
+    WSqueue_notConnected
+} WSqueueResult_t;
+
+typedef struct {
+    uint32_t framesQueued;          ///< frames accepted by queueFrame()
+    uint32_t framesSent;            ///< frames completely written to the socket
+    uint32_t framesDropped;         ///< frames rejected or dropped because the queue was full
+    uint32_t socketSends;           ///< socket send calls, less than framesSent when frames were coalesced
+    uint32_t latencyMax_us;         ///< max. time from frame creation to socket
+    uint32_t latencyAvg_us;         ///< avg. time from frame creation to socket
+} WSTxStats_t;
+
 
 
 
 typedef HttpResponse ParsedHttpRequest;
 class HttpServer;
+class WebSocketFrame;
+class WebSocketBroadcast;
 
 class ClientConnection {
 public:
@@ -92,16 +145,53 @@ public:
     bool isIdle() {return !_socketIsOpen; };
 
     // Websocket functions
-    uint8_t createHeader(uint8_t * buf, WSopcode_t opcode, size_t length, bool mask, uint8_t maskKey[4], bool fin);
+    static uint8_t createHeader(uint8_t * buf, WSopcode_t opcode, size_t length, bool mask, uint8_t maskKey[4], bool fin);
     bool sendFrameHeader(WSopcode_t opcode, int length = 0, bool fin = true);
     bool sendFrame(WSopcode_t opcode, uint8_t * payload = NULL, int length = 0, bool fin = true, bool headerToPayload = false);
+    bool sendFrame(WebSocketFrame* frame, WSopcode_t opcode, size_t length, bool fin = true);
+
+    // queue an encoded frame, takes a reference. Can be called from any thread
+    WSqueueResult_t queueFrame(WebSocketFrame* frame, WSoverflow_t policy = WSoverflow_reject);
+    // queue a complete text or binary message, compressed with permessage-deflate if it gets smaller.
+    // plain is the uncompressed frame, created from the payload if NULL. Can be called from any thread
+    WSqueueResult_t queueMessage(WSopcode_t opcode, const uint8_t* payload, size_t length, WebSocketFrame* plain,
+                                 WSoverflow_t policy = WSoverflow_reject);
+    WebSocketBroadcast* getBroadcast() { return _broadcast; };
+    bool isDeflateEnabled() { return _deflate; };
+    // messages are compressed against the previous ones of this connection, a broadcast can't share them
+    bool hasServerContextTakeover() { return _deflateServerContextTakeover; };
+    // negotiated Sec-WebSocket-Protocol, NULL if none
+    const char* getSubprotocol() { return _subprotocol; };
+
+    // bytes queued but not yet written to the socket, like bufferedAmount in the browser API
+    uint32_t getBufferedAmount() { return _bufferedAmount; };
+    bool isTxQueueFull() { return _txQueue.full(); };
+    void getTxStats(WSTxStats_t* stats);
+
+    // request a keepalive ping, ISR safe
+    void keepaliveTick();
 
 private:
     void receiveData();
+    void runWebSocket();
+    bool flushTxQueue();
+    void fillTxBuffer();
+    void clearTxQueue();
+    void frameSent(uint32_t timestamp, WebSocketBroadcast* broadcast);
+    void onSocketEvent();
     bool handleWebSocket(int size);
+    int decodeFrameHeader(const uint8_t* ptr, size_t size);
+    bool beginFrame();
+    bool endFrame();
+    bool handleControlFrame();
+    bool failWebSocket(uint16_t code);
     void handleUpgradeRequest();
     char* base64Encode(const uint8_t* data, size_t size, char* outputBuffer, size_t outputBufferSize);
-    bool sendUpgradeResponse(const char* key);
+    bool sendUpgradeResponse(const char* key, const char* extensions, const char* subprotocol);
+    WebSocketFrame* removeOldestMessage();
+    bool queueControlFrame(WebSocketFrame* frame);
+    bool negotiateDeflate(const char* offers, char* response, size_t responseSize);
+    int inflateMessage(const uint8_t* data, size_t length);
 
     Semaphore _semWaitForSocket;
     bool _socketIsOpen;
@@ -111,11 +201,63 @@ private:
     ParsedHttpRequest _response;
     HttpParser _parser;
     bool _isWebSocket;
-    bool _mPrevFin;
+    int _missedPongs;
     bool _cIsClient;
     uint8_t _recv_buffer[HTTP_RECEIVE_BUFFER_SIZE];
+
+    // receive decoder, _recv_buffer holds the assembled message followed by unparsed bytes
+    size_t _rxEnd;                                              // end of the received bytes
+    size_t _rxMessageLen;                                       // assembled payload at the start of _recv_buffer
+    uint64_t _rxRemaining;                                      // payload bytes of the current frame still to come
+    bool _rxInFrame;                                            // header decoded, payload follows
+    bool _rxFin;
+    bool _rxRsv1;
+    uint8_t _rxOpcode;
+    uint8_t _rxMaskKey[4];
+    uint8_t _rxMaskPos;
+    uint8_t _rxMessageOpcode;                                   // text/binary message in progress, 0 if none
+    bool _rxCompressed;
+    bool _rxStreaming;                                          // current message goes to onMessageData()
+    WebSocketUtf8Validator _rxUtf8;                             // state of the text message across frames
+    uint8_t _rxControl[125];                                    // payload of ping/pong/close
+    size_t _rxControlLen;
+    uint16_t _closeCode;
+    bool _closeSent;
     Callback<void(ParsedHttpRequest* request, TCPSocket* socket)> _handler;
     WebSocketHandler* _webSocketHandler;
+
+    // websocket send queue, written by any thread, sent by the connection thread
+    EventFlags _wsFlags;
+    CircularBuffer<WebSocketFrame*, WEBSOCKET_TX_QUEUE_SIZE> _txQueue;
+    WebSocketFrame* _txControl[3];                              // pong, ping, close: never rejected by a full _txQueue
+    WebSocketFrame* _txFrame;                                   // large frame, sent without copy after _txBuffer
+    size_t _txOffset;
+    uint8_t _txBuffer[WEBSOCKET_TX_COALESCE_SIZE];              // coalesced small frames
+    size_t _txBufferLen;
+    struct {
+        uint32_t timestamp;
+        WebSocketBroadcast* broadcast;
+    } _txBufferFrames[WEBSOCKET_TX_QUEUE_SIZE];                 // frames in _txBuffer, for latency
+    int _txBufferFrameCount;
+    volatile uint32_t _bufferedAmount;
+    WSTxStats_t _txStats;
+    uint64_t _txLatencySum_us;
+    WebSocketBroadcast* _broadcast;
+    const char* _subprotocol;
+
+    // permessage-deflate
+    bool _deflate;
+    bool _deflateServerContextTakeover;
+#if WEBSOCKET_DEFLATE
+    int _deflateClientWindowBits;
+    bool _deflateClientContextTakeover;
+    Mutex _deflateMutex;                                        // compress and queue in history order
+#if WEBSOCKET_DEFLATE_SERVER_CONTEXT_TAKEOVER
+    WSDeflateWindow_t _deflateHistory;                          // the client's window of our messages
+#endif
+    WSInflateWindow_t _inflateWindow;
+    uint8_t _inflateBuffer[WEBSOCKET_DEFLATE_BUFFER_SIZE + 1];     // +1 for NUL of text messages
+#endif
 };
 
 
@@ -0,0 +1,504 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "Msgpack.h"
+#include <string.h>
+
+#define MP_NIL      0xc0
+#define MP_FALSE    0xc2
+#define MP_TRUE     0xc3
+#define MP_BIN8     0xc4
+#define MP_BIN16    0xc5
+#define MP_BIN32    0xc6
+#define MP_FLOAT32  0xca
+#define MP_FLOAT64  0xcb
+#define MP_UINT8    0xcc
+#define MP_UINT16   0xcd
+#define MP_UINT32   0xce
+#define MP_UINT64   0xcf
+#define MP_INT8     0xd0
+#define MP_INT16    0xd1
+#define MP_INT32    0xd2
+#define MP_INT64    0xd3
+#define MP_STR8     0xd9
+#define MP_STR16    0xda
+#define MP_STR32    0xdb
+#define MP_ARRAY16  0xdc
+#define MP_ARRAY32  0xdd
+#define MP_MAP16    0xde
+#define MP_MAP32    0xdf
+
+// max. nesting of skip()
+#define MP_MAX_DEPTH 8
+
+/*
+ * MsgpackReader
+ */
+
+MsgpackReader::MsgpackReader(const uint8_t* data, size_t size)
+{
+    _data = data;
+    _size = size;
+    _pos = 0;
+    _error = false;
+}
+
+bool MsgpackReader::get(size_t n, const uint8_t** ptr)
+{
+    if (_error || (n > _size - _pos)) {
+        return fail();
+    }
+    *ptr = _data + _pos;
+    _pos += n;
+    return true;
+}
+
+uint32_t MsgpackReader::getBE(const uint8_t* ptr, int n)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < n; i++) {
+        value = (value << 8) | ptr[i];
+    }
+    return value;
+}
+
+MPtype_t MsgpackReader::peekType()
+{
+    if (_error || (_pos >= _size)) {
+        return MPtype_invalid;
+    }
+
+    uint8_t c = _data[_pos];
+    if ((c <= 0x7f) || (c >= 0xe0)) {
+        return MPtype_int;
+    }
+    if ((c & 0xe0) == 0xa0) {
+        return MPtype_str;
+    }
+    if ((c & 0xf0) == 0x90) {
+        return MPtype_array;
+    }
+    if ((c & 0xf0) == 0x80) {
+        return MPtype_map;
+    }
+
+    switch (c) {
+        case MP_NIL:
+            return MPtype_nil;
+        case MP_FALSE:
+        case MP_TRUE:
+            return MPtype_bool;
+        case MP_BIN8: case MP_BIN16: case MP_BIN32:
+            return MPtype_bin;
+        case MP_FLOAT32: case MP_FLOAT64:
+            return MPtype_float;
+        case MP_UINT8: case MP_UINT16: case MP_UINT32: case MP_UINT64:
+        case MP_INT8: case MP_INT16: case MP_INT32: case MP_INT64:
+            return MPtype_int;
+        case MP_STR8: case MP_STR16: case MP_STR32:
+            return MPtype_str;
+        case MP_ARRAY16: case MP_ARRAY32:
+            return MPtype_array;
+        case MP_MAP16: case MP_MAP32:
+            return MPtype_map;
+        default:
+            return MPtype_invalid;                      // ext types are not supported
+    }
+}
+
+bool MsgpackReader::readNil()
+{
+    const uint8_t* p;
+    if ((peekType() != MPtype_nil) || !get(1, &p)) {
+        return fail();
+    }
+    return true;
+}
+
+bool MsgpackReader::readBool(bool* value)
+{
+    const uint8_t* p;
+    if ((peekType() != MPtype_bool) || !get(1, &p)) {
+        return fail();
+    }
+    *value = (*p == MP_TRUE);
+    return true;
+}
+
+bool MsgpackReader::readInt64(int64_t* value)
+{
+    const uint8_t* p;
+    if ((peekType() != MPtype_int) || !get(1, &p)) {
+        return fail();
+    }
+
+    uint8_t c = *p;
+    if (c <= 0x7f) {
+        *value = c;
+        return true;
+    }
+    if (c >= 0xe0) {
+        *value = (int8_t)c;
+        return true;
+    }
+
+    int n = 1 << ((c - MP_UINT8) & 3);                  // 1, 2, 4, 8 bytes
+    if (!get(n, &p)) {
+        return false;
+    }
+    uint64_t raw = (n == 8) ? (((uint64_t)getBE(p, 4) << 32) | getBE(p + 4, 4)) : getBE(p, n);
+
+    if (c <= MP_UINT64) {
+        if ((c == MP_UINT64) && (raw >> 63)) {
+            return fail();
+        }
+        *value = (int64_t)raw;
+    } else {
+        switch (n) {
+            case 1: *value = (int8_t)raw; break;
+            case 2: *value = (int16_t)raw; break;
+            case 4: *value = (int32_t)raw; break;
+            default: *value = (int64_t)raw; break;
+        }
+    }
+    return true;
+}
+
+bool MsgpackReader::readInt(int32_t* value)
+{
+    int64_t v;
+    if (!readInt64(&v) || (v < INT32_MIN) || (v > INT32_MAX)) {
+        return fail();
+    }
+    *value = (int32_t)v;
+    return true;
+}
+
+bool MsgpackReader::readUint(uint32_t* value)
+{
+    int64_t v;
+    if (!readInt64(&v) || (v < 0) || (v > UINT32_MAX)) {
+        return fail();
+    }
+    *value = (uint32_t)v;
+    return true;
+}
+
+bool MsgpackReader::readFloat(float* value)
+{
+    MPtype_t type = peekType();
+
+    if (type == MPtype_int) {
+        int64_t v;
+        if (!readInt64(&v)) {
+            return false;
+        }
+        *value = (float)v;
+        return true;
+    }
+
+    const uint8_t* p;
+    if ((type != MPtype_float) || !get(1, &p)) {
+        return fail();
+    }
+    if (*p == MP_FLOAT32) {
+        if (!get(4, &p)) {
+            return false;
+        }
+        uint32_t bits = getBE(p, 4);
+        memcpy(value, &bits, sizeof(float));
+    } else {
+        if (!get(8, &p)) {
+            return false;
+        }
+        uint64_t bits = ((uint64_t)getBE(p, 4) << 32) | getBE(p + 4, 4);
+        double d;
+        memcpy(&d, &bits, sizeof(double));
+        *value = (float)d;
+    }
+    return true;
+}
+
+bool MsgpackReader::readLength(uint8_t fixMask, uint8_t fixBase, uint8_t code8, uint8_t code16, uint8_t code32, uint32_t* length)
+{
+    const uint8_t* p;
+    if (!get(1, &p)) {
+        return false;
+    }
+
+    uint8_t c = *p;
+    int n;
+    if (fixMask && ((c & ~fixMask) == fixBase)) {
+        *length = c & fixMask;
+        return true;
+    } else if (code8 && (c == code8)) {
+        n = 1;
+    } else if (c == code16) {
+        n = 2;
+    } else if (c == code32) {
+        n = 4;
+    } else {
+        return fail();
+    }
+
+    if (!get(n, &p)) {
+        return false;
+    }
+    *length = getBE(p, n);
+    return true;
+}
+
+bool MsgpackReader::readStr(const char** str, size_t* length)
+{
+    uint32_t len;
+    const uint8_t* p;
+    if ((peekType() != MPtype_str) || !readLength(0x1f, 0xa0, MP_STR8, MP_STR16, MP_STR32, &len) || !get(len, &p)) {
+        return fail();
+    }
+    *str = (const char*)p;
+    *length = len;
+    return true;
+}
+
+bool MsgpackReader::readBin(const uint8_t** data, size_t* length)
+{
+    uint32_t len;
+    if ((peekType() != MPtype_bin) || !readLength(0, 0, MP_BIN8, MP_BIN16, MP_BIN32, &len) || !get(len, data)) {
+        return fail();
+    }
+    *length = len;
+    return true;
+}
+
+bool MsgpackReader::readArray(uint32_t* count)
+{
+    if ((peekType() != MPtype_array) || !readLength(0x0f, 0x90, 0, MP_ARRAY16, MP_ARRAY32, count)) {
+        return fail();
+    }
+    return true;
+}
+
+bool MsgpackReader::readMap(uint32_t* count)
+{
+    if ((peekType() != MPtype_map) || !readLength(0x0f, 0x80, 0, MP_MAP16, MP_MAP32, count)) {
+        return fail();
+    }
+    return true;
+}
+
+bool MsgpackReader::skip()
+{
+    // iterative, counts the objects still to skip per nesting level
+    uint32_t pending[MP_MAX_DEPTH];
+    int depth = 0;
+    pending[0] = 1;
+
+    while (depth >= 0) {
+        if (pending[depth] == 0) {
+            depth--;
+            continue;
+        }
+        pending[depth]--;
+
+        uint32_t count = 0;
+        bool ok;
+        switch (peekType()) {
+            case MPtype_nil: {
+                ok = readNil();
+                break;
+            }
+            case MPtype_bool: {
+                bool b;
+                ok = readBool(&b);
+                break;
+            }
+            case MPtype_int: {
+                int64_t i;
+                ok = readInt64(&i);
+                break;
+            }
+            case MPtype_float: {
+                float f;
+                ok = readFloat(&f);
+                break;
+            }
+            case MPtype_str: {
+                const char* s;
+                size_t len;
+                ok = readStr(&s, &len);
+                break;
+            }
+            case MPtype_bin: {
+                const uint8_t* b;
+                size_t len;
+                ok = readBin(&b, &len);
+                break;
+            }
+            case MPtype_array: {
+                ok = readArray(&count);
+                break;
+            }
+            case MPtype_map: {
+                ok = readMap(&count);
+                count *= 2;
+                break;
+            }
+            default:
+                ok = fail();
+                break;
+        }
+        if (!ok) {
+            return false;
+        }
+
+        if (count > 0) {
+            if (depth + 1 >= MP_MAX_DEPTH) {
+                return fail();
+            }
+            pending[++depth] = count;
+        }
+    }
+    return true;
+}
+
+/*
+ * MsgpackWriter
+ */
+
+MsgpackWriter::MsgpackWriter(uint8_t* buffer, size_t size)
+{
+    _buffer = buffer;
+    _size = size;
+    _pos = 0;
+    _overflow = false;
+}
+
+bool MsgpackWriter::putBytes(const void* data, size_t length)
+{
+    if (_overflow || (length > _size - _pos)) {
+        _overflow = true;
+        return false;
+    }
+    memcpy(_buffer + _pos, data, length);
+    _pos += length;
+    return true;
+}
+
+// code followed by n bytes of value, big endian
+bool MsgpackWriter::put(uint8_t code, uint32_t value, int n)
+{
+    uint8_t buf[5];
+    buf[0] = code;
+    for (int i = 0; i < n; i++) {
+        buf[1 + i] = value >> (8 * (n - 1 - i));
+    }
+    return putBytes(buf, 1 + n);
+}
+
+bool MsgpackWriter::putLength(uint32_t length, uint8_t fixBase, uint32_t fixMax, uint8_t code8, uint8_t code16, uint8_t code32)
+{
+    // fixBase 0: no fix format, like bin
+    if (fixBase && (length <= fixMax)) {
+        return put(fixBase | length, 0, 0);
+    }
+    if (code8 && (length <= 0xff)) {
+        return put(code8, length, 1);
+    }
+    if (length <= 0xffff) {
+        return put(code16, length, 2);
+    }
+    return put(code32, length, 4);
+}
+
+bool MsgpackWriter::writeNil()
+{
+    return put(MP_NIL, 0, 0);
+}
+
+bool MsgpackWriter::writeBool(bool value)
+{
+    return put(value ? MP_TRUE : MP_FALSE, 0, 0);
+}
+
+bool MsgpackWriter::writeUint(uint32_t value)
+{
+    if (value <= 0x7f) {
+        return put(value, 0, 0);
+    }
+    if (value <= 0xff) {
+        return put(MP_UINT8, value, 1);
+    }
+    if (value <= 0xffff) {
+        return put(MP_UINT16, value, 2);
+    }
+    return put(MP_UINT32, value, 4);
+}
+
+bool MsgpackWriter::writeInt(int32_t value)
+{
+    if (value >= 0) {
+        return writeUint(value);
+    }
+    if (value >= -32) {
+        return put((uint8_t)value, 0, 0);
+    }
+    if (value >= INT8_MIN) {
+        return put(MP_INT8, (uint8_t)value, 1);
+    }
+    if (value >= INT16_MIN) {
+        return put(MP_INT16, (uint16_t)value, 2);
+    }
+    return put(MP_INT32, (uint32_t)value, 4);
+}
+
+bool MsgpackWriter::writeFloat(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return put(MP_FLOAT32, bits, 4);
+}
+
+bool MsgpackWriter::writeStr(const char* str)
+{
+    return writeStr(str, strlen(str));
+}
+
+bool MsgpackWriter::writeStr(const char* str, size_t length)
+{
+    return putLength(length, 0xa0, 31, MP_STR8, MP_STR16, MP_STR32) && putBytes(str, length);
+}
+
+bool MsgpackWriter::writeBin(const uint8_t* data, size_t length)
+{
+    return putLength(length, 0, 0, MP_BIN8, MP_BIN16, MP_BIN32) && ((length == 0) || putBytes(data, length));
+}
+
+bool MsgpackWriter::writeArray(uint32_t count)
+{
+    return putLength(count, 0x90, 15, 0, MP_ARRAY16, MP_ARRAY32);
+}
+
+bool MsgpackWriter::writeMap(uint32_t count)
+{
+    return putLength(count, 0x80, 15, 0, MP_MAP16, MP_MAP32);
+}
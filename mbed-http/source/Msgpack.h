@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * MessagePack subset for the WebSocket RPC subprotocol
+ *
+ * nil, bool, int/uint up to 32 bit, float 32/64, str, bin, array and map.
+ * The reader works in place, strings and binary data point into the message.
+ * The writer encodes into a caller supplied buffer. No heap is used.
+ */
+
+#ifndef __Msgpack_h__
+#define __Msgpack_h__
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+    MPtype_invalid,
+    MPtype_nil,
+    MPtype_bool,
+    MPtype_int,
+    MPtype_float,
+    MPtype_str,
+    MPtype_bin,
+    MPtype_array,
+    MPtype_map
+} MPtype_t;
+
+class MsgpackReader {
+public:
+    MsgpackReader(const uint8_t* data, size_t size);
+
+    MPtype_t peekType();
+    bool isNil() { return peekType() == MPtype_nil; };
+
+    bool readNil();
+    bool readBool(bool* value);
+    bool readInt(int32_t* value);
+    bool readUint(uint32_t* value);
+    bool readFloat(float* value);                       // float or int
+    bool readStr(const char** str, size_t* length);     // not NUL terminated
+    bool readBin(const uint8_t** data, size_t* length);
+    bool readArray(uint32_t* count);
+    bool readMap(uint32_t* count);
+
+    // skip one object including nested arrays and maps
+    bool skip();
+
+    size_t getPosition() { return _pos; };
+    size_t getRemaining() { return _size - _pos; };
+    bool hasError() { return _error; };
+
+private:
+    bool readInt64(int64_t* value);
+    bool readLength(uint8_t fixMask, uint8_t fixBase, uint8_t code8, uint8_t code16, uint8_t code32, uint32_t* length);
+    bool get(size_t n, const uint8_t** ptr);
+    uint32_t getBE(const uint8_t* ptr, int n);
+    bool fail() { _error = true; return false; };
+
+    const uint8_t* _data;
+    size_t _size;
+    size_t _pos;
+    bool _error;
+};
+
+class MsgpackWriter {
+public:
+    MsgpackWriter(uint8_t* buffer, size_t size);
+
+    bool writeNil();
+    bool writeBool(bool value);
+    bool writeInt(int32_t value);
+    bool writeUint(uint32_t value);
+    bool writeFloat(float value);
+    bool writeStr(const char* str);
+    bool writeStr(const char* str, size_t length);
+    bool writeBin(const uint8_t* data, size_t length);
+    bool writeArray(uint32_t count);
+    bool writeMap(uint32_t count);
+
+    size_t getSize() { return _pos; };
+    void setPosition(size_t pos) { if (pos <= _pos) { _pos = pos; _overflow = false; } };
+    bool hasOverflow() { return _overflow; };
+
+private:
+    bool put(uint8_t code, uint32_t value, int n);
+    bool putLength(uint32_t length, uint8_t fixBase, uint32_t fixMax, uint8_t code8, uint8_t code16, uint8_t code32);
+    bool putBytes(const void* data, size_t length);
+
+    uint8_t* _buffer;
+    size_t _size;
+    size_t _pos;
+    bool _overflow;
+};
+
+#endif
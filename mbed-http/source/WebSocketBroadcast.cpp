@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "WebSocketBroadcast.h"
+#include "WebSocketFrame.h"
+
+WebSocketBroadcast::WebSocketBroadcast(WSoverflow_t policy)
+{
+    _policy = policy;
+    resetStats();
+}
+
+void WebSocketBroadcast::join(ClientConnection* connection)
+{
+    _mutex.lock();
+    _members.push_back(connection);
+    _mutex.unlock();
+}
+
+void WebSocketBroadcast::leave(ClientConnection* connection)
+{
+    _mutex.lock();
+    vector<ClientConnection*>::iterator it = _members.begin();
+    while (it != _members.end()) {
+        if (*it == connection) {
+            it = _members.erase(it);
+        } else {
+            it++;
+        }
+    }
+    _mutex.unlock();
+}
+
+int WebSocketBroadcast::getMemberCount()
+{
+    _mutex.lock();
+    int count = _members.size();
+    _mutex.unlock();
+
+    return count;
+}
+
+int WebSocketBroadcast::broadcast(WSopcode_t opcode, const uint8_t* payload, size_t length)
+{
+    if (getMemberCount() == 0) {
+        return 0;                                       // nobody listening, don't encode
+    }
+
+    WebSocketFrame* frame = WebSocketFrame::allocPayload(length);
+    if (!frame) {
+        return -1;
+    }
+    if (payload && length > 0) {
+        memcpy(frame->payload(), payload, length);
+    }
+
+    return broadcast(frame, opcode, length);
+}
+
+int WebSocketBroadcast::broadcast(WebSocketFrame* frame, WSopcode_t opcode, size_t length)
+{
+    int queued = 0;
+
+    if (!frame->encodeHeader(opcode, length)) {
+        frame->release();
+        return -1;
+    }
+    frame->setBroadcast(this);
+
+    // encoded once, every member queue takes its own reference.
+    // Members with permessage-deflate share a second, compressed frame,
+    // members with server context takeover get their own.
+    WebSocketFrame* deflated = NULL;
+    bool deflateFailed = false;
+
+    _mutex.lock();
+    if (!_members.empty()) {
+        core_util_atomic_incr_u32(&_framesBroadcast, 1);
+    }
+
+    for (vector<ClientConnection*>::iterator it = _members.begin(); it != _members.end(); it++) {
+        WSqueueResult_t result;
+        if ((*it)->hasServerContextTakeover()) {
+            // compressed against the previous messages of this member
+            result = (*it)->queueMessage(opcode, frame->payload(), length, frame, _policy);
+        } else {
+            WebSocketFrame* memberFrame = frame;
+            if ((*it)->isDeflateEnabled() && !deflateFailed) {
+                if (!deflated) {
+                    // not compressible: send the plain frame
+                    deflated = WebSocketFrame::createDeflated(opcode, frame->payload(), length);
+                    deflateFailed = (deflated == NULL);
+                    if (deflated) {
+                        deflated->setBroadcast(this);
+                    }
+                }
+                if (deflated) {
+                    memberFrame = deflated;
+                }
+            }
+            result = (*it)->queueFrame(memberFrame, _policy);
+        }
+
+        switch (result) {
+            case WSqueue_ok:
+                queued++;
+                break;
+            case WSqueue_droppedOldest:
+                queued++;
+                core_util_atomic_incr_u32(&_framesDropped, 1);
+                break;
+            case WSqueue_disconnect:
+                core_util_atomic_incr_u32(&_framesDropped, 1);
+                core_util_atomic_incr_u32(&_slowDisconnects, 1);
+                break;
+            default:
+                core_util_atomic_incr_u32(&_framesDropped, 1);
+                break;
+        }
+    }
+    core_util_atomic_incr_u32(&_framesQueued, queued);
+    _mutex.unlock();
+
+    // drop the creator references
+    frame->release();
+    if (deflated) {
+        deflated->release();
+    }
+
+    return queued;
+}
+
+void WebSocketBroadcast::frameDelivered(uint32_t latency_us)
+{
+    core_util_atomic_incr_u32(&_framesDelivered, 1);
+
+    CriticalSectionLock lock;
+    _latencySum_us += latency_us;
+    if (latency_us > _latencyMax_us) {
+        _latencyMax_us = latency_us;
+    }
+}
+
+void WebSocketBroadcast::getStats(WSBroadcastStats_t* stats)
+{
+    CriticalSectionLock lock;
+    stats->framesBroadcast = _framesBroadcast;
+    stats->framesQueued = _framesQueued;
+    stats->framesDelivered = _framesDelivered;
+    stats->framesDropped = _framesDropped;
+    stats->slowDisconnects = _slowDisconnects;
+    stats->latencyMax_us = _latencyMax_us;
+    stats->latencyAvg_us = _framesDelivered ? (uint32_t)(_latencySum_us / _framesDelivered) : 0;
+}
+
+void WebSocketBroadcast::resetStats()
+{
+    CriticalSectionLock lock;
+    _framesBroadcast = 0;
+    _framesQueued = 0;
+    _framesDelivered = 0;
+    _framesDropped = 0;
+    _slowDisconnects = 0;
+    _latencyMax_us = 0;
+    _latencySum_us = 0;
+}
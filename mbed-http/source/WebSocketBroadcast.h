@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __WebSocketBroadcast_h__
+#define __WebSocketBroadcast_h__
+
+#include "mbed.h"
+#include "ClientConnection.h"
+#include <vector>
+
+class WebSocketFrame;
+
+typedef struct {
+    uint32_t framesBroadcast;       ///< number of broadcast() calls that encoded a frame
+    uint32_t framesQueued;          ///< frames put into a connection queue
+    uint32_t framesDelivered;       ///< frames completely written to a socket
+    uint32_t framesDropped;         ///< frames dropped because a queue was full
+    uint32_t slowDisconnects;       ///< connections closed by WSoverflow_disconnect
+    uint32_t latencyMax_us;         ///< max. time from broadcast() to socket
+    uint32_t latencyAvg_us;         ///< avg. time from broadcast() to socket
+} WSBroadcastStats_t;
+
+/**
+ * \brief WebSocketBroadcast sends one frame to all WebSocket connections of a path.
+ *
+ * The frame is encoded once into a refcounted WebSocketFrame and queued on
+ * every member, so the cost of a broadcast does not grow with the number of
+ * clients. Each connection writes its queue from its own thread, a slow client
+ * only fills its own queue and is handled by the overflow policy.
+ * Connections with permessage-deflate server context takeover are the
+ * exception, the message is compressed against the history of each of them.
+ */
+class WebSocketBroadcast {
+public:
+    WebSocketBroadcast(WSoverflow_t policy = WSoverflow_dropOldest);
+
+    void setOverflowPolicy(WSoverflow_t policy) { _policy = policy; };
+    WSoverflow_t getOverflowPolicy() { return _policy; };
+
+    void join(ClientConnection* connection);
+    void leave(ClientConnection* connection);
+    int getMemberCount();
+
+    /**
+     * Send a frame to all members
+     *
+     * @param opcode    WSopcode_t
+     * @param payload   ptr to the payload
+     * @param length    length of the payload
+     * @return number of connections the frame was queued on, -1 if out of memory
+     */
+    int broadcast(WSopcode_t opcode, const uint8_t* payload, size_t length);
+
+    /**
+     * Send a frame from WebSocketFrame::allocPayload() to all members, the
+     * payload is not copied
+     *
+     * @param frame     frame with the payload written to payload(), the reference
+     *                  of the caller is taken over
+     * @param length    length of the payload
+     * @return number of connections the frame was queued on, -1 if length exceeds the frame
+     */
+    int broadcast(WebSocketFrame* frame, WSopcode_t opcode, size_t length);
+
+    void getStats(WSBroadcastStats_t* stats);
+    void resetStats();
+
+    // called by ClientConnection when a frame of this broadcast was written
+    void frameDelivered(uint32_t latency_us);
+
+private:
+    Mutex _mutex;
+    vector<ClientConnection*> _members;
+    WSoverflow_t _policy;
+
+    volatile uint32_t _framesBroadcast;
+    volatile uint32_t _framesQueued;
+    volatile uint32_t _framesDelivered;
+    volatile uint32_t _framesDropped;
+    volatile uint32_t _slowDisconnects;
+    uint32_t _latencyMax_us;
+    uint64_t _latencySum_us;
+};
+
+#endif
@@ -0,0 +1,519 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "WebSocketDeflate.h"
+#include <string.h>
+
+#define DEFLATE_MIN_MATCH       3
+#define DEFLATE_MAX_MATCH       258
+#define DEFLATE_MAX_DISTANCE    32768
+#define DEFLATE_END_OF_BLOCK    256
+
+static const uint16_t lengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distanceBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distanceExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// order of the code length code lengths in a dynamic block header
+static const uint8_t codeLengthOrder[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static inline uint32_t hash3(const uint8_t* p)
+{
+    uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - WEBSOCKET_DEFLATE_HASH_BITS);
+}
+
+/*
+ * Deflater
+ */
+
+void WebSocketDeflater::putBits(uint32_t value, int count)
+{
+    _bitBuf |= value << _bitCount;
+    _bitCount += count;
+    while (_bitCount >= 8) {
+        if (_outPos < _outSize) {
+            _out[_outPos++] = _bitBuf & 0xFF;
+        } else {
+            _overflow = true;
+        }
+        _bitBuf >>= 8;
+        _bitCount -= 8;
+    }
+}
+
+// huffman codes are stored msb first
+void WebSocketDeflater::putCode(uint32_t code, int length)
+{
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; i++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    putBits(reversed, length);
+}
+
+// fixed literal/length code, RFC 1951 3.2.6
+void WebSocketDeflater::putSymbol(int symbol)
+{
+    if (symbol < 144) {
+        putCode(0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        putCode(0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        putCode(symbol - 256, 7);
+    } else {
+        putCode(0xC0 + symbol - 280, 8);
+    }
+}
+
+void WebSocketDeflater::putMatch(int length, int distance)
+{
+    int code = 28;
+    if (length < DEFLATE_MAX_MATCH) {
+        code = 27;
+        while (lengthBase[code] > length) {
+            code--;
+        }
+    }
+    putSymbol(257 + code);
+    putBits(length - lengthBase[code], lengthExtra[code]);
+
+    code = 29;
+    while (distanceBase[code] > distance) {
+        code--;
+    }
+    putCode(code, 5);
+    putBits(distance - distanceBase[code], distanceExtra[code]);
+}
+
+size_t WebSocketDeflater::deflate(const uint8_t* in, size_t inSize, uint8_t* out, size_t outSize, int windowBits,
+                                  const WSDeflateWindow_t* history)
+{
+#if WEBSOCKET_DEFLATE_SERVER_CONTEXT_TAKEOVER
+    if (history && (history->fill > 0) && (inSize <= WEBSOCKET_DEFLATE_BUFFER_SIZE)) {
+        // the message follows the history, the matches may start in it
+        memcpy(_work, history->window, history->fill);
+        memcpy(&_work[history->fill], in, inSize);
+        return compress(_work, history->fill, history->fill + inSize, out, outSize, windowBits);
+    }
+#else
+    (void)history;
+#endif
+    return compress(in, 0, inSize, out, outSize, windowBits);
+}
+
+void WebSocketDeflater::addHistory(WSDeflateWindow_t* history, const uint8_t* data, size_t length)
+{
+    const size_t size = sizeof(history->window);
+
+    if (length >= size) {
+        memcpy(history->window, &data[length - size], size);
+        history->fill = size;
+        return;
+    }
+
+    size_t keep = size - length;
+    if (keep > history->fill) {
+        keep = history->fill;
+    }
+    memmove(history->window, &history->window[history->fill - keep], keep);
+    memcpy(&history->window[keep], data, length);
+    history->fill = keep + length;
+}
+
+/*
+ * compress data[start..end), back references may reach into data[0..start)
+ */
+size_t WebSocketDeflater::compress(const uint8_t* in, size_t start, size_t inSize, uint8_t* out, size_t outSize, int windowBits)
+{
+    size_t maxDistance = (size_t)1 << windowBits;
+    if (maxDistance > DEFLATE_MAX_DISTANCE) {
+        maxDistance = DEFLATE_MAX_DISTANCE;
+    }
+
+    _out = out;
+    _outPos = 0;
+    _outSize = outSize;
+    _bitBuf = 0;
+    _bitCount = 0;
+    _overflow = false;
+    memset(_head, 0, sizeof(_head));                    // entries are position + 1, 0 is empty
+
+    putBits(0, 1);                                      // BFINAL = 0, the message ends with a sync flush
+    putBits(1, 2);                                      // BTYPE = 01, fixed huffman
+
+    for (size_t j = 0; (j < start) && (j + DEFLATE_MIN_MATCH <= inSize); j++) {
+        _head[hash3(&in[j])] = (uint16_t)(j + 1);
+    }
+
+    size_t i = start;
+    while ((i < inSize) && !_overflow) {
+        if (i + DEFLATE_MIN_MATCH <= inSize) {
+            uint32_t h = hash3(&in[i]);
+            uint32_t entry = _head[h];
+            _head[h] = (uint16_t)(i + 1);
+
+            // the table only holds 16 bit, restore the upper bits of the position
+            size_t candidate = ((i + 1) & ~(size_t)0xFFFF) | entry;
+            if (candidate > i + 1) {
+                candidate -= 0x10000;
+            }
+
+            if ((entry != 0) && (candidate > 0) && (i - (candidate - 1) <= maxDistance)) {
+                const uint8_t* match = &in[candidate - 1];
+                if ((match[0] == in[i]) && (match[1] == in[i + 1]) && (match[2] == in[i + 2])) {
+                    size_t maxLength = inSize - i;
+                    if (maxLength > DEFLATE_MAX_MATCH) {
+                        maxLength = DEFLATE_MAX_MATCH;
+                    }
+                    size_t length = DEFLATE_MIN_MATCH;
+                    while ((length < maxLength) && (match[length] == in[i + length])) {
+                        length++;
+                    }
+
+                    putMatch(length, &in[i] - match);
+
+                    // insert the skipped positions, they are the most likely next matches
+                    for (size_t j = i + 1; (j < i + length) && (j + DEFLATE_MIN_MATCH <= inSize); j++) {
+                        _head[hash3(&in[j])] = (uint16_t)(j + 1);
+                    }
+                    i += length;
+                    continue;
+                }
+            }
+        }
+
+        putSymbol(in[i]);
+        i++;
+    }
+
+    putSymbol(DEFLATE_END_OF_BLOCK);
+    putBits(0, 3);                                      // empty stored block, BFINAL = 0, BTYPE = 00
+    if (_bitCount > 0) {
+        putBits(0, 8 - _bitCount);                      // LEN/NLEN would follow byte aligned, they are left out
+    }
+
+    return _overflow ? 0 : _outPos;
+}
+
+/*
+ * Inflater
+ */
+
+static const uint8_t deflateTail[4] = { 0x00, 0x00, 0xFF, 0xFF };
+
+void WebSocketInflater::resetWindow(WSInflateWindow_t* window)
+{
+    window->pos = 0;
+    window->fill = 0;
+}
+
+bool WebSocketInflater::buildTree(Tree_t* tree, const uint8_t* lengths, int num)
+{
+    uint16_t offsets[16];
+
+    memset(tree->counts, 0, sizeof(tree->counts));
+    for (int i = 0; i < num; i++) {
+        tree->counts[lengths[i]]++;
+    }
+    tree->counts[0] = 0;
+
+    // reject over-subscribed codes, incomplete codes are allowed (single distance code)
+    int left = 1;
+    for (int len = 1; len < 16; len++) {
+        left = (left << 1) - tree->counts[len];
+        if (left < 0) {
+            return false;
+        }
+    }
+
+    uint16_t sum = 0;
+    for (int len = 0; len < 16; len++) {
+        offsets[len] = sum;
+        sum += tree->counts[len];
+    }
+    for (int i = 0; i < num; i++) {
+        if (lengths[i]) {
+            tree->symbols[offsets[lengths[i]]++] = i;
+        }
+    }
+
+    return true;
+}
+
+int WebSocketInflater::getBit()
+{
+    if (_bitCount == 0) {
+        if (_inPos < _inSize) {
+            _bitBuf = _in[_inPos];
+        } else if (_inPos < _inSize + sizeof(deflateTail)) {
+            _bitBuf = deflateTail[_inPos - _inSize];
+        } else {
+            _error = true;
+            return 0;
+        }
+        _inPos++;
+        _bitCount = 8;
+    }
+
+    int bit = _bitBuf & 1;
+    _bitBuf >>= 1;
+    _bitCount--;
+
+    return bit;
+}
+
+uint32_t WebSocketInflater::getBits(int count)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < count; i++) {
+        value |= (uint32_t)getBit() << i;
+    }
+    return value;
+}
+
+int WebSocketInflater::decodeSymbol(const Tree_t* tree)
+{
+    int sum = 0;
+    int code = 0;
+
+    // canonical code: walk the lengths until the code falls into the range of one length
+    for (int len = 1; len < 16; len++) {
+        code = (code << 1) | getBit();
+        sum += tree->counts[len];
+        code -= tree->counts[len];
+        if (code < 0) {
+            return tree->symbols[sum + code];
+        }
+    }
+
+    _error = true;
+    return -1;
+}
+
+bool WebSocketInflater::putByte(uint8_t c)
+{
+    if (_outPos >= _outSize) {
+        _overflow = true;
+        return false;
+    }
+    _out[_outPos++] = c;
+    _window->window[_window->pos & (_windowSize - 1)] = c;
+    _window->pos++;
+    if (_window->fill < _windowSize) {
+        _window->fill++;
+    }
+    return true;
+}
+
+bool WebSocketInflater::inflateStored()
+{
+    // stored blocks start byte aligned
+    _bitCount = 0;
+
+    uint32_t len = getBits(16);
+    uint32_t nlen = getBits(16);
+    if (_error || (len != (~nlen & 0xFFFF))) {
+        return false;
+    }
+
+    while (len--) {
+        uint8_t c = getBits(8);
+        if (_error || !putByte(c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool WebSocketInflater::inflateBlock(const Tree_t* lit, const Tree_t* dist)
+{
+    while (true) {
+        int symbol = decodeSymbol(lit);
+        if (_error) {
+            return false;
+        }
+
+        if (symbol < 256) {
+            if (!putByte(symbol)) {
+                return false;
+            }
+            continue;
+        }
+        if (symbol == DEFLATE_END_OF_BLOCK) {
+            return true;
+        }
+
+        symbol -= 257;
+        if (symbol >= 29) {
+            return false;
+        }
+        uint32_t length = lengthBase[symbol] + getBits(lengthExtra[symbol]);
+
+        int distSymbol = decodeSymbol(dist);
+        if (_error || (distSymbol < 0) || (distSymbol >= 30)) {
+            return false;
+        }
+        uint32_t distance = distanceBase[distSymbol] + getBits(distanceExtra[distSymbol]);
+
+        // only the negotiated window is kept, the peer must not reference more
+        if (_error || (distance > _window->fill)) {
+            return false;
+        }
+
+        while (length--) {
+            if (!putByte(_window->window[(_window->pos - distance) & (_windowSize - 1)])) {
+                return false;
+            }
+        }
+    }
+}
+
+bool WebSocketInflater::decodeTrees()
+{
+    uint8_t codeLengths[19];
+    Tree_t* codeTree = &_dist;                          // _dist is free until the code lengths are decoded
+
+    int hlit = getBits(5) + 257;
+    int hdist = getBits(5) + 1;
+    int hclen = getBits(4) + 4;
+    if ((hlit > 286) || (hdist > 30)) {
+        return false;
+    }
+
+    memset(codeLengths, 0, sizeof(codeLengths));
+    for (int i = 0; i < hclen; i++) {
+        codeLengths[codeLengthOrder[i]] = getBits(3);
+    }
+    if (_error || !buildTree(codeTree, codeLengths, 19)) {
+        return false;
+    }
+
+    int num = 0;
+    while (num < hlit + hdist) {
+        int symbol = decodeSymbol(codeTree);
+        if (_error) {
+            return false;
+        }
+
+        if (symbol < 16) {
+            _lengths[num++] = symbol;
+            continue;
+        }
+
+        uint8_t value = 0;
+        int repeat;
+        if (symbol == 16) {
+            if (num == 0) {
+                return false;
+            }
+            value = _lengths[num - 1];
+            repeat = 3 + getBits(2);
+        } else if (symbol == 17) {
+            repeat = 3 + getBits(3);
+        } else {
+            repeat = 11 + getBits(7);
+        }
+        if (num + repeat > hlit + hdist) {
+            return false;
+        }
+        while (repeat--) {
+            _lengths[num++] = value;
+        }
+    }
+
+    if (_lengths[DEFLATE_END_OF_BLOCK] == 0) {
+        return false;
+    }
+
+    return buildTree(&_lit, _lengths, hlit) && buildTree(&_dist, &_lengths[hlit], hdist);
+}
+
+int WebSocketInflater::inflate(WSInflateWindow_t* window, int windowBits, const uint8_t* in, size_t inSize, uint8_t* out, size_t outSize)
+{
+    if (windowBits > WEBSOCKET_DEFLATE_CLIENT_MAX_WINDOW_BITS) {
+        return INFLATE_ERROR;
+    }
+
+    _in = in;
+    _inSize = inSize;
+    _inPos = 0;
+    _bitBuf = 0;
+    _bitCount = 0;
+    _error = false;
+    _overflow = false;
+    _window = window;
+    _windowSize = (uint32_t)1 << windowBits;
+    _out = out;
+    _outPos = 0;
+    _outSize = outSize;
+
+    bool final;
+    do {
+        final = getBit();
+        int type = getBits(2);
+        bool ok;
+
+        switch (type) {
+            case 0:
+                ok = inflateStored();
+                break;
+            case 1: {
+                // fixed huffman code, RFC 1951 3.2.6
+                int i = 0;
+                for (; i < 144; i++) _lengths[i] = 8;
+                for (; i < 256; i++) _lengths[i] = 9;
+                for (; i < 280; i++) _lengths[i] = 7;
+                for (; i < 288; i++) _lengths[i] = 8;
+                for (i = 0; i < 30; i++) _lengths[288 + i] = 5;
+                ok = buildTree(&_lit, _lengths, 288) && buildTree(&_dist, &_lengths[288], 30) && inflateBlock(&_lit, &_dist);
+                break;
+            }
+            case 2:
+                ok = decodeTrees() && inflateBlock(&_lit, &_dist);
+                break;
+            default:
+                ok = false;
+                break;
+        }
+
+        if (_overflow) {
+            return INFLATE_OVERFLOW;
+        }
+        if (!ok || _error) {
+            return INFLATE_ERROR;
+        }
+        // the message ends with the (appended) empty stored block
+    } while (!final && (_inPos < _inSize + sizeof(deflateTail)));
+
+    return _outPos;
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * DEFLATE (RFC 1951) for the WebSocket permessage-deflate extension (RFC 7692)
+ *
+ * No heap and no mbed dependencies, all memory is in the objects.
+ * The deflater compresses one message at a time (server_no_context_takeover),
+ * so an encoded frame can be shared by all connections of a broadcast, or
+ * against the previous messages of a connection (server context takeover),
+ * whose last bytes are kept in a WSDeflateWindow_t per connection.
+ * It uses LZ77 with a single hash lookup and the fixed huffman code, which is
+ * fast and good enough for the repetitive JSON telemetry.
+ * The inflater handles all block types, its window is kept per connection.
+ */
+
+#ifndef __WebSocketDeflate_h__
+#define __WebSocketDeflate_h__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// size of the deflater hash table, 2^n entries of 2 bytes
+#ifndef WEBSOCKET_DEFLATE_HASH_BITS
+#define WEBSOCKET_DEFLATE_HASH_BITS (10)
+#endif
+
+// max. distance the deflater uses, sent as server_max_window_bits (8..15)
+#ifndef WEBSOCKET_DEFLATE_SERVER_MAX_WINDOW_BITS
+#define WEBSOCKET_DEFLATE_SERVER_MAX_WINDOW_BITS (10)
+#endif
+
+// size of the inflate window per connection, sent as client_max_window_bits (9..15)
+#ifndef WEBSOCKET_DEFLATE_CLIENT_MAX_WINDOW_BITS
+#define WEBSOCKET_DEFLATE_CLIENT_MAX_WINDOW_BITS (10)
+#endif
+
+// max. size of a compressed or inflated message
+#ifndef WEBSOCKET_DEFLATE_BUFFER_SIZE
+#define WEBSOCKET_DEFLATE_BUFFER_SIZE (1024)
+#endif
+
+// back references into the previous messages of a connection, costs a window per connection
+#ifndef WEBSOCKET_DEFLATE_SERVER_CONTEXT_TAKEOVER
+#define WEBSOCKET_DEFLATE_SERVER_CONTEXT_TAKEOVER (1)
+#endif
+
+// smaller messages are sent uncompressed
+#ifndef WEBSOCKET_DEFLATE_MIN_SIZE
+#define WEBSOCKET_DEFLATE_MIN_SIZE (32)
+#endif
+
+typedef struct {
+    uint8_t window[1 << WEBSOCKET_DEFLATE_CLIENT_MAX_WINDOW_BITS];
+    uint32_t pos;                   ///< total bytes written, index is pos & mask
+    uint32_t fill;                  ///< valid history bytes
+} WSInflateWindow_t;
+
+typedef struct {
+    uint8_t window[1 << WEBSOCKET_DEFLATE_SERVER_MAX_WINDOW_BITS];
+    uint32_t fill;                  ///< valid history bytes, the newest at the end
+} WSDeflateWindow_t;
+
+class WebSocketDeflater {
+public:
+    WebSocketDeflater() {};
+
+    /**
+     * Compress a complete message, ends with an empty stored block
+     * without the trailing 0x00 0x00 0xff 0xff (RFC 7692 7.2.1)
+     *
+     * @param windowBits    max. distance of back references, 2^windowBits
+     * @param history       previous messages of the connection (context takeover), NULL
+     *                      for a message on its own. Messages larger than
+     *                      WEBSOCKET_DEFLATE_BUFFER_SIZE are compressed on their own.
+     * @return compressed size, 0 if the result does not fit into outSize
+     */
+    size_t deflate(const uint8_t* in, size_t inSize, uint8_t* out, size_t outSize, int windowBits = WEBSOCKET_DEFLATE_SERVER_MAX_WINDOW_BITS,
+                   const WSDeflateWindow_t* history = NULL);
+
+    static void resetHistory(WSDeflateWindow_t* history) { history->fill = 0; };
+
+    // a compressed message was sent, the client has it in its window now
+    static void addHistory(WSDeflateWindow_t* history, const uint8_t* data, size_t length);
+
+private:
+    size_t compress(const uint8_t* data, size_t start, size_t end, uint8_t* out, size_t outSize, int windowBits);
+
+    void putBits(uint32_t value, int count);
+    void putCode(uint32_t code, int length);
+    void putSymbol(int symbol);
+    void putMatch(int length, int distance);
+
+    uint16_t _head[1 << WEBSOCKET_DEFLATE_HASH_BITS];
+#if WEBSOCKET_DEFLATE_SERVER_CONTEXT_TAKEOVER
+    uint8_t _work[(1 << WEBSOCKET_DEFLATE_SERVER_MAX_WINDOW_BITS) + WEBSOCKET_DEFLATE_BUFFER_SIZE];   // history and message
+#endif
+    uint8_t* _out;
+    size_t _outPos;
+    size_t _outSize;
+    uint32_t _bitBuf;
+    int _bitCount;
+    bool _overflow;
+};
+
+class WebSocketInflater {
+public:
+    WebSocketInflater() {};
+
+    // errors of inflate()
+    enum {
+        INFLATE_ERROR = -1,         ///< invalid data
+        INFLATE_OVERFLOW = -2       ///< the message does not fit into outSize
+    };
+
+    static void resetWindow(WSInflateWindow_t* window);
+
+    /**
+     * Decompress a complete message, the 0x00 0x00 0xff 0xff tail is added here
+     *
+     * @param window        history of this connection, reset it before the message
+     *                      if context takeover is not used
+     * @param windowBits    negotiated client_max_window_bits
+     * @return size of the decompressed message, INFLATE_ERROR or INFLATE_OVERFLOW
+     */
+    int inflate(WSInflateWindow_t* window, int windowBits, const uint8_t* in, size_t inSize, uint8_t* out, size_t outSize);
+
+private:
+    typedef struct {
+        uint16_t counts[16];
+        uint16_t symbols[288];
+    } Tree_t;
+
+    bool buildTree(Tree_t* tree, const uint8_t* lengths, int num);
+    int getBit();
+    uint32_t getBits(int count);
+    int decodeSymbol(const Tree_t* tree);
+    bool putByte(uint8_t c);
+    bool inflateStored();
+    bool inflateBlock(const Tree_t* lit, const Tree_t* dist);
+    bool decodeTrees();
+
+    Tree_t _lit;
+    Tree_t _dist;
+    uint8_t _lengths[288 + 32];
+
+    const uint8_t* _in;
+    size_t _inSize;
+    size_t _inPos;
+    uint32_t _bitBuf;
+    int _bitCount;
+    bool _error;
+    bool _overflow;
+
+    WSInflateWindow_t* _window;
+    uint32_t _windowSize;
+    uint8_t* _out;
+    size_t _outPos;
+    size_t _outSize;
+};
+
+#endif
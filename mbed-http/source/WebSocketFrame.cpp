@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "WebSocketFrame.h"
+
+#if WEBSOCKET_DEFLATE
+// one deflater for all connections, the compressed frame is shared by a broadcast
+static WebSocketDeflater deflater;
+static uint8_t deflateBuffer[WEBSOCKET_DEFLATE_BUFFER_SIZE];
+static Mutex deflaterMutex;
+#endif
+
+// frame object, headroom and payload in one block
+typedef struct {
+    uint32_t mem[(sizeof(WebSocketFrame) + WEBSOCKETS_MAX_HEADER_SIZE + WEBSOCKET_FRAME_POOL_BUFFER_SIZE + 3) / 4];
+} FrameBlock_t;
+
+static MemoryPool<FrameBlock_t, WEBSOCKET_FRAME_POOL_SIZE> framePool;
+
+WebSocketFrame* WebSocketFrame::allocBlock(size_t capacity)
+{
+    bool pooled = false;
+    void* mem = NULL;
+
+    // no heap traffic for the small frames of the telemetry loop
+    if (capacity <= WEBSOCKETS_MAX_HEADER_SIZE + WEBSOCKET_FRAME_POOL_BUFFER_SIZE) {
+        mem = framePool.alloc();
+        pooled = (mem != NULL);
+    }
+    if (!mem) {
+        mem = malloc(sizeof(WebSocketFrame) + capacity);
+        if (!mem) {
+            return NULL;
+        }
+    }
+
+    WebSocketFrame* frame = new (mem) WebSocketFrame();
+    frame->_refCount = 1;
+    frame->_timestamp = us_ticker_read();
+    frame->_broadcast = NULL;
+    frame->_pooled = pooled;
+    frame->_capacity = capacity;
+    frame->_base = (uint8_t*)mem + sizeof(WebSocketFrame);
+    frame->_data = frame->_base;
+    frame->_size = 0;
+
+    return frame;
+}
+
+WebSocketFrame* WebSocketFrame::alloc(size_t size)
+{
+    WebSocketFrame* frame = allocBlock(size < WEBSOCKETS_MAX_HEADER_SIZE ? WEBSOCKETS_MAX_HEADER_SIZE : size);
+    if (frame) {
+        frame->_size = size;
+    }
+
+    return frame;
+}
+
+WebSocketFrame* WebSocketFrame::allocPayload(size_t maxLength)
+{
+    return allocBlock(WEBSOCKETS_MAX_HEADER_SIZE + maxLength);
+}
+
+bool WebSocketFrame::encodeHeader(WSopcode_t opcode, size_t length, bool fin, bool rsv1)
+{
+    uint8_t header[WEBSOCKETS_MAX_HEADER_SIZE];
+    uint8_t maskKey[4] = { 0x00, 0x00, 0x00, 0x00 };
+
+    if (length > getPayloadCapacity()) {
+        return false;
+    }
+
+    // server frames are never masked, the header ends right before the payload
+    uint8_t headerSize = ClientConnection::createHeader(header, opcode, length, false, maskKey, fin);
+    if (rsv1) {
+        header[0] |= 0x40;
+    }
+
+    _data = payload() - headerSize;
+    memcpy(_data, header, headerSize);
+    _size = headerSize + length;
+
+    return true;
+}
+
+WebSocketFrame* WebSocketFrame::create(WSopcode_t opcode, const uint8_t* payload, size_t length, bool fin, bool deflate)
+{
+    if (deflate) {
+        WebSocketFrame* frame = createDeflated(opcode, payload, length, fin);
+        if (frame) {
+            return frame;
+        }
+    }
+
+    WebSocketFrame* frame = allocPayload(length);
+    if (!frame) {
+        return NULL;
+    }
+
+    if (payload && length > 0) {
+        memcpy(frame->payload(), payload, length);
+    }
+    frame->encodeHeader(opcode, length, fin);
+
+    return frame;
+}
+
+WebSocketFrame* WebSocketFrame::createDeflated(WSopcode_t opcode, const uint8_t* payload, size_t length, bool fin,
+                                               const WSDeflateWindow_t* history)
+{
+#if WEBSOCKET_DEFLATE
+    if (!payload || (length < WEBSOCKET_DEFLATE_MIN_SIZE)) {
+        return NULL;
+    }
+
+    WebSocketFrame* frame = NULL;
+
+    deflaterMutex.lock();
+    size_t compressedSize = deflater.deflate(payload, length, deflateBuffer, sizeof(deflateBuffer),
+                                             WEBSOCKET_DEFLATE_SERVER_MAX_WINDOW_BITS, history);
+    if ((compressedSize > 0) && (compressedSize < length)) {
+        frame = allocPayload(compressedSize);
+        if (frame) {
+            memcpy(frame->payload(), deflateBuffer, compressedSize);
+            frame->encodeHeader(opcode, compressedSize, fin, true);     // RSV1: compressed message
+        }
+    }
+    deflaterMutex.unlock();
+
+    return frame;
+#else
+    (void)opcode;
+    (void)payload;
+    (void)length;
+    (void)fin;
+    (void)history;
+    return NULL;
+#endif
+}
+
+void WebSocketFrame::acquire()
+{
+    core_util_atomic_incr_u32(&_refCount, 1);
+}
+
+void WebSocketFrame::release()
+{
+    if (core_util_atomic_decr_u32(&_refCount, 1) == 0) {
+        bool pooled = _pooled;
+        this->~WebSocketFrame();
+        if (pooled) {
+            framePool.free((FrameBlock_t*)this);
+        } else {
+            free(this);
+        }
+    }
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __WebSocketFrame_h__
+#define __WebSocketFrame_h__
+
+#include "mbed.h"
+#include "ClientConnection.h"
+
+// frames with up to n bytes payload are taken from a pool, larger frames from the heap
+#ifndef WEBSOCKET_FRAME_POOL_BUFFER_SIZE
+#define WEBSOCKET_FRAME_POOL_BUFFER_SIZE (256)
+#endif
+
+// number of pooled frames
+#ifndef WEBSOCKET_FRAME_POOL_SIZE
+#define WEBSOCKET_FRAME_POOL_SIZE (16)
+#endif
+
+class WebSocketBroadcast;
+
+/**
+ * \brief WebSocketFrame holds a complete frame (header + payload) as it goes on the wire.
+ *
+ * The frame is reference counted, so one encoded frame can be queued on
+ * several connections. Every queue holds one reference, the last release()
+ * frees the memory.
+ *
+ * Every frame has WEBSOCKETS_MAX_HEADER_SIZE bytes headroom in front of the
+ * payload. A producer can get a frame with allocPayload(), write the payload
+ * in place and the header is put into the headroom by encodeHeader(),
+ * so the payload is never copied.
+ */
+class WebSocketFrame {
+public:
+    /**
+     * Allocate a frame and encode header and payload into it
+     *
+     * @param opcode    WSopcode_t
+     * @param payload   ptr to the payload, may be NULL if length is 0
+     * @param length    length of the payload
+     * @param fin       set fin on the last frame
+     * @param deflate   compress the payload (permessage-deflate), only for a complete message.
+     *                  Payloads which don't get smaller are sent uncompressed.
+     * @return frame with a reference count of 1, NULL if out of memory
+     */
+    static WebSocketFrame* create(WSopcode_t opcode, const uint8_t* payload, size_t length, bool fin = true, bool deflate = false);
+
+    /**
+     * Allocate a frame and encode the compressed payload into it
+     *
+     * @param history   previous messages of the connection with server context takeover,
+     *                  NULL for a frame that can be shared
+     * @return frame with a reference count of 1, NULL if the payload doesn't get
+     *         smaller, is shorter than WEBSOCKET_DEFLATE_MIN_SIZE or out of memory
+     */
+    static WebSocketFrame* createDeflated(WSopcode_t opcode, const uint8_t* payload, size_t length, bool fin = true,
+                                          const WSDeflateWindow_t* history = NULL);
+
+    /**
+     * Allocate a frame for a payload of up to maxLength bytes, the producer
+     * writes into payload() and calls encodeHeader() when done
+     *
+     * @return frame with a reference count of 1, NULL if out of memory
+     */
+    static WebSocketFrame* allocPayload(size_t maxLength);
+
+    /**
+     * Allocate an empty frame of size bytes, the caller fills buffer()
+     *
+     * @return frame with a reference count of 1, NULL if out of memory
+     */
+    static WebSocketFrame* alloc(size_t size);
+
+    void acquire();
+    void release();
+
+    /**
+     * Put the header in front of the payload, the frame is ready to be queued
+     *
+     * @param length    length of the payload written to payload()
+     * @param rsv1      payload is compressed (permessage-deflate)
+     * @return false if length exceeds getPayloadCapacity()
+     */
+    bool encodeHeader(WSopcode_t opcode, size_t length, bool fin = true, bool rsv1 = false);
+
+    uint8_t* payload() { return _base + WEBSOCKETS_MAX_HEADER_SIZE; };
+    size_t getPayloadCapacity() const { return _capacity - WEBSOCKETS_MAX_HEADER_SIZE; };
+
+    uint8_t* buffer() { return _data; };
+    const uint8_t* data() const { return _data; };
+    size_t size() const { return _size; };
+
+    // a complete text or binary message in one frame, it can be dropped without breaking the framing
+    bool isMessage() const { return (_data[0] & 0x80) && (((_data[0] & 0x0F) == WSop_text) || ((_data[0] & 0x0F) == WSop_binary)); };
+    // RSV1, the payload is compressed
+    bool isCompressed() const { return _data[0] & 0x40; };
+
+    // us_ticker timestamp of creation, used for delivery latency
+    uint32_t getTimestamp() const { return _timestamp; };
+
+    // broadcast this frame was sent to, NULL for a single connection
+    WebSocketBroadcast* getBroadcast() const { return _broadcast; };
+    void setBroadcast(WebSocketBroadcast* broadcast) { _broadcast = broadcast; };
+
+private:
+    WebSocketFrame() {};
+    ~WebSocketFrame() {};
+
+    static WebSocketFrame* allocBlock(size_t capacity);
+
+    volatile uint32_t _refCount;
+    uint32_t _timestamp;
+    WebSocketBroadcast* _broadcast;
+    bool _pooled;
+    size_t _capacity;               ///< bytes behind _base
+    uint8_t* _base;                 ///< start of headroom
+    size_t _size;
+    uint8_t* _data;                 ///< start of the frame, inside the headroom after encodeHeader()
+};
+
+#endif
@@ -1,11 +1,20 @@
 #ifndef __WEB_SOCKET_HANDLER_H__
 #define __WEB_SOCKET_HANDLER_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 class ClientConnection;
 
+// totalLength of onMessageBegin() when the message is fragmented
+#define WEBSOCKET_LENGTH_UNKNOWN ((size_t)-1)
+
 class WebSocketHandler
 {
 public:
+    virtual ~WebSocketHandler() {};
+    // true: messages are delivered by onMessageBegin/Data/End, see WebSocketStreamHandler
+    virtual bool isStreaming() { return false; };
     virtual void onOpen(ClientConnection *clientConnection) { _clientConnection = clientConnection; };
     virtual void onClose() {};
     // to receive text message
@@ -19,5 +28,24 @@ protected:
     ClientConnection *_clientConnection;
 };
 
+/**
+ * Opt-in streaming interface for messages larger than the receive buffer.
+ * The payload is passed in slices as it is received and unmasked, the slices
+ * point into the receive buffer and are valid only during the call.
+ * permessage-deflate is not negotiated for a streaming handler, a compressed
+ * message could only be inflated as a whole. If the connection ends inside a message,
+ * onError() is called instead of onMessageEnd().
+ */
+class WebSocketStreamHandler : public WebSocketHandler
+{
+public:
+    virtual bool isStreaming() { return true; };
+
+    // opcode is WSop_text or WSop_binary, totalLength is WEBSOCKET_LENGTH_UNKNOWN for fragmented messages
+    virtual void onMessageBegin(int opcode, size_t totalLength) = 0;
+    virtual void onMessageData(const uint8_t* data, size_t length) = 0;
+    virtual void onMessageEnd() = 0;
+};
+
 
 #endif
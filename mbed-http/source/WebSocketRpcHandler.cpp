@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "WebSocketRpcHandler.h"
+#include "WebSocketFrame.h"
+
+#define RPC_REQUEST         0
+#define RPC_RESPONSE        1
+#define RPC_NOTIFICATION    2
+
+WebSocketRpcHandler::WebSocketRpcHandler(const WSrpcMethod_t* methods, size_t nMethods) :
+    _methods(methods),
+    _nMethods(nMethods),
+    _notifyFrame(NULL),
+    _notifyWriter(NULL, 0)
+{
+}
+
+WebSocketRpcHandler::~WebSocketRpcHandler()
+{
+    if (_notifyFrame) {
+        _notifyFrame->release();
+    }
+}
+
+void WebSocketRpcHandler::onMessage(char* data, size_t size)
+{
+    MsgpackReader reader((const uint8_t*)data, size);
+    uint32_t count;
+    uint32_t type;
+    uint32_t msgid = 0;
+
+    if (!reader.readArray(&count) || !reader.readUint(&type)) {
+        return;                                         // not msgpack-rpc, no msgid to answer
+    }
+
+    if ((type == RPC_REQUEST) && (count == 4) && reader.readUint(&msgid)) {
+        sendResponse(msgid, reader);
+    } else if ((type == RPC_NOTIFICATION) && (count == 3)) {
+        const WSrpcMethod_t* method = findMethod(reader);
+        uint32_t nParams;
+        if (method && reader.readArray(&nParams)) {
+            uint8_t dummy[1];
+            MsgpackWriter result(dummy, 0);             // result is discarded
+            method->fn(this, reader, nParams, result);
+        }
+    }
+}
+
+const WSrpcMethod_t* WebSocketRpcHandler::findMethod(MsgpackReader& reader)
+{
+    if (reader.peekType() == MPtype_int) {
+        uint32_t index;
+        if (reader.readUint(&index) && (index < _nMethods)) {
+            return &_methods[index];
+        }
+        return NULL;
+    }
+
+    const char* name;
+    size_t length;
+    if (!reader.readStr(&name, &length)) {
+        return NULL;
+    }
+    for (size_t i = 0; i < _nMethods; i++) {
+        if ((strncmp(_methods[i].name, name, length) == 0) && (_methods[i].name[length] == 0)) {
+            return &_methods[i];
+        }
+    }
+    return NULL;
+}
+
+bool WebSocketRpcHandler::sendResponse(uint32_t msgid, MsgpackReader& reader)
+{
+    const WSrpcMethod_t* method = findMethod(reader);
+    if (!method) {
+        sendError(msgid, reader.hasError() ? WSrpc_invalidRequest : WSrpc_methodNotFound);
+        return false;
+    }
+
+    uint32_t nParams;
+    if (!reader.readArray(&nParams)) {
+        sendError(msgid, WSrpc_invalidParams);
+        return false;
+    }
+
+    WebSocketFrame* frame = WebSocketFrame::allocPayload(WEBSOCKET_RPC_MAX_RESPONSE_SIZE);
+    if (!frame) {
+        return false;
+    }
+
+    // the result is written right behind a nil error, on failure both are rewritten
+    MsgpackWriter writer(frame->payload(), WEBSOCKET_RPC_MAX_RESPONSE_SIZE);
+    writer.writeArray(4);
+    writer.writeUint(RPC_RESPONSE);
+    writer.writeUint(msgid);
+    size_t errorPos = writer.getSize();
+    writer.writeNil();
+    size_t resultPos = writer.getSize();
+
+    WSrpcError_t error = method->fn(this, reader, nParams, writer);
+    if ((error == WSrpc_ok) && writer.hasOverflow()) {
+        error = WSrpc_responseTooLarge;
+    }
+
+    if (error != WSrpc_ok) {
+        writer.setPosition(errorPos);
+        writer.writeUint(error);
+        writer.writeNil();
+    } else if (writer.getSize() == resultPos) {
+        writer.writeNil();                              // method without result
+    }
+
+    return _clientConnection->sendFrame(frame, WSop_binary, writer.getSize());
+}
+
+void WebSocketRpcHandler::sendError(uint32_t msgid, WSrpcError_t error)
+{
+    uint8_t buf[16];
+    MsgpackWriter writer(buf, sizeof(buf));
+    writer.writeArray(4);
+    writer.writeUint(RPC_RESPONSE);
+    writer.writeUint(msgid);
+    writer.writeUint(error);
+    writer.writeNil();
+
+    WebSocketFrame* frame = WebSocketFrame::allocPayload(writer.getSize());
+    if (frame) {
+        memcpy(frame->payload(), buf, writer.getSize());
+        _clientConnection->sendFrame(frame, WSop_binary, writer.getSize());
+    }
+}
+
+MsgpackWriter* WebSocketRpcHandler::beginNotification(const char* method, uint32_t nParams)
+{
+    if (_notifyFrame) {
+        _notifyFrame->release();                        // previous one was not sent
+    }
+
+    _notifyFrame = WebSocketFrame::allocPayload(WEBSOCKET_RPC_MAX_RESPONSE_SIZE);
+    if (!_notifyFrame) {
+        return NULL;
+    }
+
+    _notifyWriter = MsgpackWriter(_notifyFrame->payload(), WEBSOCKET_RPC_MAX_RESPONSE_SIZE);
+    _notifyWriter.writeArray(3);
+    _notifyWriter.writeUint(RPC_NOTIFICATION);
+    _notifyWriter.writeStr(method);
+    _notifyWriter.writeArray(nParams);
+
+    return &_notifyWriter;
+}
+
+bool WebSocketRpcHandler::sendNotification()
+{
+    WebSocketFrame* frame = _notifyFrame;
+    _notifyFrame = NULL;
+
+    if (!frame) {
+        return false;
+    }
+    if (_notifyWriter.hasOverflow() || !_clientConnection) {
+        frame->release();
+        return false;
+    }
+
+    return _clientConnection->sendFrame(frame, WSop_binary, _notifyWriter.getSize());
+}
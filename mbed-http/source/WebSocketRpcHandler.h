@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef __WebSocketRpcHandler_h__
+#define __WebSocketRpcHandler_h__
+
+#include "mbed.h"
+#include "WebSocketHandler.h"
+#include "Msgpack.h"
+
+// Sec-WebSocket-Protocol of the rpc handler
+#define WEBSOCKET_RPC_PROTOCOL "msgpack-rpc"
+
+// max. size of a response or notification, default fits a pooled WebSocketFrame
+#ifndef WEBSOCKET_RPC_MAX_RESPONSE_SIZE
+#define WEBSOCKET_RPC_MAX_RESPONSE_SIZE (240)
+#endif
+
+typedef enum {
+    WSrpc_ok = 0,
+    WSrpc_invalidRequest,           ///< message is no msgpack-rpc request or notification
+    WSrpc_methodNotFound,
+    WSrpc_invalidParams,
+    WSrpc_responseTooLarge,         ///< result does not fit WEBSOCKET_RPC_MAX_RESPONSE_SIZE
+    WSrpc_failed                    ///< method specific error
+} WSrpcError_t;
+
+class WebSocketRpcHandler;
+class WebSocketFrame;
+
+/**
+ * RPC method
+ *
+ * @param params    reader positioned at the first parameter, strings point into the message
+ * @param nParams   number of parameters
+ * @param result    writer for exactly one result object, nothing written sends nil
+ */
+typedef WSrpcError_t (*WSrpcMethodFn)(WebSocketRpcHandler* handler, MsgpackReader& params, uint32_t nParams, MsgpackWriter& result);
+
+typedef struct {
+    const char* name;
+    WSrpcMethodFn fn;
+} WSrpcMethod_t;
+
+/**
+ * \brief WebSocketRpcHandler dispatches msgpack-rpc messages to a const method table.
+ *
+ * Messages are binary frames in msgpack-rpc format:
+ *   request       [0, msgid, method, [params]]
+ *   response      [1, msgid, error, result]
+ *   notification  [2, method, [params]]
+ * method is the name or the index in the table, the index keeps the frame of a
+ * button click at a few bytes. Requests are answered with a pooled frame,
+ * notifications get no response. No heap is used per message.
+ */
+class WebSocketRpcHandler : public WebSocketHandler
+{
+public:
+    WebSocketRpcHandler(const WSrpcMethod_t* methods, size_t nMethods);
+    virtual ~WebSocketRpcHandler();
+
+    virtual void onMessage(char* data, size_t size);
+
+    /**
+     * Send a notification to this client, write nParams parameters to the
+     * returned writer and call sendNotification(). Only one at a time.
+     *
+     * @return writer for the parameters, NULL if out of frames
+     */
+    MsgpackWriter* beginNotification(const char* method, uint32_t nParams);
+    bool sendNotification();
+
+protected:
+    const WSrpcMethod_t* findMethod(MsgpackReader& reader);
+    bool sendResponse(uint32_t msgid, MsgpackReader& reader);
+    void sendError(uint32_t msgid, WSrpcError_t error);
+
+    const WSrpcMethod_t* _methods;
+    size_t _nMethods;
+
+    WebSocketFrame* _notifyFrame;
+    MsgpackWriter _notifyWriter;
+};
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "WebSocketUtf8.h"
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * byte classes of the DFA
+ *   0: 00..7F  1: 80..8F  2: 90..9F  3: A0..BF  4: invalid (C0, C1, F5..FF)
+ *   5: C2..DF  6: E0  7: E1..EC, EE..EF  8: ED  9: F0  10: F1..F3  11: F4
+ */
+static const uint8_t utf8Class[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 00..0F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 10..1F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 20..2F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 30..3F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 40..4F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 50..5F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 60..6F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,      // 70..7F
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,      // 80..8F
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,      // 90..9F
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,      // A0..AF
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,      // B0..BF
+    4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,      // C0..CF
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,      // D0..DF
+    6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 7,      // E0..EF
+    9, 10, 10, 10, 11, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,      // F0..FF
+};
+
+/*
+ * states: 0 accept, 1 reject, 2..4 need 1..3 continuation bytes,
+ * 5..8 the second byte after E0, ED, F0, F4 has a restricted range
+ * (no overlong forms, no surrogates, max. U+10FFFF)
+ */
+static const uint8_t utf8Transition[9][12] = {
+    //  0  1  2  3  4  5  6  7  8  9 10 11
+    {   0, 1, 1, 1, 1, 2, 5, 3, 6, 7, 4, 8 },     // 0 accept
+    {   1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 },     // 1 reject
+    {   1, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1 },     // 2 one more byte
+    {   1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1 },     // 3 two more bytes
+    {   1, 3, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1 },     // 4 three more bytes
+    {   1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1 },     // 5 after E0: A0..BF
+    {   1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1 },     // 6 after ED: 80..9F
+    {   1, 1, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1 },     // 7 after F0: 90..BF
+    {   1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 },     // 8 after F4: 80..8F
+};
+
+// the 4 key bytes starting at maskPos, in memory order
+static inline uint32_t maskWord(const uint8_t maskKey[4], uint8_t maskPos)
+{
+    uint8_t rotated[4];
+    for (int i = 0; i < 4; i++) {
+        rotated[i] = maskKey[(maskPos + i) & 3];
+    }
+    uint32_t word;
+    memcpy(&word, rotated, 4);
+    return word;
+}
+
+bool WebSocketUtf8Validator::validateBytes(const uint8_t* data, size_t length)
+{
+    uint8_t state = _state;
+    for (size_t i = 0; i < length; i++) {
+        state = utf8Transition[state][utf8Class[data[i]]];
+    }
+    _state = state;
+
+    return state != UTF8_REJECT;
+}
+
+bool WebSocketUtf8Validator::validate(const uint8_t* data, size_t length)
+{
+    size_t i = 0;
+
+    while (i < length) {
+        if (_state == UTF8_ACCEPT) {
+            // ASCII fast path, only between code points
+#if defined(__SSE2__)
+            while ((i + 16 <= length) && (_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(data + i))) == 0)) {
+                i += 16;
+            }
+#endif
+            uint32_t word;
+            while ((i + 4 <= length) && (memcpy(&word, data + i, 4), (word & 0x80808080) == 0)) {
+                i += 4;
+            }
+        }
+
+        // DFA until the next code point boundary, at least one word
+        size_t end = (i + 4 < length) ? i + 4 : length;
+        if (!validateBytes(data + i, end - i)) {
+            return false;
+        }
+        i = end;
+    }
+    return _state != UTF8_REJECT;
+}
+
+bool WebSocketUtf8Validator::unmaskValidate(uint8_t* data, size_t length, const uint8_t maskKey[4], uint8_t* maskPos)
+{
+    uint32_t mask = maskWord(maskKey, *maskPos);
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    __m128i mask128 = _mm_set1_epi32((int)mask);
+    while (i + 16 <= length) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(data + i)), mask128);
+        _mm_storeu_si128((__m128i*)(data + i), v);
+        int highBits = _mm_movemask_epi8(v);
+        if ((_state != UTF8_ACCEPT) || (highBits != 0)) {
+            // DFA only for the words with non ASCII bytes or an open sequence
+            for (int j = 0; j < 16; j += 4) {
+                if (((_state != UTF8_ACCEPT) || ((highBits >> j) & 0xf)) && !validateBytes(data + i + j, 4)) {
+                    return false;
+                }
+            }
+        }
+        i += 16;
+    }
+#endif
+
+    while (i + 4 <= length) {
+        uint32_t word;
+        memcpy(&word, data + i, 4);
+        word ^= mask;
+        memcpy(data + i, &word, 4);
+        if ((_state != UTF8_ACCEPT) || (word & 0x80808080)) {
+            if (!validateBytes(data + i, 4)) {
+                return false;
+            }
+        }
+        i += 4;
+    }
+
+    // tail, the mask position moves on
+    uint8_t pos = *maskPos;
+    for (; i < length; i++) {
+        data[i] ^= maskKey[pos];
+        pos = (pos + 1) & 3;
+        _state = utf8Transition[_state][utf8Class[data[i]]];
+    }
+    *maskPos = pos;
+
+    return _state != UTF8_REJECT;
+}
+
+void WebSocketUtf8Validator::unmask(uint8_t* data, size_t length, const uint8_t maskKey[4], uint8_t* maskPos)
+{
+    uint32_t mask = maskWord(maskKey, *maskPos);
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    __m128i mask128 = _mm_set1_epi32((int)mask);
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(v, mask128));
+    }
+#endif
+
+    for (; i + 4 <= length; i += 4) {
+        uint32_t word;
+        memcpy(&word, data + i, 4);
+        word ^= mask;
+        memcpy(data + i, &word, 4);
+    }
+
+    uint8_t pos = *maskPos;
+    for (; i < length; i++) {
+        data[i] ^= maskKey[pos];
+        pos = (pos + 1) & 3;
+    }
+    *maskPos = pos;
+}
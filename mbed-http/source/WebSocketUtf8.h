@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Incremental UTF-8 validation for WebSocket text messages (RFC 6455 8.1)
+ *
+ * The state is kept between calls, so a code point may be split across
+ * frames and recv() chunks. ASCII is checked a word at a time (16 bytes with
+ * SSE2 on the host), multibyte sequences run through a small DFA.
+ * unmaskValidate() removes the client mask in the same pass, so the payload
+ * is read and written only once.
+ * No heap and no mbed dependencies.
+ */
+
+#ifndef __WebSocketUtf8_h__
+#define __WebSocketUtf8_h__
+
+#include <stdint.h>
+#include <stddef.h>
+
+class WebSocketUtf8Validator {
+public:
+    WebSocketUtf8Validator() { reset(); };
+
+    void reset() { _state = UTF8_ACCEPT; };
+
+    // @return false if data contains an invalid sequence, the state stays invalid
+    bool validate(const uint8_t* data, size_t length);
+
+    /**
+     * Unmask in place and validate
+     *
+     * @param maskKey   the 4 byte masking key of the frame
+     * @param maskPos   position in the key of data[0], advanced by length
+     * @return false if data contains an invalid sequence, data is then not completely unmasked
+     */
+    bool unmaskValidate(uint8_t* data, size_t length, const uint8_t maskKey[4], uint8_t* maskPos);
+
+    // true if no code point is incomplete, check at the end of the message
+    bool isComplete() const { return _state == UTF8_ACCEPT; };
+    bool hasError() const { return _state == UTF8_REJECT; };
+
+    // unmask in place without validation, a word at a time
+    static void unmask(uint8_t* data, size_t length, const uint8_t maskKey[4], uint8_t* maskPos);
+
+private:
+    enum {
+        UTF8_ACCEPT = 0,
+        UTF8_REJECT = 1
+    };
+
+    bool validateBytes(const uint8_t* data, size_t length);
+
+    uint8_t _state;
+};
+
+#endif
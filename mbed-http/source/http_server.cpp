@@ -29,6 +29,8 @@ HttpServer::HttpServer(NetworkInterface* network, int nWorkerThreads, int nWebSo
     _nWebSockets = 0;
     _nWebSocketsMax = nWebSocketsMax;
     _nWorkerThreads = nWorkerThreads;
+    _keepaliveInterval_ms = WEBSOCKET_KEEPALIVE_INTERVAL;
+    _keepaliveMaxMissed = WEBSOCKET_KEEPALIVE_MAX_MISSED;
 }
 
 HttpServer::~HttpServer() {
@@ -67,6 +69,7 @@ nsapi_error_t HttpServer::start(uint16_t port, Callback<void(ParsedHttpRequest*
     _serverSocket->listen(HTTP_SERVER_MAX_CONCURRENT); // max. concurrent connections...
 
     _threadHTTPServer.start(callback(this, &HttpServer::main));
+    setWSKeepalive(_keepaliveInterval_ms, _keepaliveMaxMissed);
 
     return NSAPI_ERROR_OK;
 }
@@ -97,9 +100,36 @@ void HttpServer::main() {
     }
 }
 
-void HttpServer::setWSHandler(const char* path, CreateHandlerFn handler)
+void HttpServer::setWSKeepalive(uint32_t interval_ms, int maxMissed)
+{
+    _keepaliveTicker.detach();
+    _keepaliveInterval_ms = interval_ms;
+    _keepaliveMaxMissed = maxMissed;
+
+    // the ticker runs when the connections exist
+    if ((interval_ms > 0) && !_clientConnections.empty()) {
+        _keepaliveTicker.attach_us(callback(this, &HttpServer::keepaliveTick), (us_timestamp_t)interval_ms * 1000);
+    }
+}
+
+/*
+ * one ticker for all connections, only sets a flag per connection (interrupt context)
+ */
+void HttpServer::keepaliveTick()
+{
+    for (vector<ClientConnection*>::iterator it = _clientConnections.begin(); it != _clientConnections.end(); it++) {
+        (*it)->keepaliveTick();
+    }
+}
+
+void HttpServer::setWSHandler(const char* path, CreateHandlerFn handler, const char* subprotocol)
 {
 	_WSHandlers[path] = handler;
+	if (subprotocol) {
+		_WSSubprotocols[path] = subprotocol;
+	} else {
+		_WSSubprotocols.erase(path);
+	}
 }
 
 CreateHandlerFn HttpServer::getWSHandler(const char* path)
@@ -112,3 +142,33 @@ CreateHandlerFn HttpServer::getWSHandler(const char* path)
 	}
 	return NULL;
 }
+
+const char* HttpServer::getWSSubprotocol(const char* path)
+{
+	WebSocketSubprotocolContainer::iterator it;
+
+	it = _WSSubprotocols.find(path);
+	if (it != _WSSubprotocols.end()) {
+		return it->second.c_str();
+	}
+	return NULL;
+}
+
+WebSocketBroadcast* HttpServer::getWSBroadcast(const char* path)
+{
+	WebSocketBroadcast* broadcast;
+	WebSocketBroadcastContainer::iterator it;
+
+	_WSBroadcastsMutex.lock();
+	it = _WSBroadcasts.find(path);
+	if (it != _WSBroadcasts.end()) {
+		broadcast = it->second;
+	} else {
+		broadcast = new WebSocketBroadcast();
+		MBED_ASSERT(broadcast);
+		_WSBroadcasts[path] = broadcast;
+	}
+	_WSBroadcastsMutex.unlock();
+
+	return broadcast;
+}
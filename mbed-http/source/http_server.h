@@ -23,6 +23,7 @@
 #include "http_response.h"
 #include "http_response_builder.h"
 #include "WebSocketHandler.h"
+#include "WebSocketBroadcast.h"
 #include "ClientConnection.h"
 
 #include <string>
@@ -39,6 +40,16 @@
 #warning "HTTP_SERVER_MAX_CONCURRENT > MBED_CONF_LWIP_TCP_SOCKET_MAX, HTTPServer needs more TCP sockets for this setting, increase socket count in mbed_app.json"
 #endif
 
+// interval of the websocket keepalive pings in ms, 0: no pings
+#ifndef WEBSOCKET_KEEPALIVE_INTERVAL
+#define WEBSOCKET_KEEPALIVE_INTERVAL    (30000)
+#endif
+
+// a websocket is closed after n pings without pong
+#ifndef WEBSOCKET_KEEPALIVE_MAX_MISSED
+#define WEBSOCKET_KEEPALIVE_MAX_MISSED  (2)
+#endif
+
 #ifndef NODEBUG_WEBSOCKETS
 #define DEBUG_WEBSOCKETS(...) printf(__VA_ARGS__)
 #endif
@@ -47,6 +58,8 @@ typedef HttpResponse ParsedHttpRequest;
 
 typedef WebSocketHandler* (*CreateHandlerFn)();
 typedef std::map<std::string, CreateHandlerFn> WebSocketHandlerContainer;
+typedef std::map<std::string, WebSocketBroadcast*> WebSocketBroadcastContainer;
+typedef std::map<std::string, std::string> WebSocketSubprotocolContainer;
 
 
 /**
@@ -68,8 +81,34 @@ public:
      */
     nsapi_error_t start(uint16_t port, Callback<void(ParsedHttpRequest* request, TCPSocket* socket)> a_handler);
 
-    void setWSHandler(const char* path, CreateHandlerFn handler);
+    /**
+     * Register the handler factory for websockets of a path
+     *
+     * @param subprotocol   Sec-WebSocket-Protocol the client must offer for this path,
+     *                      NULL if no subprotocol is used
+     */
+    void setWSHandler(const char* path, CreateHandlerFn handler, const char* subprotocol = NULL);
     CreateHandlerFn getWSHandler(const char* path);
+    const char* getWSSubprotocol(const char* path);
+
+    /**
+     * Get the broadcast for all websockets of a path, it is created on first use.
+     * Every websocket joins the broadcast of its url when it is opened.
+     */
+    WebSocketBroadcast* getWSBroadcast(const char* path);
+
+    /**
+     * Send a frame to all websockets of a path
+     *
+     * @return number of connections the frame was queued on
+     */
+    int broadcast(const char* path, WSopcode_t opcode, const uint8_t* payload, size_t length) {
+        return getWSBroadcast(path)->broadcast(opcode, payload, length);
+    };
+
+    int broadcast(const char* path, WebSocketFrame* frame, WSopcode_t opcode, size_t length) {
+        return getWSBroadcast(path)->broadcast(frame, opcode, length);
+    };
 
     bool isWebsocketAvailable() { return (_nWebSockets < _nWebSocketsMax); };
     int getWebsocketCount() { return _nWebSockets; };
@@ -84,10 +123,20 @@ public:
     };
     
     void decWebsocketCount() { _nWebSockets--; };
+
+    /**
+     * Ping all websockets every interval_ms from one ticker. Connections
+     * which miss maxMissed pongs are closed and free their slot.
+     *
+     * @param interval_ms   0 to disable the pings
+     */
+    void setWSKeepalive(uint32_t interval_ms, int maxMissed = WEBSOCKET_KEEPALIVE_MAX_MISSED);
+    int getWSKeepaliveMaxMissed() { return _keepaliveMaxMissed; };
     
 
 private:
     void main();
+    void keepaliveTick();
     TCPSocket* _serverSocket;
     NetworkInterface* _network;
     Thread _threadHTTPServer;
@@ -96,6 +145,9 @@ private:
     int _nWebSocketsMax;
     Callback<void(ParsedHttpRequest* request, TCPSocket* socket)> _handler;
     vector<ClientConnection*> _clientConnections;
+    Ticker _keepaliveTicker;
+    uint32_t _keepaliveInterval_ms;
+    int _keepaliveMaxMissed;
 
 #if 0
     void setHTTPHandler(const char* path, WebSocketHandler* handler);
@@ -106,6 +158,9 @@ private:
 #endif
 
     WebSocketHandlerContainer _WSHandlers;
+    WebSocketSubprotocolContainer _WSSubprotocols;
+    WebSocketBroadcastContainer _WSBroadcasts;
+    Mutex _WSBroadcastsMutex;
 };
 
 #endif // __HTTP_SERVER_h__
@@ -60,3 +60,160 @@ WebSocketHandler* WSHandler::createHandler()
     WebSocketHandler* handler = new WSHandler();
     return handler;
 }
+
+
+/*
+    Echo
+*/
+
+void EchoHandler::onMessage(char* text)
+{
+    if (_clientConnection)
+        _clientConnection->sendFrame(WSop_text, (uint8_t*)text, strlen(text));
+}
+
+void EchoHandler::onMessage(char* data, size_t size)
+{
+    if (_clientConnection)
+        _clientConnection->sendFrame(WSop_binary, (uint8_t*)data, size);
+}
+
+// EchoHandler Factory
+WebSocketHandler* EchoHandler::createHandler()
+{
+    return new EchoHandler();
+}
+
+
+/*
+    Upload
+*/
+
+void UploadHandler::onMessageBegin(int opcode, size_t totalLength)
+{
+    _received = 0;
+    _checksum = 0;
+    _timer.reset();
+    _timer.start();
+}
+
+void UploadHandler::onMessageData(const uint8_t* data, size_t length)
+{
+    // constant RAM, every slice is consumed right away
+    for (size_t i = 0; i < length; i++) {
+        _checksum = (_checksum << 1 | _checksum >> 31) ^ data[i];
+    }
+    _received += length;
+}
+
+void UploadHandler::onMessageEnd()
+{
+    _timer.stop();
+
+    char msg[64];
+    int len = snprintf(msg, sizeof(msg), "received %u bytes in %d ms, checksum %08lx",
+        (unsigned)_received, _timer.read_ms(), (unsigned long)_checksum);
+    if (_clientConnection)
+        _clientConnection->sendFrame(WSop_text, (uint8_t*)msg, len);
+}
+
+void UploadHandler::onError()
+{
+    printf("upload aborted after %u bytes\r\n", (unsigned)_received);
+}
+
+// UploadHandler Factory
+WebSocketHandler* UploadHandler::createHandler()
+{
+    return new UploadHandler();
+}
+
+
+/*
+    Telemetry
+*/
+
+void TelemetryHandler::onOpen(ClientConnection *clientConnection)
+{
+    WebSocketHandler::onOpen(clientConnection);
+
+    printf("telemetry client connected\r\n");
+}
+
+void TelemetryHandler::onClose()
+{
+    printf("telemetry client disconnected\r\n");
+}
+
+// TelemetryHandler Factory
+WebSocketHandler* TelemetryHandler::createHandler()
+{
+    return new TelemetryHandler();
+}
+
+
+/*
+    RPC
+*/
+
+extern DigitalOut led;
+
+static WSrpcError_t rpcLedGet(WebSocketRpcHandler* handler, MsgpackReader& params, uint32_t nParams, MsgpackWriter& result)
+{
+    result.writeBool(led.read());
+    return WSrpc_ok;
+}
+
+static WSrpcError_t rpcLedSet(WebSocketRpcHandler* handler, MsgpackReader& params, uint32_t nParams, MsgpackWriter& result)
+{
+    bool on;
+    if ((nParams != 1) || !params.readBool(&on)) {
+        return WSrpc_invalidParams;
+    }
+    led = on;
+    return WSrpc_ok;
+}
+
+static WSrpcError_t rpcLedToggle(WebSocketRpcHandler* handler, MsgpackReader& params, uint32_t nParams, MsgpackWriter& result)
+{
+    led = !led;
+    result.writeBool(led.read());
+    return WSrpc_ok;
+}
+
+static WSrpcError_t rpcUptime(WebSocketRpcHandler* handler, MsgpackReader& params, uint32_t nParams, MsgpackWriter& result)
+{
+    result.writeUint((uint32_t)Kernel::get_ms_count());
+    return WSrpc_ok;
+}
+
+// the index is the short method id for the web page, append new methods at the end
+static const WSrpcMethod_t rpcMethods[] = {
+    { "led.get",    rpcLedGet },        // 0
+    { "led.set",    rpcLedSet },        // 1
+    { "led.toggle", rpcLedToggle },     // 2
+    { "sys.uptime", rpcUptime },        // 3
+};
+
+RpcHandler::RpcHandler() :
+    WebSocketRpcHandler(rpcMethods, sizeof(rpcMethods) / sizeof(rpcMethods[0]))
+{
+}
+
+void RpcHandler::onOpen(ClientConnection *clientConnection)
+{
+    WebSocketHandler::onOpen(clientConnection);
+
+    printf("rpc client connected\r\n");
+}
+
+void RpcHandler::onClose()
+{
+    printf("rpc client disconnected\r\n");
+}
+
+// RpcHandler Factory
+WebSocketHandler* RpcHandler::createHandler()
+{
+    return new RpcHandler();
+}
@@ -26,6 +26,7 @@
 #include "mbed.h"
 #include "http_server.h"
 #include "WebSocketHandler.h"
+#include "WebSocketRpcHandler.h"
 
 class WSHandler: public WebSocketHandler
 {
@@ -38,5 +39,63 @@ public:
     virtual void onClose();
 };
 
+/*
+    answers every message with the same payload, for test_JS/testWebsocket.js
+*/
+class EchoHandler: public WebSocketHandler
+{
+public:
+    static WebSocketHandler* createHandler();
+
+    virtual void onMessage(char* text);
+    virtual void onMessage(char* data, size_t size);
+};
+
+/*
+    receives uploads of any size as stream, answers with the byte count and time
+    of every message. Sink for large transfers, the data could go to SD or flash.
+*/
+class UploadHandler: public WebSocketStreamHandler
+{
+public:
+    static WebSocketHandler* createHandler();
+
+    virtual void onMessageBegin(int opcode, size_t totalLength);
+    virtual void onMessageData(const uint8_t* data, size_t length);
+    virtual void onMessageEnd();
+    virtual void onError();
+
+private:
+    size_t _received;
+    uint32_t _checksum;
+    Timer _timer;
+};
+
+/*
+    subscribes the client to the binary telemetry frames of TelemetryStream,
+    the frames are sent by the broadcast of the path
+*/
+class TelemetryHandler: public WebSocketHandler
+{
+public:
+    static WebSocketHandler* createHandler();
+
+    virtual void onOpen(ClientConnection *clientConnection);
+    virtual void onClose();
+};
+
+/*
+    msgpack-rpc for controlling the board, methods see rpcMethods[]
+*/
+class RpcHandler: public WebSocketRpcHandler
+{
+public:
+    RpcHandler();
+    static WebSocketHandler* createHandler();
+
+    virtual void onOpen(ClientConnection *clientConnection);
+    virtual void onClose();
+};
+
 
 #endif
@@ -9,6 +9,8 @@
 //#include "TextLCD.h"
 #include "threadIO.h"
 #include "MQTTThreadedClient.h"
+#include "MQTTBroker.h"
+#include "SDIOBlockDevice.h"
 
 #define SAMPLE_TIME     1000 // milli-sec
 #define COMPLETED_FLAG (1UL << 0)
@@ -65,13 +67,18 @@ void print_stats()
 }
 
 #define USE_HTTPSERVER
+#define USE_TELEMETRY           // ADS1115 samples on /telemetry/, needs USE_HTTPSERVER
 //#define USE_MQTT
+//#define USE_MQTT_OFFLINE_LOG
+//#define USE_MQTT_BROKER
 
 #define DEFAULT_STACK_SIZE (4096)
 
 DigitalOut led(LED1);
 
-//ThreadIO threadIO(1000);
+#ifdef USE_TELEMETRY
+ThreadIO threadIO(5);           // 200 Hz for the telemetry stream
+#endif
 Thread msgSender(osPriorityNormal, DEFAULT_STACK_SIZE * 3);
 
 // Requests come in here
@@ -101,9 +108,16 @@ void request_handler(ParsedHttpRequest* request, TCPSocket* socket) {
             "<body>"
                 "<h1>mbed webserver</h1>"
                 "<button id=\"toggle\">Toggle LED</button>"
-                "<script>document.querySelector('#toggle').onclick = function() {"
-                    "var x = new XMLHttpRequest(); x.open('POST', '/toggle'); x.send();"
-                "}</script>"
+                "<script>"
+                    "var rpc = new WebSocket('ws://' + location.host + '/rpc/', '" WEBSOCKET_RPC_PROTOCOL "');"
+                    "document.querySelector('#toggle').onclick = function() {"
+                        "if (rpc.readyState == 1) {"
+                            "rpc.send(new Uint8Array([0x93, 2, 2, 0x90]));"     // notification [2, 2 (led.toggle), []]
+                        "} else {"
+                            "var x = new XMLHttpRequest(); x.open('POST', '/toggle'); x.send();"
+                        "}"
+                    "}"
+                "</script>"
             "</body></html>";
 
         builder.send(socket, response, sizeof(response) - 1);
@@ -167,9 +181,6 @@ class CallbackTest
 
 int main() {
 	
-    // IO Thread
-    //threadIO.start();
-    
     // Connect to the network with the default networking interface
     // if you use WiFi: see mbed_app.json for the credentials
     NetworkInterface* network = connect_to_default_network_interface();
@@ -184,6 +195,10 @@ int main() {
 #ifdef USE_HTTPSERVER	
     HttpServer server(network, 5, 4);
     server.setWSHandler("/ws/", WSHandler::createHandler);
+    server.setWSHandler("/echo/", EchoHandler::createHandler);
+    server.setWSHandler("/upload/", UploadHandler::createHandler);
+    server.setWSHandler("/telemetry/", TelemetryHandler::createHandler);
+    server.setWSHandler("/rpc/", RpcHandler::createHandler, WEBSOCKET_RPC_PROTOCOL);
 
     nsapi_error_t res = server.start(8080, &request_handler);
 
@@ -193,6 +208,14 @@ int main() {
     else {
         printf("Server could not be started... %d\n", res);
     }
+
+    // binary ADC samples for the websockets on /telemetry/, see test_JS/testTelemetry.html
+    TelemetryStream telemetry(&server, "/telemetry/", 4);
+#ifdef USE_TELEMETRY
+    // IO Thread
+    threadIO.setTelemetry(&telemetry);
+    threadIO.start();
+#endif
 #endif
 
 #ifdef USE_WEBSOCKETSERVER
@@ -200,6 +223,16 @@ int main() {
     threadWebSocketServer.start();
 #endif
 
+#ifdef USE_MQTT_BROKER
+    // local broker for a handful of clients, the client below can use it with hostname = own ip
+    static MQTTBroker broker(network);
+    static Thread brokerThread(osPriorityNormal, DEFAULT_STACK_SIZE);
+    if (broker.init(1883)) {
+        brokerThread.start(mbed::callback(&broker, &MQTTBroker::run));
+        printf("MQTT broker is listening at %s:1883\n", network->get_ip_address());
+    }
+#endif
+
 #ifdef USE_MQTT
     float version = 0.6;
     CallbackTest testcb;
@@ -213,29 +246,52 @@ int main() {
     int port = 1883;
 
     MQTTPacket_connectData logindata = MQTTPacket_connectData_initializer;
-    logindata.MQTTVersion = 3;
+    logindata.MQTTVersion = 4;
+    // v5: topic aliases, the broker must support MQTT v5 (mosquitto >= 1.6)
+    //logindata.MQTTVersion = 5;
     logindata.clientID.cstring = (char *) clientID;
+    // keep the QoS1/2 state on the server over reconnects
+    logindata.cleansession = 0;
     //logindata.username.cstring = (char *) userID;
     //logindata.password.cstring = (char *) password;
     
     mqtt.setConnectionParameters(hostname, port, logindata);
-    mqtt.addTopicHandler(topic_1, messageArrived);
+    mqtt.setSessionExpiry(24 * 3600);
+    mqtt.addTopicHandler(topic_1, messageArrived, QOS1);
     mqtt.addTopicHandler(topic_2, &testcb, &CallbackTest::messageArrived);
 
+#ifdef USE_MQTT_OFFLINE_LOG
+    // the card is used raw as a ring log, not as filesystem.
+    // 1 GB holds more than a week of 1 Hz telemetry.
+    static SDIOBlockDevice sd;
+    static OfflineLog offlineLog(&sd);
+    if (offlineLog.init() == 0)
+        mqtt.setOfflineLog(&offlineLog);
+#endif
+
     // Start the data producer
     msgSender.start(mbed::callback(&mqtt, &MQTTThreadedClient::startListener));
     
     int i = 0;
     while(true)
     {
-        PubMessage message;
-        message.qos = QOS0;
-        message.id = 123;
-        
-        strcpy(&message.topic[0], topic_1);
-        sprintf(&message.payload[0], "Testing %d", i);
-        message.payloadlen = strlen((const char *) &message.payload[0]);
-        mqtt.publish(message);
+        // the payload is written into the outbox and sent from there
+        PublishBuffer *message = mqtt.allocPublish(topic_1, 32);
+        if (message) {
+            message->qos = QOS1;
+            message->setPayloadLength(snprintf((char *) message->payload(), message->getPayloadCapacity(), "Testing %d", i));
+            mqtt.publish(message);
+        }
+
+        PublishStats stats;
+        mqtt.getPublishStats(&stats);
+        printf("MQTT published %lu (%lu bytes), retransmitted %lu, latency avg %lu us max %lu us\n",
+               stats.messagesSent, stats.bytesSent, stats.retransmissions, stats.latencyAvg_us, stats.latencyMax_us);
+        SessionStats session;
+        mqtt.getSessionStats(&session);
+        printf("MQTT sessions %lu, connect %lu ms, subscribed %lu topics %lu ms, reconnect %lu ms max %lu ms\n",
+               session.connects, session.connectTime_ms, session.subscribed, session.setupTime_ms,
+               session.reconnectTime_ms, session.reconnectTimeMax_ms);
         
         i++;
         //TODO: Nothing here yet ...
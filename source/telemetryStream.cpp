@@ -0,0 +1,129 @@
+/* 
+ * Copyright (c) 2019 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "telemetryStream.h"
+
+static inline uint8_t* putU16(uint8_t* ptr, uint16_t value)
+{
+    ptr[0] = value & 0xFF;
+    ptr[1] = value >> 8;
+    return ptr + 2;
+}
+
+static inline uint8_t* putU32(uint8_t* ptr, uint32_t value)
+{
+    ptr = putU16(ptr, value & 0xFFFF);
+    return putU16(ptr, value >> 16);
+}
+
+TelemetryStream::TelemetryStream(HttpServer* server, const char* path, int channels, int maxSamples, uint32_t maxAge_ms)
+{
+    _broadcast = server->getWSBroadcast(path);
+    _channels = channels;
+    _maxSamples = maxSamples;
+    _maxAge_us = maxAge_ms * 1000;
+    _frame = nullptr;
+    _ptr = nullptr;
+    _count = 0;
+    _framesSent = 0;
+    _samplesSent = 0;
+}
+
+TelemetryStream::~TelemetryStream()
+{
+    if (_frame) {
+        _frame->release();
+    }
+}
+
+bool TelemetryStream::startFrame(uint32_t timestamp_us)
+{
+    // samples are written in place, the frame header goes into the headroom
+    _frame = WebSocketFrame::allocPayload(TELEMETRY_HEADER_SIZE + _maxSamples * (2 + 2 * _channels));
+    if (!_frame) {
+        return false;
+    }
+
+    _ptr = _frame->payload();
+    *_ptr++ = TELEMETRY_VERSION;
+    *_ptr++ = _channels;
+    _ptr = putU16(_ptr, 0);                         // sample count, set by flush()
+    _ptr = putU32(_ptr, timestamp_us);
+    _count = 0;
+    _firstTimestamp = timestamp_us;
+    _lastTimestamp = timestamp_us;
+
+    return true;
+}
+
+void TelemetryStream::addSample(const int16_t* values)
+{
+    addSample(us_ticker_read(), values);
+}
+
+void TelemetryStream::addSample(uint32_t timestamp_us, const int16_t* values)
+{
+    if (_frame) {
+        // delta doesn't fit: start a new frame with a new base timestamp
+        if ((timestamp_us - _lastTimestamp) > 0xFFFF) {
+            flush();
+        }
+    }
+
+    if (!_frame) {
+        if (_broadcast->getMemberCount() == 0) {
+            return;                                 // nobody listening
+        }
+        if (!startFrame(timestamp_us)) {
+            return;
+        }
+    }
+
+    _ptr = putU16(_ptr, timestamp_us - _lastTimestamp);
+    for (int i = 0; i < _channels; i++) {
+        _ptr = putU16(_ptr, values[i]);
+    }
+    _lastTimestamp = timestamp_us;
+    _count++;
+
+    if ((_count >= _maxSamples) || ((timestamp_us - _firstTimestamp) >= _maxAge_us)) {
+        flush();
+    }
+}
+
+void TelemetryStream::flush()
+{
+    if (!_frame) {
+        return;
+    }
+
+    putU16(_frame->payload() + 2, _count);
+    size_t length = _ptr - _frame->payload();
+
+    // the broadcast takes over the frame reference
+    if (_broadcast->broadcast(_frame, WSop_binary, length) > 0) {
+        _framesSent++;
+        _samplesSent += _count;
+    }
+    _frame = nullptr;
+    _count = 0;
+}
@@ -0,0 +1,98 @@
+/* 
+ * Copyright (c) 2019 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __telemetryStream_h__
+#define __telemetryStream_h__
+
+#include "mbed.h"
+#include "http_server.h"
+#include "WebSocketFrame.h"
+
+// samples per frame, with 4 channels a frame fits into a pooled WebSocketFrame
+#ifndef TELEMETRY_MAX_SAMPLES
+#define TELEMETRY_MAX_SAMPLES   (24)
+#endif
+
+// a frame is sent when its first sample is older than this (ms)
+#ifndef TELEMETRY_MAX_AGE
+#define TELEMETRY_MAX_AGE       (100)
+#endif
+
+#define TELEMETRY_VERSION       (1)
+#define TELEMETRY_HEADER_SIZE   (8)
+
+/*
+    TelemetryStream collects timestamped samples into binary frames and
+    broadcasts them to all websockets of a path.
+
+    frame format, little endian:
+        uint8   version (TELEMETRY_VERSION)
+        uint8   number of channels
+        uint16  number of samples
+        uint32  timestamp of the first sample in us (us_ticker, wraps)
+        per sample:
+        uint16  time since the previous sample in us (0 for the first)
+        int16   value[channels]
+
+    See test_JS/telemetryDecoder.js for the decoder.
+*/
+class TelemetryStream
+{
+    public:
+    TelemetryStream(HttpServer* server, const char* path, int channels,
+                    int maxSamples = TELEMETRY_MAX_SAMPLES, uint32_t maxAge_ms = TELEMETRY_MAX_AGE);
+    ~TelemetryStream();
+
+    /*
+        addSample() : add one value per channel, sends the frame when it is full or too old.
+        Samples are dropped without cost while nobody is listening.
+    */
+    void addSample(const int16_t* values);
+    void addSample(uint32_t timestamp_us, const int16_t* values);
+
+    /*
+        flush() : send the pending samples
+    */
+    void flush();
+
+    uint32_t getFramesSent() { return _framesSent; };
+    uint32_t getSamplesSent() { return _samplesSent; };
+
+    private:
+    bool startFrame(uint32_t timestamp_us);
+
+    WebSocketBroadcast* _broadcast;
+    int _channels;
+    int _maxSamples;
+    uint32_t _maxAge_us;
+
+    WebSocketFrame* _frame;
+    uint8_t* _ptr;
+    int _count;
+    uint32_t _firstTimestamp;
+    uint32_t _lastTimestamp;
+
+    uint32_t _framesSent;
+    uint32_t _samplesSent;
+};
+
+#endif
@@ -28,11 +28,13 @@
 
 #define STACKSIZE   (4 * 1024)
 #define THREADNAME  "ThreadIO"
+#define ADS_CHANNELS (4)
 
 ThreadIO::ThreadIO(uint32_t cycleTime_ms) :
     _thread(osPriorityNormal, STACKSIZE, nullptr, THREADNAME)
 {
     _cycleTime = cycleTime_ms;
+    _telemetry = nullptr;
 }
 
 /*
@@ -83,33 +85,38 @@ void ThreadIO::myThreadFn()
 
 
         // led1 = !led1;
-        float reading = ads.readADC_SingleEnded_V(0); // read channel 0
-        float reading1 = ads.readADC_SingleEnded_V(1); // read channel 0
-        float reading2 = ads.readADC_SingleEnded_V(2); // read channel 0
-        float reading3 = ads.readADC_SingleEnded_V(3); // read channel 0
-        
-        //printf("reading: %7.3f %7.3f %7.3f %7.3f\r\n", reading, reading1, reading2, reading3); // print reading
+        // raw values, ~1.2 ms per channel at 860 SPS
+        int16_t values[ADS_CHANNELS];
+        for (int ch = 0; ch < ADS_CHANNELS; ch++) {
+            values[ch] = ads.readADC_SingleEnded(ch);
+        }
+
+        if (_telemetry) {
+            _telemetry->addSample(values);
+        }
+
+        //printf("reading: %6d %6d %6d %6d\r\n", values[0], values[1], values[2], values[3]); // print reading
 
 #if 0
         lcd.cls();
         lcd.locate(0, 0);
         char converted[10];
-        sprintf(converted, "%G", reading);
+        sprintf(converted, "%d", values[0]);
         lcd.printf(converted); 
 
         lcd.locate(0, 1);
         char converted1[10];
-        sprintf(converted1, "%G", reading1);
+        sprintf(converted1, "%d", values[1]);
         lcd.printf(converted1); 
 
         lcd.locate(0, 2);
         char converted2[10];
-        sprintf(converted2, "%G", reading2);
+        sprintf(converted2, "%d", values[2]);
         lcd.printf(converted2); 
 
         lcd.locate(0, 3);
         char converted3[10];
-        sprintf(converted3, "%G", reading3);
+        sprintf(converted3, "%d", values[3]);
         lcd.printf(converted3); 
 
         printf("hello from thread %d\n", i++);
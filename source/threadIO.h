@@ -21,6 +21,7 @@
  */
 
 #include "mbed.h"
+#include "telemetryStream.h"
 
 #ifndef __threadIO_h__
 #define __threadIO_h__
@@ -35,9 +36,15 @@ class ThreadIO
     */
     void start();
 
+    /*
+        setTelemetry() : stream the ADC samples of every cycle, call before start()
+    */
+    void setTelemetry(TelemetryStream* telemetry) { _telemetry = telemetry; };
+
     private:
     void myThreadFn();
     uint32_t _cycleTime;
+    TelemetryStream* _telemetry;
     Thread  _thread;
     bool _running;
 };
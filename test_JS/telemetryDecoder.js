@@ -0,0 +1,51 @@
+// decoder for the binary telemetry frames of source/telemetryStream.cpp
+//
+// frame format, little endian:
+//     uint8   version (1)
+//     uint8   number of channels
+//     uint16  number of samples
+//     uint32  timestamp of the first sample in us (wraps at 2^32)
+//     per sample:
+//     uint16  time since the previous sample in us
+//     int16   value[channels]
+//
+// works in the browser (global TelemetryDecoder) and in node (require)
+
+(function(exports) {
+    var TELEMETRY_VERSION = 1;
+    var HEADER_SIZE = 8;
+
+    // @param buffer ArrayBuffer of one websocket message
+    // @return { channels, timestamps: [us], values: [[ch0, ch1, ...], ...] }
+    function decode(buffer) {
+        var view = new DataView(buffer);
+        if (buffer.byteLength < HEADER_SIZE || view.getUint8(0) != TELEMETRY_VERSION) {
+            throw new Error('not a telemetry frame');
+        }
+
+        var channels = view.getUint8(1);
+        var count = view.getUint16(2, true);
+        var timestamp = view.getUint32(4, true);
+        var sampleSize = 2 + 2 * channels;
+        if (buffer.byteLength < HEADER_SIZE + count * sampleSize) {
+            throw new Error('telemetry frame too short');
+        }
+
+        var frame = { channels: channels, timestamps: [], values: [] };
+        var offset = HEADER_SIZE;
+        for (var i = 0; i < count; i++) {
+            timestamp = (timestamp + view.getUint16(offset, true)) >>> 0;
+            offset += 2;
+            var sample = [];
+            for (var ch = 0; ch < channels; ch++) {
+                sample.push(view.getInt16(offset, true));
+                offset += 2;
+            }
+            frame.timestamps.push(timestamp);
+            frame.values.push(sample);
+        }
+        return frame;
+    }
+
+    exports.decode = decode;
+})(typeof exports === 'undefined' ? (this.TelemetryDecoder = {}) : exports);
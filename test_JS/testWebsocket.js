@@ -1,34 +1,297 @@
 #!/usr/bin/env node
+// WebSocket load generator and latency benchmark.
+//
+// Opens N connections, sends text and/or binary messages of the given sizes and
+// measures the round trip of every message. Use the /echo/ path of the firmware,
+// every message is answered with the same payload. Paths which answer with a
+// different message (like /ws/) still work, the answers are matched in order.
+// ClientConnection reassembles fragmented messages. A handler like /echo/ gets the
+// whole message, up to HTTP_RECEIVE_BUFFER_SIZE (8 KB), larger ones are closed with
+// 1009. A streaming handler (/upload/) gets any size in chunks as they arrive.
+//
+// usage: node testWebsocket.js [options]
+//   --url <ws://host:port/path>   default ws://192.168.100.80:8080/echo/
+//   --connections <n>             concurrent connections, default 1
+//   --duration <s>                test time after all connections are open, default 10
+//   --size <n[,n...]>             payload sizes in bytes, picked round robin, default 64
+//   --rate <n>                    messages/s per connection, 0 = send on answer, default 0
+//   --window <n>                  max. unanswered messages per connection, default 1
+//   --binary <0..1>               part of binary messages, default 0 (text only)
+//   --label <text>                name of the run, e.g. the firmware version
+//   --format <text|csv|json>      output format, default text
+//   --out <file>                  append the result to a file instead of stdout
+//
+// example, compare two firmware versions:
+//   node testWebsocket.js --connections 4 --size 16,64,120 --label v1.2 --format csv --out bench.csv
 var WebSocketClient = require('websocket').client;
- 
-var client = new WebSocketClient();
- 
-client.on('connectFailed', function(error) {
-    console.log('Connect Error: ' + error.toString());
-});
- 
-client.on('connect', function(connection) {
-    console.log('WebSocket Client Connected');
-    connection.on('error', function(error) {
-        console.log("Connection Error: " + error.toString());
+var fs = require('fs');
+
+var options = {
+    url: 'ws://192.168.100.80:8080/echo/',
+    connections: 1,
+    duration: 10,
+    size: '64',
+    rate: 0,
+    window: 1,
+    binary: 0,
+    label: '',
+    format: 'text',
+    out: ''
+};
+
+function parseArgs(argv) {
+    for (var i = 2; i < argv.length; i++) {
+        var arg = argv[i];
+        if (arg.substr(0, 2) !== '--' || !(arg.substr(2) in options) || (i + 1 >= argv.length)) {
+            console.log('invalid argument: ' + arg + ', see the header of ' + argv[1]);
+            process.exit(1);
+        }
+        var key = arg.substr(2);
+        var value = argv[++i];
+        options[key] = (typeof options[key] === 'number') ? parseFloat(value) : value;
+    }
+    options.sizes = options.size.split(',').map(function(s) { return parseInt(s); });
+}
+
+function now() {
+    var t = process.hrtime();
+    return t[0] * 1e3 + t[1] / 1e6;                     // ms
+}
+
+var stats = {
+    sent: 0,
+    received: 0,
+    bytesSent: 0,
+    bytesReceived: 0,
+    errors: 0,
+    rtt: [],                                            // ms
+    setup: []                                           // ms
+};
+
+var startTime = 0;
+var stopTime = 0;
+var running = false;
+
+// payload starts with the sequence number, text as 8 hex digits, binary as uint32
+function makePayload(seq, size, binary) {
+    if (binary) {
+        var buf = Buffer.alloc(Math.max(size, 4), 0x55);
+        buf.writeUInt32LE(seq, 0);
+        return buf;
+    }
+    var head = ('0000000' + seq.toString(16)).substr(-8);
+    return (head + 'x'.repeat(Math.max(size - 8, 0))).substr(0, Math.max(size, 8));
+}
+
+function parseSeq(message) {
+    if (message.type === 'binary') {
+        return (message.binaryData.length >= 4) ? message.binaryData.readUInt32LE(0) : -1;
+    }
+    var head = message.utf8Data.substr(0, 8);
+    return /^[0-9a-f]{8}$/.test(head) ? parseInt(head, 16) : -1;
+}
+
+function Client(id) {
+    this.id = id;
+    this.connection = null;
+    this.connected = false;
+    this.seq = 0;
+    this.pending = {};                                  // seq -> send time
+    this.pendingOrder = [];                             // seqs in send order
+    this.sentInRun = 0;
+}
+
+Client.prototype.start = function(onReady) {
+    var self = this;
+    var client = new WebSocketClient();
+    var connectStart = now();
+
+    client.on('connectFailed', function(error) {
+        console.error('client ' + self.id + ' connect error: ' + error.toString());
+        stats.errors++;
+        onReady();
     });
-    connection.on('close', function() {
-        console.log('echo-protocol Connection Closed');
+
+    client.on('connect', function(connection) {
+        stats.setup.push(now() - connectStart);
+        self.connection = connection;
+        self.connected = true;
+        connection.on('error', function(error) {
+            console.error('client ' + self.id + ' connection error: ' + error.toString());
+            stats.errors++;
+        });
+        connection.on('close', function() {
+            self.connected = false;
+        });
+        connection.on('message', function(message) {
+            self.onMessage(message);
+        });
+        onReady();
     });
-    connection.on('message', function(message) {
-        if (message.type === 'utf8') {
-            console.log("Received: '" + message.utf8Data + "'");
+
+    client.connect(options.url);
+};
+
+Client.prototype.onMessage = function(message) {
+    var t = now();
+    var seq = parseSeq(message);
+    if (!(seq in this.pending)) {
+        seq = this.pendingOrder.length ? this.pendingOrder[0] : -1;     // not an echo, match in order
+    }
+    if (seq >= 0 && (seq in this.pending)) {
+        if (running) {
+            stats.rtt.push(t - this.pending[seq]);
+            stats.received++;
+            stats.bytesReceived += (message.type === 'binary') ? message.binaryData.length : Buffer.byteLength(message.utf8Data);
         }
-    });
-    
-    function sendNumber() {
-        if (connection.connected) {
-            var number = Math.round(Math.random() * 0xFFFFFF);
-            connection.sendUTF(number.toString());
-            setTimeout(sendNumber, 1000);
+        delete this.pending[seq];
+        this.pendingOrder.splice(this.pendingOrder.indexOf(seq), 1);
+    }
+    if (options.rate === 0) {
+        this.fillWindow();
+    }
+};
+
+Client.prototype.send = function() {
+    if (!this.connected || !running || (this.pendingOrder.length >= options.window)) {
+        return false;
+    }
+    var seq = this.seq++;
+    var size = options.sizes[seq % options.sizes.length];
+    var binary = Math.random() < options.binary;
+    var payload = makePayload(seq, size, binary);
+
+    this.pending[seq] = now();
+    this.pendingOrder.push(seq);
+    if (binary) {
+        this.connection.sendBytes(payload);
+    } else {
+        this.connection.sendUTF(payload);
+    }
+    stats.sent++;
+    stats.bytesSent += payload.length;
+    this.sentInRun++;
+    return true;
+};
+
+Client.prototype.fillWindow = function() {
+    while (this.send()) {
+    }
+};
+
+// open loop: catch up with the messages due at the configured rate
+Client.prototype.tick = function() {
+    var due = Math.floor((now() - startTime) * options.rate / 1000);
+    while ((this.sentInRun < due) && this.send()) {
+    }
+};
+
+function percentile(sorted, p) {
+    if (sorted.length === 0) {
+        return 0;
+    }
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p / 100))];
+}
+
+function result() {
+    var seconds = (stopTime - startTime) / 1000;
+    var rtt = stats.rtt.slice().sort(function(a, b) { return a - b; });
+    var setup = stats.setup.slice().sort(function(a, b) { return a - b; });
+
+    function round(v) { return Math.round(v * 1000) / 1000; }
+
+    return {
+        date: new Date().toISOString(),
+        label: options.label,
+        url: options.url,
+        connections: options.connections,
+        connected: setup.length,
+        duration_s: round(seconds),
+        sizes: options.size,
+        rate: options.rate,
+        window: options.window,
+        binary: options.binary,
+        sent: stats.sent,
+        received: stats.received,
+        unanswered: stats.sent - stats.received,       // includes the messages in flight at the end
+        errors: stats.errors,
+        msgs_per_s: round(stats.received / seconds),
+        tx_bytes_per_s: round(stats.bytesSent / seconds),
+        rx_bytes_per_s: round(stats.bytesReceived / seconds),
+        rtt_p50_ms: round(percentile(rtt, 50)),
+        rtt_p99_ms: round(percentile(rtt, 99)),
+        rtt_max_ms: round(rtt.length ? rtt[rtt.length - 1] : 0),
+        setup_avg_ms: round(setup.length ? setup.reduce(function(a, b) { return a + b; }, 0) / setup.length : 0),
+        setup_max_ms: round(setup.length ? setup[setup.length - 1] : 0)
+    };
+}
+
+function output(r) {
+    var keys = Object.keys(r);
+    var text;
+    var header = '';
+
+    if (options.format === 'json') {
+        text = JSON.stringify(r) + '\n';                // one object per line, easy to append
+    } else if (options.format === 'csv') {
+        header = keys.join(',') + '\n';
+        text = keys.map(function(k) {
+            var v = String(r[k]);
+            return /[,"]/.test(v) ? '"' + v.replace(/"/g, '""') + '"' : v;
+        }).join(',') + '\n';
+    } else {
+        text = keys.map(function(k) { return (k + ':                ').substr(0, 16) + r[k]; }).join('\n') + '\n';
+    }
+
+    if (options.out) {
+        if (header && !fs.existsSync(options.out)) {
+            fs.writeFileSync(options.out, header);
         }
+        fs.appendFileSync(options.out, text);
+    } else {
+        process.stdout.write(header + text);
     }
-    sendNumber();
+}
+
+parseArgs(process.argv);
+
+var clients = [];
+var ready = 0;
+
+for (var i = 0; i < options.connections; i++) {
+    clients.push(new Client(i));
+}
+
+clients.forEach(function(client) {
+    client.start(function() {
+        if (++ready < clients.length) {
+            return;
+        }
+
+        running = true;
+        startTime = now();
+        var timer = null;
+        if (options.rate > 0) {
+            timer = setInterval(function() {
+                clients.forEach(function(c) { c.tick(); });
+            }, 5);
+        } else {
+            clients.forEach(function(c) { c.fillWindow(); });
+        }
+
+        setTimeout(function() {
+            running = false;
+            stopTime = now();
+            if (timer) {
+                clearInterval(timer);
+            }
+            output(result());
+            clients.forEach(function(c) {
+                if (c.connected) {
+                    c.connection.close();
+                }
+            });
+            setTimeout(function() { process.exit(0); }, 500);
+        }, options.duration * 1000);
+    });
 });
- 
-client.connect('ws://192.168.100.80:8080/ws/');
\ No newline at end of file
@@ -0,0 +1,97 @@
+#!/usr/bin/env node
+// opens N WebSocket clients at the same time, every client sends a text message
+// and waits for the answer of the server before sending the next one.
+// Prints the aggregate message throughput after the test time.
+//
+// usage: node testWebsocketConcurrent.js [url] [clients] [seconds]
+var WebSocketClient = require('websocket').client;
+
+var url = process.argv[2] || 'ws://192.168.100.80:8081/ws/';
+var nClients = parseInt(process.argv[3] || '4');
+var seconds = parseInt(process.argv[4] || '10');
+
+var clients = [];
+var startTime;
+
+function Client(id) {
+    this.id = id;
+    this.connected = false;
+    this.failed = false;
+    this.sent = 0;
+    this.received = 0;
+    this.connection = null;
+}
+
+Client.prototype.start = function(onReady) {
+    var self = this;
+    var client = new WebSocketClient();
+
+    client.on('connectFailed', function(error) {
+        console.log('client ' + self.id + ' connect error: ' + error.toString());
+        self.failed = true;
+        onReady();
+    });
+
+    client.on('connect', function(connection) {
+        self.connection = connection;
+        self.connected = true;
+        connection.on('error', function(error) {
+            console.log('client ' + self.id + ' connection error: ' + error.toString());
+        });
+        connection.on('close', function() {
+            self.connected = false;
+        });
+        connection.on('message', function(message) {
+            self.received++;
+            self.send();
+        });
+        onReady();
+    });
+
+    client.connect(url);
+};
+
+Client.prototype.send = function() {
+    if (this.connected && startTime && (Date.now() - startTime < seconds * 1000)) {
+        this.connection.sendUTF('client ' + this.id + ' message ' + this.sent);
+        this.sent++;
+    }
+};
+
+function report() {
+    var elapsed = seconds;                  // no new messages are sent after the test time
+    var total = 0;
+    var connected = 0;
+
+    clients.forEach(function(client) {
+        console.log('client ' + client.id + ': sent ' + client.sent + ' received ' + client.received +
+                    ' (' + (client.received / elapsed).toFixed(1) + ' msg/s)');
+        total += client.received;
+        if (!client.failed) {
+            connected++;
+        }
+    });
+    console.log(connected + '/' + nClients + ' clients connected, ' + total + ' messages in ' + elapsed.toFixed(1) + ' s: ' +
+                (total / elapsed).toFixed(1) + ' msg/s');
+
+    clients.forEach(function(client) {
+        if (client.connection) {
+            client.connection.close();
+        }
+    });
+    process.exitCode = (connected == nClients) ? 0 : 1;
+}
+
+// connect all clients first, then start sending at the same time
+var pending = nClients;
+for (var i = 0; i < nClients; i++) {
+    var client = new Client(i);
+    clients.push(client);
+    client.start(function() {
+        if (--pending == 0) {
+            startTime = Date.now();
+            clients.forEach(function(c) { c.send(); });
+            setTimeout(report, seconds * 1000 + 500);
+        }
+    });
+}
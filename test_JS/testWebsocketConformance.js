@@ -0,0 +1,698 @@
+#!/usr/bin/env node
+// RFC 6455 conformance and throughput suite, modelled on the Autobahn test cases.
+//
+// Every case opens its own connection to an echo path (/echo/ of the firmware),
+// writes raw frames and checks the answer of the server. Protocol errors must
+// be answered with a close frame with the expected status code, closing the TCP
+// connection without close frame is reported as NON-STRICT.
+// Uses only node core modules, no npm install needed.
+//
+// usage: node testWebsocketConformance.js [options]
+//   --url <ws://host:port/path>   default ws://192.168.100.80:8080/echo/
+//   --cases <regex>               run only the matching case ids, e.g. '^5\.' or '^(1|9)\.'
+//   --timeout <ms>                max. wait for an answer, default 2000
+//   --label <text>                name of the run, e.g. the firmware version
+//   --format <text|csv|json>      output format, default text
+//   --out <file>                  append the report to a file instead of stdout
+//
+// exit code is the number of failed cases
+var net = require('net');
+var crypto = require('crypto');
+var fs = require('fs');
+
+var options = {
+    url: 'ws://192.168.100.80:8080/echo/',
+    cases: '',
+    timeout: 2000,
+    label: '',
+    format: 'text',
+    out: ''
+};
+
+var OP_CONT = 0x0;
+var OP_TEXT = 0x1;
+var OP_BINARY = 0x2;
+var OP_CLOSE = 0x8;
+var OP_PING = 0x9;
+var OP_PONG = 0xA;
+
+function parseArgs(argv) {
+    for (var i = 2; i < argv.length; i++) {
+        var arg = argv[i];
+        if (arg.substr(0, 2) !== '--' || !(arg.substr(2) in options) || (i + 1 >= argv.length)) {
+            console.log('invalid argument: ' + arg + ', see the header of ' + argv[1]);
+            process.exit(1);
+        }
+        var key = arg.substr(2);
+        var value = argv[++i];
+        options[key] = (typeof options[key] === 'number') ? parseFloat(value) : value;
+    }
+}
+
+function now() {
+    var t = process.hrtime();
+    return t[0] * 1e3 + t[1] / 1e6;                     // ms
+}
+
+function delay(ms) {
+    return new Promise(function(resolve) { setTimeout(resolve, ms); });
+}
+
+/*
+ * frame encoding, client frames are masked unless mask === false
+ */
+function encodeFrame(opcode, payload, opts) {
+    opts = opts || {};
+    payload = Buffer.isBuffer(payload) ? payload : Buffer.from(payload || '');
+    var fin = (opts.fin === undefined) ? true : opts.fin;
+    var mask = (opts.mask === undefined) ? true : opts.mask;
+    var len = payload.length;
+    var header;
+
+    if (len <= 125) {
+        header = Buffer.alloc(2);
+        header[1] = len;
+    } else if (len <= 0xffff) {
+        header = Buffer.alloc(4);
+        header[1] = 126;
+        header.writeUInt16BE(len, 2);
+    } else {
+        header = Buffer.alloc(10);
+        header[1] = 127;
+        header.writeUInt32BE(Math.floor(len / 0x100000000), 2);
+        header.writeUInt32BE(len % 0x100000000, 6);
+    }
+    header[0] = (fin ? 0x80 : 0) | ((opts.rsv || 0) << 4) | opcode;
+
+    if (!mask) {
+        return Buffer.concat([header, payload]);
+    }
+    header[1] |= 0x80;
+    var key = crypto.randomBytes(4);
+    var masked = Buffer.alloc(len);
+    for (var i = 0; i < len; i++) {
+        masked[i] = payload[i] ^ key[i & 3];
+    }
+    return Buffer.concat([header, key, masked]);
+}
+
+function closePayload(code, reason) {
+    var buf = Buffer.alloc(2);
+    buf.writeUInt16BE(code, 0);
+    return Buffer.concat([buf, Buffer.isBuffer(reason) ? reason : Buffer.from(reason || '')]);
+}
+
+/*
+ * raw client: handshake and a queue of events { type: 'frame' | 'closed' | 'timeout' }
+ */
+function RawClient(url) {
+    var m = /^ws:\/\/([^\/:]+)(?::(\d+))?(\/.*)?$/.exec(url);
+    this.host = m[1];
+    this.port = parseInt(m[2] || '80');
+    this.path = m[3] || '/';
+    this.socket = null;
+    this.buffer = Buffer.alloc(0);
+    this.events = [];
+    this.waiter = null;
+}
+
+RawClient.prototype.open = function() {
+    var self = this;
+    var key = crypto.randomBytes(16).toString('base64');
+    var accept = crypto.createHash('sha1').update(key + '258EAFA5-E914-47DA-95CA-C5AB0DC85B11').digest('base64');
+
+    return new Promise(function(resolve, reject) {
+        var handshakeDone = false;
+        var timer = setTimeout(function() { reject(new Error('handshake timeout')); self.socket.destroy(); }, options.timeout);
+
+        self.socket = net.connect(self.port, self.host, function() {
+            self.socket.setNoDelay(true);
+            self.socket.write('GET ' + self.path + ' HTTP/1.1\r\n' +
+                'Host: ' + self.host + ':' + self.port + '\r\n' +
+                'Upgrade: websocket\r\n' +
+                'Connection: Upgrade\r\n' +
+                'Sec-WebSocket-Key: ' + key + '\r\n' +
+                'Sec-WebSocket-Version: 13\r\n\r\n');
+        });
+        self.socket.on('data', function(data) {
+            self.buffer = Buffer.concat([self.buffer, data]);
+            if (!handshakeDone) {
+                var end = self.buffer.indexOf('\r\n\r\n');
+                if (end < 0) {
+                    return;
+                }
+                var head = self.buffer.slice(0, end).toString();
+                self.buffer = self.buffer.slice(end + 4);
+                handshakeDone = true;
+                clearTimeout(timer);
+                if (!/^HTTP\/1\.1 101/.test(head) || head.indexOf(accept) < 0) {
+                    reject(new Error('handshake failed: ' + head.split('\r\n')[0]));
+                    self.socket.destroy();
+                    return;
+                }
+                resolve();
+            }
+            self.parse();
+        });
+        self.socket.on('close', function() {
+            clearTimeout(timer);
+            if (!handshakeDone) {
+                reject(new Error('connection closed during handshake'));
+            }
+            self.push({ type: 'closed' });
+        });
+        self.socket.on('error', function(error) {
+            clearTimeout(timer);
+            if (!handshakeDone) {
+                reject(error);
+            }
+        });
+    });
+};
+
+RawClient.prototype.parse = function() {
+    while (this.buffer.length >= 2) {
+        var b = this.buffer;
+        var len = b[1] & 0x7f;
+        var pos = 2;
+        if (len === 126) {
+            if (b.length < 4) {
+                return;
+            }
+            len = b.readUInt16BE(2);
+            pos = 4;
+        } else if (len === 127) {
+            if (b.length < 10) {
+                return;
+            }
+            len = b.readUInt32BE(2) * 0x100000000 + b.readUInt32BE(6);
+            pos = 10;
+        }
+        var masked = (b[1] & 0x80) !== 0;
+        var key = null;
+        if (masked) {
+            if (b.length < pos + 4) {
+                return;
+            }
+            key = b.slice(pos, pos + 4);
+            pos += 4;
+        }
+        if (b.length < pos + len) {
+            return;
+        }
+        var payload = Buffer.from(b.slice(pos, pos + len));
+        if (key) {
+            for (var i = 0; i < len; i++) {
+                payload[i] ^= key[i & 3];
+            }
+        }
+        this.buffer = b.slice(pos + len);
+        this.push({
+            type: 'frame',
+            fin: (b[0] & 0x80) !== 0,
+            rsv: (b[0] >> 4) & 7,
+            opcode: b[0] & 0x0f,
+            masked: masked,
+            payload: payload
+        });
+    }
+};
+
+RawClient.prototype.push = function(event) {
+    if (this.waiter) {
+        var waiter = this.waiter;
+        this.waiter = null;
+        waiter(event);
+    } else {
+        this.events.push(event);
+    }
+};
+
+RawClient.prototype.next = function(timeout) {
+    var self = this;
+    if (this.events.length) {
+        return Promise.resolve(this.events.shift());
+    }
+    return new Promise(function(resolve) {
+        var timer = setTimeout(function() {
+            self.waiter = null;
+            resolve({ type: 'timeout' });
+        }, timeout || options.timeout);
+        self.waiter = function(event) {
+            clearTimeout(timer);
+            resolve(event);
+        };
+    });
+};
+
+RawClient.prototype.write = function(data) {
+    this.socket.write(data);
+};
+
+RawClient.prototype.send = function(opcode, payload, opts) {
+    this.write(encodeFrame(opcode, payload, opts));
+};
+
+RawClient.prototype.destroy = function() {
+    if (this.socket) {
+        this.socket.destroy();
+    }
+};
+
+/*
+ * expectations, return a note string on failure and '' on success
+ */
+function describe(event) {
+    if (event.type !== 'frame') {
+        return event.type;
+    }
+    var desc = 'opcode ' + event.opcode + (event.fin ? '' : ' (no fin)') + ', ' + event.payload.length + ' bytes';
+    if (event.opcode === OP_CLOSE && event.payload.length >= 2) {
+        desc += ', code ' + event.payload.readUInt16BE(0);
+    }
+    return desc;
+}
+
+// next complete data message, pongs are skipped
+async function readMessage(c) {
+    var opcode = -1;
+    var parts = [];
+    for (;;) {
+        var event = await c.next();
+        if (event.type !== 'frame') {
+            return { error: 'got ' + event.type + ' instead of a message' };
+        }
+        if (event.opcode === OP_PONG) {
+            continue;
+        }
+        if (event.masked) {
+            return { error: 'server frame is masked' };
+        }
+        if (event.opcode === OP_CLOSE || event.opcode === OP_PING) {
+            return { error: 'got ' + describe(event) + ' instead of a message' };
+        }
+        if (opcode < 0) {
+            if (event.opcode === OP_CONT) {
+                return { error: 'message starts with a continuation frame' };
+            }
+            opcode = event.opcode;
+        } else if (event.opcode !== OP_CONT) {
+            return { error: 'expected a continuation frame, got ' + describe(event) };
+        }
+        parts.push(event.payload);
+        if (event.fin) {
+            return { opcode: opcode, payload: Buffer.concat(parts) };
+        }
+    }
+}
+
+async function expectEcho(c, opcode, payload) {
+    payload = Buffer.isBuffer(payload) ? payload : Buffer.from(payload);
+    var msg = await readMessage(c);
+    if (msg.error) {
+        return msg.error;
+    }
+    if (msg.opcode !== opcode) {
+        return 'echo has opcode ' + msg.opcode + ', expected ' + opcode;
+    }
+    if (!msg.payload.equals(payload)) {
+        return 'echo differs, ' + msg.payload.length + ' bytes, expected ' + payload.length;
+    }
+    return '';
+}
+
+async function expectPong(c, payload) {
+    payload = Buffer.isBuffer(payload) ? payload : Buffer.from(payload || '');
+    var event = await c.next();
+    if (event.type !== 'frame' || event.opcode !== OP_PONG) {
+        return 'expected pong, got ' + describe(event);
+    }
+    if (!event.payload.equals(payload)) {
+        return 'pong payload differs';
+    }
+    return '';
+}
+
+// clean close: close frame from the server (code in codes, if given), then TCP close
+async function expectClose(c, codes) {
+    var event = await c.next();
+    while (event.type === 'frame' && event.opcode === OP_PONG) {
+        event = await c.next();
+    }
+    if (event.type === 'closed') {
+        return { nonStrict: 'TCP closed without close frame' };
+    }
+    if (event.type !== 'frame' || event.opcode !== OP_CLOSE) {
+        return { error: 'expected close, got ' + describe(event) };
+    }
+    var code = (event.payload.length >= 2) ? event.payload.readUInt16BE(0) : 1005;
+    if (codes && codes.indexOf(code) < 0) {
+        return { error: 'close code ' + code + ', expected ' + codes.join('/') };
+    }
+    // answer the close and wait for the server to drop the connection
+    c.send(OP_CLOSE, event.payload.slice(0, 2));
+    var closed = await c.next();
+    if (closed.type !== 'closed') {
+        return { error: 'connection not closed after close handshake, got ' + describe(closed) };
+    }
+    return {};
+}
+
+function pattern(length, start) {
+    var buf = Buffer.alloc(length);
+    for (var i = 0; i < length; i++) {
+        buf[i] = 0x20 + ((i + (start || 0)) % 0x5f);      // printable ASCII, valid UTF-8
+    }
+    return buf;
+}
+
+/*
+ * test cases, run(c) returns '' on pass, a note on failure or { nonStrict: note }
+ */
+var cases = [];
+
+function addCase(id, desc, run) {
+    cases.push({ id: id, desc: desc, run: run });
+}
+
+function addEchoCase(id, opcode, length) {
+    addCase(id, (opcode === OP_TEXT ? 'text' : 'binary') + ' message, ' + length + ' bytes', async function(c) {
+        var payload = pattern(length);
+        c.send(opcode, payload);
+        return expectEcho(c, opcode, payload);
+    });
+}
+
+function addFailCase(id, desc, codes, send) {
+    addCase(id, desc, async function(c) {
+        await send(c);
+        return expectClose(c, codes);
+    });
+}
+
+// 1 framing, payload length encodings: 7 bit, 16 bit and 64 bit
+[OP_TEXT, OP_BINARY].forEach(function(opcode, j) {
+    [0, 125, 126, 65535, 65536].forEach(function(length, i) {
+        addEchoCase('1.' + (j + 1) + '.' + (i + 1), opcode, length);
+    });
+});
+
+// 2 ping and pong
+addCase('2.1', 'ping without payload', async function(c) {
+    c.send(OP_PING, '');
+    return expectPong(c, '');
+});
+addCase('2.2', 'ping with 125 bytes payload', async function(c) {
+    var payload = pattern(125);
+    c.send(OP_PING, payload);
+    return expectPong(c, payload);
+});
+addFailCase('2.3', 'ping with 126 bytes payload', [1002], function(c) {
+    c.send(OP_PING, pattern(126));
+});
+addCase('2.4', 'unsolicited pong is ignored', async function(c) {
+    c.send(OP_PONG, 'unsolicited');
+    c.send(OP_TEXT, 'after pong');
+    return expectEcho(c, OP_TEXT, 'after pong');
+});
+addCase('2.5', '10 pings in a row', async function(c) {
+    for (var i = 0; i < 10; i++) {
+        c.send(OP_PING, 'ping ' + i);
+    }
+    for (i = 0; i < 10; i++) {
+        var note = await expectPong(c, 'ping ' + i);
+        if (note) {
+            return note;
+        }
+    }
+    return '';
+});
+
+// 3 reserved bits without negotiated extension
+[1, 2, 3].forEach(function(bit) {
+    addFailCase('3.' + bit, 'text message with RSV' + bit, [1002], function(c) {
+        c.send(OP_TEXT, 'reserved bit', { rsv: 1 << (3 - bit) });
+    });
+});
+
+// 4 reserved opcodes
+[3, 7, 0xB, 0xF].forEach(function(opcode, i) {
+    addFailCase('4.' + (i + 1), 'reserved opcode ' + opcode, [1002], function(c) {
+        c.send(opcode, 'reserved');
+    });
+});
+
+// 5 fragmentation
+addCase('5.1', 'text message in 2 fragments', async function(c) {
+    c.send(OP_TEXT, 'fragment1', { fin: false });
+    c.send(OP_CONT, 'fragment2');
+    return expectEcho(c, OP_TEXT, 'fragment1fragment2');
+});
+addCase('5.2', 'text message in 1 byte fragments', async function(c) {
+    var text = 'Hello, fragments!';
+    for (var i = 0; i < text.length; i++) {
+        c.send(i === 0 ? OP_TEXT : OP_CONT, text[i], { fin: i === text.length - 1 });
+    }
+    return expectEcho(c, OP_TEXT, text);
+});
+addCase('5.3', 'binary message in 3 fragments of 100 bytes', async function(c) {
+    var payload = pattern(300);
+    c.send(OP_BINARY, payload.slice(0, 100), { fin: false });
+    c.send(OP_CONT, payload.slice(100, 200), { fin: false });
+    c.send(OP_CONT, payload.slice(200));
+    return expectEcho(c, OP_BINARY, payload);
+});
+addCase('5.4', 'ping between fragments', async function(c) {
+    c.send(OP_TEXT, 'fragment1', { fin: false });
+    c.send(OP_PING, 'between');
+    c.send(OP_CONT, 'fragment2');
+    var note = await expectPong(c, 'between');
+    return note || expectEcho(c, OP_TEXT, 'fragment1fragment2');
+});
+addCase('5.5', 'empty fragments', async function(c) {
+    c.send(OP_TEXT, '', { fin: false });
+    c.send(OP_CONT, 'middle', { fin: false });
+    c.send(OP_CONT, '');
+    return expectEcho(c, OP_TEXT, 'middle');
+});
+addFailCase('5.6', 'continuation without start', [1002], function(c) {
+    c.send(OP_CONT, 'orphan');
+});
+addFailCase('5.7', 'fragmented ping', [1002], function(c) {
+    c.send(OP_PING, 'frag', { fin: false });
+    c.send(OP_CONT, 'ment');
+});
+addFailCase('5.8', 'new text message before the last fragment', [1002], function(c) {
+    c.send(OP_TEXT, 'fragment1', { fin: false });
+    c.send(OP_TEXT, 'fragment2');
+});
+
+// 6 UTF-8 handling
+addCase('6.1', 'valid multi byte UTF-8', async function(c) {
+    var text = Buffer.from('κόσμε € 😀');
+    c.send(OP_TEXT, text);
+    return expectEcho(c, OP_TEXT, text);
+});
+addCase('6.2', 'valid UTF-8 split inside a code point across fragments', async function(c) {
+    var text = Buffer.from('€😀');
+    c.send(OP_TEXT, text.slice(0, 2), { fin: false });
+    c.send(OP_CONT, text.slice(2, 5), { fin: false });
+    c.send(OP_CONT, text.slice(5));
+    return expectEcho(c, OP_TEXT, text);
+});
+[
+    ['overlong encoding', [0xc0, 0xaf]],
+    ['UTF-16 surrogate', [0xed, 0xa0, 0x80]],
+    ['code point above U+10FFFF', [0xf4, 0x90, 0x80, 0x80]],
+    ['invalid byte 0xFF', [0x61, 0xff, 0x62]],
+    ['truncated sequence at end of message', [0x61, 0xe2, 0x82]],
+    ['lone continuation byte', [0x80]]
+].forEach(function(t, i) {
+    addFailCase('6.' + (i + 3), 'invalid UTF-8, ' + t[0], [1007], function(c) {
+        c.send(OP_TEXT, Buffer.from(t[1]));
+    });
+});
+addFailCase('6.9', 'invalid UTF-8 in a fragmented message', [1007], function(c) {
+    c.send(OP_TEXT, 'valid', { fin: false });
+    c.send(OP_CONT, Buffer.from([0xed, 0xa0, 0x80]), { fin: false });
+    c.send(OP_CONT, 'end');
+});
+
+// 7 close handshake and close codes
+addFailCase('7.1', 'close with code 1000', [1000], function(c) {
+    c.send(OP_CLOSE, closePayload(1000, 'bye'));
+});
+addFailCase('7.2', 'close without payload', null, function(c) {
+    c.send(OP_CLOSE, '');
+});
+addCase('7.3', 'data after close is ignored', async function(c) {
+    c.send(OP_CLOSE, closePayload(1000));
+    c.send(OP_TEXT, 'after close');
+    return expectClose(c, [1000]);
+});
+addFailCase('7.4', 'close with 1 byte payload', [1002], function(c) {
+    c.send(OP_CLOSE, Buffer.from([0x03]));
+});
+[0, 999, 1004, 1005, 1006, 1016, 2999].forEach(function(code, i) {
+    addFailCase('7.' + (i + 5), 'close with invalid code ' + code, [1002], function(c) {
+        c.send(OP_CLOSE, closePayload(code));
+    });
+});
+[1001, 1002, 1003, 1007, 1008, 1009, 1010, 1011, 3000, 4999].forEach(function(code, i) {
+    addFailCase('7.' + (i + 12), 'close with valid code ' + code, [code, 1000], function(c) {
+        c.send(OP_CLOSE, closePayload(code));
+    });
+});
+addFailCase('7.22', 'close with invalid UTF-8 reason', [1007], function(c) {
+    c.send(OP_CLOSE, closePayload(1000, Buffer.from([0xc0, 0xaf])));
+});
+
+// 8 masking
+addFailCase('8.1', 'unmasked client frame', [1002], function(c) {
+    c.send(OP_TEXT, 'not masked', { mask: false });
+});
+
+// 9 frames split at every byte offset, each part is sent in its own TCP segment
+async function splitEcho(c, opcode, payload, step) {
+    var frame = encodeFrame(opcode, payload);
+    for (var pos = 0; pos < frame.length; pos += step) {
+        c.write(frame.slice(pos, pos + step));
+        await delay(2);
+    }
+    return expectEcho(c, opcode, payload);
+}
+
+addCase('9.1', 'text frame split at every offset into 2 parts', async function(c) {
+    var payload = pattern(100);
+    var frame = encodeFrame(OP_TEXT, payload);
+    for (var split = 1; split < frame.length; split++) {
+        c.write(frame.slice(0, split));
+        await delay(2);
+        c.write(frame.slice(split));
+        var note = await expectEcho(c, OP_TEXT, payload);
+        if (note) {
+            return 'split at ' + split + ': ' + note;
+        }
+    }
+    return '';
+});
+addCase('9.2', 'text frame with 16 bit length sent byte by byte', async function(c) {
+    return splitEcho(c, OP_TEXT, pattern(200), 1);
+});
+addCase('9.3', 'binary frame with 64 bit length in 1000 byte parts', async function(c) {
+    return splitEcho(c, OP_BINARY, pattern(70000), 1000);
+});
+addCase('9.4', 'two frames in one TCP segment', async function(c) {
+    c.write(Buffer.concat([encodeFrame(OP_TEXT, 'first'), encodeFrame(OP_TEXT, 'second')]));
+    var note = await expectEcho(c, OP_TEXT, 'first');
+    return note || expectEcho(c, OP_TEXT, 'second');
+});
+
+// 10 throughput, messages are pipelined and must come back in order
+function addThroughputCase(id, opcode, length, count) {
+    addCase(id, count + ' ' + (opcode === OP_TEXT ? 'text' : 'binary') + ' messages of ' + length + ' bytes pipelined', async function(c) {
+        var start = now();
+        var frames = [];
+        for (var i = 0; i < count; i++) {
+            frames.push(encodeFrame(opcode, pattern(length, i)));
+        }
+        c.write(Buffer.concat(frames));
+        for (i = 0; i < count; i++) {
+            var note = await expectEcho(c, opcode, pattern(length, i));
+            if (note) {
+                return 'message ' + i + ': ' + note;
+            }
+        }
+        var seconds = (now() - start) / 1000;
+        return { info: Math.round(count / seconds) + ' msgs/s, ' + Math.round(count * length / seconds / 1024) + ' KiB/s' };
+    });
+}
+
+addThroughputCase('10.1', OP_TEXT, 16, 1000);
+addThroughputCase('10.2', OP_TEXT, 125, 1000);
+addThroughputCase('10.3', OP_BINARY, 125, 1000);
+addThroughputCase('10.4', OP_BINARY, 1024, 200);
+addThroughputCase('10.5', OP_BINARY, 65536, 10);
+
+/*
+ * runner
+ */
+async function runCase(tc) {
+    var c = new RawClient(options.url);
+    var start = now();
+    var result = { id: tc.id, desc: tc.desc, result: 'FAIL', time_ms: 0, note: '' };
+
+    try {
+        await c.open();
+        var ret = await tc.run(c);
+        if (typeof ret === 'string') {
+            result.result = ret ? 'FAIL' : 'PASS';
+            result.note = ret;
+        } else if (ret.error) {
+            result.note = ret.error;
+        } else if (ret.nonStrict) {
+            result.result = 'NON-STRICT';
+            result.note = ret.nonStrict;
+        } else {
+            result.result = 'PASS';
+            result.note = ret.info || '';
+        }
+    } catch (error) {
+        result.note = error.message;
+    }
+    result.time_ms = Math.round((now() - start) * 10) / 10;
+    c.destroy();
+
+    return result;
+}
+
+function output(results) {
+    var date = new Date().toISOString();
+    var text = '';
+    var header = '';
+
+    if (options.format === 'json') {
+        text = JSON.stringify({ date: date, label: options.label, url: options.url, results: results }) + '\n';
+    } else if (options.format === 'csv') {
+        header = 'date,label,id,result,time_ms,desc,note\n';
+        results.forEach(function(r) {
+            text += [date, options.label, r.id, r.result, r.time_ms, r.desc, r.note].map(function(v) {
+                v = String(v);
+                return /[,"]/.test(v) ? '"' + v.replace(/"/g, '""') + '"' : v;
+            }).join(',') + '\n';
+        });
+    } else {
+        results.forEach(function(r) {
+            text += (r.id + '        ').substr(0, 8) + (r.result + '           ').substr(0, 11) +
+                ('        ' + r.time_ms.toFixed(1)).substr(-8) + ' ms  ' + r.desc + (r.note ? ' [' + r.note + ']' : '') + '\n';
+        });
+        var count = function(res) { return results.filter(function(r) { return r.result === res; }).length; };
+        text += '\n' + results.length + ' cases: ' + count('PASS') + ' passed, ' + count('NON-STRICT') + ' non-strict, ' + count('FAIL') + ' failed\n';
+    }
+
+    if (options.out) {
+        if (header && !fs.existsSync(options.out)) {
+            fs.writeFileSync(options.out, header);
+        }
+        fs.appendFileSync(options.out, text);
+    } else {
+        process.stdout.write(header + text);
+    }
+}
+
+async function main() {
+    parseArgs(process.argv);
+    var filter = new RegExp(options.cases);
+    var results = [];
+
+    for (var i = 0; i < cases.length; i++) {
+        if (filter.test(cases[i].id)) {
+            results.push(await runCase(cases[i]));
+        }
+    }
+
+    output(results);
+    process.exit(results.filter(function(r) { return r.result === 'FAIL'; }).length);
+}
+
+main();
@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Host benchmark for MQTTBrokerCore: messages/s from one publisher to
+ * 1..3 subscribers with QoS0 and QoS1, the connections are byte streams
+ * in memory served like MQTTBroker does it, one receive buffer per
+ * connection and round. Before timing, connect, wildcards, retained
+ * messages, will and persistent sessions are checked against the packets
+ * the clients receive.
+ *
+ * build:
+ *   g++ -O2 -I../libs/MQTTBroker -I../libs/MQTTPacket -I../libs/MQTTClient -I../libs/util mqtt_broker_bench.cpp ../libs/MQTTBroker/MQTTBrokerCore.cpp -x c ../libs/MQTTPacket/MQTT*.c -o mqtt_broker_bench
+ *
+ * run:
+ *   ./mqtt_broker_bench
+ */
+
+#include "MQTTBrokerCore.h"
+#include "MQTTPacket.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define MESSAGES    (200000)
+
+using namespace MQTT;
+
+static MQTTBrokerCore* broker;
+static uint32_t now = 0;
+
+struct Received {
+    std::string topic;
+    std::string payload;
+    int qos;
+    bool retained;
+    bool dup;
+};
+
+struct Client {
+    int conn;
+    std::vector<unsigned char> stream;      // from the broker, not yet parsed
+    std::vector<Received> received;
+    bool keep;                              // keep the publishes for the checks
+    int publishes;
+    int connack;                            // -1 none, else sessionPresent << 8 | rc
+};
+
+static double now_us()
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void drain(Client& c);
+
+// like a recv(), as much as the receive buffer takes
+static int feedSome(Client& c, const unsigned char* data, int len)
+{
+    int space;
+    unsigned char* buf = broker->receiveBuffer(c.conn, &space);
+    int n = (len < space) ? len : space;
+    memcpy(buf, data, n);
+    if (broker->received(c.conn, n, now) < 0) {
+        return -1;
+    }
+    return n;
+}
+
+static int feed(Client& c, const unsigned char* data, int len)
+{
+    while (len > 0) {
+        int n = feedSome(c, data, len);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            drain(c);
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// reads what the broker has sent, QoS1 publishes are acknowledged
+static void drain(Client& c)
+{
+    while (true) {
+        const unsigned char* data;
+        int len = broker->pending(c.conn, &data);
+        if (len == 0) {
+            return;
+        }
+        c.stream.insert(c.stream.end(), data, data + len);
+        broker->sent(c.conn, len);
+
+        std::vector<unsigned char> acks;
+        size_t pos = 0;
+        while (c.stream.size() - pos >= 2) {
+            int remaining;
+            int n = MQTTPacket_decodeBuf(&c.stream[pos + 1], &remaining);
+            size_t total = 1 + n + remaining;
+            if (c.stream.size() - pos < total) {
+                break;
+            }
+            unsigned char* packet = &c.stream[pos];
+            MQTTHeader header = {0};
+            header.byte = packet[0];
+
+            if (header.bits.type == CONNACK) {
+                unsigned char present, rc;
+                MQTTDeserialize_connack(&present, &rc, packet, total);
+                c.connack = (present << 8) | rc;
+            } else if (header.bits.type == PUBLISH) {
+                unsigned char dup, retained;
+                int qos;
+                unsigned short id;
+                MQTTString topic;
+                unsigned char* payload;
+                int payloadLen;
+                MQTTDeserialize_publish(&dup, &qos, &retained, &id, &topic, &payload, &payloadLen, packet, total);
+                c.publishes++;
+                if (c.keep) {
+                    Received r = { std::string(topic.lenstring.data, topic.lenstring.len),
+                                   std::string((char*)payload, payloadLen), qos, retained != 0, dup != 0 };
+                    c.received.push_back(r);
+                }
+                if (qos == 1) {
+                    unsigned char ack[4];
+                    int alen = MQTTSerialize_puback(ack, sizeof(ack), id);
+                    acks.insert(acks.end(), ack, ack + alen);
+                }
+            }
+            pos += total;
+        }
+        c.stream.erase(c.stream.begin(), c.stream.begin() + pos);
+
+        if (!acks.empty()) {
+            feed(c, &acks[0], acks.size());
+        }
+    }
+}
+
+static bool connect(Client& c, const char* id, bool clean, const char* willTopic = NULL)
+{
+    unsigned char buf[128];
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.clientID.cstring = (char*)id;
+    data.cleansession = clean;
+    data.keepAliveInterval = 60;
+    if (willTopic) {
+        data.willFlag = 1;
+        data.will.topicName.cstring = (char*)willTopic;
+        data.will.message.cstring = (char*)"offline";
+        data.will.qos = 1;
+    }
+
+    c.conn = broker->open(now);
+    c.stream.clear();
+    c.received.clear();
+    c.keep = true;
+    c.publishes = 0;
+    c.connack = -1;
+    if (c.conn < 0) {
+        return false;
+    }
+    int len = MQTTSerialize_connect(buf, sizeof(buf), &data);
+    feed(c, buf, len);
+    drain(c);
+    return (c.connack & 0xFF) == 0;
+}
+
+static void subscribe(Client& c, const char* filter, int qos)
+{
+    unsigned char buf[128];
+    MQTTString topic = MQTTString_initializer;
+    topic.cstring = (char*)filter;
+    int len = MQTTSerialize_subscribe(buf, sizeof(buf), 0, 1, 1, &topic, &qos);
+    feed(c, buf, len);
+    drain(c);
+}
+
+static int serializePublish(unsigned char* buf, int buflen, const char* name, const char* payload, int qos, bool retained, unsigned short id = 1)
+{
+    MQTTString topic = MQTTString_initializer;
+    topic.cstring = (char*)name;
+    return MQTTSerialize_publish(buf, buflen, 0, qos, retained, id, topic, (unsigned char*)payload, strlen(payload));
+}
+
+static void publish(Client& c, const char* topic, const char* payload, int qos, bool retained)
+{
+    unsigned char buf[256];
+    feed(c, buf, serializePublish(buf, sizeof(buf), topic, payload, qos, retained));
+    drain(c);
+}
+
+static void disconnect(Client& c)
+{
+    unsigned char buf[4];
+    feed(c, buf, MQTTSerialize_disconnect(buf, sizeof(buf)));
+    broker->close(c.conn);
+}
+
+#define CHECK(x) do { if (!(x)) { printf("FAILED line %d: %s\n", __LINE__, #x); return false; } } while (0)
+
+static bool selfTest()
+{
+    Client a, b, p, w;
+
+    CHECK(connect(a, "a", true));
+    CHECK(connect(b, "b", true));
+    CHECK(connect(p, "p", true));
+
+    // overlapping filters: one copy with the higher QoS
+    subscribe(a, "t/+/x", 1);
+    subscribe(a, "t/#", 0);
+    subscribe(b, "t/a", 0);
+    publish(p, "t/a/x", "1", 1, false);
+    drain(a);
+    drain(b);
+    CHECK(a.received.size() == 1 && a.received[0].qos == 1 && a.received[0].payload == "1");
+    CHECK(b.received.empty());
+    publish(p, "t/a", "2", 1, false);
+    drain(a);
+    drain(b);
+    CHECK(a.received.size() == 2 && a.received[1].qos == 0);
+    CHECK(b.received.size() == 1 && b.received[0].qos == 0 && !b.received[0].retained);
+
+    // retained: stored, sent to new subscribers with the flag, deleted by an empty payload
+    publish(p, "r/1", "on", 0, true);
+    publish(p, "r/2", "off", 0, true);
+    subscribe(b, "r/#", 1);
+    CHECK(b.received.size() == 3 && b.received[1].retained && b.received[2].retained);
+    publish(p, "r/1", "", 0, true);
+    drain(b);
+    CHECK(b.received.size() == 4 && !b.received[3].retained);
+    b.received.clear();
+    subscribe(b, "r/+", 0);
+    CHECK(b.received.size() == 1 && b.received[0].topic == "r/2" && b.received[0].payload == "off");
+
+    // will on a lost connection, not after DISCONNECT
+    a.received.clear();
+    subscribe(a, "w/#", 1);
+    CHECK(connect(w, "w", true, "w/1"));
+    broker->close(w.conn);
+    drain(a);
+    CHECK(a.received.size() == 1 && a.received[0].topic == "w/1" && a.received[0].payload == "offline");
+    CHECK(connect(w, "w", true, "w/2"));
+    disconnect(w);
+    drain(a);
+    CHECK(a.received.size() == 1);
+
+    // persistent session: QoS1 kept while offline, QoS0 not
+    Client s;
+    CHECK(connect(s, "s", false));
+    CHECK((s.connack >> 8) == 0);
+    subscribe(s, "q/#", 1);
+    disconnect(s);
+    publish(p, "q/1", "kept", 1, false);
+    publish(p, "q/2", "lost", 0, false);
+    CHECK(connect(s, "s", false));
+    CHECK((s.connack >> 8) == 1);
+    CHECK(s.received.size() == 1 && s.received[0].payload == "kept");
+    disconnect(s);
+    CHECK(connect(s, "s", true));
+    CHECK((s.connack >> 8) == 0);
+
+    // protocol errors close the connection
+    unsigned char bad[] = { PUBLISH << 4, 5, 0, 3, 'a', '/', '#' };
+    CHECK(feed(p, bad, sizeof(bad)) < 0);
+
+    broker->close(a.conn);
+    broker->close(b.conn);
+    broker->close(p.conn);
+    broker->close(s.conn);
+
+    BrokerStats stats;
+    broker->getStats(&stats);
+    CHECK(stats.connections == 0 && stats.messagesDropped == 0 && stats.retained == 1);
+    return true;
+}
+
+static void run(int subscribers, int qos)
+{
+    Client pub;
+    Client subs[MQTT_BROKER_MAX_CONNECTIONS];
+    char name[16];
+
+    broker = new MQTTBrokerCore();
+    connect(pub, "pub", true);
+    for (int i = 0; i < subscribers; i++) {
+        snprintf(name, sizeof(name), "sub%d", i);
+        connect(subs[i], name, true);
+        subscribe(subs[i], (i & 1) ? "sensors/+/temp" : "sensors/#", qos);
+        subs[i].keep = false;
+    }
+    pub.keep = false;
+
+    // telemetry like the client publishes, serialized before timing
+    std::vector<unsigned char> stream;
+    unsigned char buf[128];
+    for (int i = 0; i < MESSAGES; i++) {
+        char topic[32];
+        char payload[64];
+        snprintf(topic, sizeof(topic), "sensors/room%d/temp", i % 8);
+        snprintf(payload, sizeof(payload), "{\"time\":%d,\"value\":%d}", i, 2000 + i % 300);
+        int len = serializePublish(buf, sizeof(buf), topic, payload, qos, false, (i % 65535) + 1);
+        stream.insert(stream.end(), buf, buf + len);
+    }
+
+    double t0 = now_us();
+    size_t pos = 0;
+    while (pos < stream.size()) {
+        pos += feedSome(pub, &stream[pos], stream.size() - pos);
+        drain(pub);
+        for (int i = 0; i < subscribers; i++) {
+            drain(subs[i]);
+        }
+    }
+    double t = now_us() - t0;
+
+    int delivered = 0;
+    for (int i = 0; i < subscribers; i++) {
+        delivered += subs[i].publishes;
+    }
+    BrokerStats stats;
+    broker->getStats(&stats);
+    printf("%d subscribers QoS%d: %8.0f messages/s in, %8.0f deliveries/s, %5.2f us/message, dropped %lu\n",
+           subscribers, qos, MESSAGES / t * 1e6, delivered / t * 1e6, t / MESSAGES, (unsigned long)stats.messagesDropped);
+
+    delete broker;
+}
+
+int main()
+{
+    broker = new MQTTBrokerCore();
+    bool ok = selfTest();
+    delete broker;
+    if (!ok) {
+        return 1;
+    }
+    printf("self test ok\n\n");
+
+    for (int qos = 0; qos <= 1; qos++) {
+        for (int subscribers = 1; subscribers < MQTT_BROKER_MAX_CONNECTIONS; subscribers++) {
+            run(subscribers, qos);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,512 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Host benchmark for MQTTThreadedClient: publish rate, end-to-end latency
+ * percentiles, reconnect time and memory per message in flight, for QoS0..2
+ * and several payload sizes, with buffers of PublishBuffer::alloc() and of
+ * the outbox ring (allocPublish()), from one and from several producers.
+ *
+ * The client runs on the POSIX shim in posix/ (threads and BSD sockets
+ * instead of mbed OS, no TLS). The broker is MQTTBrokerCore on a localhost
+ * port, served like MQTTBroker serves it on the target. A raw MQTT subscriber
+ * receives the messages and takes the latency from the timestamp in the
+ * payload: publish() -> client thread -> broker -> subscriber.
+ *
+ * build:
+ *   g++ -O2 -pthread -DMQTT_BROKER_PACKET_SIZE=2048 -DMQTT_BROKER_TX_BUFFER_SIZE=4096 \
+ *       -Iposix -I../libs/MQTTClient -I../libs/MQTTBroker -I../libs/MQTTPacket -I../libs/util \
+ *       mqtt_client_bench.cpp posix/posix_shim.cpp ../libs/MQTTClient/MQTTThreadedClient.cpp \
+ *       ../libs/MQTTClient/PublishBuffer.cpp ../libs/MQTTClient/PublishRing.cpp \
+ *       ../libs/MQTTClient/OfflineLog.cpp ../libs/MQTTBroker/MQTTBrokerCore.cpp \
+ *       -x c ../libs/MQTTPacket/MQTT*.c -o mqtt_client_bench
+ *
+ * run:
+ *   ./mqtt_client_bench [messages per run]
+ */
+
+#include "mbed.h"
+#include "MQTTThreadedClient.h"
+#include "MQTTBrokerCore.h"
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <vector>
+
+#define TOPIC           "bench/telemetry"
+#define RECONNECTS      (5)
+
+using namespace MQTT;
+
+static uint64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint16_t localPort(int fd, bool peer)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if ((peer ? getpeername(fd, (struct sockaddr*)&addr, &len) : getsockname(fd, (struct sockaddr*)&addr, &len)) != 0) {
+        return 0;
+    }
+    return ntohs(addr.sin_port);
+}
+
+/*
+ * The broker stand-in: MQTTBrokerCore with one poll() loop, like MQTTBroker
+ * with sigio. dropConnections() closes all connections but one, the client
+ * sees the broker go away.
+ */
+class LocalBroker {
+public:
+    LocalBroker() : _listener(-1), _running(false), _dropExcept(-1)
+    {
+        for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++) {
+            _fds[i] = -1;
+        }
+    }
+
+    uint16_t start()
+    {
+        _listener = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        if (bind(_listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(_listener, MQTT_BROKER_MAX_CONNECTIONS) != 0) {
+            return 0;
+        }
+        _running = true;
+        _thread = std::thread(&LocalBroker::run, this);
+        return localPort(_listener, false);
+    }
+
+    void stop()
+    {
+        _running = false;
+        _thread.join();
+        for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++) {
+            if (_fds[i] >= 0) {
+                closeConnection(i);
+            }
+        }
+        close(_listener);
+    }
+
+    void dropConnections(uint16_t exceptPort)
+    {
+        _dropExcept = exceptPort;
+        while (_dropExcept >= 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+private:
+    void run()
+    {
+        while (_running) {
+            struct pollfd pfds[MQTT_BROKER_MAX_CONNECTIONS + 1];
+            pfds[0].fd = _listener;
+            pfds[0].events = POLLIN;
+            for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++) {
+                const unsigned char* data;
+                pfds[i + 1].fd = _fds[i];
+                pfds[i + 1].events = POLLIN | ((_fds[i] >= 0 && _core.pending(i, &data) > 0) ? POLLOUT : 0);
+            }
+            poll(pfds, MQTT_BROKER_MAX_CONNECTIONS + 1, 10);
+            uint32_t now = (uint32_t)Kernel::get_ms_count();
+
+            if (pfds[0].revents & POLLIN) {
+                int fd = accept(_listener, NULL, NULL);
+                int conn = (fd >= 0) ? _core.open(now) : -1;
+                if (conn >= 0) {
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    _fds[conn] = fd;
+                } else if (fd >= 0) {
+                    close(fd);
+                }
+            }
+
+            int except = _dropExcept;
+            if (except >= 0) {
+                for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++) {
+                    if (_fds[i] >= 0 && localPort(_fds[i], true) != except) {
+                        closeConnection(i);
+                    }
+                }
+                _dropExcept = -1;
+            }
+
+            // one receive buffer per connection and round, then send
+            for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++) {
+                if (_fds[i] < 0) {
+                    continue;
+                }
+                int rc = _core.received(i, 0, now);
+                if (rc == 0 && (pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    int space;
+                    unsigned char* buf = _core.receiveBuffer(i, &space);
+                    if (space > 0) {
+                        ssize_t n = recv(_fds[i], buf, space, MSG_DONTWAIT);
+                        if (n == 0 || (n < 0 && errno != EAGAIN)) {
+                            rc = -1;
+                        } else if (n > 0) {
+                            rc = _core.received(i, n, now);
+                        }
+                    }
+                }
+                if (rc < 0) {
+                    send(i);
+                    closeConnection(i);
+                }
+            }
+
+            for (int i = 0; i < MQTT_BROKER_MAX_CONNECTIONS; i++) {
+                if (_fds[i] >= 0 && (send(i) < 0 || _core.isExpired(i, now))) {
+                    closeConnection(i);
+                }
+            }
+        }
+    }
+
+    int send(int conn)
+    {
+        const unsigned char* data;
+        int len;
+        while ((len = _core.pending(conn, &data)) > 0) {
+            ssize_t n = ::send(_fds[conn], data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0) {
+                return (errno == EAGAIN) ? 0 : -1;
+            }
+            _core.sent(conn, n);
+        }
+        return 0;
+    }
+
+    void closeConnection(int conn)
+    {
+        _core.close(conn);
+        close(_fds[conn]);
+        _fds[conn] = -1;
+    }
+
+    MQTTBrokerCore _core;
+    int _listener;
+    int _fds[MQTT_BROKER_MAX_CONNECTIONS];
+    std::thread _thread;
+    std::atomic<bool> _running;
+    std::atomic<int> _dropExcept;
+};
+
+/*
+ * Subscribes TOPIC with QoS1 and records the latency of every message,
+ * the payload starts with the publish time in us.
+ */
+class Subscriber {
+public:
+    bool start(uint16_t port)
+    {
+        _fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (connect(_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            return false;
+        }
+        int one = 1;
+        setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        unsigned char buf[128];
+        MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+        data.clientID.cstring = (char*)"bench-subscriber";
+        data.keepAliveInterval = 0;
+        int len = MQTTSerialize_connect(buf, sizeof(buf), &data);
+        MQTTString topic = MQTTString_initializer;
+        topic.cstring = (char*)TOPIC;
+        int qos = 1;
+        len += MQTTSerialize_subscribe(buf + len, sizeof(buf) - len, 0, 1, 1, &topic, &qos);
+        ::send(_fd, buf, len, MSG_NOSIGNAL);
+
+        _running = true;
+        _thread = std::thread(&Subscriber::run, this);
+        return true;
+    }
+
+    void stop()
+    {
+        _running = false;
+        shutdown(_fd, SHUT_RDWR);
+        _thread.join();
+        close(_fd);
+    }
+
+    uint16_t port() { return localPort(_fd, false); }
+
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _latencies.clear();
+    }
+
+    size_t received()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _latencies.size();
+    }
+
+    std::vector<uint32_t> latencies()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _latencies;
+    }
+
+private:
+    void run()
+    {
+        std::vector<unsigned char> stream;
+        unsigned char buf[16 * 1024];
+
+        while (_running) {
+            ssize_t n = recv(_fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                break;
+            }
+            uint64_t now = now_us();
+            stream.insert(stream.end(), buf, buf + n);
+
+            std::vector<unsigned char> acks;
+            size_t pos = 0;
+            while (stream.size() - pos >= 2) {
+                int remaining;
+                int lenBytes = MQTTPacket_decodeBuf(&stream[pos + 1], &remaining);
+                size_t total = 1 + lenBytes + remaining;
+                if (stream.size() - pos < total) {
+                    break;
+                }
+                MQTTHeader header = {0};
+                header.byte = stream[pos];
+                if (header.bits.type == PUBLISH) {
+                    unsigned char dup, retained;
+                    int qos;
+                    unsigned short id;
+                    MQTTString topic;
+                    unsigned char* payload;
+                    int payloadLen;
+                    MQTTDeserialize_publish(&dup, &qos, &retained, &id, &topic, &payload, &payloadLen, &stream[pos], total);
+                    uint64_t sent;
+                    memcpy(&sent, payload, sizeof(sent));
+                    {
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        _latencies.push_back((uint32_t)(now - sent));
+                    }
+                    if (qos == 1) {
+                        unsigned char ack[4];
+                        int alen = MQTTSerialize_puback(ack, sizeof(ack), id);
+                        acks.insert(acks.end(), ack, ack + alen);
+                    }
+                }
+                pos += total;
+            }
+            stream.erase(stream.begin(), stream.begin() + pos);
+            if (!acks.empty()) {
+                ::send(_fd, &acks[0], acks.size(), MSG_NOSIGNAL);
+            }
+        }
+    }
+
+    int _fd;
+    std::thread _thread;
+    std::atomic<bool> _running;
+    std::mutex _mutex;
+    std::vector<uint32_t> _latencies;
+};
+
+static NetworkInterface network;
+static LocalBroker broker;
+static Subscriber subscriber;
+
+static bool waitFor(MQTTThreadedClient& mqtt, uint32_t connects, uint32_t timeout_ms)
+{
+    uint64_t end = Kernel::get_ms_count() + timeout_ms;
+    while (Kernel::get_ms_count() < end) {
+        SessionStats session;
+        mqtt.getSessionStats(&session);
+        if (session.connects >= connects) {
+            return true;
+        }
+        ThisThread::sleep_for(1);
+    }
+    return false;
+}
+
+// bytes held from publish() until the acknowledge, like PublishBuffer::allocBlock()
+// and PublishRing::reserve() with its 8 byte record header
+static size_t bytesPerMessage(size_t payloadSize, bool ring, const char** storage)
+{
+    size_t size = strlen(TOPIC) + 1 + payloadSize;
+    if (ring) {
+        *storage = "ring";
+        return (8 + sizeof(PublishBuffer) + size + 7) / 8 * 8;
+    }
+    if (size <= MQTT_PUBLISH_POOL_BUFFER_SIZE) {
+        *storage = "pool";
+        return (sizeof(PublishBuffer) + MQTT_PUBLISH_POOL_BUFFER_SIZE + 3) / 4 * 4;
+    }
+    *storage = "heap";
+    return sizeof(PublishBuffer) + size;
+}
+
+// the payload is written in place, into the outbox ring or a PublishBuffer
+static int produce(MQTTThreadedClient* mqtt, QoS qos, size_t payloadSize, int messages, bool ring)
+{
+    int failed = 0;
+    for (int i = 0; i < messages; i++) {
+        PublishBuffer* message = ring ? mqtt->allocPublish(TOPIC, payloadSize, 1000) : PublishBuffer::alloc(TOPIC, payloadSize);
+        if (!message) {
+            failed++;
+            continue;
+        }
+        uint64_t t = now_us();
+        memset(message->payload(), 'x', payloadSize);
+        memcpy(message->payload(), &t, sizeof(t));
+        message->setPayloadLength(payloadSize);
+        message->qos = qos;
+        if (mqtt->publish(message, 1000) != SUCCESS) {
+            failed++;
+        }
+    }
+    return failed;
+}
+
+static void run(MQTTThreadedClient& mqtt, QoS qos, size_t payloadSize, int messages, bool ring, int producers)
+{
+    subscriber.reset();
+    mqtt.resetPublishStats();
+
+    std::atomic<int> failed(0);
+    std::vector<std::thread> threads;
+    uint64_t t0 = now_us();
+    for (int i = 0; i < producers; i++) {
+        threads.push_back(std::thread([&]() { failed += produce(&mqtt, qos, payloadSize, messages / producers, ring); }));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    uint64_t published = now_us();
+    messages = messages / producers * producers;
+
+    // QoS0 may be lost, then the wait ends when nothing more arrives
+    size_t received = 0;
+    uint64_t lastChange = now_us();
+    while (received < (size_t)(messages - failed) && now_us() - lastChange < 500000) {
+        ThisThread::sleep_for(1);
+        size_t n = subscriber.received();
+        if (n != received) {
+            received = n;
+            lastChange = now_us();
+        }
+    }
+    uint64_t done = (received < (size_t)(messages - failed)) ? lastChange : now_us();
+
+    std::vector<uint32_t> latencies = subscriber.latencies();
+    std::sort(latencies.begin(), latencies.end());
+    size_t n = latencies.size();
+    PublishStats stats;
+    mqtt.getPublishStats(&stats);
+    const char* storage;
+    size_t bytes = bytesPerMessage(payloadSize, ring, &storage);
+
+    printf("QoS%d %5zu bytes %s x%d: publish() %8.0f/s, delivered %8.0f/s, lost %5zu | latency us p50 %6u p90 %6u p99 %6u max %7u | "
+           "to wire avg %5lu | %4zu bytes/message\n",
+           qos, payloadSize, storage, producers, messages / ((published - t0) / 1e6), n / ((done - t0) / 1e6), messages - n,
+           n ? latencies[n / 2] : 0, n ? latencies[n * 9 / 10] : 0, n ? latencies[n * 99 / 100] : 0, n ? latencies[n - 1] : 0,
+           (unsigned long)stats.latencyAvg_us, bytes);
+}
+
+int main(int argc, char* argv[])
+{
+    int messages = (argc > 1) ? atoi(argv[1]) : 20000;
+    static const size_t payloadSizes[] = { 16, 100, 1024 };
+
+    uint16_t port = broker.start();
+    if (port == 0 || !subscriber.start(port)) {
+        printf("broker not started\n");
+        return 1;
+    }
+
+    static MQTTThreadedClient mqtt(&network);
+    MQTTPacket_connectData logindata = MQTTPacket_connectData_initializer;
+    logindata.clientID.cstring = (char*)"bench-client";
+    logindata.cleansession = 0;
+    mqtt.setConnectionParameters("127.0.0.1", port, logindata);
+
+    Thread listener;
+    listener.start(mbed::callback(&mqtt, &MQTTThreadedClient::startListener));
+    if (!waitFor(mqtt, 1, 5000)) {
+        printf("client not connected\n");
+        return 1;
+    }
+
+    printf("%d messages per run, %d in flight, %d pooled buffers of %d bytes, outbox ring %d bytes\n\n",
+           messages, MQTT_MAX_INFLIGHT, MQTT_PUBLISH_POOL_SIZE, MQTT_PUBLISH_POOL_BUFFER_SIZE, MQTT_OUTBOX_RING_SIZE);
+    for (int qos = QOS0; qos <= QOS2; qos++) {
+        for (size_t i = 0; i < sizeof(payloadSizes) / sizeof(payloadSizes[0]); i++) {
+            run(mqtt, (QoS)qos, payloadSizes[i], messages, false, 1);
+            run(mqtt, (QoS)qos, payloadSizes[i], messages, true, 1);
+        }
+    }
+    // several producers share the ring
+    run(mqtt, QOS0, payloadSizes[0], messages, true, 4);
+    run(mqtt, QOS1, payloadSizes[0], messages, true, 4);
+
+    // the broker closes the connection, the client connects again at once
+    uint32_t sum = 0;
+    uint32_t max = 0;
+    for (int i = 0; i < RECONNECTS; i++) {
+        SessionStats session;
+        mqtt.getSessionStats(&session);
+        broker.dropConnections(subscriber.port());
+        if (!waitFor(mqtt, session.connects + 1, 10000)) {
+            printf("no reconnect\n");
+            return 1;
+        }
+        mqtt.getSessionStats(&session);
+        sum += session.reconnectTime_ms;
+        max = std::max(max, session.reconnectTime_ms);
+    }
+    printf("\nreconnect: avg %lu ms, max %lu ms (%d times)\n", (unsigned long)(sum / RECONNECTS), (unsigned long)max, RECONNECTS);
+
+    mqtt.stopListener();
+    listener.join();
+    subscriber.stop();
+    broker.stop();
+    return 0;
+}
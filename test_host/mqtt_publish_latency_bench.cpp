@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Host benchmark for the publish()-to-wire latency of MQTTThreadedClient:
+ * the time from publish() until the PUBLISH arrives at the server socket,
+ * without a broker in between. The server is a raw sink on a localhost port,
+ * it answers CONNECT and acknowledges QoS1. The messages are published at
+ * random intervals, so they meet the listener thread in any state of its loop.
+ *
+ * Only publish(PublishBuffer*) of PublishBuffer::alloc() is used, the bench
+ * also builds against older versions of the client for a comparison.
+ *
+ * build:
+ *   g++ -O2 -pthread -Iposix -I../libs/MQTTClient -I../libs/MQTTPacket -I../libs/util \
+ *       mqtt_publish_latency_bench.cpp posix/posix_shim.cpp ../libs/MQTTClient/MQTTThreadedClient.cpp \
+ *       ../libs/MQTTClient/PublishBuffer.cpp ../libs/MQTTClient/PublishRing.cpp \
+ *       ../libs/MQTTClient/OfflineLog.cpp -x c ../libs/MQTTPacket/MQTT*.c -o mqtt_publish_latency_bench
+ *
+ * run:
+ *   ./mqtt_publish_latency_bench [messages per QoS] [max. interval ms]
+ */
+
+#include "mbed.h"
+#include "MQTTThreadedClient.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <vector>
+
+#define TOPIC           "bench/latency"
+#define PAYLOAD_SIZE    (16)
+#define MAX_INTERVAL_MS (50)         // default, the interval is random up to this
+
+using namespace MQTT;
+
+static NetworkInterface network;
+static std::vector<uint32_t> latencies;
+static volatile int received = 0;
+static int maxInterval = MAX_INTERVAL_MS;
+
+static bool readPacket(int fd, std::vector<unsigned char>& packet)
+{
+    unsigned char c;
+    packet.clear();
+    if (recv(fd, &c, 1, MSG_WAITALL) != 1) {
+        return false;
+    }
+    packet.push_back(c);
+    int length = 0, multiplier = 1;
+    do {
+        if (recv(fd, &c, 1, MSG_WAITALL) != 1) {
+            return false;
+        }
+        packet.push_back(c);
+        length += (c & 127) * multiplier;
+        multiplier *= 128;
+    } while (c & 128);
+    size_t header = packet.size();
+    packet.resize(header + length);
+    return length == 0 || recv(fd, &packet[header], length, MSG_WAITALL) == length;
+}
+
+// accepts the client, the arrival time of every PUBLISH is taken at once
+static void sink(int listener)
+{
+    int fd = accept(listener, NULL, NULL);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    std::vector<unsigned char> packet;
+    unsigned char buf[8];
+    while (readPacket(fd, packet)) {
+        uint32_t now = us_ticker_read();
+        switch (packet[0] >> 4) {
+            case CONNECT:
+                buf[0] = 0x20; buf[1] = 2; buf[2] = 0; buf[3] = 0;
+                send(fd, buf, 4, MSG_NOSIGNAL);
+                break;
+            case PINGREQ:
+                buf[0] = 0xD0; buf[1] = 0;
+                send(fd, buf, 2, MSG_NOSIGNAL);
+                break;
+            case PUBLISH: {
+                unsigned char dup, retained;
+                int qos, payloadLen;
+                unsigned short id;
+                unsigned char* payload;
+                MQTTString topic;
+                if (MQTTDeserialize_publish(&dup, &qos, &retained, &id, &topic, &payload, &payloadLen, &packet[0], packet.size()) != 1) {
+                    break;
+                }
+                if (qos > 0) {
+                    int len = MQTTSerialize_ack(buf, sizeof(buf), PUBACK, 0, id);
+                    send(fd, buf, len, MSG_NOSIGNAL);
+                }
+                uint32_t sent;
+                memcpy(&sent, payload, sizeof(sent));
+                if (!dup) {
+                    latencies.push_back(now - sent);
+                    received = received + 1;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    close(fd);
+}
+
+static void run(MQTTThreadedClient* mqtt, QoS qos, int messages)
+{
+    latencies.clear();
+    received = 0;
+    int rejected = 0;
+
+    for (int i = 0; i < messages; i++) {
+        usleep((rand() % maxInterval) * 1000);
+
+        PublishBuffer* message = PublishBuffer::alloc(TOPIC, PAYLOAD_SIZE);
+        if (message == NULL) {
+            continue;
+        }
+        memset(message->payload(), 'x', PAYLOAD_SIZE);
+        uint32_t t = us_ticker_read();
+        memcpy(message->payload(), &t, sizeof(t));
+        message->setPayloadLength(PAYLOAD_SIZE);
+        message->qos = qos;
+        message->retained = false;
+        if (mqtt->publish(message) != SUCCESS) {
+            rejected++;                                 // outbox full
+        }
+    }
+
+    // the old loops may hold the last message for a second
+    for (int i = 0; (i < 300) && (received < messages - rejected); i++) {
+        usleep(10000);
+    }
+
+    std::vector<uint32_t> sorted(latencies);
+    std::sort(sorted.begin(), sorted.end());
+    if (sorted.empty()) {
+        printf("QoS%d: no messages received\n", qos);
+        return;
+    }
+    uint64_t sum = 0;
+    for (size_t i = 0; i < sorted.size(); i++) {
+        sum += sorted[i];
+    }
+    printf("QoS%d x%d: publish() -> wire latency us avg %7.0f p50 %7u p90 %7u p99 %7u max %7u, rejected %d, lost %d\n",
+           qos, messages, (double)sum / sorted.size(), sorted[sorted.size() / 2], sorted[sorted.size() * 9 / 10],
+           sorted[sorted.size() * 99 / 100], sorted.back(), rejected, messages - rejected - (int)sorted.size());
+}
+
+int main(int argc, char* argv[])
+{
+    int messages = (argc > 1) ? atoi(argv[1]) : 200;
+    if (argc > 2) {
+        maxInterval = atoi(argv[2]);
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    bind(listener, (struct sockaddr*) &addr, sizeof(addr));
+    listen(listener, 1);
+    getsockname(listener, (struct sockaddr*) &addr, &addrLen);
+    std::thread server(sink, listener);
+
+    static MQTTThreadedClient mqtt(&network);
+    MQTTPacket_connectData options = MQTTPacket_connectData_initializer;
+    options.clientID.cstring = (char*) "latency-bench";
+    mqtt.setConnectionParameters("127.0.0.1", ntohs(addr.sin_port), options);
+    Thread listenerThread;
+    listenerThread.start(mbed::callback(&mqtt, &MQTTThreadedClient::startListener));
+    usleep(200000);
+
+    srand(1);
+    run(&mqtt, QOS0, messages);
+    run(&mqtt, QOS1, messages);
+
+    fflush(stdout);
+    _exit(0);
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Host benchmark for the dispatch of incoming MQTT publishes:
+ * linear scan over all subscribed filters (in place matcher, no allocations)
+ * vs. TopicTrie::dispatch(). Before timing, both are compared with a
+ * matcher written straight from the spec, on random topics against random
+ * filters with '+' and '#' wildcards.
+ *
+ * build:
+ *   g++ -O2 -I../libs/MQTTClient -I../libs/util mqtt_topic_trie_bench.cpp -o mqtt_topic_trie_bench
+ *
+ * run:
+ *   ./mqtt_topic_trie_bench
+ */
+
+#include "TopicTrie.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <chrono>
+
+using namespace MQTT;
+
+static const char* words[] = { "sensors", "cmd", "state", "temp", "hum", "led", "set", "get",
+                               "room1", "room2", "room3", "kitchen", "node7", "node8", "$SYS", "" };
+static const int numWords = sizeof(words) / sizeof(words[0]);
+
+static uint32_t rnd()
+{
+    static uint32_t x = 2463534242u;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+// reference matcher, straight from the spec, one level at a time
+static bool matches(const std::string& filter, const std::string& topic)
+{
+    size_t f = 0;
+    size_t t = 0;
+    bool first = true;
+
+    while (true) {
+        size_t fe = filter.find('/', f);
+        std::string fl = filter.substr(f, fe == std::string::npos ? std::string::npos : fe - f);
+        if (fl == "#") {
+            return !(first && !topic.empty() && topic[0] == '$');
+        }
+        if (t > topic.size()) {
+            return false;                                   // topic has fewer levels
+        }
+        size_t te = topic.find('/', t);
+        std::string tl = topic.substr(t, te == std::string::npos ? std::string::npos : te - t);
+        if (fl == "+") {
+            if (first && !tl.empty() && tl[0] == '$') {
+                return false;
+            }
+        } else if (fl != tl) {
+            return false;
+        }
+        first = false;
+
+        if (fe == std::string::npos) {
+            return te == std::string::npos;
+        }
+        if (te == std::string::npos) {
+            // "a/#" also matches "a"
+            return filter.compare(fe + 1, std::string::npos, "#") == 0;
+        }
+        f = fe + 1;
+        t = te + 1;
+    }
+}
+
+// the same without allocations, used for the timing of the linear scan
+static bool matchesInPlace(const char* f, const char* t, const char* tend)
+{
+    bool first = true;
+
+    while (true) {
+        const char* fe = strchr(f, '/');
+        size_t flen = fe ? (size_t)(fe - f) : strlen(f);
+        bool dollar = first && (t < tend) && (*t == '$');
+        if (flen == 1 && *f == '#') {
+            return !dollar;
+        }
+        if (t > tend) {
+            return false;
+        }
+        const char* te = (const char*)memchr(t, '/', tend - t);
+        size_t tlen = (te ? te : tend) - t;
+        if (flen == 1 && *f == '+') {
+            if (dollar) {
+                return false;
+            }
+        } else if (flen != tlen || memcmp(f, t, flen) != 0) {
+            return false;
+        }
+        first = false;
+
+        if (!fe) {
+            return te == NULL;
+        }
+        if (!te) {
+            return strcmp(fe + 1, "#") == 0;
+        }
+        f = fe + 1;
+        t = te + 1;
+    }
+}
+
+static std::string randomTopic(int levels)
+{
+    std::string s;
+    for (int i = 0; i < levels; i++) {
+        if (i) {
+            s += '/';
+        }
+        // some empty levels, '$' only in the first level
+        const char* w = (rnd() % 64 == 0) ? "" : words[rnd() % (numWords - 1)];
+        s += (i > 0 && w[0] == '$') ? words[0] : w;
+    }
+    return s;
+}
+
+static std::string randomFilter()
+{
+    int levels = 1 + rnd() % 5;
+    std::string s;
+    for (int i = 0; i < levels; i++) {
+        if (i) {
+            s += '/';
+        }
+        uint32_t r = rnd() % 10;
+        if (r == 0) {
+            s += '+';
+        } else if (r == 1 && i == levels - 1) {
+            s += '#';
+        } else {
+            s += words[rnd() % (numWords - 1)];
+        }
+    }
+    return s;
+}
+
+struct Counter {
+    int calls;
+};
+
+static void count(Counter& c)
+{
+    c.calls++;
+}
+
+static double now_ns()
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int run(int numFilters)
+{
+    std::vector<std::string> filters;
+    TopicTrie<Counter&> trie;
+
+    for (int i = 0; i < numFilters; i++) {
+        std::string f = randomFilter();
+        filters.push_back(f);
+        FP<void, Counter&> fp;
+        fp.attach(count);
+        trie.add(f.c_str(), fp);
+    }
+
+    std::vector<std::string> topics;
+    for (int i = 0; i < 20000; i++) {
+        topics.push_back(randomTopic(1 + rnd() % 5));
+    }
+
+    // cross check
+    int mismatches = 0;
+    long matched = 0;
+    for (size_t i = 0; i < topics.size(); i++) {
+        int expected = 0;
+        for (size_t f = 0; f < filters.size(); f++) {
+            bool m = matches(filters[f], topics[i]);
+            if (m != matchesInPlace(filters[f].c_str(), topics[i].data(), topics[i].data() + topics[i].size())) {
+                mismatches++;
+            }
+            expected += m;
+        }
+        Counter c = { 0 };
+        int n = trie.dispatch(topics[i].data(), topics[i].size(), c);
+        if (n != expected || c.calls != expected) {
+            if (mismatches++ < 5) {
+                printf("  mismatch: topic [%s] trie %d expected %d\n", topics[i].c_str(), n, expected);
+            }
+        }
+        matched += expected;
+    }
+
+    // timing: linear scan over all filters, like a list of subscriptions
+    // each checked with a matcher, vs. one walk of the trie
+    const int rounds = 5;
+    volatile long sink = 0;
+    double t0 = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < topics.size(); i++) {
+            const char* t = topics[i].data();
+            const char* tend = t + topics[i].size();
+            for (size_t f = 0; f < filters.size(); f++) {
+                sink += matchesInPlace(filters[f].c_str(), t, tend);
+            }
+        }
+    }
+    double t1 = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < topics.size(); i++) {
+            Counter c = { 0 };
+            sink += trie.dispatch(topics[i].data(), topics[i].size(), c);
+        }
+    }
+    double t2 = now_ns();
+
+    double n = (double)rounds * topics.size();
+    printf("%6d filters  avg %.2f matches/topic  linear %9.1f ns/topic  trie %7.1f ns/topic  %6.1fx  mismatches %d\n",
+           numFilters, (double)matched / topics.size(), (t1 - t0) / n, (t2 - t1) / n, (t1 - t0) / (t2 - t1), mismatches);
+
+    return mismatches;
+}
+
+int main()
+{
+    int mismatches = 0;
+    int sizes[] = { 10, 100, 300, 1000 };
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        mismatches += run(sizes[i]);
+    }
+
+    return mismatches ? 1 : 0;
+}
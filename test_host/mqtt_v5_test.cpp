@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Host test of the MQTT v5 packets: round trips of CONNECT/CONNACK with
+ * properties, PUBLISH with a new and with a known topic alias, the acks
+ * with reason codes, SUBSCRIBE and SUBACK through MQTTV5Packet and
+ * MQTTProperties.
+ *
+ * Then MQTTThreadedClient publishes telemetry samples to a scripted v5
+ * server on a localhost port, on the POSIX shim in posix/. The server
+ * checks the aliases and counts the bytes of every PUBLISH, the same
+ * samples are also sent with MQTT 3.1.1 for the comparison.
+ *
+ * build:
+ *   g++ -O2 -pthread -Iposix -I../libs/MQTTClient -I../libs/MQTTPacket -I../libs/util \
+ *       mqtt_v5_test.cpp posix/posix_shim.cpp ../libs/MQTTClient/MQTTThreadedClient.cpp \
+ *       ../libs/MQTTClient/PublishBuffer.cpp ../libs/MQTTClient/PublishRing.cpp \
+ *       ../libs/MQTTClient/OfflineLog.cpp -x c ../libs/MQTTPacket/MQTT*.c -o mqtt_v5_test
+ *
+ * run:
+ *   ./mqtt_v5_test
+ */
+
+#include "mbed.h"
+#include "MQTTThreadedClient.h"
+#include "MQTTV5Packet.h"
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+using namespace MQTT;
+
+// a telemetry sample: 10 bytes to a 30 byte topic
+#define SAMPLE_TOPIC    "sensors/board-01/adc/channel-0"
+#define SAMPLE_SIZE     (10)
+#define SAMPLES         (20)
+#define ALIAS_MAXIMUM   (5)
+
+static int failures = 0;
+
+static void check(const char* name, bool ok)
+{
+    if (!ok) {
+        printf("FAIL %s\n", name);
+        failures++;
+    }
+}
+
+static bool equals(MQTTString& s, const char* cstring)
+{
+    return s.lenstring.len == (int) strlen(cstring) && memcmp(s.lenstring.data, cstring, s.lenstring.len) == 0;
+}
+
+static bool equals(MQTTLenString& s, const char* cstring)
+{
+    return s.len == (int) strlen(cstring) && memcmp(s.data, cstring, s.len) == 0;
+}
+
+// a CONNACK as the server sends it, there is no serializer for it
+static int writeConnack(unsigned char* buf, unsigned char sessionPresent, unsigned char rc, MQTTProperties* props)
+{
+    unsigned char* ptr = buf;
+    *ptr++ = 0x20;
+    ptr += MQTTPacket_encode(ptr, 2 + MQTTProperties_len(props));
+    *ptr++ = sessionPresent;
+    *ptr++ = rc;
+    MQTTProperties_write(&ptr, props);
+    return ptr - buf;
+}
+
+static void testConnect()
+{
+    unsigned char buf[128];
+    MQTTPacket_connectData options = MQTTPacket_connectData_initializer;
+    options.MQTTVersion = 5;
+    options.clientID.cstring = (char*) "board-01";
+    options.cleansession = 0;
+    options.keepAliveInterval = 60;
+
+    MQTTProperty array[3];
+    MQTTProperties props = { 0, 3, 0, array };
+    MQTTProperty prop;
+    prop.identifier = MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL;
+    prop.value.integer4 = 86400;
+    check("connect add", MQTTProperties_add(&props, &prop) == 0);
+    prop.identifier = MQTTPROPERTY_CODE_RECEIVE_MAXIMUM;
+    prop.value.integer2 = 8;
+    check("connect add", MQTTProperties_add(&props, &prop) == 0);
+    prop.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;      // not in the array any more
+    check("connect add full", MQTTProperties_add(&props, &prop) == 0 && MQTTProperties_add(&props, &prop) == -1);
+    props.count = 2;
+    props.length = 5 + 3;
+
+    int len = MQTTV5Serialize_connect(buf, sizeof(buf), &options, &props, NULL);
+    // variable header: "MQTT", level 5, flags, keep alive, properties 1 + 8, client id 2 + 8
+    check("connect length", len == 2 + 10 + 9 + 10);
+    check("connect header", len > 12 && buf[0] == 0x10 && buf[1] == len - 2 && memcmp(&buf[2], "\0\4MQTT\5", 7) == 0
+          && buf[9] == 0x00 && buf[10] == 0 && buf[11] == 60);
+
+    MQTTProperty readArray[4];
+    MQTTProperties read = { 0, 4, 0, readArray };
+    unsigned char* ptr = &buf[12];
+    check("connect properties", MQTTProperties_read(&read, &ptr, buf + len) && read.count == 2);
+    MQTTProperty* p = MQTTProperties_get(&read, MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL);
+    check("connect session expiry", p && p->value.integer4 == 86400);
+    p = MQTTProperties_get(&read, MQTTPROPERTY_CODE_RECEIVE_MAXIMUM);
+    check("connect receive maximum", p && p->value.integer2 == 8);
+    check("connect client id", ptr + 10 == buf + len && ptr[1] == 8 && memcmp(ptr + 2, "board-01", 8) == 0);
+
+    check("connect too small", MQTTV5Serialize_connect(buf, len - 1, &options, &props, NULL) <= 0);
+}
+
+static void testConnack()
+{
+    unsigned char buf[64];
+    MQTTProperty array[3];
+    MQTTProperties props = { 0, 3, 0, array };
+    MQTTProperty prop;
+    prop.identifier = MQTTPROPERTY_CODE_RECEIVE_MAXIMUM;
+    prop.value.integer2 = 10;
+    MQTTProperties_add(&props, &prop);
+    prop.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM;
+    prop.value.integer2 = ALIAS_MAXIMUM;
+    MQTTProperties_add(&props, &prop);
+    prop.identifier = MQTTPROPERTY_CODE_REASON_STRING;
+    prop.value.data.data = (char*) "hello";
+    prop.value.data.len = 5;
+    MQTTProperties_add(&props, &prop);
+    int len = writeConnack(buf, 1, 0, &props);
+
+    MQTTProperty readArray[2];
+    MQTTProperties read = { 0, 2, 0, readArray };
+    unsigned char sessionPresent = 0, rc = 255;
+    check("connack", MQTTV5Deserialize_connack(&read, &sessionPresent, &rc, buf, len) == 1
+          && sessionPresent == 1 && rc == 0);
+    // the reason string does not fit into the array, it is skipped
+    check("connack properties", read.count == 2 && !MQTTProperties_get(&read, MQTTPROPERTY_CODE_REASON_STRING));
+    MQTTProperty* p = MQTTProperties_get(&read, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM);
+    check("connack topic alias maximum", p && p->value.integer2 == ALIAS_MAXIMUM);
+
+    // refused, without properties
+    len = writeConnack(buf, 0, MQTTREASONCODE_UNSPECIFIED_ERROR, NULL);
+    check("connack refused", len == 5 && MQTTV5Deserialize_connack(&read, &sessionPresent, &rc, buf, len) == 1
+          && sessionPresent == 0 && rc == MQTTREASONCODE_UNSPECIFIED_ERROR && read.count == 0);
+    check("connack truncated", MQTTV5Deserialize_connack(&read, &sessionPresent, &rc, buf, 3) != 1);
+}
+
+static void testPublish()
+{
+    unsigned char buf[128];
+    unsigned char payload[SAMPLE_SIZE] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+    MQTTProperty array[2];
+    MQTTProperties props = { 0, 2, 0, array };
+    MQTTProperty prop;
+    prop.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+    prop.value.integer2 = 3;
+    MQTTProperties_add(&props, &prop);
+
+    // the first PUBLISH sets the alias
+    MQTTString topic = MQTTString_initializer;
+    topic.cstring = (char*) SAMPLE_TOPIC;
+    int len = MQTTV5Serialize_publish(buf, sizeof(buf), 0, 1, 0, 42, topic, &props, payload, sizeof(payload));
+    check("publish alias set length", len == 2 + 2 + 30 + 2 + 4 + SAMPLE_SIZE);
+
+    unsigned char dup, retained;
+    int qos, payloadLen;
+    unsigned short id;
+    unsigned char* data;
+    MQTTString readTopic;
+    MQTTProperty readArray[2];
+    MQTTProperties read = { 0, 2, 0, readArray };
+    check("publish alias set", MQTTV5Deserialize_publish(&dup, &qos, &retained, &id, &readTopic, &read, &data, &payloadLen, buf, len) == 1
+          && qos == 1 && id == 42 && equals(readTopic, SAMPLE_TOPIC) && payloadLen == SAMPLE_SIZE
+          && memcmp(data, payload, SAMPLE_SIZE) == 0);
+    MQTTProperty* p = MQTTProperties_get(&read, MQTTPROPERTY_CODE_TOPIC_ALIAS);
+    check("publish alias set property", read.count == 1 && p && p->value.integer2 == 3);
+
+    // the next ones only carry the alias
+    topic.cstring = (char*) "";
+    len = MQTTV5Serialize_publish(buf, sizeof(buf), 0, 1, 0, 43, topic, &props, payload, sizeof(payload));
+    check("publish alias reused length", len == 2 + 2 + 2 + 4 + SAMPLE_SIZE);
+    check("publish alias reused", MQTTV5Deserialize_publish(&dup, &qos, &retained, &id, &readTopic, &read, &data, &payloadLen, buf, len) == 1
+          && id == 43 && readTopic.lenstring.len == 0 && payloadLen == SAMPLE_SIZE);
+    p = MQTTProperties_get(&read, MQTTPROPERTY_CODE_TOPIC_ALIAS);
+    check("publish alias reused property", p && p->value.integer2 == 3);
+
+    // QoS0 without properties, the property length is still there
+    topic.cstring = (char*) "a/b";
+    len = MQTTV5Serialize_publish(buf, sizeof(buf), 0, 0, 1, 0, topic, NULL, payload, 0);
+    check("publish qos0", len == 2 + 5 + 1 && buf[0] == 0x31
+          && MQTTV5Deserialize_publish(&dup, &qos, &retained, &id, &readTopic, &read, &data, &payloadLen, buf, len) == 1
+          && qos == 0 && retained == 1 && equals(readTopic, "a/b") && read.count == 0 && payloadLen == 0);
+    buf[1]--;       // the property length is missing
+    check("publish no property length", MQTTV5Deserialize_publish(&dup, &qos, &retained, &id, &readTopic, &read, &data, &payloadLen, buf, len - 1) != 1);
+}
+
+static void testAcks()
+{
+    unsigned char buf[64];
+    unsigned char type, dup, rc;
+    unsigned short id;
+    MQTTProperty readArray[2];
+    MQTTProperties read = { 0, 2, 0, readArray };
+
+    // success without properties: the short form of 3.1.1
+    int len = MQTTV5Serialize_ack(buf, sizeof(buf), PUBACK, 0, 7, MQTTREASONCODE_SUCCESS, NULL);
+    check("puback short", len == 4 && buf[0] == 0x40 && buf[1] == 2);
+    check("puback short read", MQTTV5Deserialize_ack(&type, &dup, &id, &rc, &read, buf, len) == 1
+          && type == PUBACK && id == 7 && rc == MQTTREASONCODE_SUCCESS && read.count == 0);
+
+    // reason code alone, the property length may be left out
+    const unsigned char pubrec[] = { 0x50, 0x03, 0x00, 0x08, 0x10 };
+    memcpy(buf, pubrec, sizeof(pubrec));
+    check("pubrec reason code", MQTTV5Deserialize_ack(&type, &dup, &id, &rc, &read, buf, sizeof(pubrec)) == 1
+          && type == PUBREC && id == 8 && rc == 0x10 && read.count == 0);
+
+    // reason code and reason string
+    MQTTProperty array[1];
+    MQTTProperties props = { 0, 1, 0, array };
+    MQTTProperty prop;
+    prop.identifier = MQTTPROPERTY_CODE_REASON_STRING;
+    prop.value.data.data = (char*) "quota";
+    prop.value.data.len = 5;
+    MQTTProperties_add(&props, &prop);
+    len = MQTTV5Serialize_ack(buf, sizeof(buf), PUBREL, 0, 9, 0x92, &props);
+    check("pubrel", len == 2 + 2 + 1 + 1 + 8 && buf[0] == 0x62);
+    check("pubrel read", MQTTV5Deserialize_ack(&type, &dup, &id, &rc, &read, buf, len) == 1
+          && type == PUBREL && id == 9 && rc == 0x92 && read.count == 1
+          && equals(read.array[0].value.data, "quota"));
+}
+
+static void testSubscribe()
+{
+    unsigned char buf[64];
+    MQTTString filters[2] = { MQTTString_initializer, MQTTString_initializer };
+    filters[0].cstring = (char*) "cmd/#";
+    filters[1].cstring = (char*) "cfg/+";
+    unsigned char options[2] = { 1, 2 };
+    int len = MQTTV5Serialize_subscribe(buf, sizeof(buf), 0, 11, NULL, 2, filters, options);
+    const unsigned char expected[] = { 0x82, 19, 0, 11, 0, 0, 5, 'c', 'm', 'd', '/', '#', 1, 0, 5, 'c', 'f', 'g', '/', '+', 2 };
+    check("subscribe", len == (int) sizeof(expected) && memcmp(buf, expected, len) == 0);
+
+    // granted QoS1, refused with 0x87 not authorized
+    const unsigned char suback[] = { 0x90, 5, 0, 11, 0, 0x01, 0x87 };
+    memcpy(buf, suback, sizeof(suback));
+    unsigned short id;
+    int count, codes[2];
+    MQTTProperty readArray[1];
+    MQTTProperties read = { 0, 1, 0, readArray };
+    check("suback", MQTTV5Deserialize_suback(&id, &read, 2, &count, codes, buf, sizeof(suback)) == 1
+          && id == 11 && count == 2 && codes[0] == 1 && codes[1] == 0x87);
+    check("suback too many", MQTTV5Deserialize_suback(&id, &read, 1, &count, codes, buf, sizeof(suback)) != 1);
+}
+
+/*
+ * The scripted server: accepts one connection, answers the CONNECT with a
+ * CONNACK with Topic Alias Maximum (v5), acknowledges every PUBLISH and
+ * counts their bytes.
+ */
+struct WireCount
+{
+    int publishes;
+    int bytes;
+    int first;          // bytes of the first PUBLISH
+    int last;           // and of the last one
+    int aliasSet;       // topic and alias
+    int aliasReused;    // alias only
+    bool ok;
+};
+
+static bool readPacket(int fd, std::vector<unsigned char>& packet)
+{
+    unsigned char c;
+    packet.clear();
+    if (recv(fd, &c, 1, MSG_WAITALL) != 1)
+        return false;
+    packet.push_back(c);
+    int length = 0, multiplier = 1;
+    do {
+        if (recv(fd, &c, 1, MSG_WAITALL) != 1)
+            return false;
+        packet.push_back(c);
+        length += (c & 127) * multiplier;
+        multiplier *= 128;
+    } while (c & 128);
+    size_t header = packet.size();
+    packet.resize(header + length);
+    return length == 0 || recv(fd, &packet[header], length, MSG_WAITALL) == length;
+}
+
+static void serve(int listener, int version, WireCount* count)
+{
+    int fd = accept(listener, NULL, NULL);
+    std::vector<unsigned char> packet;
+    unsigned char buf[64];
+    std::string aliasTopics[ALIAS_MAXIMUM + 1];
+    count->ok = readPacket(fd, packet) && packet[0] == 0x10 && packet[8] == version;
+
+    MQTTProperty array[1];
+    MQTTProperties props = { 0, 1, 0, array };
+    MQTTProperty prop;
+    prop.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM;
+    prop.value.integer2 = ALIAS_MAXIMUM;
+    MQTTProperties_add(&props, &prop);
+    int len = writeConnack(buf, 0, 0, (version == 5) ? &props : NULL);
+    if (version != 5)
+        buf[1] = 2;     // no property length in 3.1.1
+    send(fd, buf, (version == 5) ? len : 4, MSG_NOSIGNAL);
+
+    while (count->publishes < SAMPLES && readPacket(fd, packet))
+    {
+        if ((packet[0] >> 4) != PUBLISH)
+            continue;
+        unsigned char dup, retained;
+        int qos, payloadLen;
+        unsigned short id;
+        unsigned char* payload;
+        MQTTString topic;
+        MQTTProperty readArray[2];
+        MQTTProperties read = { 0, 2, 0, readArray };
+        std::string name;
+        if (version == 5)
+        {
+            if (MQTTV5Deserialize_publish(&dup, &qos, &retained, &id, &topic, &read, &payload, &payloadLen, &packet[0], packet.size()) != 1)
+                break;
+            MQTTProperty* alias = MQTTProperties_get(&read, MQTTPROPERTY_CODE_TOPIC_ALIAS);
+            if (alias && alias->value.integer2 >= 1 && alias->value.integer2 <= ALIAS_MAXIMUM)
+            {
+                std::string& known = aliasTopics[alias->value.integer2];
+                if (topic.lenstring.len > 0)
+                {
+                    known.assign(topic.lenstring.data, topic.lenstring.len);
+                    count->aliasSet++;
+                }
+                else
+                    count->aliasReused++;
+                name = known;
+            }
+            else if (alias)
+                count->ok = false;
+            else
+                name.assign(topic.lenstring.data, topic.lenstring.len);
+            len = MQTTV5Serialize_ack(buf, sizeof(buf), PUBACK, 0, id, MQTTREASONCODE_SUCCESS, NULL);
+        }
+        else
+        {
+            if (MQTTDeserialize_publish(&dup, &qos, &retained, &id, &topic, &payload, &payloadLen, &packet[0], packet.size()) != 1)
+                break;
+            name.assign(topic.lenstring.data, topic.lenstring.len);
+            len = MQTTSerialize_ack(buf, sizeof(buf), PUBACK, 0, id);
+        }
+        if (name != SAMPLE_TOPIC || payloadLen != SAMPLE_SIZE || payload[0] != count->publishes)
+            count->ok = false;
+        if (count->publishes == 0)
+            count->first = packet.size();
+        count->last = packet.size();
+        count->publishes++;
+        count->bytes += packet.size();
+        send(fd, buf, len, MSG_NOSIGNAL);
+    }
+    close(fd);
+}
+
+static NetworkInterface network;
+
+static WireCount publishSamples(int version)
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    bind(listener, (struct sockaddr*) &addr, sizeof(addr));
+    listen(listener, 1);
+    getsockname(listener, (struct sockaddr*) &addr, &addrLen);
+
+    WireCount count = { 0, 0, 0, 0, 0, 0, false };
+    std::thread server(serve, listener, version, &count);
+
+    MQTTThreadedClient* mqtt = new MQTTThreadedClient(&network);
+    MQTTPacket_connectData options = MQTTPacket_connectData_initializer;
+    options.MQTTVersion = version;
+    options.clientID.cstring = (char*) "board-01";
+    mqtt->setConnectionParameters("127.0.0.1", ntohs(addr.sin_port), options);
+    Thread* listenerThread = new Thread();
+    listenerThread->start(mbed::callback(mqtt, &MQTTThreadedClient::startListener));
+
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        PublishBuffer* message = mqtt->allocPublish(SAMPLE_TOPIC, SAMPLE_SIZE, 1000);
+        if (message == NULL)
+            break;
+        memset(message->payload(), 0, SAMPLE_SIZE);
+        message->payload()[0] = i;
+        message->setPayloadLength(SAMPLE_SIZE);
+        message->qos = QOS1;
+        mqtt->publish(message, 1000);
+    }
+    server.join();
+    close(listener);
+    // the client keeps running on its thread, the process ends with main()
+    return count;
+}
+
+int main()
+{
+    testConnect();
+    testConnack();
+    testPublish();
+    testAcks();
+    testSubscribe();
+
+    WireCount v3 = publishSamples(4);
+    WireCount v5 = publishSamples(5);
+    check("3.1.1 samples", v3.ok && v3.publishes == SAMPLES);
+    check("v5 samples", v5.ok && v5.publishes == SAMPLES && v5.aliasSet == 1 && v5.aliasReused == SAMPLES - 1);
+
+    // the first v5 PUBLISH sets the alias, the others only carry it
+    printf("QoS1 sample of %d bytes to a %d byte topic, bytes per PUBLISH:\n", SAMPLE_SIZE, (int) strlen(SAMPLE_TOPIC));
+    printf("  MQTT 3.1.1: %d\n", v3.last);
+    printf("  MQTT v5:    %d with the alias set, %d with the alias reused, %.1f average of %d\n",
+           v5.first, v5.last, v5.publishes ? (double) v5.bytes / v5.publishes : 0.0, v5.publishes);
+    check("v5 bytes", v5.last < v3.last);
+
+    printf("%s\n", failures ? "FAILED" : "all tests passed");
+    fflush(stdout);
+    _exit(failures ? 1 : 0);
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Host test of Msgpack: the writer against the encodings of the msgpack
+ * spec at the boundaries of every format, then the reader on the same bytes.
+ *
+ * build:
+ *   g++ -O2 -Wall -I../mbed-http/source msgpack_test.cpp ../mbed-http/source/Msgpack.cpp -o msgpack_test
+ *
+ * run:
+ *   ./msgpack_test
+ */
+
+#include "Msgpack.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(const char* name, bool ok)
+{
+    if (!ok) {
+        printf("FAIL %s\n", name);
+        failures++;
+    }
+}
+
+static std::vector<uint8_t> header(std::initializer_list<int> bytes)
+{
+    return std::vector<uint8_t>(bytes.begin(), bytes.end());
+}
+
+// the encoding must start with the expected header, then the data follows
+static void expect(const char* name, const uint8_t* out, size_t size, const std::vector<uint8_t>& head, size_t total)
+{
+    bool ok = (size == total) && (size >= head.size()) && (memcmp(out, &head[0], head.size()) == 0);
+    if (!ok) {
+        printf("FAIL %s: %zu bytes", name, size);
+        for (size_t i = 0; i < size && i < 8; i++) {
+            printf(" %02x", out[i]);
+        }
+        printf("\n");
+        failures++;
+    }
+}
+
+static void testBin(size_t length, const std::vector<uint8_t>& head)
+{
+    static uint8_t out[70000 + 8];
+    std::vector<uint8_t> data(length, 0x5a);
+    MsgpackWriter writer(out, sizeof(out));
+    check("bin write", writer.writeBin(length ? &data[0] : NULL, length));
+
+    std::string name = "bin " + std::to_string(length);
+    expect(name.c_str(), out, writer.getSize(), head, head.size() + length);
+
+    MsgpackReader reader(out, writer.getSize());
+    const uint8_t* p;
+    size_t n;
+    check((name + " read").c_str(), reader.peekType() == MPtype_bin && reader.readBin(&p, &n) && (n == length)
+          && (length == 0 || memcmp(p, &data[0], length) == 0) && reader.getRemaining() == 0);
+}
+
+static void testStr(size_t length, const std::vector<uint8_t>& head)
+{
+    static uint8_t out[70000 + 8];
+    std::string str(length, 'x');
+    MsgpackWriter writer(out, sizeof(out));
+    check("str write", writer.writeStr(str.c_str(), length));
+
+    std::string name = "str " + std::to_string(length);
+    expect(name.c_str(), out, writer.getSize(), head, head.size() + length);
+
+    MsgpackReader reader(out, writer.getSize());
+    const char* p;
+    size_t n;
+    check((name + " read").c_str(), reader.readStr(&p, &n) && (n == length) && reader.getRemaining() == 0);
+}
+
+static void testUint(uint32_t value, const std::vector<uint8_t>& bytes)
+{
+    uint8_t out[8];
+    MsgpackWriter writer(out, sizeof(out));
+    writer.writeUint(value);
+
+    std::string name = "uint " + std::to_string(value);
+    expect(name.c_str(), out, writer.getSize(), bytes, bytes.size());
+
+    MsgpackReader reader(out, writer.getSize());
+    uint32_t v;
+    check((name + " read").c_str(), reader.readUint(&v) && (v == value));
+}
+
+static void testInt(int32_t value, const std::vector<uint8_t>& bytes)
+{
+    uint8_t out[8];
+    MsgpackWriter writer(out, sizeof(out));
+    writer.writeInt(value);
+
+    std::string name = "int " + std::to_string(value);
+    expect(name.c_str(), out, writer.getSize(), bytes, bytes.size());
+
+    MsgpackReader reader(out, writer.getSize());
+    int32_t v;
+    check((name + " read").c_str(), reader.readInt(&v) && (v == value));
+}
+
+static void testContainers()
+{
+    uint8_t out[16];
+    MsgpackWriter writer(out, sizeof(out));
+    writer.writeArray(0);
+    writer.writeArray(16);
+    writer.writeMap(15);
+    expect("array/map", out, writer.getSize(), header({ 0x90, 0xdc, 0x00, 0x10, 0x8f }), 5);
+
+    MsgpackReader reader(out, writer.getSize());
+    uint32_t a0, a16, m15;
+    check("array/map read", reader.readArray(&a0) && reader.readArray(&a16) && reader.readMap(&m15)
+          && a0 == 0 && a16 == 16 && m15 == 15);
+}
+
+static void testOverflow()
+{
+    uint8_t out[4];
+    MsgpackWriter writer(out, sizeof(out));
+    const uint8_t data[4] = { 1, 2, 3, 4 };
+    check("overflow", !writer.writeBin(data, sizeof(data)) && writer.hasOverflow());
+
+    // an empty bin is c4 00, not the fixint 0
+    const uint8_t empty[] = { 0xc4, 0x00, 0x00 };
+    MsgpackReader reader(empty, sizeof(empty));
+    const uint8_t* p;
+    size_t n;
+    uint32_t v;
+    check("empty bin read", reader.readBin(&p, &n) && n == 0 && reader.readUint(&v) && v == 0);
+}
+
+int main()
+{
+    testBin(0, header({ 0xc4, 0x00 }));
+    testBin(1, header({ 0xc4, 0x01 }));
+    testBin(255, header({ 0xc4, 0xff }));
+    testBin(256, header({ 0xc5, 0x01, 0x00 }));
+    testBin(65535, header({ 0xc5, 0xff, 0xff }));
+    testBin(65536, header({ 0xc6, 0x00, 0x01, 0x00, 0x00 }));
+
+    testStr(0, header({ 0xa0 }));
+    testStr(31, header({ 0xbf }));
+    testStr(32, header({ 0xd9, 0x20 }));
+    testStr(256, header({ 0xda, 0x01, 0x00 }));
+
+    testUint(0, header({ 0x00 }));
+    testUint(127, header({ 0x7f }));
+    testUint(128, header({ 0xcc, 0x80 }));
+    testUint(65536, header({ 0xce, 0x00, 0x01, 0x00, 0x00 }));
+    testInt(-1, header({ 0xff }));
+    testInt(-32, header({ 0xe0 }));
+    testInt(-33, header({ 0xd0, 0xdf }));
+
+    testContainers();
+    testOverflow();
+
+    printf("%s\n", failures ? "FAILED" : "all tests passed");
+    return failures ? 1 : 0;
+}
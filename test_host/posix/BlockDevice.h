@@ -0,0 +1,28 @@
+#ifndef _POSIX_BLOCK_DEVICE_H_
+#define _POSIX_BLOCK_DEVICE_H_
+
+#include <stdint.h>
+
+namespace mbed {
+
+typedef uint64_t bd_addr_t;
+typedef uint64_t bd_size_t;
+
+// interface of the mbed BlockDevice, as far as OfflineLog uses it
+class BlockDevice {
+public:
+    virtual ~BlockDevice() {}
+    virtual int init() = 0;
+    virtual int deinit() = 0;
+    virtual int read(void* buffer, bd_addr_t addr, bd_size_t size) = 0;
+    virtual int program(const void* buffer, bd_addr_t addr, bd_size_t size) = 0;
+    virtual int erase(bd_addr_t addr, bd_size_t size) { return 0; }
+    virtual bd_size_t get_read_size() const = 0;
+    virtual bd_size_t get_program_size() const = 0;
+    virtual bd_size_t get_erase_size() const { return get_program_size(); }
+    virtual bd_size_t size() const = 0;
+};
+
+}
+
+#endif
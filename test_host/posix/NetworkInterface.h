@@ -0,0 +1,10 @@
+#ifndef _POSIX_NETWORK_INTERFACE_H_
+#define _POSIX_NETWORK_INTERFACE_H_
+
+// the host network, the sockets are opened on the default route
+class NetworkInterface {
+public:
+    const char* get_ip_address() { return "127.0.0.1"; }
+};
+
+#endif
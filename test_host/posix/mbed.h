@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The part of the mbed OS 5 API used by libs/MQTTClient, on POSIX threads
+ * and BSD sockets, to run the client in the host benchmarks. Not a port:
+ * CriticalSectionLock is a global mutex, sigio is emulated by a thread
+ * per socket and TLS is not available (see posix_shim.cpp).
+ */
+
+#ifndef _POSIX_MBED_H_
+#define _POSIX_MBED_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#define MBED_ASSERT(expr)   assert(expr)
+
+typedef int nsapi_error_t;
+typedef int nsapi_size_or_error_t;
+typedef unsigned int nsapi_size_t;
+
+enum nsapi_error {
+    NSAPI_ERROR_OK                  =  0,
+    NSAPI_ERROR_WOULD_BLOCK         = -3001,
+    NSAPI_ERROR_PARAMETER           = -3003,
+    NSAPI_ERROR_NO_CONNECTION       = -3004,
+    NSAPI_ERROR_NO_SOCKET           = -3005,
+    NSAPI_ERROR_DNS_FAILURE         = -3009,
+    NSAPI_ERROR_CONNECTION_LOST     = -3016,
+};
+
+inline uint32_t us_ticker_read()
+{
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void wait_ms(int ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline void wait(float s)
+{
+    wait_ms((int)(s * 1000));
+}
+
+inline uint32_t core_util_atomic_incr_u32(volatile uint32_t* valuePtr, uint32_t delta)
+{
+    return __atomic_add_fetch(valuePtr, delta, __ATOMIC_SEQ_CST);
+}
+
+inline uint32_t core_util_atomic_decr_u32(volatile uint32_t* valuePtr, uint32_t delta)
+{
+    return __atomic_sub_fetch(valuePtr, delta, __ATOMIC_SEQ_CST);
+}
+
+inline bool core_util_atomic_cas_u32(volatile uint32_t* ptr, uint32_t* expectedCurrentValue, uint32_t desiredValue)
+{
+    return __atomic_compare_exchange_n(ptr, expectedCurrentValue, desiredValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+#define __DMB()             __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+namespace mbed {
+
+template <typename F>
+class Callback;
+
+template <typename R, typename... Args>
+class Callback<R(Args...)> {
+public:
+    Callback() {}
+    Callback(R (*func)(Args...))
+    {
+        if (func) {
+            _func = func;
+        }
+    }
+    template <typename T>
+    Callback(T* obj, R (T::*method)(Args...))
+        : _func([obj, method](Args... args) { return (obj->*method)(args...); })
+    {
+    }
+
+    R call(Args... args) const { return _func(args...); }
+    R operator()(Args... args) const { return _func(args...); }
+    explicit operator bool() const { return (bool)_func; }
+
+private:
+    std::function<R(Args...)> _func;
+};
+
+template <typename T, typename R, typename... Args>
+Callback<R(Args...)> callback(T* obj, R (T::*method)(Args...))
+{
+    return Callback<R(Args...)>(obj, method);
+}
+
+template <typename R, typename... Args>
+Callback<R(Args...)> callback(R (*func)(Args...))
+{
+    return Callback<R(Args...)>(func);
+}
+
+// the interrupts of the target are the other threads here
+std::recursive_mutex& criticalSectionMutex();
+
+class CriticalSectionLock {
+public:
+    CriticalSectionLock() { criticalSectionMutex().lock(); }
+    ~CriticalSectionLock() { criticalSectionMutex().unlock(); }
+};
+
+class Timer {
+public:
+    Timer() : _running(false), _elapsed(0) {}
+
+    void start()
+    {
+        if (!_running) {
+            _start = std::chrono::steady_clock::now();
+            _running = true;
+        }
+    }
+    void stop()
+    {
+        _elapsed = read_us();
+        _running = false;
+    }
+    void reset()
+    {
+        _elapsed = 0;
+        _start = std::chrono::steady_clock::now();
+    }
+    int read_us()
+    {
+        if (!_running) {
+            return (int)_elapsed;
+        }
+        return (int)(_elapsed + std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - _start).count());
+    }
+    int read_ms() { return read_us() / 1000; }
+    float read() { return read_us() / 1000000.0f; }
+
+private:
+    bool _running;
+    int64_t _elapsed;
+    std::chrono::steady_clock::time_point _start;
+};
+
+}
+
+#include "NetworkInterface.h"
+
+namespace mbed {
+
+/**
+ * TCPSocket on a BSD socket. The timeout applies to every send/recv,
+ * sigio is called from a thread when data arrives, once until the next
+ * recv() like the edge of the lwIP event.
+ */
+class TCPSocket {
+public:
+    TCPSocket();
+    ~TCPSocket();
+
+    nsapi_error_t open(NetworkInterface* network);
+    nsapi_error_t close();
+    nsapi_error_t connect(const char* host, uint16_t port);
+    nsapi_size_or_error_t send(const void* data, nsapi_size_t size);
+    nsapi_size_or_error_t recv(void* data, nsapi_size_t size);
+    void set_blocking(bool blocking) { _timeout = blocking ? -1 : 0; }
+    void set_timeout(int timeout) { _timeout = timeout; }
+    void sigio(Callback<void()> func);
+
+private:
+    void stopWatcher();
+    void watch();
+
+    int _fd;
+    int _timeout;
+    Callback<void()> _sigio;
+    std::thread _watcher;
+    std::atomic<bool> _watching;
+    std::atomic<bool> _armed;
+};
+
+}
+
+#include "rtos.h"
+
+using namespace mbed;
+using namespace rtos;
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef _POSIX_MBEDTLS_SSL_H_
+#define _POSIX_MBEDTLS_SSL_H_
+
+// declarations of the mbed TLS calls of MQTTThreadedClient, TLS is not
+// available on the host: mbedtls_ssl_setup() fails with FEATURE_UNAVAILABLE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define mbedtls_printf printf
+
+#define MBEDTLS_SSL_CLI_C
+#define MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE     -0x7080
+#define MBEDTLS_ERR_SSL_WANT_READ               -0x6900
+#define MBEDTLS_ERR_SSL_WANT_WRITE              -0x6880
+#define MBEDTLS_SSL_IS_CLIENT                   0
+#define MBEDTLS_SSL_TRANSPORT_STREAM            0
+#define MBEDTLS_SSL_PRESET_DEFAULT              0
+#define MBEDTLS_SSL_VERIFY_NONE                 0
+#define MBEDTLS_SSL_VERIFY_REQUIRED             2
+#define MBEDTLS_SSL_HANDSHAKE_OVER              16
+
+typedef struct { int unused; } mbedtls_entropy_context;
+typedef struct { int unused; } mbedtls_ctr_drbg_context;
+typedef struct { int unused; } mbedtls_x509_crt;
+typedef struct { int unused; } mbedtls_ssl_config;
+typedef struct { int unused; } mbedtls_ssl_session;
+
+typedef struct {
+    int resume;
+} mbedtls_ssl_handshake_params;
+
+typedef struct {
+    int state;
+    mbedtls_ssl_handshake_params* handshake;
+} mbedtls_ssl_context;
+
+typedef int mbedtls_ssl_send_t(void* ctx, const unsigned char* buf, size_t len);
+typedef int mbedtls_ssl_recv_t(void* ctx, unsigned char* buf, size_t len);
+typedef int mbedtls_ssl_recv_timeout_t(void* ctx, unsigned char* buf, size_t len, uint32_t timeout);
+
+void mbedtls_entropy_init(mbedtls_entropy_context* ctx);
+void mbedtls_entropy_free(mbedtls_entropy_context* ctx);
+int mbedtls_entropy_func(void* data, unsigned char* output, size_t len);
+
+void mbedtls_ctr_drbg_init(mbedtls_ctr_drbg_context* ctx);
+void mbedtls_ctr_drbg_free(mbedtls_ctr_drbg_context* ctx);
+int mbedtls_ctr_drbg_seed(mbedtls_ctr_drbg_context* ctx, int (*f_entropy)(void*, unsigned char*, size_t),
+                          void* p_entropy, const unsigned char* custom, size_t len);
+int mbedtls_ctr_drbg_random(void* p_rng, unsigned char* output, size_t output_len);
+
+void mbedtls_x509_crt_init(mbedtls_x509_crt* crt);
+void mbedtls_x509_crt_free(mbedtls_x509_crt* crt);
+int mbedtls_x509_crt_parse(mbedtls_x509_crt* chain, const unsigned char* buf, size_t buflen);
+int mbedtls_x509_crt_info(char* buf, size_t size, const char* prefix, const mbedtls_x509_crt* crt);
+int mbedtls_x509_crt_verify_info(char* buf, size_t size, const char* prefix, uint32_t flags);
+
+void mbedtls_ssl_init(mbedtls_ssl_context* ssl);
+void mbedtls_ssl_free(mbedtls_ssl_context* ssl);
+void mbedtls_ssl_config_init(mbedtls_ssl_config* conf);
+void mbedtls_ssl_config_free(mbedtls_ssl_config* conf);
+int mbedtls_ssl_config_defaults(mbedtls_ssl_config* conf, int endpoint, int transport, int preset);
+void mbedtls_ssl_conf_ca_chain(mbedtls_ssl_config* conf, mbedtls_x509_crt* ca_chain, void* ca_crl);
+void mbedtls_ssl_conf_rng(mbedtls_ssl_config* conf, int (*f_rng)(void*, unsigned char*, size_t), void* p_rng);
+void mbedtls_ssl_conf_authmode(mbedtls_ssl_config* conf, int authmode);
+int mbedtls_ssl_setup(mbedtls_ssl_context* ssl, const mbedtls_ssl_config* conf);
+int mbedtls_ssl_session_reset(mbedtls_ssl_context* ssl);
+int mbedtls_ssl_set_hostname(mbedtls_ssl_context* ssl, const char* hostname);
+void mbedtls_ssl_set_bio(mbedtls_ssl_context* ssl, void* p_bio, mbedtls_ssl_send_t* f_send,
+                         mbedtls_ssl_recv_t* f_recv, mbedtls_ssl_recv_timeout_t* f_recv_timeout);
+int mbedtls_ssl_handshake(mbedtls_ssl_context* ssl);
+int mbedtls_ssl_handshake_step(mbedtls_ssl_context* ssl);
+const mbedtls_x509_crt* mbedtls_ssl_get_peer_cert(const mbedtls_ssl_context* ssl);
+uint32_t mbedtls_ssl_get_verify_result(const mbedtls_ssl_context* ssl);
+void mbedtls_ssl_session_free(mbedtls_ssl_session* session);
+int mbedtls_ssl_get_session(const mbedtls_ssl_context* ssl, mbedtls_ssl_session* session);
+int mbedtls_ssl_set_session(mbedtls_ssl_context* ssl, const mbedtls_ssl_session* session);
+int mbedtls_ssl_read(mbedtls_ssl_context* ssl, unsigned char* buf, size_t len);
+int mbedtls_ssl_write(mbedtls_ssl_context* ssl, const unsigned char* buf, size_t len);
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Implementation of the POSIX mbed shim, see mbed.h
+ */
+
+#include "mbed.h"
+#include "mbedtls/ssl.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// ms between the polls of the sigio thread, also the delay of a stop
+#define SIGIO_POLL_INTERVAL     (20)
+
+namespace mbed {
+
+std::recursive_mutex& criticalSectionMutex()
+{
+    static std::recursive_mutex mutex;
+    return mutex;
+}
+
+TCPSocket::TCPSocket()
+    : _fd(-1)
+    , _timeout(-1)
+    , _watching(false)
+    , _armed(false)
+{
+}
+
+TCPSocket::~TCPSocket()
+{
+    close();
+}
+
+nsapi_error_t TCPSocket::open(NetworkInterface* network)
+{
+    close();
+    _fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (_fd < 0) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    // the client collects its packets itself, lwIP sends them at once too
+    int one = 1;
+    setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return NSAPI_ERROR_OK;
+}
+
+nsapi_error_t TCPSocket::close()
+{
+    stopWatcher();
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    return NSAPI_ERROR_OK;
+}
+
+nsapi_error_t TCPSocket::connect(const char* host, uint16_t port)
+{
+    if (_fd < 0) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo* result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &result) != 0) {
+        return NSAPI_ERROR_DNS_FAILURE;
+    }
+
+    struct sockaddr_in addr = *(struct sockaddr_in*)result->ai_addr;
+    addr.sin_port = htons(port);
+    freeaddrinfo(result);
+
+    if (::connect(_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+    return NSAPI_ERROR_OK;
+}
+
+// like lwIP: blocking sends all data, with a timeout what fits in time
+nsapi_size_or_error_t TCPSocket::send(const void* data, nsapi_size_t size)
+{
+    if (_fd < 0) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    nsapi_size_t sent = 0;
+    while (sent < size) {
+        struct pollfd pfd = { _fd, POLLOUT, 0 };
+        if (poll(&pfd, 1, _timeout) <= 0) {
+            break;
+        }
+        ssize_t n = ::send(_fd, (const char*)data + sent, size - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
+            }
+            return NSAPI_ERROR_CONNECTION_LOST;
+        }
+        sent += n;
+    }
+    return sent ? (nsapi_size_or_error_t)sent : NSAPI_ERROR_WOULD_BLOCK;
+}
+
+nsapi_size_or_error_t TCPSocket::recv(void* data, nsapi_size_t size)
+{
+    if (_fd < 0) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    // the next arrival is signalled again
+    _armed = true;
+
+    struct pollfd pfd = { _fd, POLLIN, 0 };
+    if (poll(&pfd, 1, _timeout) <= 0) {
+        return NSAPI_ERROR_WOULD_BLOCK;
+    }
+    ssize_t n = ::recv(_fd, data, size, MSG_DONTWAIT);
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? NSAPI_ERROR_WOULD_BLOCK : NSAPI_ERROR_CONNECTION_LOST;
+    }
+    return n;
+}
+
+void TCPSocket::sigio(Callback<void()> func)
+{
+    stopWatcher();
+    _sigio = func;
+    if (_sigio && _fd >= 0) {
+        _armed = true;
+        _watching = true;
+        _watcher = std::thread(&TCPSocket::watch, this);
+    }
+}
+
+void TCPSocket::stopWatcher()
+{
+    _watching = false;
+    if (_watcher.joinable()) {
+        _watcher.join();
+    }
+}
+
+void TCPSocket::watch()
+{
+    while (_watching) {
+        struct pollfd pfd = { _fd, POLLIN, 0 };
+        if (poll(&pfd, 1, SIGIO_POLL_INTERVAL) > 0 && _armed) {
+            _armed = false;
+            _sigio();
+        } else if (pfd.revents) {
+            // readable, but not yet read since the last event
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+}
+
+}
+
+// TLS: every call succeeds until mbedtls_ssl_setup(), which fails
+
+void mbedtls_entropy_init(mbedtls_entropy_context* ctx) {}
+void mbedtls_entropy_free(mbedtls_entropy_context* ctx) {}
+int mbedtls_entropy_func(void* data, unsigned char* output, size_t len) { return 0; }
+void mbedtls_ctr_drbg_init(mbedtls_ctr_drbg_context* ctx) {}
+void mbedtls_ctr_drbg_free(mbedtls_ctr_drbg_context* ctx) {}
+int mbedtls_ctr_drbg_seed(mbedtls_ctr_drbg_context* ctx, int (*f_entropy)(void*, unsigned char*, size_t),
+                          void* p_entropy, const unsigned char* custom, size_t len) { return 0; }
+int mbedtls_ctr_drbg_random(void* p_rng, unsigned char* output, size_t output_len) { return 0; }
+void mbedtls_x509_crt_init(mbedtls_x509_crt* crt) {}
+void mbedtls_x509_crt_free(mbedtls_x509_crt* crt) {}
+int mbedtls_x509_crt_parse(mbedtls_x509_crt* chain, const unsigned char* buf, size_t buflen) { return 0; }
+int mbedtls_x509_crt_info(char* buf, size_t size, const char* prefix, const mbedtls_x509_crt* crt) { return 0; }
+int mbedtls_x509_crt_verify_info(char* buf, size_t size, const char* prefix, uint32_t flags) { return 0; }
+void mbedtls_ssl_init(mbedtls_ssl_context* ssl) { memset(ssl, 0, sizeof(*ssl)); }
+void mbedtls_ssl_free(mbedtls_ssl_context* ssl) {}
+void mbedtls_ssl_config_init(mbedtls_ssl_config* conf) {}
+void mbedtls_ssl_config_free(mbedtls_ssl_config* conf) {}
+int mbedtls_ssl_config_defaults(mbedtls_ssl_config* conf, int endpoint, int transport, int preset) { return 0; }
+void mbedtls_ssl_conf_ca_chain(mbedtls_ssl_config* conf, mbedtls_x509_crt* ca_chain, void* ca_crl) {}
+void mbedtls_ssl_conf_rng(mbedtls_ssl_config* conf, int (*f_rng)(void*, unsigned char*, size_t), void* p_rng) {}
+void mbedtls_ssl_conf_authmode(mbedtls_ssl_config* conf, int authmode) {}
+int mbedtls_ssl_setup(mbedtls_ssl_context* ssl, const mbedtls_ssl_config* conf) { return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE; }
+int mbedtls_ssl_session_reset(mbedtls_ssl_context* ssl) { return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE; }
+int mbedtls_ssl_set_hostname(mbedtls_ssl_context* ssl, const char* hostname) { return 0; }
+void mbedtls_ssl_set_bio(mbedtls_ssl_context* ssl, void* p_bio, mbedtls_ssl_send_t* f_send,
+                         mbedtls_ssl_recv_t* f_recv, mbedtls_ssl_recv_timeout_t* f_recv_timeout) {}
+int mbedtls_ssl_handshake(mbedtls_ssl_context* ssl) { return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE; }
+int mbedtls_ssl_handshake_step(mbedtls_ssl_context* ssl) { return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE; }
+const mbedtls_x509_crt* mbedtls_ssl_get_peer_cert(const mbedtls_ssl_context* ssl) { return NULL; }
+uint32_t mbedtls_ssl_get_verify_result(const mbedtls_ssl_context* ssl) { return 0; }
+void mbedtls_ssl_session_free(mbedtls_ssl_session* session) {}
+int mbedtls_ssl_get_session(const mbedtls_ssl_context* ssl, mbedtls_ssl_session* session) { return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE; }
+int mbedtls_ssl_set_session(mbedtls_ssl_context* ssl, const mbedtls_ssl_session* session) { return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE; }
+int mbedtls_ssl_read(mbedtls_ssl_context* ssl, unsigned char* buf, size_t len) { return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE; }
+int mbedtls_ssl_write(mbedtls_ssl_context* ssl, const unsigned char* buf, size_t len) { return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE; }
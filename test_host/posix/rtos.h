@@ -0,0 +1,213 @@
+// mbed OS rtos API on std::thread, see mbed.h
+
+// before the guard, mbed.h includes this file at its end
+#include "mbed.h"
+
+#ifndef _POSIX_RTOS_H_
+#define _POSIX_RTOS_H_
+
+#define osWaitForever       0xFFFFFFFFU
+#define osFlagsError        0x80000000U
+#define osFlagsErrorTimeout 0xFFFFFFFEU
+
+typedef enum {
+    osPriorityNormal = 24,
+    osPriorityNormal1 = 25,
+} osPriority;
+
+typedef enum {
+    osOK = 0,
+    osEventMessage = 0x10,
+    osEventTimeout = 0x40,
+    osErrorResource = -3,
+} osStatus;
+
+typedef struct {
+    osStatus status;
+    union {
+        uint32_t v;
+        void* p;
+    } value;
+} osEvent;
+
+namespace rtos {
+
+class Kernel {
+public:
+    static uint64_t get_ms_count()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+namespace ThisThread {
+inline void sleep_for(uint32_t ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+}
+
+class Mutex {
+public:
+    void lock() { _mutex.lock(); }
+    void unlock() { _mutex.unlock(); }
+    bool trylock() { return _mutex.try_lock(); }
+
+private:
+    std::recursive_mutex _mutex;
+};
+
+class Thread {
+public:
+    Thread(osPriority priority = osPriorityNormal, uint32_t stack_size = 0, unsigned char* stack_mem = NULL, const char* name = NULL) {}
+    ~Thread()
+    {
+        if (_thread.joinable()) {
+            _thread.detach();
+        }
+    }
+
+    osStatus start(mbed::Callback<void()> task)
+    {
+        _thread = std::thread([task]() { task(); });
+        return osOK;
+    }
+    osStatus join()
+    {
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        return osOK;
+    }
+
+private:
+    std::thread _thread;
+};
+
+class EventFlags {
+public:
+    EventFlags() : _flags(0) {}
+
+    uint32_t set(uint32_t flags)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _flags |= flags;
+        _cond.notify_all();
+        return _flags;
+    }
+    uint32_t clear(uint32_t flags = 0x7fffffff)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        uint32_t old = _flags;
+        _flags &= ~flags;
+        return old;
+    }
+    uint32_t get()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _flags;
+    }
+    uint32_t wait_any(uint32_t flags, uint32_t millisec = osWaitForever, bool clear = true)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto ready = [&]() { return (_flags & flags) != 0; };
+        if (millisec == osWaitForever) {
+            _cond.wait(lock, ready);
+        } else if (!_cond.wait_for(lock, std::chrono::milliseconds(millisec), ready)) {
+            return osFlagsErrorTimeout;
+        }
+        uint32_t result = _flags;
+        if (clear) {
+            _flags &= ~flags;
+        }
+        return result;
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    uint32_t _flags;
+};
+
+template <typename T, uint32_t pool_sz>
+class MemoryPool {
+public:
+    MemoryPool() { memset(_used, 0, sizeof(_used)); }
+
+    T* alloc()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (uint32_t i = 0; i < pool_sz; i++) {
+            if (!_used[i]) {
+                _used[i] = true;
+                return &_blocks[i];
+            }
+        }
+        return NULL;
+    }
+    osStatus free(T* block)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _used[block - _blocks] = false;
+        return osOK;
+    }
+
+private:
+    std::mutex _mutex;
+    T _blocks[pool_sz];
+    bool _used[pool_sz];
+};
+
+template <typename T, uint32_t queue_sz>
+class Queue {
+public:
+    Queue() : _head(0), _count(0) {}
+
+    osStatus put(T* data, uint32_t millisec = 0, uint8_t prio = 0)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto room = [&]() { return _count < queue_sz; };
+        if (!_cond.wait_for(lock, std::chrono::milliseconds(millisec), room)) {
+            return osErrorResource;
+        }
+        _items[(_head + _count) % queue_sz] = data;
+        _count++;
+        _cond.notify_all();
+        return osOK;
+    }
+    osEvent get(uint32_t millisec = osWaitForever)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        osEvent event;
+        auto ready = [&]() { return _count > 0; };
+        if (millisec == osWaitForever) {
+            _cond.wait(lock, ready);
+        } else if (!_cond.wait_for(lock, std::chrono::milliseconds(millisec), ready)) {
+            event.status = (millisec == 0) ? osOK : osEventTimeout;
+            return event;
+        }
+        event.status = osEventMessage;
+        event.value.p = _items[_head];
+        _head = (_head + 1) % queue_sz;
+        _count--;
+        _cond.notify_all();
+        return event;
+    }
+    bool empty()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _count == 0;
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    T* _items[queue_sz];
+    uint32_t _head;
+    uint32_t _count;
+};
+
+}
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Host benchmark for permessage-deflate: compressed vs. raw size and the CPU
+ * time for deflate/inflate per message, each message on its own
+ * (server_no_context_takeover) and with server context takeover, where the
+ * messages refer to the previous ones of the connection.
+ *
+ * build:
+ *   g++ -O2 -I../mbed-http/source websocket_deflate_bench.cpp ../mbed-http/source/WebSocketDeflate.cpp -o websocket_deflate_bench
+ *
+ * run:
+ *   ./websocket_deflate_bench [captured.txt]
+ *
+ * captured.txt holds one WebSocket message per line, e.g. copied from the
+ * browser network tab. Without a file, JSON telemetry like the ADS1115
+ * messages of ThreadIO is generated.
+ */
+
+#include "WebSocketDeflate.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define REPEAT      (20)
+
+static WebSocketDeflater deflater;
+static WebSocketInflater inflater;
+
+static double now_us()
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void generateTelemetry(std::vector<std::string>& messages)
+{
+    char buf[256];
+    unsigned int seed = 1;
+
+    for (int i = 0; i < 1000; i++) {
+        int len = snprintf(buf, sizeof(buf), "{\"time\":%d,\"adc\":[", 1000 * i);
+        for (int ch = 0; ch < 4; ch++) {
+            seed = seed * 1103515245 + 12345;
+            len += snprintf(buf + len, sizeof(buf) - len, "%s%d", ch ? "," : "", 12000 + ch * 100 + (int)((seed >> 16) % 200));
+        }
+        snprintf(buf + len, sizeof(buf) - len, "],\"unit\":\"mV\",\"status\":\"ok\"}");
+        messages.push_back(buf);
+    }
+}
+
+static bool readCapture(const char* fileName, std::vector<std::string>& messages)
+{
+    FILE* f = fopen(fileName, "r");
+    if (!f) {
+        return false;
+    }
+
+    char line[WEBSOCKET_DEFLATE_BUFFER_SIZE];
+    while (fgets(line, sizeof(line), f)) {
+        size_t len = strcspn(line, "\r\n");
+        if (len > 0) {
+            messages.push_back(std::string(line, len));
+        }
+    }
+    fclose(f);
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> messages;
+
+    if (argc > 1) {
+        if (!readCapture(argv[1], messages)) {
+            printf("can't open %s\n", argv[1]);
+            return 1;
+        }
+    } else {
+        generateTelemetry(messages);
+    }
+    if (messages.empty()) {
+        printf("no messages\n");
+        return 1;
+    }
+
+    static uint8_t compressed[WEBSOCKET_DEFLATE_BUFFER_SIZE * 2];
+    static uint8_t inflated[WEBSOCKET_DEFLATE_BUFFER_SIZE * 2];
+    static WSInflateWindow_t window;
+    std::vector<size_t> compressedSize(messages.size());
+
+    size_t rawBytes = 0;
+    size_t deflatedBytes = 0;
+    size_t sentBytes = 0;
+
+    // deflate, same rules as WebSocketFrame::create: fall back to raw if not smaller
+    double start = now_us();
+    for (int r = 0; r < REPEAT; r++) {
+        for (size_t i = 0; i < messages.size(); i++) {
+            compressedSize[i] = deflater.deflate((const uint8_t*)messages[i].data(), messages[i].size(), compressed, sizeof(compressed));
+        }
+    }
+    double deflateTime = now_us() - start;
+
+    for (size_t i = 0; i < messages.size(); i++) {
+        size_t size = messages[i].size();
+        size_t cSize = compressedSize[i];
+        rawBytes += size;
+        deflatedBytes += cSize;
+        sentBytes += (cSize > 0 && cSize < size && size >= WEBSOCKET_DEFLATE_MIN_SIZE) ? cSize : size;
+    }
+
+    // inflate and verify
+    double inflateTime = 0;
+    for (size_t i = 0; i < messages.size(); i++) {
+        const std::string& msg = messages[i];
+        size_t cSize = deflater.deflate((const uint8_t*)msg.data(), msg.size(), compressed, sizeof(compressed));
+        if (cSize == 0) {
+            continue;                                   // larger than the buffer
+        }
+
+        start = now_us();
+        int len = 0;
+        for (int r = 0; r < REPEAT; r++) {
+            WebSocketInflater::resetWindow(&window);
+            len = inflater.inflate(&window, WEBSOCKET_DEFLATE_SERVER_MAX_WINDOW_BITS, compressed, cSize, inflated, sizeof(inflated));
+        }
+        inflateTime += now_us() - start;
+
+        if ((len != (int)msg.size()) || (memcmp(inflated, msg.data(), len) != 0)) {
+            printf("ERROR: message %zu does not match after inflate\n", i);
+            return 1;
+        }
+    }
+
+    // server context takeover: the history follows the compressed messages,
+    // the client keeps its window. Same fallback to raw as ClientConnection::queueMessage
+    static WSDeflateWindow_t history;
+    size_t takeoverBytes = 0;
+    double takeoverTime = 0;
+    WebSocketDeflater::resetHistory(&history);
+    WebSocketInflater::resetWindow(&window);
+    for (size_t i = 0; i < messages.size(); i++) {
+        const std::string& msg = messages[i];
+        const uint8_t* data = (const uint8_t*)msg.data();
+
+        start = now_us();
+        size_t cSize = 0;
+        if (msg.size() >= WEBSOCKET_DEFLATE_MIN_SIZE) {
+            cSize = deflater.deflate(data, msg.size(), compressed, sizeof(compressed), WEBSOCKET_DEFLATE_SERVER_MAX_WINDOW_BITS, &history);
+        }
+        if ((cSize == 0) || (cSize >= msg.size())) {
+            takeoverTime += now_us() - start;
+            takeoverBytes += msg.size();
+            continue;
+        }
+        WebSocketDeflater::addHistory(&history, data, msg.size());
+        takeoverTime += now_us() - start;
+        takeoverBytes += cSize;
+
+        int len = inflater.inflate(&window, WEBSOCKET_DEFLATE_SERVER_MAX_WINDOW_BITS, compressed, cSize, inflated, sizeof(inflated));
+        if ((len != (int)msg.size()) || (memcmp(inflated, data, len) != 0)) {
+            printf("ERROR: message %zu does not match after inflate with context takeover\n", i);
+            return 1;
+        }
+    }
+
+    double mbytes = (double)rawBytes * REPEAT / (1024.0 * 1024.0);
+
+    printf("messages:        %zu\n", messages.size());
+    printf("raw bytes:       %zu (avg %.1f)\n", rawBytes, (double)rawBytes / messages.size());
+    printf("deflated bytes:  %zu (ratio %.2f)\n", deflatedBytes, (double)deflatedBytes / rawBytes);
+    printf("sent bytes:      %zu (ratio %.2f, min size %d)\n", sentBytes, (double)sentBytes / rawBytes, WEBSOCKET_DEFLATE_MIN_SIZE);
+    printf("deflate:         %.1f MB/s, %.2f us/message\n", mbytes / (deflateTime / 1e6), deflateTime / (messages.size() * REPEAT));
+    printf("inflate:         %.1f MB/s, %.2f us/message\n", mbytes / (inflateTime / 1e6), inflateTime / (messages.size() * REPEAT));
+    printf("context takeover:\n");
+    printf("sent bytes:      %zu (ratio %.2f, window %d bytes)\n", takeoverBytes, (double)takeoverBytes / rawBytes, 1 << WEBSOCKET_DEFLATE_SERVER_MAX_WINDOW_BITS);
+    printf("deflate:         %.2f us/message\n", takeoverTime / messages.size());
+
+    return 0;
+}
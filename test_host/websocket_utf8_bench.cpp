@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2019
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Host benchmark for the UTF-8 validation of WebSocket text frames:
+ * unmask + naive per byte validation vs. WebSocketUtf8Validator::unmaskValidate().
+ * Before timing, both are compared on random valid and broken input, split into
+ * random chunks like frames and recv() calls.
+ *
+ * build:
+ *   g++ -O2 -I../mbed-http/source websocket_utf8_bench.cpp ../mbed-http/source/WebSocketUtf8.cpp -o websocket_utf8_bench
+ *   add -mno-sse2 on x86-64 to measure the word-at-a-time path of the firmware
+ *
+ * run:
+ *   ./websocket_utf8_bench
+ */
+
+#include "WebSocketUtf8.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define MESSAGE_SIZE    (1024)
+#define TOTAL_BYTES     (64 * 1024 * 1024)
+
+static double now_us()
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static unsigned int seed = 1;
+
+static unsigned int rnd()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+/*
+ * reference: decode every code point, with state across chunks like the fast one
+ */
+class NaiveValidator {
+public:
+    NaiveValidator() : _need(0), _error(false) {};
+
+    bool validate(const uint8_t* data, size_t length)
+    {
+        for (size_t i = 0; i < length && !_error; i++) {
+            uint8_t c = data[i];
+            if (_need == 0) {
+                if (c < 0x80) {
+                    continue;
+                } else if ((c & 0xe0) == 0xc0) {
+                    _need = 1;
+                    _cp = c & 0x1f;
+                    _min = 0x80;
+                } else if ((c & 0xf0) == 0xe0) {
+                    _need = 2;
+                    _cp = c & 0x0f;
+                    _min = 0x800;
+                } else if ((c & 0xf8) == 0xf0) {
+                    _need = 3;
+                    _cp = c & 0x07;
+                    _min = 0x10000;
+                } else {
+                    _error = true;
+                }
+            } else {
+                if ((c & 0xc0) != 0x80) {
+                    _error = true;
+                    break;
+                }
+                _cp = (_cp << 6) | (c & 0x3f);
+                if (--_need == 0) {
+                    _error = (_cp < _min) || (_cp > 0x10ffff) || ((_cp >= 0xd800) && (_cp <= 0xdfff));
+                }
+            }
+        }
+        return !_error;
+    }
+
+    bool isComplete() const { return !_error && (_need == 0); };
+
+private:
+    int _need;
+    uint32_t _cp;
+    uint32_t _min;
+    bool _error;
+};
+
+static void naiveUnmask(uint8_t* data, size_t length, const uint8_t maskKey[4], uint8_t* maskPos)
+{
+    for (size_t i = 0; i < length; i++) {
+        data[i] ^= maskKey[*maskPos];
+        *maskPos = (*maskPos + 1) & 3;
+    }
+}
+
+static void appendCodePoint(std::string& s, uint32_t cp)
+{
+    if (cp < 0x80) {
+        s += (char)cp;
+    } else if (cp < 0x800) {
+        s += (char)(0xc0 | (cp >> 6));
+        s += (char)(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        s += (char)(0xe0 | (cp >> 12));
+        s += (char)(0x80 | ((cp >> 6) & 0x3f));
+        s += (char)(0x80 | (cp & 0x3f));
+    } else {
+        s += (char)(0xf0 | (cp >> 18));
+        s += (char)(0x80 | ((cp >> 12) & 0x3f));
+        s += (char)(0x80 | ((cp >> 6) & 0x3f));
+        s += (char)(0x80 | (cp & 0x3f));
+    }
+}
+
+// asciiPercent of the code points are ASCII, the others from all planes
+static std::string generateText(size_t size, int asciiPercent)
+{
+    std::string s;
+    while (s.size() < size) {
+        if ((int)(rnd() % 100) < asciiPercent) {
+            s += (char)(0x20 + rnd() % 0x5f);
+        } else {
+            uint32_t cp;
+            do {
+                static const uint32_t limit[] = { 0x800, 0x10000, 0x110000 };
+                cp = 0x80 + rnd() % (limit[rnd() % 3] - 0x80);
+            } while ((cp >= 0xd800) && (cp <= 0xdfff));
+            appendCodePoint(s, cp);
+        }
+    }
+    return s;
+}
+
+/*
+ * both validators on the same masked input, split at random offsets
+ */
+static bool compare(const std::string& text, bool* valid)
+{
+    const uint8_t maskKey[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    std::vector<uint8_t> a(text.begin(), text.end());
+    for (size_t i = 0; i < a.size(); i++) {
+        a[i] ^= maskKey[i & 3];
+    }
+    std::vector<uint8_t> b = a;
+
+    WebSocketUtf8Validator fast;
+    NaiveValidator naive;
+    uint8_t fastPos = 0;
+    uint8_t naivePos = 0;
+    bool fastOk = true;
+    bool naiveOk = true;
+
+    for (size_t i = 0; i < a.size();) {
+        size_t n = 1 + rnd() % 40;
+        if (n > a.size() - i) {
+            n = a.size() - i;
+        }
+        fastOk = fast.unmaskValidate(&a[i], n, maskKey, &fastPos) && fastOk;
+        naiveUnmask(&b[i], n, maskKey, &naivePos);
+        naiveOk = naive.validate(&b[i], n) && naiveOk;
+        i += n;
+    }
+    fastOk = fastOk && fast.isComplete();
+    naiveOk = naiveOk && naive.isComplete();
+
+    WebSocketUtf8Validator plain;
+    bool plainOk = plain.validate((const uint8_t*)text.data(), text.size()) && plain.isComplete();
+
+    *valid = naiveOk;
+    // after an error the rest of the chunk stays masked, the connection is closed anyway
+    return (fastOk == naiveOk) && (plainOk == naiveOk) && (!naiveOk || (a == b));
+}
+
+static bool checkCorrectness()
+{
+    int errors = 0;
+    int invalid = 0;
+
+    for (int i = 0; i < 20000; i++) {
+        std::string text = generateText(1 + rnd() % 200, rnd() % 101);
+        int mode = rnd() % 4;
+        if ((mode > 0) && !text.empty()) {
+            size_t at = rnd() % text.size();
+            if (mode == 1) {
+                text[at] = (char)(rnd() & 0xff);                // random byte
+            } else if (mode == 2) {
+                text.erase(at, 1);                              // truncated sequence
+            } else {
+                static const char* bad[] = { "\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xe0\x80\x80", "\xf8\x88\x80\x80\x80", "\xc2" };
+                text.insert(at, bad[rnd() % 6]);
+            }
+        }
+
+        bool valid;
+        if (!compare(text, &valid)) {
+            errors++;
+        }
+        invalid += valid ? 0 : 1;
+    }
+
+    printf("correctness: 20000 random messages, %d invalid, %d mismatches\n", invalid, errors);
+    return errors == 0;
+}
+
+static void bench(const char* name, int asciiPercent)
+{
+    const uint8_t maskKey[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    std::string text = generateText(MESSAGE_SIZE, asciiPercent);
+    std::vector<uint8_t> buf(text.size());
+    size_t rounds = TOTAL_BYTES / text.size();
+    bool ok = true;
+
+    // the payload is masked again each round by the unmask itself, XOR is symmetric,
+    // so even rounds work on masked and odd rounds on plain data: validate only the odd ones
+    double t0 = now_us();
+    memcpy(buf.data(), text.data(), text.size());
+    for (size_t r = 0; r < rounds; r++) {
+        uint8_t pos = 0;
+        NaiveValidator naive;
+        naiveUnmask(buf.data(), buf.size(), maskKey, &pos);
+        if (r & 1) {
+            ok = naive.validate(buf.data(), buf.size()) && ok;
+        }
+    }
+    double naiveTime = now_us() - t0;
+
+    t0 = now_us();
+    memcpy(buf.data(), text.data(), text.size());
+    for (size_t r = 0; r < rounds; r++) {
+        uint8_t pos = 0;
+        WebSocketUtf8Validator fast;
+        if (r & 1) {
+            ok = fast.unmaskValidate(buf.data(), buf.size(), maskKey, &pos) && ok;
+        } else {
+            WebSocketUtf8Validator::unmask(buf.data(), buf.size(), maskKey, &pos);
+        }
+    }
+    double fastTime = now_us() - t0;
+
+    double mb = (double)rounds * text.size() / (1024 * 1024);
+    printf("%-24s naive %8.1f MB/s   fused %8.1f MB/s   x%.1f%s\n", name,
+        mb / (naiveTime / 1e6), mb / (fastTime / 1e6), naiveTime / fastTime, ok ? "" : "  VALIDATION FAILED");
+}
+
+int main()
+{
+    if (!checkCorrectness()) {
+        return 1;
+    }
+
+    printf("\n%d byte messages, %d MB each, unmask + validate\n", MESSAGE_SIZE, TOTAL_BYTES / (1024 * 1024));
+    bench("ASCII (JSON)", 100);
+    bench("95% ASCII", 95);
+    bench("50% ASCII", 50);
+    bench("no ASCII", 0);
+
+    return 0;
+}